@@ -0,0 +1,88 @@
+#!/bin/bash
+
+# Benchmark for compressed tarball downloads.
+# Downloads the same archives with plain "downltar" and with "downltar <type> gzip", checks that
+# every compressed archive unpacks to exactly the plain one, and reports time, bytes received and
+# throughput (in archive bytes per second) for both. .c archives are built on S1 itself, .txt
+# archives come from S3 through the S1 relay. Runs against a throwaway HOME so real data is
+# untouched.
+#
+# Usage: ./bench_gzip.sh [files_per_type] [rounds]
+
+FILES=${1:-2000}
+ROUNDS=${2:-5}
+
+# Get the absolute path of the script's directory
+SCRIPT_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+WORK_DIR=$(mktemp -d)
+BIN_DIR="$WORK_DIR/bin"
+OUTPUT="$SCRIPT_DIR/bench_output.txt"
+
+# Function to stop every server started by this script
+stop_servers() {
+    for port in 4307 4308 4309 4310; do
+        lsof -ti:$port | xargs kill -9 2>/dev/null
+    done
+    sleep 1
+}
+
+# Function to download one archive $ROUNDS times and print seconds, bytes and archive size
+# $1 is the file type, $2 the encoding ("" for a plain tar) and $3 the local archive name.
+run_rounds() {
+    local dir="$WORK_DIR/run$2"
+    mkdir -p "$dir"
+    local start=$(date +%s.%N)
+    for ((r = 0; r < ROUNDS; r++)); do
+        (cd "$dir" && printf 'downltar %s %s\nexit\n' "$1" "$2" | "$BIN_DIR/w25clients" > /dev/null 2>&1)
+    done
+    local end=$(date +%s.%N)
+    local received=$(stat -c %s "$dir/$3")
+    local plain=$received
+    if [ -n "$2" ]; then
+        plain=$(gunzip -c "$dir/$3" | wc -c)
+    fi
+    awk -v t0=$start -v t1=$end -v n=$ROUNDS -v got=$received -v tar=$plain 'BEGIN {
+        printf "%.3f %d %.1f\n", (t1 - t0) / n, got, tar / 1048576 / ((t1 - t0) / n)
+    }'
+}
+
+# Build the servers and client with optimizations
+mkdir -p "$BIN_DIR"
+for src in s1 s2 s3 s4 w25clients; do
+    gcc -O2 -o "$BIN_DIR/$src" "$SCRIPT_DIR/$src.c" -lz -pthread || exit 1
+done
+
+stop_servers
+echo "Creating $FILES compressible files of each type..."
+for server in S1 S2 S3 S4; do
+    mkdir -p "$WORK_DIR/home/$server"
+done
+for ((i = 0; i < FILES; i++)); do
+    dir="dir$((i % 20))/sub$((i % 7))"
+    mkdir -p "$WORK_DIR/home/S1/$dir" "$WORK_DIR/home/S3/$dir"
+    seq $i $((i + 4000)) | sed 's/^/int value_/; s/$/ = 0;/' > "$WORK_DIR/home/S1/$dir/file$i.c"
+    seq $i $((i + 4000)) | sed 's/$/ the quick brown fox jumps over the lazy dog/' > "$WORK_DIR/home/S3/$dir/file$i.txt"
+done
+
+for server in s2 s3 s4 s1; do
+    HOME="$WORK_DIR/home" "$BIN_DIR/$server" > /dev/null 2>&1 &
+done
+sleep 1
+
+echo "=== Compressed downltar benchmark: $FILES files per type, $ROUNDS rounds, $(nproc) CPUs ($(date)) ===" | tee -a "$OUTPUT"
+for type in .c .txt; do
+    archive=cfiles.tar
+    [ "$type" = ".txt" ] && archive=txtfiles.tar
+    read -r plain_s plain_bytes plain_rate <<< "$(run_rounds $type "" $archive)"
+    read -r gzip_s gzip_bytes gzip_rate <<< "$(run_rounds $type gzip $archive.gz)"
+
+    # The compressed archive must unpack to exactly the plain one
+    same="identical"
+    gunzip -c "$WORK_DIR/rungzip/$archive.gz" | cmp -s - "$WORK_DIR/run/$archive" || same="MISMATCH"
+    printf "%-4s plain: %.3f s, %d bytes, %.1f MB/s | gzip: %.3f s, %d bytes (%.1f%%), %.1f MB/s | %s\n" \
+        $type $plain_s $plain_bytes $plain_rate $gzip_s $gzip_bytes \
+        "$(awk -v a=$gzip_bytes -v b=$plain_bytes 'BEGIN { print 100 * a / b }')" $gzip_rate $same | tee -a "$OUTPUT"
+done
+
+stop_servers
+rm -rf "$WORK_DIR"
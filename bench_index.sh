@@ -0,0 +1,105 @@
+#!/bin/bash
+
+# Benchmark for the in-memory path index.
+# Runs the same listings and filtered tarballs against servers with the index (the default) and
+# without it (DFS_INDEX_MB=0, where every request walks the filesystem), checks that both give
+# the same answers, and reports the time each takes. Filtered archives are used because they are
+# always planned afresh rather than served from the tarball cache. Also reports how long the
+# servers take to start: walking the tree to build the index the first time, and loading it
+# from the snapshot after a restart. Runs against a throwaway HOME so real data is untouched.
+#
+# Usage: ./bench_index.sh [files_per_type] [rounds]
+
+FILES=${1:-100000}
+ROUNDS=${2:-5}
+
+# Get the absolute path of the script's directory
+SCRIPT_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+WORK_DIR=$(mktemp -d)
+BIN_DIR="$WORK_DIR/bin"
+OUTPUT="$SCRIPT_DIR/bench_output.txt"
+
+# Function to stop every server started by this script
+stop_servers() {
+    for port in 4307 4308 4309 4310; do
+        lsof -ti:$port | xargs kill -9 2>/dev/null
+    done
+    sleep 1
+}
+
+# Function to start the servers and print how long they took to accept connections
+start_servers() {
+    local start=$(date +%s.%N)
+    for server in s2 s3 s4 s1; do
+        HOME="$WORK_DIR/home" "$BIN_DIR/$server" > /dev/null 2>&1 &
+    done
+    for port in 4307 4308 4309 4310; do
+        until (exec 3<> /dev/tcp/127.0.0.1/$port) 2> /dev/null; do
+            sleep 0.01
+        done
+    done
+    awk -v t0=$start -v t1=$(date +%s.%N) 'BEGIN { printf "%.3f\n", t1 - t0 }'
+}
+
+# Function to run one client command $ROUNDS times and print the average seconds
+# $1 is the command, $2 the file its last output is saved to.
+run_rounds() {
+    local start=$(date +%s.%N)
+    for ((r = 0; r < ROUNDS; r++)); do
+        (cd "$WORK_DIR/out" && printf '%s\nexit\n' "$1" | "$BIN_DIR/w25clients" > "$2" 2>&1)
+    done
+    awk -v t0=$start -v t1=$(date +%s.%N) -v n=$ROUNDS 'BEGIN { printf "%.3f\n", (t1 - t0) / n }'
+}
+
+# Build the servers and client with optimizations
+mkdir -p "$BIN_DIR" "$WORK_DIR/out"
+for src in s1 s2 s3 s4 w25clients; do
+    gcc -O2 -o "$BIN_DIR/$src" "$SCRIPT_DIR/$src.c" -lz -pthread || exit 1
+done
+
+stop_servers
+echo "Creating $FILES small files of each type..."
+for server in S1 S2 S3 S4; do
+    mkdir -p "$WORK_DIR/home/$server"
+done
+for ((d = 0; d < 100; d++)); do
+    for sub in a b c d; do
+        mkdir -p "$WORK_DIR/home/S1/dir$d/$sub" "$WORK_DIR/home/S2/dir$d/$sub"
+    done
+done
+(cd "$WORK_DIR/home/S1" && seq 0 $((FILES - 1)) | awk '{ printf "dir%d/%c/file%d.c\n", $1 % 100, 97 + $1 % 4, $1 }' | xargs touch)
+(cd "$WORK_DIR/home/S2" && seq 0 $((FILES - 1)) | awk '{ printf "dir%d/%c/file%d.pdf\n", $1 % 100, 97 + $1 % 4, $1 }' | xargs touch)
+
+echo "=== Path index benchmark: $FILES files per type, $ROUNDS rounds ($(date)) ===" | tee -a "$OUTPUT"
+for mode in walk index restart; do
+    [ $mode = walk ] && export DFS_INDEX_MB=0 || unset DFS_INDEX_MB
+    startup=$(start_servers)
+    if [ $mode = index ]; then
+        # Let the first snapshots be written so the restart can load them
+        until [ -f "$WORK_DIR/home/.dfs_index/S1.snap" ] && [ -f "$WORK_DIR/home/.dfs_index/S2.snap" ]; do
+            sleep 0.1
+        done
+    fi
+    list_all=$(run_rounds "dispfnames ~S1/ 10000" "$WORK_DIR/list_all.$mode")
+    list_dir=$(run_rounds "dispfnames ~S1/dir7/b" "$WORK_DIR/list_dir.$mode")
+    tar_c=$(run_rounds "downltar .c prefix=~S1/dir7" "$WORK_DIR/tar_c.$mode")
+    tar -tf "$WORK_DIR/out/cfiles.tar" | sort > "$WORK_DIR/tar_c.list.$mode"
+    tar_pdf=$(run_rounds "downltar .pdf min=0" "$WORK_DIR/tar_pdf.$mode")
+    tar -tf "$WORK_DIR/out/pdfiles.tar" | sort > "$WORK_DIR/tar_pdf.list.$mode"
+    stop_servers
+    printf "%-7s startup %s s | dispfnames ~S1/: %s s | one directory: %s s | downltar .c subtree: %s s | downltar .pdf: %s s\n" \
+        $mode $startup $list_all $list_dir $tar_c $tar_pdf | tee -a "$OUTPUT"
+done
+unset DFS_INDEX_MB
+
+# Both modes must give the same files; listing order differs, so compare them sorted
+same="identical"
+for result in list_all list_dir tar_c.list tar_pdf.list; do
+    for mode in index restart; do
+        cmp -s <(sort "$WORK_DIR/$result.walk") <(sort "$WORK_DIR/$result.$mode") || same="MISMATCH in $result ($mode)"
+    done
+done
+echo "Results: $same" | tee -a "$OUTPUT"
+
+stop_servers
+rm -rf "$WORK_DIR"
@@ -0,0 +1,103 @@
+#!/bin/bash
+
+# Benchmark for the S1 download relay.
+# Downloads a large .pdf through S1 several times, once with the read/write copy
+# loop (DFS_NO_SPLICE=1), once with the splice() path and once redirected straight to
+# S2 (DFS_REDIRECT=1), and reports throughput and S1 CPU time per GB for each. Runs
+# against a throwaway HOME so real data is untouched.
+#
+# Usage: ./bench_relay.sh [size_mb] [rounds]
+
+SIZE_MB=${1:-256}
+ROUNDS=${2:-5}
+
+# Get the absolute path of the script's directory
+SCRIPT_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+WORK_DIR=$(mktemp -d)
+BIN_DIR="$WORK_DIR/bin"
+OUTPUT="$SCRIPT_DIR/bench_output.txt"
+CLK_TCK=$(getconf CLK_TCK)
+
+# Function to stop every server started by this script
+stop_servers() {
+    for port in 4307 4308 4309 4310; do
+        lsof -ti:$port | xargs kill -9 2>/dev/null
+    done
+    sleep 1
+}
+
+# Function to sum user+system CPU ticks of all S1 processes, including reaped children
+s1_cpu_ticks() {
+    local total=0
+    for pid in $(pgrep -f "$BIN_DIR/s1"); do
+        local fields=($(cut -d')' -f2 /proc/$pid/stat 2>/dev/null))
+        # Fields after the command name: utime=12 stime=13 cutime=14 cstime=15 (0-based)
+        total=$((total + ${fields[11]:-0} + ${fields[12]:-0} + ${fields[13]:-0} + ${fields[14]:-0}))
+    done
+    echo $total
+}
+
+# Function to run one benchmark pass with the given relay mode
+run_pass() {
+    local mode=$1
+    local no_splice=0 redirect=0
+    [ "$mode" = "copy" ] && no_splice=1
+    [ "$mode" = "direct" ] && redirect=1
+
+    rm -rf "$WORK_DIR/home"
+    mkdir -p "$WORK_DIR/home/S1" "$WORK_DIR/home/S2" "$WORK_DIR/home/S3" "$WORK_DIR/home/S4"
+    for server in s2 s3 s4 s1; do
+        HOME="$WORK_DIR/home" DFS_WORKERS=1 DFS_NO_SPLICE=$no_splice "$BIN_DIR/$server" > /dev/null 2>&1 &
+    done
+    sleep 1
+
+    # Upload the test file once
+    (cd "$WORK_DIR" && printf 'uploadf bench.pdf ~S1/bench\nexit\n' | "$BIN_DIR/w25clients" > /dev/null)
+
+    # Download it repeatedly and measure S1's CPU time around the downloads
+    local cmds=""
+    for ((i = 0; i < ROUNDS; i++)); do
+        cmds+="downlf ~S1/bench/bench.pdf"$'\n'
+    done
+    cmds+="exit"$'\n'
+
+    mkdir -p "$WORK_DIR/dl"
+    local cpu_before=$(s1_cpu_ticks)
+    local start=$(date +%s.%N)
+    (cd "$WORK_DIR/dl" && printf '%s' "$cmds" | DFS_REDIRECT=$redirect "$BIN_DIR/w25clients" > /dev/null)
+    local end=$(date +%s.%N)
+    sleep 1 # Let the workers reap their children so cutime/cstime are complete
+    local cpu_after=$(s1_cpu_ticks)
+
+    if ! cmp -s "$WORK_DIR/bench.pdf" "$WORK_DIR/dl/bench.pdf"; then
+        echo "$mode: downloaded file does not match" | tee -a "$OUTPUT"
+    fi
+
+    awk -v mode="$mode" -v mb=$SIZE_MB -v rounds=$ROUNDS -v t0=$start -v t1=$end \
+        -v c0=$cpu_before -v c1=$cpu_after -v hz=$CLK_TCK 'BEGIN {
+        gb = mb * rounds / 1024
+        secs = t1 - t0
+        cpu = (c1 - c0) / hz
+        printf "%-6s %8.1f MB/s %10.3f s S1 CPU/GB\n", mode, mb * rounds / secs, cpu / gb
+    }' | tee -a "$OUTPUT"
+
+    rm -rf "$WORK_DIR/dl"
+    stop_servers
+}
+
+# Build the servers and client with optimizations
+mkdir -p "$BIN_DIR"
+for src in s1 s2 s3 s4 w25clients; do
+    gcc -O2 -o "$BIN_DIR/$src" "$SCRIPT_DIR/$src.c" -lz -pthread || exit 1
+done
+
+stop_servers
+echo "Creating ${SIZE_MB} MB test file..."
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$WORK_DIR/bench.pdf"
+
+echo "=== S1 relay benchmark: ${SIZE_MB} MB x ${ROUNDS} downloads ($(date)) ===" | tee -a "$OUTPUT"
+run_pass copy
+run_pass splice
+run_pass direct
+
+rm -rf "$WORK_DIR"
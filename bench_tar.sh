@@ -0,0 +1,108 @@
+#!/bin/bash
+
+# Benchmark for concurrent tarball downloads.
+# Starts many clients at once, each running downltar for .c, .pdf or .txt, and checks that
+# every client received a complete, identical archive. A second pass has all clients download
+# into the same directory, where they must not corrupt each other's copy or leave staging
+# files behind. Runs against a throwaway HOME so real data is untouched.
+#
+# Usage: ./bench_tar.sh [clients] [files_per_type]
+
+CLIENTS=${1:-32}
+FILES=${2:-500}
+
+# Get the absolute path of the script's directory
+SCRIPT_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+WORK_DIR=$(mktemp -d)
+BIN_DIR="$WORK_DIR/bin"
+OUTPUT="$SCRIPT_DIR/bench_output.txt"
+TYPES=(.c .pdf .txt)
+ARCHIVES=(cfiles.tar pdfiles.tar txtfiles.tar)
+
+# Function to stop every server started by this script
+stop_servers() {
+    for port in 4307 4308 4309 4310; do
+        lsof -ti:$port | xargs kill -9 2>/dev/null
+    done
+    sleep 1
+}
+
+# Function to start the clients at once and wait for all of them
+# Client i runs in directory $1/i, or in $1 itself when $2 is "shared".
+run_clients() {
+    local base=$1
+    local shared=$2
+    local pids=()
+    for ((i = 0; i < CLIENTS; i++)); do
+        local dir="$base/$i"
+        [ "$shared" = "shared" ] && dir="$base"
+        mkdir -p "$dir"
+        (cd "$dir" && printf 'downltar %s\nexit\n' "${TYPES[i % 3]}" | "$BIN_DIR/w25clients" > "$base/log.$i" 2>&1) &
+        pids+=($!)
+    done
+    wait "${pids[@]}"
+}
+
+# Build the servers and client with optimizations
+mkdir -p "$BIN_DIR"
+for src in s1 s2 s3 s4 w25clients; do
+    gcc -O2 -o "$BIN_DIR/$src" "$SCRIPT_DIR/$src.c" -lz -pthread || exit 1
+done
+
+stop_servers
+echo "Creating $FILES files of each type..."
+for server in S1 S2 S3 S4; do
+    mkdir -p "$WORK_DIR/home/$server"
+done
+for ((i = 0; i < FILES; i++)); do
+    dir="dir$((i % 20))/sub$((i % 7))"
+    mkdir -p "$WORK_DIR/home/S1/$dir" "$WORK_DIR/home/S2/$dir" "$WORK_DIR/home/S3/$dir"
+    head -c $((1024 + i * 37)) /dev/urandom > "$WORK_DIR/home/S1/$dir/file$i.c"
+    head -c $((4096 + i * 53)) /dev/urandom > "$WORK_DIR/home/S2/$dir/file$i.pdf"
+    head -c $((512 + i * 11)) /dev/urandom > "$WORK_DIR/home/S3/$dir/file$i.txt"
+done
+
+for server in s2 s3 s4 s1; do
+    HOME="$WORK_DIR/home" "$BIN_DIR/$server" > /dev/null 2>&1 &
+done
+sleep 1
+
+echo "=== Concurrent downltar benchmark: $CLIENTS clients, $FILES files per type ($(date)) ===" | tee -a "$OUTPUT"
+
+# Pass 1: every client in its own directory; all archives of a type must be identical
+start=$(date +%s.%N)
+run_clients "$WORK_DIR/own" own
+end=$(date +%s.%N)
+
+bad=0
+for ((i = 0; i < CLIENTS; i++)); do
+    archive="$WORK_DIR/own/$i/${ARCHIVES[i % 3]}"
+    reference="$WORK_DIR/own/$((i % 3))/${ARCHIVES[i % 3]}"
+    if [ ! -f "$archive" ] || [ "$(tar -tf "$archive" 2>/dev/null | wc -l)" -ne "$FILES" ] || ! cmp -s "$archive" "$reference"; then
+        bad=$((bad + 1))
+    fi
+done
+bytes=$(cat "$WORK_DIR"/own/*/*.tar 2>/dev/null | wc -c)
+awk -v n=$CLIENTS -v bad=$bad -v bytes=$bytes -v t0=$start -v t1=$end 'BEGIN {
+    secs = t1 - t0
+    printf "separate dirs: %d/%d archives complete, %.2f s, %.1f MB/s\n", n - bad, n, secs, bytes / 1048576 / secs
+}' | tee -a "$OUTPUT"
+
+# Pass 2: every client in the same directory; each archive must survive intact
+start=$(date +%s.%N)
+run_clients "$WORK_DIR/shared" shared
+end=$(date +%s.%N)
+
+bad=0
+for archive in "${ARCHIVES[@]}"; do
+    if [ "$(tar -tf "$WORK_DIR/shared/$archive" 2>/dev/null | wc -l)" -ne "$FILES" ]; then
+        bad=$((bad + 1))
+    fi
+done
+leftover=$(find "$WORK_DIR/shared" -name '.*.tar.*' | wc -l)
+awk -v bad=$bad -v left=$leftover -v t0=$start -v t1=$end 'BEGIN {
+    printf "shared dir:    %d/3 archives intact, %d staging files left, %.2f s\n", 3 - bad, left, t1 - t0
+}' | tee -a "$OUTPUT"
+
+stop_servers
+rm -rf "$WORK_DIR"
@@ -0,0 +1,80 @@
+// Distributed File System - Bloom Filters
+// Compact sets of paths without false negatives, used by S1 to answer for missing files.
+//
+// A filter of m bits holds a path by setting k of its bits, picked by hashing the path. A path
+// whose bits are not all set was certainly never added; one whose bits are all set probably was
+// (with 10 bits per path and 7 hashes, about 1% of paths never added look present). Bits are only
+// ever set, so a filter forgets removed paths only by being built again. Bits are set atomically,
+// which lets processes add paths to a filter in shared memory while others check it.
+//
+// A filter is an array of 64-bit words, bit b being bit b % 64 of word b / 64. Sent over the
+// network, each word goes least significant byte first.
+
+#ifndef DFS_BLOOM_H
+#define DFS_BLOOM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DFS_BLOOM_BITS_PER_KEY 10 // Filter bits per path
+#define DFS_BLOOM_HASHES 7 // Bits set per path
+#define DFS_BLOOM_MIN_BITS 65536 // Smallest filter built, a multiple of 64
+
+// Function to scramble a 64-bit hash (the splitmix64 finalizer)
+static inline uint64_t dfs_bloom_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Function to hash a path into the two values its bit positions are derived from
+static inline void dfs_bloom_hash(const char *key, size_t len, uint64_t *h1, uint64_t *h2)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h ^ (unsigned char)key[i]) * 0x100000001b3ULL; // FNV-1a
+    }
+    *h1 = dfs_bloom_mix(h);
+    *h2 = dfs_bloom_mix(h ^ 0x9e3779b97f4a7c15ULL) | 1;
+}
+
+// Function to choose the size in bits of a filter for keys paths
+// Always a power of two, so bit positions are found with a mask.
+static inline uint64_t dfs_bloom_size(uint64_t keys)
+{
+    uint64_t nbits = DFS_BLOOM_MIN_BITS;
+    while (nbits < keys * DFS_BLOOM_BITS_PER_KEY) nbits <<= 1;
+    return nbits;
+}
+
+// Function to add a path to a filter of nbits bits
+static inline void dfs_bloom_add(uint64_t *words, uint64_t nbits, const char *key, size_t len)
+{
+    uint64_t h1, h2;
+    dfs_bloom_hash(key, len, &h1, &h2);
+    for (int i = 0; i < DFS_BLOOM_HASHES; i++)
+    {
+        uint64_t bit = (h1 + i * h2) & (nbits - 1);
+        __atomic_fetch_or(&words[bit >> 6], 1ULL << (bit & 63), __ATOMIC_RELAXED);
+    }
+}
+
+// Function to check whether a path may be in a filter of nbits bits
+// Returns 0 only if the path was certainly never added.
+static inline int dfs_bloom_check(const uint64_t *words, uint64_t nbits, const char *key, size_t len)
+{
+    uint64_t h1, h2;
+    dfs_bloom_hash(key, len, &h1, &h2);
+    for (int i = 0; i < DFS_BLOOM_HASHES; i++)
+    {
+        uint64_t bit = (h1 + i * h2) & (nbits - 1);
+        if (!(__atomic_load_n(&words[bit >> 6], __ATOMIC_RELAXED) & (1ULL << (bit & 63)))) return 0;
+    }
+    return 1;
+}
+
+#endif
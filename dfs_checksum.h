@@ -0,0 +1,53 @@
+// Distributed File System - File Checksums
+// Checksums S1 uses to verify the files it moves between backend instances.
+//
+// A checksum is the CRC-32 of a file's contents (zlib's crc32()) and its size, written
+// "<crc in hex>:<size>", so a file cut short or grown never matches its original. S1 computes it
+// while it copies a file and asks both backends for theirs (DFS_OP_CHECKSUM) before it trusts the
+// copy; a removal that names a checksum only removes a file that still has it.
+
+#ifndef DFS_CHECKSUM_H
+#define DFS_CHECKSUM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <zlib.h>
+
+#define DFS_CHECKSUM_MAX 32 // Longest checksum, with its NUL
+#define DFS_CHECKSUM_BUFFER 65536 // Bytes read at a time
+
+// Function to write out a checksum; out must have room for DFS_CHECKSUM_MAX bytes
+static inline void dfs_checksum_format(uint32_t crc, uint64_t size, char *out)
+{
+    snprintf(out, DFS_CHECKSUM_MAX, "%08x:%llu", crc, (unsigned long long)size);
+}
+
+// Function to add len bytes to a running CRC-32 (start from 0)
+static inline uint32_t dfs_checksum_update(uint32_t crc, const void *data, size_t len)
+{
+    return (uint32_t)crc32(crc, data, len);
+}
+
+// Function to compute the checksum of an open file, read from its start
+// Returns -1 if the file cannot be read.
+static inline int dfs_checksum_fd(int fd, char *out)
+{
+    char buffer[DFS_CHECKSUM_BUFFER];
+    uint32_t crc = 0;
+    uint64_t size = 0;
+    while (1)
+    {
+        ssize_t n = pread(fd, buffer, sizeof(buffer), size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        crc = dfs_checksum_update(crc, buffer, n);
+        size += n;
+    }
+    dfs_checksum_format(crc, size, out);
+    return 0;
+}
+
+#endif
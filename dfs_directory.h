@@ -0,0 +1,556 @@
+// Distributed File System - Namespace Directory
+// S1's map of where every file in the namespace lives, so requests go straight to the right server.
+//
+// The directory is an index (dfs_index.h) of the files held by the backends, keyed by path like
+// a server's own index, with each entry naming the server that holds the file, its size and the
+// directory's change number for it (its version). S1's own files are already in its path index.
+// S1 adds an entry as soon as a backend has accepted an upload and drops it when a removal
+// succeeds, so the directory knows about every change made through S1 before the client hears of
+// it. An upload S1 redirects to a backend is only expected when the client is sent there: its
+// entry is marked as such (DFS_DIRECTORY_EXPECTED) until a sync reports the file, and a lookup
+// drops it if that has not happened expect_secs after the redirect, so an upload the client never
+// made leaves no entry behind. A sync process fills the directory in when S1 starts and then keeps polling each backend for
+// the changes made to its files since the last poll (dfs_index_sync()), which brings in files added
+// or removed on the backends by other programs; DFS_DIRECTORY_SYNC_SECS (default 2) sets the
+// interval. A download or removal of a path the directory does not hold is answered "not found"
+// straight away, without asking the backend, but only once the directory has been synced with
+// the server that would hold it; until then, or while that server cannot be reached, such
+// requests are forwarded as before. When a file type is spread over several backend instances
+// (dfs_routes.h), "not found" needs every instance of the group synced, and a path the directory
+// does not hold is sent wherever the routing table places it. A sync reporting a file that the
+// directory has on another instance of the group leaves the entry alone: while S1 moves a file
+// between instances, both hold it and the directory names the one reads should go to until the
+// copy has been checked (dfs_directory_move()). The files of a mirrored type, which every
+// instance of its group keeps a copy of, are filed under the group's first instance, whichever
+// instance reported them; an instance that lost its copy does not make the file disappear, and
+// only removals made through S1 drop the entry.
+//
+// When the directory cannot hold every path (its arena is full or could not be reserved, or
+// DFS_DIRECTORY=filter asks for the compact form), it keeps a Bloom filter (dfs_bloom.h) of each
+// backend's files instead, about 10 bits per file. Each backend builds its filter from its path
+// index (dfs_index_filter()); the sync process adds the files each poll reports as added, and S1
+// adds its own uploads at once, so a path missing from a synced backend's filter is answered
+// "not found" as above. Anything else, including the ~1% of missing paths the filter lets
+// through, is forwarded. Removed files stay in a filter until it is fetched again, every
+// DFS_FILTER_REFRESH_SECS seconds (default 60); a new filter is built beside the one in use
+// and replaces it once it has caught up.
+
+#ifndef DFS_DIRECTORY_H
+#define DFS_DIRECTORY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include "dfs_bloom.h"
+#include "dfs_index.h"
+
+#define DFS_DIRECTORY_SYNC_SECS 2 // Seconds between polls of each backend
+#define DFS_DIRECTORY_FILTER_SECS 60 // Seconds between fetches of each backend's filter
+#define DFS_DIRECTORY_FILTER_MB 64 // Largest filter kept per backend (DFS_FILTER_MAX_MB)
+#define DFS_DIRECTORY_EXPECTED 0 // Mode of an entry for an upload no sync has reported yet
+
+// What the directory last heard from one backend
+struct dfs_directory_peer
+{
+    uint64_t epoch; // The backend index's epoch
+    uint64_t seq; // Last change of that epoch applied
+    int synced; // Set while the directory holds every file of the backend
+    int group; // Server the backend's files are filed under: itself, or its mirrored group's first
+    int mirrored; // Set if the backend is one of a mirrored group
+    uint64_t filter_bits[2]; // Size of each of the backend's filter slots
+    int filter_active; // Slot lookups use, or -1 if there is no filter yet
+    int filter_open; // Slot being built, or -1
+    time_t filter_time; // When the active filter was fetched
+};
+
+// S1's namespace directory, shared by all of its processes
+struct dfs_directory
+{
+    struct dfs_index names; // Remote files by path, each leaf's owner being its server
+    struct dfs_directory_peer *peers; // Indexed by server number; NULL when disabled
+    uint64_t *filters; // Two filter slots per server, each filter_capacity bits; NULL without filters
+    uint64_t filter_capacity;
+    int nservers; // One past the highest server number
+    int64_t expect_secs; // Seconds an expected upload has to show up in a sync
+};
+
+// Where a file lives, as the directory knows it
+struct dfs_directory_entry
+{
+    int server;
+    uint64_t size;
+    int64_t mtime; // When the file was last written, as far as the directory knows
+    uint64_t version;
+};
+
+// Full listing being checked against the directory by dfs_directory_sweep()
+struct dfs_directory_sweep
+{
+    int server;
+    uint64_t guard; // Entries changed after this were changed by S1 itself; they are left alone
+    char **keys; // Paths the backend listed, in path order
+    size_t nkeys;
+    struct dfs_buf doomed; // NUL-separated paths to remove
+    char last[DFS_INDEX_KEY_MAX];
+    int failed;
+};
+
+// Function to set up an empty directory for servers numbered below nservers
+// Must run in the main process before any worker is started. The filter slots are reserved
+// without being backed, so only the part of each that a filter uses takes memory. Returns -1,
+// leaving the directory disabled, if neither paths nor filters can be kept.
+static inline int dfs_directory_init(struct dfs_directory *d, int nservers)
+{
+    d->peers = NULL;
+    d->nservers = nservers;
+    d->filters = NULL;
+    d->filter_capacity = 0;
+    d->expect_secs = 0;
+    const char *mode = getenv("DFS_DIRECTORY");
+    if (mode == NULL || strcmp(mode, "filter") != 0)
+    {
+        dfs_index_create(&d->names, "", "");
+    }
+    else
+    {
+        memset(&d->names, 0, sizeof(d->names));
+    }
+
+    long max_mb = dfs_index_setting("DFS_FILTER_MAX_MB", DFS_DIRECTORY_FILTER_MB);
+    if (max_mb > 0)
+    {
+        uint64_t capacity = DFS_BLOOM_MIN_BITS;
+        while (capacity * 2 <= (uint64_t)max_mb * 8 * 1024 * 1024) capacity *= 2;
+        void *filters = mmap(NULL, (size_t)nservers * 2 * (capacity / 8), PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (filters != MAP_FAILED)
+        {
+            d->filters = filters;
+            d->filter_capacity = capacity;
+        }
+    }
+    if (!dfs_index_usable(&d->names) && d->filters == NULL) return -1;
+
+    struct dfs_directory_peer *peers = mmap(NULL, nservers * sizeof(struct dfs_directory_peer),
+                                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (peers == MAP_FAILED) return -1;
+    for (int server = 0; server < nservers; server++)
+    {
+        peers[server].filter_active = -1;
+        peers[server].filter_open = -1;
+        peers[server].group = server;
+    }
+    d->peers = peers;
+    return 0;
+}
+
+// Function to record that the servers first to first + count - 1 each keep a copy of every file
+// Must be called before any worker is started.
+static inline void dfs_directory_mirror(struct dfs_directory *d, int first, int count)
+{
+    if (d->peers == NULL) return;
+    for (int server = first; server < first + count; server++)
+    {
+        d->peers[server].group = first;
+        d->peers[server].mirrored = 1;
+    }
+}
+
+// Function to give one of a server's two filter slots
+static inline uint64_t *dfs_directory_slot(struct dfs_directory *d, int server, int slot)
+{
+    return d->filters + ((size_t)server * 2 + slot) * (d->filter_capacity / 64);
+}
+
+// Function to check a path against a server's filter
+// Returns 0 if the server certainly does not hold it, 1 if it may, and -1 if there is no filter.
+static inline int dfs_directory_filter_check(struct dfs_directory *d, int server, const char *key)
+{
+    struct dfs_directory_peer *peer = &d->peers[server];
+    int slot = __atomic_load_n(&peer->filter_active, __ATOMIC_ACQUIRE);
+    if (slot < 0) return -1;
+    return dfs_bloom_check(dfs_directory_slot(d, server, slot), peer->filter_bits[slot], key, strlen(key));
+}
+
+// Function to add a path to a server's filter, and to the one being built if there is one
+static inline void dfs_directory_filter_add(struct dfs_directory *d, int server, const char *key)
+{
+    struct dfs_directory_peer *peer = &d->peers[server];
+    int slots[2] = { __atomic_load_n(&peer->filter_active, __ATOMIC_ACQUIRE), __atomic_load_n(&peer->filter_open, __ATOMIC_ACQUIRE) };
+    for (int i = 0; i < 2; i++)
+    {
+        if (slots[i] < 0) continue;
+        dfs_bloom_add(dfs_directory_slot(d, server, slots[i]), peer->filter_bits[slots[i]], key, strlen(key));
+    }
+}
+
+// Function to start building a new filter of nbits bits for a server
+// Uses the slot not in use; uploads made from now on are added to it as well as to the current
+// filter. Returns the slot, or -1 if there are no filters or nbits does not fit.
+static inline int dfs_directory_filter_open(struct dfs_directory *d, int server, uint64_t nbits)
+{
+    struct dfs_directory_peer *peer = &d->peers[server];
+    if (d->filters == NULL || nbits < 64 || nbits > d->filter_capacity || (nbits & (nbits - 1)) != 0) return -1;
+    int slot = (peer->filter_active == 0) ? 1 : 0;
+    memset(dfs_directory_slot(d, server, slot), 0, nbits / 8);
+    peer->filter_bits[slot] = nbits;
+    __atomic_store_n(&peer->filter_open, slot, __ATOMIC_RELEASE);
+    return slot;
+}
+
+// Function to merge the filter a server sent into the slot being built
+static inline void dfs_directory_filter_merge(struct dfs_directory *d, int server, int slot, const char *data)
+{
+    uint64_t *words = dfs_directory_slot(d, server, slot);
+    for (uint64_t i = 0; i < d->peers[server].filter_bits[slot] / 64; i++)
+    {
+        uint64_t word;
+        memcpy(&word, data + i * 8, 8);
+        word = le64toh(word);
+        if (word != 0) __atomic_fetch_or(&words[i], word, __ATOMIC_RELAXED);
+    }
+}
+
+// Function to put a server's newly built filter in use
+static inline void dfs_directory_filter_publish(struct dfs_directory *d, int server, int slot)
+{
+    struct dfs_directory_peer *peer = &d->peers[server];
+    peer->filter_time = time(NULL);
+    __atomic_store_n(&peer->filter_active, slot, __ATOMIC_RELEASE);
+    __atomic_store_n(&peer->filter_open, -1, __ATOMIC_RELEASE);
+}
+
+// Function to give up on a filter that could not be built
+static inline void dfs_directory_filter_abandon(struct dfs_directory *d, int server, int slot)
+{
+    if (slot != d->peers[server].filter_active) __atomic_store_n(&d->peers[server].filter_open, -1, __ATOMIC_RELEASE);
+}
+
+// Function to turn a namespace path ("~S1/docs/a.pdf") into a directory key
+static inline int dfs_directory_key(const char *path, char *key, size_t size)
+{
+    if (strncmp(path, "~S1", 3) != 0) return -1;
+    return dfs_index_key(path + 3, key, size);
+}
+
+// Function to check whether the directory is synced with every server of a group
+static inline int dfs_directory_synced(struct dfs_directory *d, int first, int count)
+{
+    for (int server = first; server < first + count; server++)
+    {
+        if (!__atomic_load_n(&d->peers[server].synced, __ATOMIC_ACQUIRE)) return 0;
+    }
+    return 1;
+}
+
+// Function to find out which server holds path
+// first and count give the group of servers that would hold a file of its type. Returns 1 and
+// fills in entry if the directory holds the path, 0 if the file certainly does not exist, and -1
+// if the directory cannot tell (it is disabled or not synced with all of the group yet). Without
+// paths, only the group's filters are consulted: 1 means a single server's filter may hold the
+// file (entry then has only its server), and a file several may hold gives -1. A file of a
+// mirrored group is given as held by the group's first server.
+static inline int dfs_directory_lookup(struct dfs_directory *d, const char *path, int first, int count, struct dfs_directory_entry *entry)
+{
+    char key[DFS_INDEX_KEY_MAX];
+    if (d->peers == NULL || dfs_directory_key(path, key, sizeof(key)) < 0) return -1;
+    if (!dfs_index_usable(&d->names))
+    {
+        if (!dfs_directory_synced(d, first, count) || d->filters == NULL) return -1;
+        int holders = 0;
+        if (d->peers[first].mirrored)
+        {
+            for (int server = first; server < first + count && holders == 0; server++)
+            {
+                holders = (dfs_directory_filter_check(d, server, key) != 0);
+            }
+            entry->server = first;
+            entry->size = 0;
+            entry->mtime = 0;
+            entry->version = 0;
+            return holders;
+        }
+        for (int server = first; server < first + count; server++)
+        {
+            if (dfs_directory_filter_check(d, server, key) != 0)
+            {
+                holders++;
+                entry->server = server;
+                entry->size = 0;
+                entry->mtime = 0;
+                entry->version = 0;
+            }
+        }
+        return (holders <= 1) ? holders : -1;
+    }
+
+    dfs_index_lock(d->names.head);
+    const struct dfs_index_leaf *leaf = dfs_index_find(d->names.head, key);
+    if (leaf != NULL && leaf->mode == DFS_DIRECTORY_EXPECTED && leaf->mtime + d->expect_secs < (int64_t)time(NULL))
+    {
+        // The redirected upload it was made for never arrived
+        dfs_index_delete(d->names.head, key);
+        leaf = NULL;
+    }
+    if (leaf != NULL)
+    {
+        entry->server = leaf->owner;
+        entry->size = leaf->size;
+        entry->mtime = leaf->mtime;
+        entry->version = leaf->version;
+    }
+    int synced = dfs_directory_synced(d, first, count);
+    dfs_index_unlock(d->names.head);
+    if (leaf != NULL) return 1;
+    return synced ? 0 : -1;
+}
+
+// Function to enter path in the directory as held by server, size bytes long, with the given mode
+static inline void dfs_directory_record(struct dfs_directory *d, const char *path, int server, uint64_t size, mode_t mode)
+{
+    char key[DFS_INDEX_KEY_MAX];
+    if (d->peers == NULL || dfs_directory_key(path, key, sizeof(key)) < 0) return;
+    if (d->filters != NULL) dfs_directory_filter_add(d, server, key);
+    if (!dfs_index_usable(&d->names)) return;
+
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_size = size;
+    st.st_mtime = time(NULL);
+    st.st_mode = mode;
+    dfs_index_lock(d->names.head);
+    // An expected upload never replaces a file the directory already has: if it does not arrive,
+    // the entry must not expire, since the old file is still there
+    const struct dfs_index_leaf *leaf = dfs_index_find(d->names.head, key);
+    if (mode != DFS_DIRECTORY_EXPECTED || leaf == NULL || leaf->mode == DFS_DIRECTORY_EXPECTED)
+    {
+        dfs_index_insert_owned(d->names.head, key, &st, d->peers[server].group);
+    }
+    dfs_index_unlock(d->names.head);
+}
+
+// Function to record that server now holds path, size bytes long
+static inline void dfs_directory_add(struct dfs_directory *d, const char *path, int server, uint64_t size)
+{
+    dfs_directory_record(d, path, server, size, S_IFREG | 0644);
+}
+
+// Function to record that a client was sent to upload path to server, size bytes long
+// Reads of the path go to server meanwhile. The entry stays once a sync reports the file (or S1
+// itself stores it again), and is dropped by the first lookup made expect_secs later otherwise.
+// A path the directory already holds keeps its entry as it is.
+static inline void dfs_directory_expect(struct dfs_directory *d, const char *path, int server, uint64_t size)
+{
+    dfs_directory_record(d, path, server, size, DFS_DIRECTORY_EXPECTED);
+}
+
+// Function to record that a file S1 copied from one server to another is now read from the new one
+// The entry changes only if it is still the one S1 copied, with owner from and the given version;
+// otherwise the file was changed or removed meanwhile and -1 is returned.
+static inline int dfs_directory_move(struct dfs_directory *d, const char *path, int from, int to, uint64_t version)
+{
+    char key[DFS_INDEX_KEY_MAX];
+    if (d->peers == NULL || !dfs_index_usable(&d->names) || dfs_directory_key(path, key, sizeof(key)) < 0) return -1;
+    if (d->filters != NULL) dfs_directory_filter_add(d, to, key);
+
+    int result = -1;
+    dfs_index_lock(d->names.head);
+    struct dfs_index_leaf *leaf = dfs_index_find(d->names.head, key);
+    if (leaf != NULL && leaf->owner == from && leaf->version == version)
+    {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_size = leaf->size;
+        st.st_mtime = leaf->mtime;
+        st.st_mode = S_IFREG | 0644;
+        dfs_index_insert_owned(d->names.head, key, &st, to);
+        result = 0;
+    }
+    dfs_index_unlock(d->names.head);
+    return result;
+}
+
+// Function to record that path no longer exists
+static inline void dfs_directory_forget(struct dfs_directory *d, const char *path)
+{
+    char key[DFS_INDEX_KEY_MAX];
+    if (d->peers == NULL || !dfs_index_usable(&d->names) || dfs_directory_key(path, key, sizeof(key)) < 0) return;
+
+    dfs_index_lock(d->names.head);
+    dfs_index_delete(d->names.head, key);
+    dfs_index_unlock(d->names.head);
+}
+
+// Function to mark a backend as synced or not
+static inline void dfs_directory_set_synced(struct dfs_directory *d, int server, int synced)
+{
+    if (d->peers == NULL) return;
+    __atomic_store_n(&d->peers[server].synced, synced, __ATOMIC_RELEASE);
+}
+
+// Function to take the change number a sync starts from
+// Entries S1 changes after this point are newer than anything the sync brings, so it skips them.
+static inline uint64_t dfs_directory_guard(struct dfs_directory *d)
+{
+    dfs_index_lock(d->names.head);
+    uint64_t guard = d->names.head->seq;
+    dfs_index_unlock(d->names.head);
+    return guard;
+}
+
+// Function to compare two paths for bsearch()
+static inline int dfs_directory_compare(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Function to note an entry of the swept server that the backend did not list
+static inline int dfs_directory_sweep_one(void *arg, const struct dfs_index_leaf *leaf)
+{
+    struct dfs_directory_sweep *s = arg;
+    const char *key = leaf->key;
+    memcpy(s->last, leaf->key, leaf->key_len + 1);
+    if (leaf->owner != s->server || leaf->version > s->guard ||
+        bsearch(&key, s->keys, s->nkeys, sizeof(char *), dfs_directory_compare) != NULL)
+    {
+        return 0;
+    }
+    if (dfs_buf_append(&s->doomed, leaf->key, leaf->key_len + 1) < 0)
+    {
+        s->failed = 1;
+        return 1;
+    }
+    return 0;
+}
+
+// Function to drop the entries of a server that its full listing no longer holds
+static inline int dfs_directory_sweep(struct dfs_directory *d, struct dfs_directory_sweep *s)
+{
+    struct dfs_index_head *h = d->names.head;
+    int visited;
+    do
+    {
+        // Note a batch of entries to drop, then drop them; the next batch starts after the last seen
+        s->doomed.len = 0;
+        dfs_index_lock(h);
+        visited = dfs_index_walk(h, "/", s->last[0] ? s->last : NULL, DFS_INDEX_SCAN_BATCH, dfs_directory_sweep_one, s);
+        for (size_t pos = 0; !s->failed && pos < s->doomed.len; pos += strlen(s->doomed.data + pos) + 1)
+        {
+            dfs_index_delete(h, s->doomed.data + pos);
+        }
+        dfs_index_unlock(h);
+    } while (!s->failed && visited == DFS_INDEX_SCAN_BATCH);
+    free(s->doomed.data);
+    return s->failed ? -1 : 0;
+}
+
+// Function to read one entry sent by dfs_index_sync()
+// Returns the entry's path, filling in st if the file was added or changed ('+'), or NULL if the
+// entry is malformed.
+static inline char *dfs_directory_entry_key(char *entry, struct stat *st)
+{
+    char *key = NULL;
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFREG | 0644;
+    if (entry[0] == '+')
+    {
+        unsigned long long size;
+        long long mtime;
+        int used = 0;
+        if (sscanf(entry + 1, "%llu %lld %n", &size, &mtime, &used) < 2 || used == 0) return NULL;
+        st->st_size = size;
+        st->st_mtime = mtime;
+        key = entry + 1 + used;
+    }
+    else if (entry[0] == '-')
+    {
+        key = entry + 1;
+    }
+    return (key != NULL && key[0] == '/') ? key : NULL;
+}
+
+// Function to add the files a sync reports as added to the filter being built in slot
+// Removals are ignored: a filter only forgets when it is built again. Returns -1 if the entries
+// are malformed.
+static inline int dfs_directory_filter_apply(struct dfs_directory *d, int server, int slot, char *data, size_t len)
+{
+    if (len > 0 && data[len - 1] != '\0') return -1;
+    uint64_t *words = dfs_directory_slot(d, server, slot);
+    for (size_t pos = 0; pos < len; pos += strlen(data + pos) + 1)
+    {
+        struct stat st;
+        char *key = dfs_directory_entry_key(data + pos, &st);
+        if (key == NULL) return -1;
+        if (data[pos] == '+') dfs_bloom_add(words, d->peers[server].filter_bits[slot], key, strlen(key));
+    }
+    return 0;
+}
+
+// Function to apply what a backend sent in answer to a sync
+// data holds the NUL-terminated entries dfs_index_sync() produced for server; full says whether
+// they are every file the backend holds, in which case entries it no longer holds are dropped.
+// guard is the value dfs_directory_guard() returned before the sync was asked for. Returns -1
+// if the entries are malformed or memory runs out.
+static inline int dfs_directory_apply(struct dfs_directory *d, int server, int full, uint64_t guard, char *data, size_t len)
+{
+    struct dfs_index_head *h = d->names.head;
+    if (len > 0 && data[len - 1] != '\0') return -1;
+
+    struct dfs_directory_sweep s;
+    int owner = d->peers[server].group;
+    memset(&s, 0, sizeof(s));
+    s.server = owner;
+    s.guard = guard;
+    if (full)
+    {
+        size_t count = 0;
+        for (size_t pos = 0; pos < len; pos += strlen(data + pos) + 1) count++;
+        s.keys = malloc((count > 0 ? count : 1) * sizeof(char *));
+        if (s.keys == NULL) return -1;
+    }
+
+    int failed = 0;
+    for (size_t pos = 0; pos < len && !failed; pos += strlen(data + pos) + 1)
+    {
+        char *entry = data + pos;
+        struct stat st;
+        char *key = dfs_directory_entry_key(entry, &st);
+        if (key == NULL)
+        {
+            failed = 1;
+            break;
+        }
+        if (full) s.keys[s.nkeys++] = key;
+
+        // What S1 did to the path since the sync began is newer than what the backend sent, except
+        // that an upload S1 only expected may have arrived since then too
+        dfs_index_lock(h);
+        struct dfs_index_leaf *leaf = dfs_index_find(h, key);
+        if (leaf == NULL || leaf->version <= guard || (entry[0] == '+' && leaf->mode == DFS_DIRECTORY_EXPECTED))
+        {
+            if (entry[0] == '+' && (leaf == NULL || leaf->owner == owner))
+            {
+                dfs_index_insert_owned(h, key, &st, owner);
+            }
+            else if (entry[0] == '-' && leaf != NULL && leaf->owner == owner && !d->peers[server].mirrored)
+            {
+                dfs_index_delete(h, key);
+            }
+        }
+        dfs_index_unlock(h);
+    }
+
+    if (!failed && full && !d->peers[server].mirrored)
+    {
+        failed = (dfs_directory_sweep(d, &s) < 0);
+    }
+    free(s.keys);
+    return failed ? -1 : 0;
+}
+
+#endif
@@ -0,0 +1,1329 @@
+// Distributed File System - In-memory Path Index
+// Keeps every server's files in memory so listings and tar archives do not walk the filesystem.
+//
+// Each server indexes the files of its type under its storage root by path ("/docs/a.pdf", the
+// part of a ~S1 path after "~S1"), with their size, modification time, mode and owner. The index
+// is a crit-bit tree, a compressed binary trie: one internal node per branching point and one leaf
+// per file, so a lookup costs one step per branching point and the leaves come out in path order.
+// All of a directory's files are a contiguous run of that order, which makes a listing page a
+// walk over just the matching leaves, and its continuation cursor simply the last path listed.
+//
+// The tree lives in an arena of shared memory mapped by the main process before the workers are
+// started, so every worker and every forked session sees and updates the same index. Nodes refer
+// to each other by offsets into the arena, and a robust process-shared mutex serialises access.
+// The index is kept current by the servers' own uploads and removals. DFS_INDEX_MB (default
+// 1024) sets the address space reserved for it; memory is only committed as it is used. Set it
+// to 0 to disable the index. If the arena fills up the index stops being used and servers go
+// back to walking the filesystem.
+//
+// So that a restart does not have to walk the whole tree again, the index is also kept on disk
+// in $DFS_INDEX_DIR (default ~/.dfs_index), as a snapshot plus a write-ahead log. Since nodes
+// refer to each other by offset, a snapshot is simply an image of the arena, and loading it is
+// one mmap() and copy. Every change is appended to the log, numbered, while the index lock is
+// held, so the log's order is the order the changes were made in. A background process writes a
+// fresh snapshot when DFS_INDEX_SNAPSHOT_SECS seconds (default 60) have passed with changes
+// logged, or sooner after DFS_INDEX_SNAPSHOT_RECORDS changes, moving the log aside first so it
+// only ever holds what the snapshots lack. At startup the snapshot is loaded and the changes
+// logged after it are replayed; only without a usable snapshot is the tree walked. A snapshot is
+// not used if the storage root has been replaced or changed at the top level since the index
+// last changed, as happens when it is cleared while the server is down.
+//
+// Every change is numbered, and each entry remembers the number of the change that last touched
+// it. S1 uses those numbers to keep its namespace directory of every server's files current
+// (dfs_index_sync()): it asks for the changes after the last one it saw and is sent the log
+// records that follow it, or every entry when the log no longer reaches back that far. The
+// numbers are only compared within one epoch, which is chosen afresh each time a server starts.
+// A server can also describe its files as a Bloom filter (dfs_index_filter()), which S1 keeps
+// instead of the paths themselves when it is short of memory.
+
+#ifndef DFS_INDEX_H
+#define DFS_INDEX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+#include "dfs_protocol.h"
+#include "dfs_listing.h"
+#include "dfs_bloom.h"
+
+#define DFS_INDEX_DEFAULT_MB 1024 // Address space reserved for the index when DFS_INDEX_MB is not set
+#define DFS_INDEX_KEY_MAX DFS_WALK_PATH_LEN // Longest path the index holds
+#define DFS_INDEX_ALIGN 16 // Arena allocations are multiples of this
+#define DFS_INDEX_CLASSES (DFS_INDEX_KEY_MAX / DFS_INDEX_ALIGN + 4) // Free lists, one per allocation size
+#define DFS_INDEX_SCAN_BATCH 4096 // Leaves read per lock hold when enumerating a whole subtree
+#define DFS_INDEX_DIR ".dfs_index" // Default directory for snapshots and logs, under $HOME
+#define DFS_INDEX_MAGIC 0x49534644 // "DFSI", at the start of a snapshot
+#define DFS_INDEX_VERSION 2 // Layout of snapshots and log records
+#define DFS_INDEX_SNAPSHOT_SECS 60 // Longest a logged change waits for a snapshot
+#define DFS_INDEX_SNAPSHOT_RECORDS 100000 // Logged changes that trigger a snapshot straight away
+
+// Internal node: the first bit at which the keys below it differ
+struct dfs_index_node
+{
+    uint64_t child[2]; // Tagged references: internal nodes have the low bit set
+    uint32_t byte; // Index of the byte holding the critical bit
+    uint8_t otherbits; // Every bit of that byte except the critical one
+};
+
+// Leaf: one indexed file
+struct dfs_index_leaf
+{
+    uint64_t size;
+    int64_t mtime;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t version; // Number of the change that last touched the entry
+    uint16_t owner; // Server holding the file, in S1's namespace directory; 0 elsewhere
+    uint16_t key_len;
+    char key[]; // NUL-terminated path
+};
+
+// Start of the shared arena, and of a snapshot
+struct dfs_index_head
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t head_size; // sizeof(struct dfs_index_head) when the snapshot was written
+    char store[DFS_WALK_PATH_LEN]; // Storage root and file type the snapshot describes
+    char ext[8];
+    uint64_t store_dev; // Identity of the storage root, to notice it being replaced
+    uint64_t store_ino;
+    int64_t changed_ns; // When the index last changed, to notice the root changing behind it
+    uint64_t epoch; // Chosen when the server starts; change numbers are compared within one epoch
+    uint64_t seq; // Number of the last change made
+    uint64_t snapshot_seq; // Last change the snapshot on disk includes
+    int64_t snapshot_time; // When that snapshot was written
+    uint32_t log_generation; // Bumped when the log is moved aside, so processes reopen it
+    int snapshot_missing; // Set when nothing on disk describes the index yet
+    pthread_mutex_t lock; // Robust and shared by every process of the server
+    uint64_t capacity; // Arena size in bytes
+    uint64_t used; // Bytes handed out so far
+    uint64_t root; // Tagged reference to the root, 0 when the index is empty
+    uint64_t count; // Files indexed
+    uint64_t free_lists[DFS_INDEX_CLASSES]; // Released allocations by size class
+    int usable; // Cleared if the arena ran out, after which the index is not consulted
+};
+
+// A server's handle on its index
+struct dfs_index
+{
+    struct dfs_index_head *head; // NULL when the index is disabled
+    char root[DFS_WALK_PATH_LEN]; // Storage root the keys are relative to
+    char ext[8]; // File type indexed
+    char state[DFS_WALK_PATH_LEN]; // Snapshot and log path without suffix, "" if not persisted
+    int log_fd; // This process's descriptor for the log, -1 until first used
+    uint32_t log_generation; // Log generation log_fd belongs to
+};
+
+// One change in the write-ahead log, followed by the key
+struct dfs_index_record
+{
+    uint64_t check; // Checksum of the rest of the record and the key
+    uint64_t seq;
+    int64_t time_ns; // When the change was made
+    uint64_t size;
+    int64_t mtime;
+    uint32_t mode; // 0 for a removal
+    uint32_t uid;
+    uint32_t gid;
+    uint16_t key_len;
+    uint16_t unused;
+};
+
+// Visitor called for each leaf of a scan; returns nonzero to stop the scan
+typedef int (*dfs_index_visit)(void *arg, const struct dfs_index_leaf *leaf);
+
+// Visitor called for each record read from a log; returns nonzero to stop reading
+typedef int (*dfs_index_record_visit)(void *arg, const struct dfs_index_record *r, const char *key);
+
+// Function to turn an arena offset into a pointer
+static inline void *dfs_index_at(const struct dfs_index_head *h, uint64_t ref)
+{
+    return (char *)h + (ref & ~(uint64_t)1);
+}
+
+// Function to check whether the index may be consulted
+static inline int dfs_index_usable(const struct dfs_index *idx)
+{
+    return idx != NULL && idx->head != NULL && idx->head->usable;
+}
+
+// Function to set up the index lock in a new arena
+static inline void dfs_index_lock_init(struct dfs_index_head *h)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&h->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+// Function to take the index lock
+// A process that died holding it cannot have left the tree half-linked (every change becomes
+// visible with one store), so the lock is simply made consistent again.
+static inline void dfs_index_lock(struct dfs_index_head *h)
+{
+    if (pthread_mutex_lock(&h->lock) == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&h->lock);
+    }
+}
+
+// Function to release the index lock
+static inline void dfs_index_unlock(struct dfs_index_head *h)
+{
+    pthread_mutex_unlock(&h->lock);
+}
+
+// Function to allocate len bytes of the arena
+// Returns the offset, or 0 (and marks the index unusable) once the arena is full.
+static inline uint64_t dfs_index_alloc(struct dfs_index_head *h, size_t len)
+{
+    size_t cls = (len + DFS_INDEX_ALIGN - 1) / DFS_INDEX_ALIGN;
+    if (cls < DFS_INDEX_CLASSES && h->free_lists[cls] != 0)
+    {
+        uint64_t ref = h->free_lists[cls];
+        memcpy(&h->free_lists[cls], dfs_index_at(h, ref), sizeof(uint64_t));
+        return ref;
+    }
+    if (h->used + cls * DFS_INDEX_ALIGN > h->capacity)
+    {
+        h->usable = 0;
+        return 0;
+    }
+    uint64_t ref = h->used;
+    h->used += cls * DFS_INDEX_ALIGN;
+    return ref;
+}
+
+// Function to return an allocation of len bytes to its free list
+static inline void dfs_index_release(struct dfs_index_head *h, uint64_t ref, size_t len)
+{
+    size_t cls = (len + DFS_INDEX_ALIGN - 1) / DFS_INDEX_ALIGN;
+    if (cls < DFS_INDEX_CLASSES)
+    {
+        memcpy(dfs_index_at(h, ref), &h->free_lists[cls], sizeof(uint64_t));
+        h->free_lists[cls] = ref;
+    }
+}
+
+// Function to give the direction a key takes at an internal node
+static inline int dfs_index_direction(const struct dfs_index_node *q, const char *key, size_t len)
+{
+    uint8_t c = (q->byte < len) ? (uint8_t)key[q->byte] : 0;
+    return (1 + (q->otherbits | c)) >> 8;
+}
+
+// Function to find the first bit at which a key and a leaf's key differ
+// Returns 0 if they are equal; otherwise sets the byte and the mask of all other bits.
+static inline int dfs_index_differ(const char *key, size_t len, const struct dfs_index_leaf *leaf, uint32_t *byte, uint8_t *otherbits)
+{
+    size_t n = (len > leaf->key_len) ? len : leaf->key_len;
+    for (size_t i = 0; i < n; i++)
+    {
+        uint8_t a = (i < len) ? (uint8_t)key[i] : 0;
+        uint8_t b = (i < leaf->key_len) ? (uint8_t)leaf->key[i] : 0;
+        if (a != b)
+        {
+            uint32_t x = a ^ b;
+            x |= x >> 1;
+            x |= x >> 2;
+            x |= x >> 4;
+            *byte = i;
+            *otherbits = (uint8_t)((x & ~(x >> 1)) ^ 255); // Keep only the highest differing bit
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to find the leaf a key would be compared with
+static inline struct dfs_index_leaf *dfs_index_best(struct dfs_index_head *h, const char *key, size_t len)
+{
+    uint64_t p = h->root;
+    while (p & 1)
+    {
+        struct dfs_index_node *q = dfs_index_at(h, p);
+        p = q->child[dfs_index_direction(q, key, len)];
+    }
+    return dfs_index_at(h, p);
+}
+
+// Function to look a path up in the index
+// The index lock must be held. Returns the file's leaf, or NULL if it is not indexed.
+static inline struct dfs_index_leaf *dfs_index_find(struct dfs_index_head *h, const char *key)
+{
+    size_t len = strlen(key);
+    if (h->root == 0) return NULL;
+    struct dfs_index_leaf *leaf = dfs_index_best(h, key, len);
+    return (leaf->key_len == len && memcmp(leaf->key, key, len) == 0) ? leaf : NULL;
+}
+
+// Function to add or update a file held by server owner in the index
+// The index lock must be held. A change is given the next change number. Returns 0 if the
+// index changed, 1 if it already held exactly this, or -1 if the arena is full.
+static inline int dfs_index_insert_owned(struct dfs_index_head *h, const char *key, const struct stat *st, int owner)
+{
+    size_t len = strlen(key);
+    if (len >= DFS_INDEX_KEY_MAX) return -1;
+
+    struct dfs_index_leaf *best = (h->root != 0) ? dfs_index_best(h, key, len) : NULL;
+    uint32_t newbyte = 0;
+    uint8_t newotherbits = 0;
+    if (best != NULL && !dfs_index_differ(key, len, best, &newbyte, &newotherbits))
+    {
+        // Already indexed: refresh what is known about it
+        if (best->size == (uint64_t)st->st_size && best->mtime == st->st_mtime && best->mode == st->st_mode &&
+            best->uid == st->st_uid && best->gid == st->st_gid && best->owner == owner)
+        {
+            return 1;
+        }
+        best->size = st->st_size;
+        best->mtime = st->st_mtime;
+        best->mode = st->st_mode;
+        best->uid = st->st_uid;
+        best->gid = st->st_gid;
+        best->owner = owner;
+        best->version = ++h->seq;
+        return 0;
+    }
+
+    uint64_t leaf_ref = dfs_index_alloc(h, sizeof(struct dfs_index_leaf) + len + 1);
+    if (leaf_ref == 0) return -1;
+    struct dfs_index_leaf *leaf = dfs_index_at(h, leaf_ref);
+    leaf->size = st->st_size;
+    leaf->mtime = st->st_mtime;
+    leaf->mode = st->st_mode;
+    leaf->uid = st->st_uid;
+    leaf->gid = st->st_gid;
+    leaf->owner = owner;
+    leaf->key_len = len;
+    memcpy(leaf->key, key, len + 1);
+
+    if (best == NULL)
+    {
+        leaf->version = ++h->seq;
+        h->root = leaf_ref;
+        h->count++;
+        return 0;
+    }
+
+    uint64_t node_ref = dfs_index_alloc(h, sizeof(struct dfs_index_node));
+    if (node_ref == 0)
+    {
+        dfs_index_release(h, leaf_ref, sizeof(struct dfs_index_leaf) + len + 1);
+        return -1;
+    }
+    struct dfs_index_node *node = dfs_index_at(h, node_ref);
+    uint8_t c = (newbyte < best->key_len) ? (uint8_t)best->key[newbyte] : 0;
+    int newdirection = (1 + (newotherbits | c)) >> 8; // Side the existing keys go
+    node->byte = newbyte;
+    node->otherbits = newotherbits;
+    node->child[1 - newdirection] = leaf_ref;
+
+    // Find where the new branching point belongs: above every node that branches later
+    uint64_t *wherep = &h->root;
+    while (*wherep & 1)
+    {
+        struct dfs_index_node *q = dfs_index_at(h, *wherep);
+        if (q->byte > newbyte || (q->byte == newbyte && q->otherbits > newotherbits)) break;
+        wherep = &q->child[dfs_index_direction(q, key, len)];
+    }
+    node->child[newdirection] = *wherep;
+    leaf->version = ++h->seq;
+    *wherep = node_ref | 1; // The new file becomes visible with this one store
+    h->count++;
+    return 0;
+}
+
+// Function to add or update one of the server's own files in the index
+static inline int dfs_index_insert(struct dfs_index_head *h, const char *key, const struct stat *st)
+{
+    return dfs_index_insert_owned(h, key, st, 0);
+}
+
+// Function to remove a file from the index
+// The index lock must be held. A removal is given the next change number. Returns 1 if the
+// file was indexed, 0 if not.
+static inline int dfs_index_delete(struct dfs_index_head *h, const char *key)
+{
+    size_t len = strlen(key);
+    if (h->root == 0) return 0;
+
+    uint64_t *wherep = &h->root, *whereq = NULL;
+    struct dfs_index_node *q = NULL;
+    int direction = 0;
+    while (*wherep & 1)
+    {
+        whereq = wherep;
+        q = dfs_index_at(h, *wherep);
+        direction = dfs_index_direction(q, key, len);
+        wherep = &q->child[direction];
+    }
+
+    struct dfs_index_leaf *leaf = dfs_index_at(h, *wherep);
+    if (leaf->key_len != len || memcmp(leaf->key, key, len) != 0) return 0;
+
+    uint64_t leaf_ref = *wherep;
+    if (whereq == NULL)
+    {
+        h->root = 0;
+    }
+    else
+    {
+        uint64_t node_ref = *whereq;
+        *whereq = q->child[1 - direction]; // The sibling takes the parent's place
+        dfs_index_release(h, node_ref & ~(uint64_t)1, sizeof(struct dfs_index_node));
+    }
+    dfs_index_release(h, leaf_ref, sizeof(struct dfs_index_leaf) + len + 1);
+    h->count--;
+    h->seq++;
+    return 1;
+}
+
+// Function to visit, in path order, the indexed files whose path starts with prefix
+// Starts at the path start, or just after it if strict is set, and stops after max files or when
+// visit returns nonzero. start must not sort before prefix. The index lock must be held. Returns
+// the number of files visited.
+static inline int dfs_index_walk_from(struct dfs_index_head *h, const char *prefix, const char *start, int strict, int max, dfs_index_visit visit, void *arg)
+{
+    // Path from the root to the current leaf: node references and the direction taken at each
+    static __thread uint64_t stack[DFS_INDEX_KEY_MAX * 8 + 1];
+    static __thread uint8_t dirs[DFS_INDEX_KEY_MAX * 8 + 1];
+    int depth = 0, count = 0;
+    size_t prefix_len = strlen(prefix);
+    if (h->root == 0 || max <= 0) return 0;
+
+    // Find the first leaf at or after the starting key
+    size_t len = strlen(start);
+    uint64_t p = h->root;
+    while (p & 1)
+    {
+        struct dfs_index_node *q = dfs_index_at(h, p);
+        stack[depth] = p;
+        dirs[depth] = dfs_index_direction(q, start, len);
+        p = q->child[dirs[depth++]];
+    }
+
+    uint32_t newbyte;
+    uint8_t newotherbits;
+    struct dfs_index_leaf *leaf = dfs_index_at(h, p);
+    int advance = 0;
+    if (!dfs_index_differ(start, len, leaf, &newbyte, &newotherbits))
+    {
+        advance = strict; // The starting key itself is indexed
+    }
+    else
+    {
+        // Climb to where the starting key would branch off; it sorts either before everything
+        // below that point or after all of it
+        int top = 0;
+        while (top < depth)
+        {
+            struct dfs_index_node *q = dfs_index_at(h, stack[top]);
+            if (q->byte > newbyte || (q->byte == newbyte && q->otherbits > newotherbits)) break;
+            top++;
+        }
+        depth = top;
+        uint8_t c = (newbyte < len) ? (uint8_t)start[newbyte] : 0;
+        if (((1 + (newotherbits | c)) >> 8) == 0)
+        {
+            p = (depth == 0) ? h->root : ((struct dfs_index_node *)dfs_index_at(h, stack[depth - 1]))->child[dirs[depth - 1]];
+            while (p & 1)
+            {
+                stack[depth] = p;
+                dirs[depth++] = 0;
+                p = ((struct dfs_index_node *)dfs_index_at(h, p))->child[0];
+            }
+        }
+        else
+        {
+            advance = 1; // Continue after the subtree the key would have branched from
+            p = 0;
+        }
+    }
+
+    while (1)
+    {
+        if (advance)
+        {
+            // Move to the next leaf: back up to the last left turn, then take the right branch
+            while (depth > 0 && dirs[depth - 1] == 1) depth--;
+            if (depth == 0) break;
+            dirs[depth - 1] = 1;
+            p = ((struct dfs_index_node *)dfs_index_at(h, stack[depth - 1]))->child[1];
+            while (p & 1)
+            {
+                stack[depth] = p;
+                dirs[depth++] = 0;
+                p = ((struct dfs_index_node *)dfs_index_at(h, p))->child[0];
+            }
+        }
+        advance = 1;
+
+        leaf = dfs_index_at(h, p);
+        if (leaf->key_len < prefix_len || memcmp(leaf->key, prefix, prefix_len) != 0) break; // Past the prefix
+        if (count == max) break;
+        count++;
+        if (visit(arg, leaf)) break;
+    }
+    return count;
+}
+
+// Function to visit, in path order, the indexed files whose path starts with prefix
+// Starts after the path after (or at the beginning when it is NULL) and stops after max files or
+// when visit returns nonzero. The index lock must be held. Returns the number of files visited.
+static inline int dfs_index_walk(struct dfs_index_head *h, const char *prefix, const char *after, int max, dfs_index_visit visit, void *arg)
+{
+    int resume = (after != NULL && strcmp(after, prefix) > 0);
+    return dfs_index_walk_from(h, prefix, resume ? after : prefix, resume, max, visit, arg);
+}
+
+// Function to work out a path's key: relative to the root, with duplicate slashes removed
+// path is what follows the storage root (or "~S1"), e.g. "/docs//a.pdf". Returns -1 if too long.
+static inline int dfs_index_key(const char *path, char *key, size_t size)
+{
+    size_t n = 0;
+    for (const char *p = path; *p != '\0'; p++)
+    {
+        if (*p == '/' && n > 0 && key[n - 1] == '/') continue;
+        if (n == 0 && *p != '/') key[n++] = '/';
+        if (n + 1 >= size) return -1;
+        key[n++] = *p;
+    }
+    if (n == 0) key[n++] = '/';
+    key[n] = '\0';
+    return 0;
+}
+
+// Function to checksum a log record, continuing from h
+static inline uint64_t dfs_index_checksum(const void *data, size_t len, uint64_t h)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h ^ p[i]) * 0x100000001b3ULL; // FNV-1a
+    }
+    return h;
+}
+
+// Function to give the checksum a record and its key should carry
+static inline uint64_t dfs_index_record_check(const struct dfs_index_record *r, const char *key)
+{
+    uint64_t h = dfs_index_checksum((const char *)r + sizeof(r->check), sizeof(*r) - sizeof(r->check), 0xcbf29ce484222325ULL);
+    return dfs_index_checksum(key, r->key_len, h);
+}
+
+// Function to append the change just made to the write-ahead log
+// st is the file's new state, or NULL for a removal; the change already has its number. The index
+// lock must be held, which keeps the log in the order the changes were made. A failed write only
+// costs the change's durability: the index itself is already up to date.
+static inline void dfs_index_log(struct dfs_index *idx, const char *key, const struct stat *st)
+{
+    struct dfs_index_head *h = idx->head;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    h->changed_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    if (idx->state[0] == '\0') return;
+
+    if (idx->log_fd < 0 || idx->log_generation != h->log_generation)
+    {
+        // The log was moved aside by a snapshot since this process last wrote to it
+        char path[DFS_WALK_PATH_LEN + 16];
+        snprintf(path, sizeof(path), "%s.log", idx->state);
+        if (idx->log_fd >= 0) close(idx->log_fd);
+        idx->log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        idx->log_generation = h->log_generation;
+        if (idx->log_fd < 0) return;
+    }
+
+    char buf[sizeof(struct dfs_index_record) + DFS_INDEX_KEY_MAX];
+    struct dfs_index_record *r = (struct dfs_index_record *)buf;
+    memset(r, 0, sizeof(*r));
+    r->seq = h->seq;
+    r->time_ns = h->changed_ns;
+    if (st != NULL)
+    {
+        r->size = st->st_size;
+        r->mtime = st->st_mtime;
+        r->mode = st->st_mode;
+        r->uid = st->st_uid;
+        r->gid = st->st_gid;
+    }
+    r->key_len = strlen(key);
+    memcpy(buf + sizeof(*r), key, r->key_len);
+    r->check = dfs_index_record_check(r, key);
+
+    // One write per record, so appends from different processes never interleave
+    if (write(idx->log_fd, buf, sizeof(*r) + r->key_len) < 0)
+    {
+        close(idx->log_fd);
+        idx->log_fd = -1;
+    }
+}
+
+// Function to read the records of a log that came after change number after, in order
+// Stops at the first record that is cut short or damaged, as a crash mid-write leaves it, or when
+// visit returns nonzero. Returns the number of records visited.
+static inline long dfs_index_read_log(const char *path, uint64_t after, dfs_index_record_visit visit, void *arg)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+    const char *log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (log == MAP_FAILED) return 0;
+
+    long visited = 0;
+    size_t pos = 0;
+    while (pos + sizeof(struct dfs_index_record) <= (size_t)st.st_size)
+    {
+        struct dfs_index_record r;
+        memcpy(&r, log + pos, sizeof(r));
+        const char *key = log + pos + sizeof(r);
+        if (r.key_len >= DFS_INDEX_KEY_MAX || pos + sizeof(r) + r.key_len > (size_t)st.st_size ||
+            r.check != dfs_index_record_check(&r, key))
+        {
+            break;
+        }
+        pos += sizeof(r) + r.key_len;
+        if (r.seq <= after) continue;
+
+        visited++;
+        if (visit(arg, &r, key)) break;
+    }
+    munmap((void *)log, st.st_size);
+    return visited;
+}
+
+// Function to apply one logged change to the index being loaded
+static inline int dfs_index_replay_one(void *arg, const struct dfs_index_record *r, const char *key)
+{
+    struct dfs_index_head *h = arg;
+    char name[DFS_INDEX_KEY_MAX];
+    memcpy(name, key, r->key_len);
+    name[r->key_len] = '\0';
+
+    // The change gets the number it was logged with
+    h->seq = r->seq - 1;
+    if (r->mode != 0)
+    {
+        struct stat file;
+        memset(&file, 0, sizeof(file));
+        file.st_size = r->size;
+        file.st_mtime = r->mtime;
+        file.st_mode = r->mode;
+        file.st_uid = r->uid;
+        file.st_gid = r->gid;
+        dfs_index_insert(h, name, &file);
+    }
+    else
+    {
+        dfs_index_delete(h, name);
+    }
+    h->seq = r->seq;
+    h->changed_ns = r->time_ns;
+    return 0;
+}
+
+// Function to apply the changes in a log that came after change number after
+// Returns the number of changes applied.
+static inline long dfs_index_replay(struct dfs_index *idx, const char *path, uint64_t after)
+{
+    return dfs_index_read_log(path, after, dfs_index_replay_one, idx->head);
+}
+
+// Function to add one record's length to the valid length of its log
+static inline int dfs_index_measure_one(void *arg, const struct dfs_index_record *r, const char *key)
+{
+    (void)key;
+    *(off_t *)arg += sizeof(*r) + r->key_len;
+    return 0;
+}
+
+// Function to cut a log back to its last intact record
+// A crash mid-write leaves a torn record at the end; records appended after it would never be
+// read again, since reading stops at the torn one.
+static inline void dfs_index_trim_log(const char *path)
+{
+    off_t valid = 0;
+    dfs_index_read_log(path, 0, dfs_index_measure_one, &valid);
+    struct stat st;
+    if (stat(path, &st) == 0 && st.st_size > valid && truncate(path, valid) < 0)
+    {
+        unlink(path); // Better to lose its changes now than everything written after them
+    }
+}
+
+// Function to load the index from its snapshot into the arena
+// Returns 0, or -1 if there is no snapshot or it does not fit this server and arena.
+static inline int dfs_index_load(struct dfs_index *idx)
+{
+    char path[DFS_WALK_PATH_LEN + 16];
+    snprintf(path, sizeof(path), "%s.snap", idx->state);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct dfs_index_head) || (uint64_t)st.st_size > idx->head->capacity)
+    {
+        close(fd);
+        return -1;
+    }
+    const struct dfs_index_head *snap = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (snap == MAP_FAILED) return -1;
+
+    int valid = (snap->magic == DFS_INDEX_MAGIC && snap->version == DFS_INDEX_VERSION &&
+                 snap->head_size == sizeof(struct dfs_index_head) && snap->used == (uint64_t)st.st_size &&
+                 strcmp(snap->store, idx->root) == 0 && strcmp(snap->ext, idx->ext) == 0);
+    if (valid)
+    {
+        // The image replaces everything but the arena's size, and its lock is set up afresh
+        struct dfs_index_head *h = idx->head;
+        uint64_t capacity = h->capacity;
+        memcpy(h, snap, st.st_size);
+        dfs_index_lock_init(h);
+        h->capacity = capacity;
+        h->usable = 1;
+        h->log_generation = 0;
+        h->snapshot_missing = 0;
+    }
+    munmap((void *)snap, st.st_size);
+    return valid ? 0 : -1;
+}
+
+// Function to write a snapshot of the index and drop the log it makes redundant
+// The arena is copied under the lock, at which point the log is moved aside so that changes made
+// while the copy is written go to a fresh log. Once the snapshot is safely in place the old log is
+// deleted. Returns 0, or -1 if the snapshot could not be written (the logs are then kept).
+static inline int dfs_index_snapshot(struct dfs_index *idx)
+{
+    struct dfs_index_head *h = idx->head;
+    char path[DFS_WALK_PATH_LEN + 16], tmp_path[DFS_WALK_PATH_LEN + 16];
+    char log_path[DFS_WALK_PATH_LEN + 16], old_path[DFS_WALK_PATH_LEN + 16];
+    snprintf(path, sizeof(path), "%s.snap", idx->state);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.snap.tmp", idx->state);
+    snprintf(log_path, sizeof(log_path), "%s.log", idx->state);
+    snprintf(old_path, sizeof(old_path), "%s.log.old", idx->state);
+
+    dfs_index_lock(h);
+    if (!h->usable)
+    {
+        dfs_index_unlock(h);
+        return -1;
+    }
+    size_t len = h->used;
+    char *image = malloc(len);
+    if (image == NULL)
+    {
+        dfs_index_unlock(h);
+        return -1;
+    }
+    memcpy(image, h, len);
+    uint64_t seq = h->seq;
+
+    // A log already moved aside by a failed snapshot is kept; the current one then just goes on
+    if (access(old_path, F_OK) != 0 && rename(log_path, old_path) == 0)
+    {
+        h->log_generation++;
+    }
+    dfs_index_unlock(h);
+
+    struct dfs_index_head *copy = (struct dfs_index_head *)image;
+    int64_t now = time(NULL);
+    copy->snapshot_seq = seq;
+    copy->snapshot_time = now;
+    memset(&copy->lock, 0, sizeof(copy->lock));
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    int failed = (fd < 0 || dfs_write_full(fd, image, len) < 0 || fsync(fd) < 0);
+    if (fd >= 0) close(fd);
+    failed = failed || rename(tmp_path, path) < 0;
+    free(image);
+    if (failed)
+    {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    unlink(old_path);
+    dfs_index_lock(h);
+    h->snapshot_seq = seq;
+    h->snapshot_time = now;
+    h->snapshot_missing = 0;
+    dfs_index_unlock(h);
+    return 0;
+}
+
+// Function to read a number of seconds or changes from the environment
+static inline long dfs_index_setting(const char *name, long fallback)
+{
+    const char *value = getenv(name);
+    long n = (value != NULL) ? atol(value) : fallback;
+    return (n > 0) ? n : fallback;
+}
+
+// Function run by the snapshot process: writes snapshots while the server runs
+static inline void dfs_index_snapshots(struct dfs_index *idx)
+{
+    long interval = dfs_index_setting("DFS_INDEX_SNAPSHOT_SECS", DFS_INDEX_SNAPSHOT_SECS);
+    long records = dfs_index_setting("DFS_INDEX_SNAPSHOT_RECORDS", DFS_INDEX_SNAPSHOT_RECORDS);
+    struct dfs_index_head *h = idx->head;
+    while (1)
+    {
+        dfs_index_lock(h);
+        uint64_t pending = h->seq - h->snapshot_seq;
+        int due = h->usable && (h->snapshot_missing || pending >= (uint64_t)records ||
+                                (pending > 0 && time(NULL) - h->snapshot_time >= interval));
+        dfs_index_unlock(h);
+        if (due && dfs_index_snapshot(idx) < 0)
+        {
+            sleep(interval); // Try again later rather than spin on a full disk
+        }
+        sleep(1);
+    }
+}
+
+// Function to start the process that keeps the snapshot current
+// Forked before the workers so it holds none of their descriptors; it exits with the server.
+static inline void dfs_index_start_snapshots(struct dfs_index *idx)
+{
+    pid_t pid = fork();
+    if (pid != 0) return;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1) _exit(0);
+    dfs_index_snapshots(idx);
+    _exit(0);
+}
+
+// Function to bring one file's entry up to date with the filesystem
+// path is an absolute path under the index's root. An existing regular file of the indexed type
+// is added or refreshed; anything else is removed. Call it after every change the server makes.
+// Returns 1 if the index changed, or 0 if it already matched the file.
+static inline int dfs_index_update(struct dfs_index *idx, const char *path)
+{
+    if (!dfs_index_usable(idx)) return 0;
+
+    size_t root_len = strlen(idx->root);
+    char key[DFS_INDEX_KEY_MAX];
+    if (strncmp(path, idx->root, root_len) != 0 || dfs_index_key(path + root_len, key, sizeof(key)) < 0) return 0;
+
+    struct stat st;
+    const char *dot = strrchr(key, '.');
+    int present = (lstat(path, &st) == 0 && S_ISREG(st.st_mode) && dot != NULL && strcmp(dot, idx->ext) == 0);
+    int changed = 0;
+    dfs_index_lock(idx->head);
+    if (present && dfs_index_insert(idx->head, key, &st) == 0)
+    {
+        dfs_index_log(idx, key, &st);
+        changed = 1;
+    }
+    else if (!present && dfs_index_delete(idx->head, key) == 1)
+    {
+        dfs_index_log(idx, key, NULL);
+        changed = 1;
+    }
+    dfs_index_unlock(idx->head);
+    return changed;
+}
+
+// Keys collected by dfs_index_remove_tree()
+struct dfs_index_doomed
+{
+    struct dfs_buf keys; // NUL-separated
+    int failed;
+};
+
+// Function to note one key to be removed
+static inline int dfs_index_doom(void *arg, const struct dfs_index_leaf *leaf)
+{
+    struct dfs_index_doomed *d = arg;
+    if (dfs_buf_append(&d->keys, leaf->key, leaf->key_len + 1) < 0)
+    {
+        d->failed = 1;
+        return 1;
+    }
+    return 0;
+}
+
+// Function to remove every file under a directory from the index, e.g. after it was deleted
+// rel is the directory's key ("/docs"). Each removal is logged like any other.
+// Returns the number of entries removed.
+static inline int dfs_index_remove_tree(struct dfs_index *idx, const char *rel)
+{
+    if (!dfs_index_usable(idx)) return 0;
+
+    char prefix[DFS_INDEX_KEY_MAX];
+    if (dfs_index_key(rel, prefix, sizeof(prefix) - 1) < 0) return 0;
+    if (prefix[strlen(prefix) - 1] != '/') strcat(prefix, "/");
+
+    int visited, removed = 0;
+    do
+    {
+        // Take a batch of keys, then drop them; the next batch starts after what is left
+        struct dfs_index_doomed d = { { 0 }, 0 };
+        dfs_index_lock(idx->head);
+        visited = dfs_index_walk(idx->head, prefix, NULL, DFS_INDEX_SCAN_BATCH, dfs_index_doom, &d);
+        for (size_t pos = 0; !d.failed && pos < d.keys.len; pos += strlen(d.keys.data + pos) + 1)
+        {
+            if (dfs_index_delete(idx->head, d.keys.data + pos) == 1)
+            {
+                dfs_index_log(idx, d.keys.data + pos, NULL);
+                removed++;
+            }
+        }
+        dfs_index_unlock(idx->head);
+        free(d.keys.data);
+        if (d.failed) break;
+    } while (visited == DFS_INDEX_SCAN_BATCH);
+    return removed;
+}
+
+// Function to add every file of the indexed type under dir (the key prefix rel) to the index
+static inline void dfs_index_fill(struct dfs_index *idx, const char *dir, char *rel, size_t rel_len, int depth)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL) return;
+
+    struct dirent *ent;
+    char path[DFS_WALK_PATH_LEN * 2];
+    while ((ent = readdir(d)) != NULL && idx->head->usable)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        size_t name_len = strlen(ent->d_name);
+        if (rel_len + 1 + name_len >= DFS_INDEX_KEY_MAX) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        rel[rel_len] = '/';
+        memcpy(rel + rel_len + 1, ent->d_name, name_len + 1);
+
+        struct stat st;
+        if (lstat(path, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode) && depth + 1 < DFS_WALK_MAX_DEPTH)
+        {
+            dfs_index_fill(idx, path, rel, rel_len + 1 + name_len, depth + 1);
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            const char *dot = strrchr(ent->d_name, '.');
+            if (dot != NULL && strcmp(dot, idx->ext) == 0)
+            {
+                dfs_index_insert(idx->head, rel, &st);
+            }
+        }
+    }
+    rel[rel_len] = '\0';
+    closedir(d);
+}
+
+// Function to check that a loaded index still describes the storage root
+// The root must be the same directory, not modified since the index last changed: anything
+// removed or added at the top level while the server was down changes its modification time.
+// The server's own changes there (new folders for uploads) are always followed by a logged one.
+static inline int dfs_index_current(struct dfs_index *idx)
+{
+    struct stat st;
+    const struct dfs_index_head *h = idx->head;
+    return stat(idx->root, &st) == 0 && st.st_dev == h->store_dev && st.st_ino == h->store_ino &&
+           (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec <= h->changed_ns;
+}
+
+// Function to work out where a server keeps its snapshot and log
+// Files are named after the storage root's last component, e.g. ~/.dfs_index/S2.snap. Leaves
+// state empty, so nothing is persisted, if the directory cannot be created or a path would not
+// fit; a cut-short path could name another server's files.
+static inline void dfs_index_state_path(struct dfs_index *idx)
+{
+    char dir[DFS_WALK_PATH_LEN];
+    const char *value = getenv("DFS_INDEX_DIR");
+    int len;
+    if (value != NULL && value[0] != '\0')
+    {
+        len = snprintf(dir, sizeof(dir), "%s", value);
+    }
+    else
+    {
+        len = snprintf(dir, sizeof(dir), "%s/%s", getenv("HOME"), DFS_INDEX_DIR);
+    }
+    if (len < 0 || (size_t)len >= sizeof(dir)) return;
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) return;
+
+    const char *name = strrchr(idx->root, '/');
+    len = snprintf(idx->state, sizeof(idx->state), "%s/%s", dir, (name != NULL) ? name + 1 : idx->root);
+    if (len < 0 || (size_t)len >= sizeof(idx->state)) idx->state[0] = '\0';
+}
+
+// Function to empty the arena and start a new index of the files of type ext under root
+static inline void dfs_index_reset(struct dfs_index_head *h, const char *root, const char *ext)
+{
+    uint64_t capacity = h->capacity;
+    memset(h, 0, sizeof(*h));
+    dfs_index_lock_init(h);
+    h->capacity = capacity;
+    h->magic = DFS_INDEX_MAGIC;
+    h->version = DFS_INDEX_VERSION;
+    h->head_size = sizeof(*h);
+    snprintf(h->store, sizeof(h->store), "%s", root);
+    snprintf(h->ext, sizeof(h->ext), "%s", ext);
+    h->used = (sizeof(*h) + DFS_INDEX_ALIGN - 1) / DFS_INDEX_ALIGN * DFS_INDEX_ALIGN;
+    h->usable = 1;
+    h->snapshot_missing = 1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    h->changed_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Function to reserve the shared arena for an empty index that is not kept on disk
+// Used as is for S1's namespace directory; dfs_index_init() builds on it. Must run in the main
+// process before any worker is started. Returns -1, leaving the index disabled, if
+// DFS_INDEX_MB is 0, root or ext is too long to hold, or the memory cannot be reserved.
+static inline int dfs_index_create(struct dfs_index *idx, const char *root, const char *ext)
+{
+    memset(idx, 0, sizeof(*idx));
+    idx->log_fd = -1;
+    int root_len = snprintf(idx->root, sizeof(idx->root), "%s", root);
+    int ext_len = snprintf(idx->ext, sizeof(idx->ext), "%s", ext);
+    if (root_len < 0 || (size_t)root_len >= sizeof(idx->root) || ext_len < 0 || (size_t)ext_len >= sizeof(idx->ext)) return -1;
+
+    const char *value = getenv("DFS_INDEX_MB");
+    long mb = (value != NULL) ? atol(value) : DFS_INDEX_DEFAULT_MB;
+    if (mb <= 0) return -1;
+
+    size_t capacity = (size_t)mb << 20;
+    void *arena = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena == MAP_FAILED) return -1;
+
+    struct dfs_index_head *h = arena;
+    h->capacity = capacity;
+    dfs_index_reset(h, root, ext);
+    h->epoch = h->changed_ns ^ ((uint64_t)getpid() << 32);
+    idx->head = h;
+    return 0;
+}
+
+// Function to create a server's index of the files of type ext under root
+// Reserves the shared arena and loads the last snapshot and log into it, or walks the tree if
+// there is no usable snapshot, then starts the snapshot process. Must run in the main process
+// before any worker is started. Returns -1, leaving the index disabled, if it cannot be set up.
+static inline int dfs_index_init(struct dfs_index *idx, const char *root, const char *ext)
+{
+    if (dfs_index_create(idx, root, ext) < 0) return -1;
+    struct dfs_index_head *h = idx->head;
+    uint64_t epoch = h->epoch;
+    dfs_index_state_path(idx);
+
+    char path[DFS_WALK_PATH_LEN + 16];
+    int loaded = (idx->state[0] != '\0' && dfs_index_load(idx) == 0);
+    if (loaded)
+    {
+        // Bring the snapshot up to date with the changes logged since it was written
+        snprintf(path, sizeof(path), "%s.log.old", idx->state);
+        dfs_index_replay(idx, path, h->snapshot_seq);
+        snprintf(path, sizeof(path), "%s.log", idx->state);
+        dfs_index_replay(idx, path, h->seq);
+        dfs_index_trim_log(path);
+        loaded = dfs_index_current(idx);
+    }
+    if (!loaded)
+    {
+        // Start from an empty arena and build the index from the tree
+        dfs_index_reset(h, root, ext);
+        struct stat st;
+        if (stat(root, &st) == 0)
+        {
+            h->store_dev = st.st_dev;
+            h->store_ino = st.st_ino;
+        }
+        char rel[DFS_INDEX_KEY_MAX] = "";
+        dfs_index_fill(idx, root, rel, 0, 0);
+
+        // Logs without the snapshot they continue describe nothing the walk did not see
+        if (idx->state[0] != '\0')
+        {
+            snprintf(path, sizeof(path), "%s.log.old", idx->state);
+            unlink(path);
+            snprintf(path, sizeof(path), "%s.log", idx->state);
+            unlink(path);
+        }
+    }
+
+    // A log cut short by a crash may have lost changes whose numbers will now be reused
+    h->epoch = epoch;
+    if (!h->usable) return -1;
+
+    if (idx->state[0] != '\0')
+    {
+        dfs_index_start_snapshots(idx);
+    }
+    return 0;
+}
+
+// Listing page being written by dfs_index_page()
+struct dfs_index_listing
+{
+    const char *pathname; // Directory as the client named it
+    size_t skip; // Length of the key prefix pathname stands for
+    int slash; // Whether a '/' goes between pathname and the rest
+    int max; // Files that fit on the page
+    int listed;
+    int more; // Set when a file beyond the page exists
+    int failed;
+    struct dfs_buf *out;
+    char last[DFS_INDEX_KEY_MAX]; // Key of the last file listed
+};
+
+// Function to add one file to a listing page
+static inline int dfs_index_list_one(void *arg, const struct dfs_index_leaf *leaf)
+{
+    struct dfs_index_listing *l = arg;
+    if (l->listed == l->max)
+    {
+        l->more = 1;
+        return 1;
+    }
+    if (dfs_buf_append(l->out, l->pathname, strlen(l->pathname)) < 0 ||
+        (l->slash && dfs_buf_append(l->out, "/", 1) < 0) ||
+        dfs_buf_append(l->out, leaf->key + l->skip, leaf->key_len - l->skip) < 0 ||
+        dfs_buf_append(l->out, "\n", 1) < 0)
+    {
+        l->failed = 1;
+        return 1;
+    }
+    memcpy(l->last, leaf->key, leaf->key_len + 1);
+    l->listed++;
+    return 0;
+}
+
+// Function to list one page of the files under pathname ("~S1/dir") from the index
+// Same contract as dfs_walk_page(): appends "pathname/relative_path\n" for at most max files,
+// starting where cursor says, and leaves the continuation in cursor (empty once complete). The
+// cursor is "i" followed by the last path listed, with '%' and ',' escaped. Returns the number of
+// files listed, or -1 on error.
+static inline int dfs_index_page(struct dfs_index *idx, const char *pathname, int max, char *cursor, size_t cursor_size, struct dfs_buf *out)
+{
+    // Files under the directory are the keys starting with "/dir/"
+    char prefix[DFS_INDEX_KEY_MAX];
+    if (dfs_index_key(pathname + 3, prefix, sizeof(prefix) - 1) < 0) return -1; // +3 to skip "~S1"
+    size_t prefix_len = strlen(prefix);
+    if (prefix[prefix_len - 1] != '/')
+    {
+        prefix[prefix_len++] = '/';
+        prefix[prefix_len] = '\0';
+    }
+
+    // Resume after the path the cursor names
+    char after[DFS_INDEX_KEY_MAX];
+    int resume = (cursor[0] != '\0');
+    if (resume)
+    {
+        size_t n = snprintf(after, sizeof(after), "%s", prefix);
+        if (cursor[0] != 'i') return -1;
+        for (const char *p = cursor + 1; *p != '\0'; p++)
+        {
+            unsigned int c = (unsigned char)*p;
+            if (c == '%')
+            {
+                // An escape is always two hex digits; anything else is not a cursor we made
+                if (!isxdigit((unsigned char)p[1]) || !isxdigit((unsigned char)p[2])) return -1;
+                char hex[3] = { p[1], p[2], '\0' };
+                c = (unsigned int)strtoul(hex, NULL, 16);
+                p += 2;
+            }
+            if (n + 1 >= sizeof(after)) return -1;
+            after[n++] = (char)c;
+        }
+        after[n] = '\0';
+    }
+
+    struct dfs_index_listing l;
+    memset(&l, 0, sizeof(l));
+    size_t path_len = strlen(pathname);
+    l.pathname = pathname;
+    l.skip = prefix_len;
+    l.slash = (path_len > 0 && pathname[path_len - 1] != '/');
+    l.max = max;
+    l.out = out;
+
+    // One file past the page tells whether a continuation is needed
+    dfs_index_lock(idx->head);
+    dfs_index_walk(idx->head, prefix, resume ? after : NULL, max + 1, dfs_index_list_one, &l);
+    dfs_index_unlock(idx->head);
+    if (l.failed) return -1;
+
+    cursor[0] = '\0';
+    if (l.more)
+    {
+        size_t used = snprintf(cursor, cursor_size, "i");
+        for (const char *p = l.last + prefix_len; *p != '\0' && used < cursor_size; p++)
+        {
+            used += (*p == '%' || *p == ',') ? snprintf(cursor + used, cursor_size - used, "%%%02X", (unsigned char)*p)
+                                             : snprintf(cursor + used, cursor_size - used, "%c", *p);
+        }
+        if (used >= cursor_size) return -1;
+    }
+    return l.listed;
+}
+
+// Changes being collected by dfs_index_sync()
+struct dfs_index_feed
+{
+    struct dfs_buf *out;
+    uint64_t next; // Number the next change must have
+    uint64_t last; // Last change to send
+    char key[DFS_INDEX_KEY_MAX]; // Last path added to a full listing
+    int failed;
+};
+
+// Function to add one entry to a feed: "+<size> <mtime> <path>" or "-<path>", NUL-terminated
+static inline int dfs_index_feed_entry(struct dfs_index_feed *f, const char *key, size_t key_len, int present, uint64_t size, int64_t mtime)
+{
+    char head[48];
+    int n = present ? snprintf(head, sizeof(head), "+%llu %lld ", (unsigned long long)size, (long long)mtime)
+                    : snprintf(head, sizeof(head), "-");
+    if (dfs_buf_append(f->out, head, n) < 0 || dfs_buf_append(f->out, key, key_len) < 0 ||
+        dfs_buf_append(f->out, "", 1) < 0)
+    {
+        f->failed = 1;
+        return 1;
+    }
+    return 0;
+}
+
+// Function to add one logged change to a feed
+// The changes must follow on from each other; a gap ends the feed short of f->last.
+static inline int dfs_index_feed_record(void *arg, const struct dfs_index_record *r, const char *key)
+{
+    struct dfs_index_feed *f = arg;
+    if (r->seq != f->next || r->seq > f->last) return 1;
+    f->next++;
+    return dfs_index_feed_entry(f, key, r->key_len, r->mode != 0, r->size, r->mtime);
+}
+
+// Function to add one indexed file to a full listing
+static inline int dfs_index_feed_leaf(void *arg, const struct dfs_index_leaf *leaf)
+{
+    struct dfs_index_feed *f = arg;
+    memcpy(f->key, leaf->key, leaf->key_len + 1);
+    return dfs_index_feed_entry(f, leaf->key, leaf->key_len, 1, leaf->size, leaf->mtime);
+}
+
+// Function to collect what a peer that last saw change since of epoch epoch needs to catch up
+// Appends to out the changes made since, as NUL-terminated "+<size> <mtime> <path>" (added or
+// updated) and "-<path>" (removed) entries, read back from the log. If the peer knew another
+// epoch or the log no longer holds every one of those changes, out gets every indexed file as
+// "+" entries in path order instead. msg is set to "changes" or "full", then the epoch and the
+// number of the last change covered. Returns 0, or -1 if the index is not usable.
+static inline int dfs_index_sync(struct dfs_index *idx, uint64_t epoch, uint64_t since, struct dfs_buf *out, char *msg, size_t msg_size)
+{
+    if (!dfs_index_usable(idx)) return -1;
+    struct dfs_index_head *h = idx->head;
+    dfs_index_lock(h);
+    uint64_t current = h->epoch, seq = h->seq;
+    dfs_index_unlock(h);
+
+    struct dfs_index_feed f;
+    memset(&f, 0, sizeof(f));
+    f.out = out;
+    f.next = since + 1;
+    f.last = seq;
+    int changes = (epoch == current && since <= seq);
+    if (changes && since < seq)
+    {
+        // A snapshot may move the log aside meanwhile, which shows up as a gap
+        char path[DFS_WALK_PATH_LEN + 16];
+        snprintf(path, sizeof(path), "%s.log.old", idx->state);
+        if (idx->state[0] != '\0') dfs_index_read_log(path, since, dfs_index_feed_record, &f);
+        snprintf(path, sizeof(path), "%s.log", idx->state);
+        if (idx->state[0] != '\0') dfs_index_read_log(path, f.next - 1, dfs_index_feed_record, &f);
+        changes = (f.next == seq + 1);
+    }
+    if (!changes)
+    {
+        // List every file, a batch per lock hold; changes made meanwhile come with the next sync
+        out->len = 0;
+        int visited;
+        do
+        {
+            dfs_index_lock(h);
+            visited = dfs_index_walk(h, "/", f.key[0] ? f.key : NULL, DFS_INDEX_SCAN_BATCH, dfs_index_feed_leaf, &f);
+            dfs_index_unlock(h);
+        } while (!f.failed && visited == DFS_INDEX_SCAN_BATCH);
+    }
+    if (f.failed) return -1;
+
+    snprintf(msg, msg_size, "%s %llu %llu", changes ? "changes" : "full", (unsigned long long)current, (unsigned long long)seq);
+    return 0;
+}
+
+// Filter being built by dfs_index_filter()
+struct dfs_index_filling
+{
+    uint64_t *words;
+    uint64_t nbits;
+    char key[DFS_INDEX_KEY_MAX]; // Last path added
+};
+
+// Function to add one indexed file to a filter
+static inline int dfs_index_filter_one(void *arg, const struct dfs_index_leaf *leaf)
+{
+    struct dfs_index_filling *f = arg;
+    memcpy(f->key, leaf->key, leaf->key_len + 1);
+    dfs_bloom_add(f->words, f->nbits, leaf->key, leaf->key_len);
+    return 0;
+}
+
+// Function to build a Bloom filter of every indexed file
+// The filter has room for a quarter more files than are indexed, so it stays accurate as paths
+// are added to it afterwards. Sets *words (freed by the caller) and *nbits, and msg to the epoch,
+// the number of the last change made before the filter was built (files added or changed since
+// then may be missing from it) and the size in bits. Returns 0, or -1 if the index is not usable.
+static inline int dfs_index_filter(struct dfs_index *idx, uint64_t **words, uint64_t *nbits, char *msg, size_t msg_size)
+{
+    if (!dfs_index_usable(idx)) return -1;
+    struct dfs_index_head *h = idx->head;
+    dfs_index_lock(h);
+    uint64_t epoch = h->epoch, seq = h->seq, count = h->count;
+    dfs_index_unlock(h);
+
+    struct dfs_index_filling f;
+    memset(&f, 0, sizeof(f));
+    f.nbits = dfs_bloom_size(count + count / 4);
+    f.words = calloc(f.nbits / 64, sizeof(uint64_t));
+    if (f.words == NULL) return -1;
+
+    // A batch per lock hold, like a full sync
+    int visited;
+    do
+    {
+        dfs_index_lock(h);
+        visited = dfs_index_walk(h, "/", f.key[0] ? f.key : NULL, DFS_INDEX_SCAN_BATCH, dfs_index_filter_one, &f);
+        dfs_index_unlock(h);
+    } while (visited == DFS_INDEX_SCAN_BATCH);
+
+    *words = f.words;
+    *nbits = f.nbits;
+    snprintf(msg, msg_size, "%llu %llu %llu", (unsigned long long)epoch, (unsigned long long)seq, (unsigned long long)f.nbits);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,176 @@
+// Distributed File System - Paged Directory Listings
+// Resumable directory walk shared by all servers (S1-S4) to answer dispfnames one page at a time.
+//
+// A listing is produced in pages of at most a caller-chosen number of files. Each page ends with
+// a continuation cursor that records where the walk stopped: the readdir() position (telldir())
+// in every directory from the listed one down to the one being read, as hex numbers joined by
+// '.'. The next page reopens those directories and seekdir()s back to the same entries, so no
+// server ever holds more than one page of a listing, however large the directory tree is.
+// Files added or removed between pages may be missed or listed twice, as with any paged listing.
+
+#ifndef DFS_LISTING_H
+#define DFS_LISTING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define DFS_WALK_MAX_DEPTH 64 // Deepest directory level a listing descends into
+#define DFS_WALK_PATH_LEN 1024 // Longest relative path a listing reports
+
+// Growable buffer a page of listing lines is collected in
+struct dfs_buf
+{
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+// Function to append len bytes to a buffer, growing it as needed
+// Returns -1 if memory runs out.
+static inline int dfs_buf_append(struct dfs_buf *b, const char *s, size_t len)
+{
+    if (b->len + len + 1 > b->cap)
+    {
+        size_t cap = (b->cap > 0) ? b->cap : 4096;
+        while (b->len + len + 1 > cap) cap *= 2;
+        char *data = realloc(b->data, cap);
+        if (data == NULL) return -1;
+        b->data = data;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+    return 0;
+}
+
+// Function to close the directories still open in a walk
+static inline void dfs_walk_close(DIR **dirs, int depth)
+{
+    for (int i = depth; i >= 0; i--)
+    {
+        closedir(dirs[i]);
+    }
+}
+
+// Function to list one page of files with extension ext under base, recursively
+// Appends "prefix/relative_path\n" for at most max files to out, starting where cursor says
+// (an empty cursor starts at the beginning). On return cursor holds the continuation, or is
+// empty when the walk is complete. Returns the number of files listed, or -1 on error.
+static inline int dfs_walk_page(const char *base, const char *ext, const char *prefix, int max, char *cursor, size_t cursor_size, struct dfs_buf *out)
+{
+    DIR *dirs[DFS_WALK_MAX_DEPTH];
+    long pos[DFS_WALK_MAX_DEPTH];
+    size_t rel_len[DFS_WALK_MAX_DEPTH];
+    char rel[DFS_WALK_PATH_LEN] = "";
+    char path[DFS_WALK_PATH_LEN * 2];
+    int depth = 0, count = 0;
+
+    // Decode the positions to resume from
+    int npos = 0;
+    for (char *p = cursor; *p != '\0' && npos < DFS_WALK_MAX_DEPTH; npos++)
+    {
+        char *end;
+        pos[npos] = (long)strtoul(p, &end, 16);
+        if (end == p || (*end != '.' && *end != '\0')) return -1;
+        p = (*end == '.') ? end + 1 : end;
+    }
+    cursor[0] = '\0';
+
+    dirs[0] = opendir(base);
+    if (dirs[0] == NULL) return 0;
+    rel_len[0] = 0;
+
+    // Return to the directory the previous page stopped in. Each saved position points at the
+    // entry for the next level down; the last one points at the next entry to list.
+    for (int i = 0; i < npos; i++)
+    {
+        seekdir(dirs[depth], pos[i]);
+        if (i == npos - 1) break;
+
+        struct dirent *ent = readdir(dirs[depth]);
+        if (ent == NULL) break;
+        snprintf(path, sizeof(path), "%s/%s%s%s", base, rel, (rel[0] != '\0') ? "/" : "", ent->d_name);
+        DIR *child = opendir(path);
+        if (child == NULL) break; // Gone since the last page; carry on after it
+        snprintf(rel + rel_len[depth], sizeof(rel) - rel_len[depth], "%s%s", (rel_len[depth] > 0) ? "/" : "", ent->d_name);
+        dirs[++depth] = child;
+        rel_len[depth] = strlen(rel);
+    }
+
+    size_t prefix_len = strlen(prefix);
+    int slash = (prefix_len > 0 && prefix[prefix_len - 1] != '/');
+    while (depth >= 0)
+    {
+        long here = telldir(dirs[depth]);
+        struct dirent *ent = readdir(dirs[depth]);
+        if (ent == NULL)
+        {
+            // Finished this directory; continue in its parent
+            closedir(dirs[depth]);
+            depth--;
+            if (depth >= 0) rel[rel_len[depth]] = '\0';
+            continue;
+        }
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        int type = ent->d_type;
+        snprintf(path, sizeof(path), "%s/%s%s%s", base, rel, (rel[0] != '\0') ? "/" : "", ent->d_name);
+        if (type == DT_UNKNOWN)
+        {
+            // Some filesystems do not report the type in the directory entry
+            struct stat st;
+            if (lstat(path, &st) != 0) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+
+        if (type == DT_DIR && depth + 1 < DFS_WALK_MAX_DEPTH)
+        {
+            DIR *child = opendir(path);
+            if (child == NULL) continue;
+            pos[depth] = here;
+            snprintf(rel + rel_len[depth], sizeof(rel) - rel_len[depth], "%s%s", (rel_len[depth] > 0) ? "/" : "", ent->d_name);
+            dirs[++depth] = child;
+            rel_len[depth] = strlen(rel);
+        }
+        else if (type == DT_REG)
+        {
+            const char *dot = strrchr(ent->d_name, '.');
+            if (dot == NULL || strcmp(dot, ext) != 0) continue;
+
+            if (count == max)
+            {
+                // The page is full: remember this entry as the place to resume
+                pos[depth] = here;
+                size_t used = 0;
+                for (int i = 0; i <= depth && used < cursor_size; i++)
+                {
+                    used += snprintf(cursor + used, cursor_size - used, "%s%lx", (i > 0) ? "." : "", pos[i]);
+                }
+                dfs_walk_close(dirs, depth);
+                return (used < cursor_size) ? count : -1;
+            }
+
+            if (dfs_buf_append(out, prefix, prefix_len) < 0 ||
+                (slash && dfs_buf_append(out, "/", 1) < 0) ||
+                dfs_buf_append(out, rel, strlen(rel)) < 0 ||
+                (rel[0] != '\0' && dfs_buf_append(out, "/", 1) < 0) ||
+                dfs_buf_append(out, ent->d_name, strlen(ent->d_name)) < 0 ||
+                dfs_buf_append(out, "\n", 1) < 0)
+            {
+                dfs_walk_close(dirs, depth);
+                return -1;
+            }
+            count++;
+        }
+    }
+    return count;
+}
+
+#endif
@@ -0,0 +1,428 @@
+// Distributed File System - Wire Protocol
+// Binary framing shared by the client (w25clients.c) and all servers (S1-S4).
+//
+// Every request and response starts with a fixed 24-byte header in network byte order:
+//
+//   offset  size  field
+//   0       2     magic       DFS_MAGIC
+//   2       1     version     DFS_VERSION
+//   3       1     opcode      DFS_OP_* (a response echoes its request's opcode)
+//   4       2     flags       DFS_FLAG_*
+//   6       2     status      DFS_OK or a DFS_E* code (responses only)
+//   8       4     request_id  chosen by the sender of a request, echoed in its response
+//   12      4     arg_len     size of the argument block that follows the header
+//   16      8     length      size of the payload that follows the argument block
+//
+// In a request the argument block holds NUL-terminated strings; in a response it holds a
+// human-readable message (a listing page with DFS_FLAG_MORE set adds a NUL and the cursor
+// for the next page after it). The payload carries file contents, archives and listings and is
+// streamed by the handlers rather than buffered. Because every frame states its own size,
+// a receiver never has to guess where a message ends, and a sender can stream an upload's
+// payload right behind its header without waiting for a go-ahead.
+//
+// A response whose size is not known when it starts (a compressed archive) sets
+// DFS_FLAG_CHUNKED and a length of 0 instead. Its payload is a series of chunks, each a 4-byte
+// big-endian size followed by that many bytes, ended by a chunk of size 0.
+//
+// A client may set DFS_FLAG_REDIRECT on a download or upload sent to S1 (an upload then holds its
+// payload back and gives its size as a third argument instead). S1 may answer with the same flag
+// and no payload, naming the backend to send the request to and a token (dfs_token.h) to pass
+// there as an extra argument under DFS_FLAG_TOKEN; the file's bytes then bypass S1.
+
+#ifndef DFS_PROTOCOL_H
+#define DFS_PROTOCOL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/types.h>
+
+#define DFS_MAGIC 0xDF5A // Identifies a DFS frame
+#define DFS_VERSION 1 // Protocol version
+#define DFS_HEADER_SIZE 24 // Size of the fixed header
+#define DFS_MAX_ARG_LEN 8192 // Largest argument block a server accepts
+#define DFS_MAX_ARGS 8 // Most arguments a request may carry
+#define DFS_MAX_CURSOR 4608 // Longest listing continuation cursor
+#define DFS_DEFAULT_PAGE 1000 // Files per listing page when the client does not choose
+#define DFS_MAX_PAGE 10000 // Most files a listing page may hold
+#define DFS_MAX_CHUNK (4 << 20) // Largest chunk of a chunked payload a receiver accepts
+#define DFS_TAR_FILTER_ARG 2 // Index of the first filter (e.g. "since=<seconds>") among TAR arguments
+
+// Opcodes
+#define DFS_OP_UPLOAD 1 // args: filename, destination path; payload: file contents
+#define DFS_OP_DOWNLOAD 2 // args: path; response payload: file contents
+#define DFS_OP_REMOVE 3 // args: path [, checksum the file must still have (S1 -> backend)]
+#define DFS_OP_TAR 4 // args: file type [, accepted encodings [, filters]]; response payload: tar archive, encoded as the message names
+#define DFS_OP_LIST 5 // args: path [, page size [, cursor]]; response payload: newline-separated paths
+#define DFS_OP_AUTH 6 // args: shared secret (S1 -> backend sessions)
+#define DFS_OP_SYNC 7 // args: index epoch, last change seen; response payload: changes since (S1 -> backend), as the message names
+#define DFS_OP_FILTER 8 // response payload: Bloom filter of the backend's files, sized in the message (S1 -> backend)
+#define DFS_OP_CHECKSUM 9 // args: path; response message: the file's checksum (S1 -> backend)
+
+// Flags
+#define DFS_FLAG_MORE 0x0001 // Listing continues: the response message is followed by a cursor
+#define DFS_FLAG_CHUNKED 0x0002 // The payload is sent in chunks; its length is unknown in advance
+#define DFS_FLAG_REDIRECT 0x0004 // Request: the client can transfer the file with the backend itself. Response: do so; the message names host, port and token
+#define DFS_FLAG_TOKEN 0x0008 // The request's last argument is an access token issued by S1 (client -> backend)
+
+// Status codes
+#define DFS_OK 0 // Success
+#define DFS_EINVAL 1 // Malformed or unsupported request
+#define DFS_ENOENT 2 // File or directory not found
+#define DFS_EIO 3 // Storage or transfer failure
+#define DFS_EUNAVAIL 4 // A backend server could not be reached
+#define DFS_EAUTH 5 // Authentication failed
+#define DFS_EPROTO 6 // Bad magic, version or frame size
+#define DFS_ECHANGED 7 // The file no longer has the checksum the request named
+
+// Decoded frame header
+struct dfs_header
+{
+    uint8_t opcode;
+    uint16_t flags;
+    uint16_t status;
+    uint32_t request_id;
+    uint32_t arg_len;
+    uint64_t length;
+};
+
+// Request with its argument block split into strings
+struct dfs_request
+{
+    struct dfs_header hdr;
+    int argc;
+    char *argv[DFS_MAX_ARGS];
+};
+
+// Function to encode a header into its wire format
+static inline void dfs_encode_header(const struct dfs_header *h, unsigned char *out)
+{
+    uint16_t magic = htobe16(DFS_MAGIC);
+    uint16_t flags = htobe16(h->flags);
+    uint16_t status = htobe16(h->status);
+    uint32_t request_id = htobe32(h->request_id);
+    uint32_t arg_len = htobe32(h->arg_len);
+    uint64_t length = htobe64(h->length);
+
+    memcpy(out, &magic, 2);
+    out[2] = DFS_VERSION;
+    out[3] = h->opcode;
+    memcpy(out + 4, &flags, 2);
+    memcpy(out + 6, &status, 2);
+    memcpy(out + 8, &request_id, 4);
+    memcpy(out + 12, &arg_len, 4);
+    memcpy(out + 16, &length, 8);
+}
+
+// Function to decode a header from its wire format
+// Returns -1 if the magic or version does not match or the argument block is too large.
+static inline int dfs_decode_header(const unsigned char *in, struct dfs_header *h)
+{
+    uint16_t magic, flags, status;
+    uint32_t request_id, arg_len;
+    uint64_t length;
+
+    memcpy(&magic, in, 2);
+    memcpy(&flags, in + 4, 2);
+    memcpy(&status, in + 6, 2);
+    memcpy(&request_id, in + 8, 4);
+    memcpy(&arg_len, in + 12, 4);
+    memcpy(&length, in + 16, 8);
+
+    h->opcode = in[3];
+    h->flags = be16toh(flags);
+    h->status = be16toh(status);
+    h->request_id = be32toh(request_id);
+    h->arg_len = be32toh(arg_len);
+    h->length = be64toh(length);
+
+    if (be16toh(magic) != DFS_MAGIC || in[2] != DFS_VERSION || h->arg_len > DFS_MAX_ARG_LEN)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Function to split an argument block into NUL-terminated strings
+// Returns the number of arguments, or -1 if the block is malformed.
+static inline int dfs_split_args(char *args, uint32_t len, char **argv, int max)
+{
+    int argc = 0;
+    uint32_t start = 0;
+
+    if (len > 0 && args[len - 1] != '\0')
+    {
+        return -1;
+    }
+    for (uint32_t i = 0; i < len; i++)
+    {
+        if (args[i] == '\0')
+        {
+            if (argc == max) return -1;
+            argv[argc++] = args + start;
+            start = i + 1;
+        }
+    }
+    return argc;
+}
+
+// Function to read exactly len bytes from a descriptor
+// Returns -1 on error or if the peer closes the connection early.
+static inline int dfs_read_full(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Function to write exactly len bytes to a descriptor
+// Returns -1 if the write fails.
+static inline int dfs_write_full(int fd, const void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = write(fd, (const char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Function to read and discard len bytes, keeping the connection in sync
+static inline int dfs_discard(int fd, uint64_t len)
+{
+    char scratch[4096];
+    while (len > 0)
+    {
+        size_t chunk = (len < sizeof(scratch)) ? len : sizeof(scratch);
+        if (dfs_read_full(fd, scratch, chunk) < 0) return -1;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Function to send a header followed by its argument block
+// Both go out in one write so a small frame leaves in a single segment; the caller
+// sends the payload afterwards.
+static inline int dfs_send_frame(int fd, const struct dfs_header *h, const char *args)
+{
+    unsigned char *frame = malloc(DFS_HEADER_SIZE + h->arg_len);
+    if (frame == NULL) return -1;
+
+    dfs_encode_header(h, frame);
+    if (h->arg_len > 0)
+    {
+        memcpy(frame + DFS_HEADER_SIZE, args, h->arg_len);
+    }
+    int result = dfs_write_full(fd, frame, DFS_HEADER_SIZE + h->arg_len);
+    free(frame);
+    return result;
+}
+
+// Function to build a request frame (header and arguments) with the given flags in a new buffer
+// Returns NULL if the arguments do not fit; the caller frees the frame.
+static inline unsigned char *dfs_build_flagged_request(uint8_t opcode, uint16_t flags, uint32_t request_id, uint64_t length, int argc, char *const *argv, size_t *frame_len)
+{
+    uint32_t arg_len = 0;
+    for (int i = 0; i < argc; i++)
+    {
+        arg_len += strlen(argv[i]) + 1;
+    }
+    if (arg_len > DFS_MAX_ARG_LEN) return NULL;
+
+    unsigned char *frame = malloc(DFS_HEADER_SIZE + arg_len);
+    if (frame == NULL) return NULL;
+
+    struct dfs_header h = { opcode, flags, DFS_OK, request_id, arg_len, length };
+    dfs_encode_header(&h, frame);
+    unsigned char *p = frame + DFS_HEADER_SIZE;
+    for (int i = 0; i < argc; i++)
+    {
+        size_t n = strlen(argv[i]) + 1;
+        memcpy(p, argv[i], n);
+        p += n;
+    }
+    *frame_len = DFS_HEADER_SIZE + arg_len;
+    return frame;
+}
+
+// Function to build a request frame (header and arguments) in a new buffer
+// Returns NULL if the arguments do not fit; the caller frees the frame. Used by senders
+// that queue frames instead of writing them straight away.
+static inline unsigned char *dfs_build_request(uint8_t opcode, uint32_t request_id, uint64_t length, int argc, char *const *argv, size_t *frame_len)
+{
+    return dfs_build_flagged_request(opcode, 0, request_id, length, argc, argv, frame_len);
+}
+
+// Function to send a request with the given flags and arguments
+// The payload (length bytes) must be written by the caller right after.
+static inline int dfs_send_flagged_request(int fd, uint8_t opcode, uint16_t flags, uint32_t request_id, uint64_t length, int argc, char *const *argv)
+{
+    size_t frame_len;
+    unsigned char *frame = dfs_build_flagged_request(opcode, flags, request_id, length, argc, argv, &frame_len);
+    if (frame == NULL) return -1;
+
+    int result = dfs_write_full(fd, frame, frame_len);
+    free(frame);
+    return result;
+}
+
+// Function to send a request with the given arguments
+// The payload (length bytes) must be written by the caller right after.
+static inline int dfs_send_request(int fd, uint8_t opcode, uint32_t request_id, uint64_t length, int argc, char *const *argv)
+{
+    return dfs_send_flagged_request(fd, opcode, 0, request_id, length, argc, argv);
+}
+
+// Function to send one page of a listing whose lines are already in memory
+// msg (possibly empty, e.g. a warning about a partial result) is the response message. A
+// non-empty cursor follows it after a NUL and sets DFS_FLAG_MORE. Everything goes out in one
+// write, so small pages are not held back by Nagle.
+static inline int dfs_send_page(int fd, const struct dfs_request *req, const char *msg, const char *cursor, const void *data, size_t len)
+{
+    size_t msg_len = strlen(msg);
+    size_t cursor_len = strlen(cursor);
+    size_t arg_len = msg_len + ((cursor_len > 0) ? cursor_len + 1 : 0);
+    unsigned char *frame = malloc(DFS_HEADER_SIZE + arg_len + len);
+    if (frame == NULL) return -1;
+
+    struct dfs_header h = { req->hdr.opcode, (cursor_len > 0) ? DFS_FLAG_MORE : 0, DFS_OK, req->hdr.request_id, (uint32_t)arg_len, len };
+    dfs_encode_header(&h, frame);
+    unsigned char *p = frame + DFS_HEADER_SIZE;
+    memcpy(p, msg, msg_len);
+    if (cursor_len > 0)
+    {
+        p[msg_len] = '\0';
+        memcpy(p + msg_len + 1, cursor, cursor_len);
+    }
+    if (len > 0)
+    {
+        memcpy(p + arg_len, data, len);
+    }
+    int result = dfs_write_full(fd, frame, DFS_HEADER_SIZE + arg_len + len);
+    free(frame);
+    return result;
+}
+
+// Function to find the continuation cursor in a listing response's message
+// args must be NUL-terminated at arg_len (as dfs_read_message() leaves it). Returns NULL
+// when the listing is complete.
+static inline const char *dfs_page_cursor(const struct dfs_header *h, const char *args)
+{
+    size_t msg_len = strlen(args);
+    if (!(h->flags & DFS_FLAG_MORE) || msg_len + 1 >= h->arg_len)
+    {
+        return NULL;
+    }
+    return args + msg_len + 1;
+}
+
+// Function to send a response carrying only a status and a message
+static inline int dfs_send_status(int fd, const struct dfs_request *req, uint16_t status, const char *msg)
+{
+    struct dfs_header h = { req->hdr.opcode, 0, status, req->hdr.request_id, (uint32_t)strlen(msg), 0 };
+    return dfs_send_frame(fd, &h, msg);
+}
+
+// Function to send a client to a backend to make its transfer there
+// msg names the backend's host and port and the token to present to it.
+static inline int dfs_send_redirect(int fd, const struct dfs_request *req, const char *msg)
+{
+    struct dfs_header h = { req->hdr.opcode, DFS_FLAG_REDIRECT, DFS_OK, req->hdr.request_id, (uint32_t)strlen(msg), 0 };
+    return dfs_send_frame(fd, &h, msg);
+}
+
+// Function to send a successful response header announcing length bytes of payload
+// The caller streams the payload right after.
+static inline int dfs_send_data_header(int fd, const struct dfs_request *req, uint64_t length)
+{
+    struct dfs_header h = { req->hdr.opcode, 0, DFS_OK, req->hdr.request_id, 0, length };
+    return dfs_send_frame(fd, &h, NULL);
+}
+
+// Function to send a successful response header for a payload sent in chunks
+// msg goes in the response's message (the archive's encoding, say). The caller then sends the
+// payload with dfs_send_chunk(), ending with an empty chunk.
+static inline int dfs_send_chunked_header(int fd, const struct dfs_request *req, const char *msg)
+{
+    struct dfs_header h = { req->hdr.opcode, DFS_FLAG_CHUNKED, DFS_OK, req->hdr.request_id, (uint32_t)strlen(msg), 0 };
+    return dfs_send_frame(fd, &h, msg);
+}
+
+// Function to send one chunk of a chunked payload
+// A chunk of length 0 ends the payload.
+static inline int dfs_send_chunk(int fd, const void *data, uint32_t len)
+{
+    unsigned char size[4];
+    uint32_t be = htobe32(len);
+    memcpy(size, &be, sizeof(size));
+    if (dfs_write_full(fd, size, sizeof(size)) < 0) return -1;
+    return (len > 0) ? dfs_write_full(fd, data, len) : 0;
+}
+
+// Function to read the size of the next chunk of a chunked payload
+// Returns -1 on error or if the size is over DFS_MAX_CHUNK.
+static inline int dfs_read_chunk_size(int fd, uint32_t *len)
+{
+    uint32_t be;
+    if (dfs_read_full(fd, &be, sizeof(be)) < 0) return -1;
+    *len = be32toh(be);
+    if (*len > DFS_MAX_CHUNK)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to send a successful response whose payload is already in memory
+// Header and payload go out in one write, so small listings are not held back by Nagle.
+static inline int dfs_send_data(int fd, const struct dfs_request *req, const void *data, size_t len)
+{
+    return dfs_send_page(fd, req, "", "", data, len);
+}
+
+// Function to refuse a request before its payload has been consumed
+// The payload is read and dropped first so the sender is never left blocked mid-upload
+// and the connection stays in sync for the next request.
+static inline int dfs_reject(int fd, const struct dfs_request *req, uint16_t status, const char *msg)
+{
+    if (dfs_discard(fd, req->hdr.length) < 0) return -1;
+    return dfs_send_status(fd, req, status, msg);
+}
+
+// Function to read and decode the next header from a blocking descriptor
+static inline int dfs_read_header(int fd, struct dfs_header *h)
+{
+    unsigned char raw[DFS_HEADER_SIZE];
+    if (dfs_read_full(fd, raw, sizeof(raw)) < 0) return -1;
+    if (dfs_decode_header(raw, h) < 0)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to read a response message into msg as a C string
+// Messages longer than size - 1 are truncated; the rest is discarded.
+static inline int dfs_read_message(int fd, const struct dfs_header *h, char *msg, size_t size)
+{
+    size_t keep = (h->arg_len < size - 1) ? h->arg_len : size - 1;
+    if (dfs_read_full(fd, msg, keep) < 0) return -1;
+    msg[keep] = '\0';
+    return dfs_discard(fd, h->arg_len - keep);
+}
+
+#endif
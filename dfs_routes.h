@@ -0,0 +1,344 @@
+// Distributed File System - Routing Table
+// Which servers hold the files of each type, and which of them holds a given file.
+//
+// S1 keeps the .c files itself. Every other type is routed to a group of backend instances, each
+// a backend server started under its own name and port (DFS_NAME, DFS_PORT) that keeps its files
+// in ~/<name>. The table is read from the file DFS_ROUTES names, one type per line:
+//
+//     .txt S3@localhost:4309 S3b@localhost:4311 S3c@storage2:4309
+//
+// Blank lines and lines starting with '#' are skipped. Without DFS_ROUTES, S1 uses the built-in
+// table: .pdf on S2, .txt on S3 and .zip on S4. A group is known by its first instance's name.
+//
+// Within a group, a file is placed by rendezvous hashing: every instance scores the file's path
+// and the highest score wins. Adding an instance to a group takes over only the files it now
+// wins, about one in N, and removing one moves only the files it held; no other file changes
+// hands.
+//
+// A type can instead be mirrored: every instance of its group keeps a copy of every file. The
+// line then ends with the number of copies, which must be the number of instances, and
+// optionally how many of them must have stored an upload before it succeeds (by default a
+// majority):
+//
+//     .pdf S2@localhost:4308 S2b@storage2:4308 S2c@storage3:4308 replicas=3 writes=2
+//
+// Servers are numbered as the namespace directory numbers them: 1 is S1 and the instances follow
+// from 2 in table order, so a group's instances are numbered consecutively.
+
+#ifndef DFS_ROUTES_H
+#define DFS_ROUTES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include "dfs_bloom.h"
+
+#define DFS_ROUTES_MAX_SERVERS 64 // S1 and the instances, numbered 1 to 63
+#define DFS_ROUTES_MAX_TYPES 16 // Most file types a table may route
+#define DFS_ROUTES_NAME_MAX 32 // Longest instance name, with its NUL
+#define DFS_ROUTES_EXT_MAX 16 // Longest file type, with its NUL
+#define DFS_ROUTES_HOST_MAX 256 // Longest host name, with its NUL
+
+// One server, S1 or a backend instance
+struct dfs_route_server
+{
+    char name[DFS_ROUTES_NAME_MAX]; // "S3b"
+    char host[DFS_ROUTES_HOST_MAX];
+    int port;
+    uint64_t seed; // Hash of the name, which placement scores paths with
+};
+
+// The group of servers holding the files of one type
+struct dfs_route
+{
+    char ext[DFS_ROUTES_EXT_MAX]; // ".txt"
+    int first; // Number of the group's first server
+    int count; // Number of servers in the group
+    int replicas; // Copies kept of each file: 1, or count when the group is mirrored
+    int writes; // Copies that must be stored before an upload succeeds
+    char missing[64]; // What the group says of a file it does not have
+};
+
+// The whole table
+struct dfs_routes
+{
+    struct dfs_route_server servers[DFS_ROUTES_MAX_SERVERS]; // Indexed by server number; 0 is unused
+    int nservers; // One past the highest server number
+    struct dfs_route types[DFS_ROUTES_MAX_TYPES];
+    int ntypes;
+};
+
+// Function to check that ext can name a file type: a dot and a name without dots or slashes
+// Backends (DFS_EXT) and the client apply the same rule, so every type a table routes can be
+// stored and asked for.
+static inline int dfs_routes_valid_ext(const char *ext)
+{
+    return ext[0] == '.' && ext[1] != '\0' && strlen(ext) < DFS_ROUTES_EXT_MAX && strchr(ext + 1, '.') == NULL &&
+           strchr(ext, '/') == NULL;
+}
+
+// Function to write the name messages give a file type, its extension in capitals ("TXT")
+static inline void dfs_routes_type_name(const char *ext, char *name, size_t size)
+{
+    size_t i = 0;
+    for (; ext[i + 1] != '\0' && i + 1 < size; i++)
+    {
+        name[i] = toupper((unsigned char)ext[i + 1]);
+    }
+    name[i] = '\0';
+}
+
+// Function to add a file type and its group of instances ("S3@localhost:4309 ...") to a table
+// The instances may be followed by "replicas=N" and "writes=W" for a mirrored group. Returns -1,
+// with the reason in err, if the line is malformed or the table is full.
+static inline int dfs_routes_add(struct dfs_routes *r, const char *ext, char *instances, char *err, size_t errsize)
+{
+    if (!dfs_routes_valid_ext(ext))
+    {
+        snprintf(err, errsize, "invalid file type %s", ext);
+        return -1;
+    }
+    for (int i = 0; i < r->ntypes; i++)
+    {
+        if (strcmp(r->types[i].ext, ext) == 0)
+        {
+            snprintf(err, errsize, "%s routed twice", ext);
+            return -1;
+        }
+    }
+    if (r->ntypes == DFS_ROUTES_MAX_TYPES)
+    {
+        snprintf(err, errsize, "too many file types");
+        return -1;
+    }
+
+    struct dfs_route *route = &r->types[r->ntypes];
+    route->first = r->nservers;
+    route->count = 0;
+    route->replicas = 1;
+    route->writes = 0;
+    char *save = NULL;
+    for (char *word = strtok_r(instances, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save))
+    {
+        if (strncmp(word, "replicas=", 9) == 0 || strncmp(word, "writes=", 7) == 0)
+        {
+            char *value = strchr(word, '=') + 1, *end;
+            long n = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || n < 1 || n >= DFS_ROUTES_MAX_SERVERS)
+            {
+                snprintf(err, errsize, "invalid %s", word);
+                return -1;
+            }
+            if (word[0] == 'r')
+            {
+                route->replicas = (int)n;
+            }
+            else
+            {
+                route->writes = (int)n;
+            }
+            continue;
+        }
+        // name@host:port, the host running up to the last colon
+        char *at = strchr(word, '@');
+        char *colon = strrchr(word, ':');
+        char *end = NULL;
+        long port = (colon != NULL) ? strtol(colon + 1, &end, 10) : 0;
+        if (at == NULL || at == word || colon == NULL || colon < at + 2 || end == colon + 1 || *end != '\0' ||
+            port < 1 || port > 65535 || at - word >= DFS_ROUTES_NAME_MAX || colon - at - 1 >= DFS_ROUTES_HOST_MAX ||
+            memchr(word, '/', at - word) != NULL)
+        {
+            snprintf(err, errsize, "invalid instance %s (expected name@host:port)", word);
+            return -1;
+        }
+        if (r->nservers == DFS_ROUTES_MAX_SERVERS)
+        {
+            snprintf(err, errsize, "too many instances");
+            return -1;
+        }
+        struct dfs_route_server *server = &r->servers[r->nservers];
+        memset(server, 0, sizeof(*server));
+        memcpy(server->name, word, at - word);
+        memcpy(server->host, at + 1, colon - at - 1);
+        server->port = (int)port;
+        for (int i = 1; i < r->nservers; i++)
+        {
+            if (strcmp(r->servers[i].name, server->name) == 0)
+            {
+                snprintf(err, errsize, "instance %s named twice", server->name);
+                return -1;
+            }
+        }
+        uint64_t h2;
+        dfs_bloom_hash(server->name, strlen(server->name), &server->seed, &h2);
+        r->nservers++;
+        route->count++;
+    }
+    if (route->count == 0)
+    {
+        snprintf(err, errsize, "no instances for %s", ext);
+        return -1;
+    }
+    if (route->replicas != 1 && route->replicas != route->count)
+    {
+        snprintf(err, errsize, "replicas=%d for %s, which has %d instances (a mirrored type keeps a copy on each)",
+                 route->replicas, ext, route->count);
+        return -1;
+    }
+    if (route->writes == 0)
+    {
+        route->writes = route->replicas / 2 + 1;
+    }
+    if (route->writes > route->replicas)
+    {
+        snprintf(err, errsize, "writes=%d for %s, which keeps %d copies", route->writes, ext, route->replicas);
+        return -1;
+    }
+
+    // The message matches the one the backends send ("ERROR: TXT file not found in S3")
+    char type[DFS_ROUTES_EXT_MAX];
+    dfs_routes_type_name(ext, type, sizeof(type));
+    char missing[sizeof(route->missing)];
+    snprintf(missing, sizeof(missing), "ERROR: %s file not found in %s", type, r->servers[route->first].name);
+    memcpy(route->missing, missing, sizeof(missing));
+    memcpy(route->ext, ext, strlen(ext) + 1);
+    r->ntypes++;
+    return 0;
+}
+
+// Function to fill in a table from its text, one line per file type
+// Returns -1, with the reason and line in err, if a line is malformed.
+static inline int dfs_routes_parse(struct dfs_routes *r, const char *text, char *err, size_t errsize)
+{
+    int lineno = 0;
+    while (*text != '\0')
+    {
+        const char *eol = strchr(text, '\n');
+        size_t len = (eol != NULL) ? (size_t)(eol - text) : strlen(text);
+        char line[4096];
+        lineno++;
+        if (len >= sizeof(line))
+        {
+            snprintf(err, errsize, "line %d is too long", lineno);
+            return -1;
+        }
+        memcpy(line, text, len);
+        line[len] = '\0';
+        text += len + (eol != NULL);
+
+        char *p = line + strspn(line, " \t\r");
+        p[strcspn(p, "\r")] = '\0';
+        if (*p == '\0' || *p == '#') continue;
+
+        char ext[64], reason[256];
+        size_t extlen = strcspn(p, " \t");
+        if (extlen >= sizeof(ext))
+        {
+            snprintf(err, errsize, "line %d: invalid file type", lineno);
+            return -1;
+        }
+        memcpy(ext, p, extlen);
+        ext[extlen] = '\0';
+        if (strcmp(ext, ".c") == 0)
+        {
+            snprintf(err, errsize, "line %d: .c files are always kept by S1", lineno);
+            return -1;
+        }
+        if (dfs_routes_add(r, ext, p + extlen, reason, sizeof(reason)) < 0)
+        {
+            snprintf(err, errsize, "line %d: %s", lineno, reason);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to set up the routing table
+// S1 is server 1, holding the .c files; the other types come from the file at path, or from defaults
+// when path is NULL. Returns -1, with the reason in err, if the file cannot be read or is malformed.
+static inline int dfs_routes_load(struct dfs_routes *r, const char *path, const char *defaults, int port, char *err, size_t errsize)
+{
+    memset(r, 0, sizeof(*r));
+    r->nservers = 1;
+    char self[64];
+    snprintf(self, sizeof(self), "S1@localhost:%d", port);
+    if (dfs_routes_add(r, ".c", self, err, errsize) < 0) return -1;
+
+    if (path == NULL || path[0] == '\0') return dfs_routes_parse(r, defaults, err, errsize);
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        snprintf(err, errsize, "cannot read %s", path);
+        return -1;
+    }
+    char *text = NULL;
+    size_t size = 0;
+    FILE *mem = open_memstream(&text, &size);
+    char chunk[4096];
+    size_t n;
+    while (mem != NULL && (n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    {
+        fwrite(chunk, 1, n, mem);
+    }
+    fclose(f);
+    if (mem == NULL || fclose(mem) != 0)
+    {
+        free(text);
+        snprintf(err, errsize, "cannot read %s", path);
+        return -1;
+    }
+    int result = dfs_routes_parse(r, text, err, errsize);
+    free(text);
+    return result;
+}
+
+// Function to find the group holding files with the given extension
+// Returns NULL for a type no route names.
+static inline const struct dfs_route *dfs_routes_find(const struct dfs_routes *r, const char *ext)
+{
+    for (int i = 0; i < r->ntypes; i++)
+    {
+        if (strcmp(r->types[i].ext, ext) == 0) return &r->types[i];
+    }
+    return NULL;
+}
+
+// Function to find the group a server belongs to
+static inline const struct dfs_route *dfs_routes_group(const struct dfs_routes *r, int server)
+{
+    for (int i = 0; i < r->ntypes; i++)
+    {
+        if (server >= r->types[i].first && server < r->types[i].first + r->types[i].count) return &r->types[i];
+    }
+    return NULL;
+}
+
+// Function to score a path for one server; the highest-scoring server of a group holds it
+static inline uint64_t dfs_routes_score(const struct dfs_route_server *server, uint64_t path_hash)
+{
+    return dfs_bloom_mix(path_hash ^ server->seed);
+}
+
+// Function to place a file in its type's group
+// key is the file's path as the index keys it ("/docs/a.txt"). Returns the server number.
+static inline int dfs_routes_place(const struct dfs_routes *r, const struct dfs_route *route, const char *key)
+{
+    uint64_t h, h2, best_score = 0;
+    dfs_bloom_hash(key, strlen(key), &h, &h2);
+    int best = route->first;
+    for (int server = route->first; server < route->first + route->count; server++)
+    {
+        uint64_t score = dfs_routes_score(&r->servers[server], h);
+        if (server == route->first || score > best_score)
+        {
+            best = server;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+#endif
@@ -0,0 +1,957 @@
+// Distributed File System - Streaming Tar Archives
+// In-process ustar/pax writer used by S1, S2 and S3 to answer downltar.
+//
+// Archives are written straight to the socket instead of being built on disk first. A first pass
+// walks the tree and only stats the matching files, so the response header can announce the exact
+// archive size; the second pass writes each member's header and sends its body with sendfile().
+// A file that shrinks or disappears between the two passes is padded with zeros and one that grows
+// is cut at the size recorded, so the archive always has the length announced. Member names are
+// the files' absolute paths without the leading '/', as tar itself stores them. Names that do not
+// fit a ustar header, and files of 8 GiB or more, get a pax extended header.
+//
+// Each server also keeps its finished archive in a cache directory ($DFS_CACHE_DIR, default
+// ~/.dfs_cache) so repeated downltar requests are served from one file with sendfile(). The cached
+// file's name carries a generation number kept in memory shared by all of the server's processes;
+// uploads and removals bump it, which makes the cached archive stale. The first request to find
+// it stale rebuilds it under a file lock, and requests arriving meanwhile wait for that rebuild
+// and then share its result instead of building archives of their own.
+//
+// When the server keeps a path index (dfs_index.h) the plan is read from it instead: the index
+// already holds every file's size, time and mode in path order, so planning an archive touches
+// no directories and stats no files, and a subtree is just a range of the index.
+//
+// A downltar request may narrow the archive to a subtree, to files modified since a given time
+// and to a size range (struct dfs_tar_filter). The walk then starts at the subtree and the other
+// filters are applied to the stat it already does, so unselected files cost no more than a stat.
+// Filtered archives are always built fresh, never taken from or written to the cache.
+//
+// For "downltar all", S1 asks every backend for its share of a unified archive, whose members
+// are named by their ~S1 path rather than their location on disk, and merges the shares with
+// dfs_tar_merge(): each share is read as it arrives and whole members are copied out from
+// whichever share has one ready, so one slow backend does not hold up the others.
+
+#ifndef DFS_TAR_H
+#define DFS_TAR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <poll.h>
+#include "dfs_protocol.h"
+#include "dfs_listing.h"
+#include "dfs_index.h"
+#include "dfs_routes.h"
+
+#define DFS_TAR_BLOCK 512 // Tar headers and bodies are padded to whole blocks
+#define DFS_TAR_MAX_USTAR_SIZE 077777777777ULL // Largest size a ustar header can hold
+#define DFS_TAR_CACHE_DIR ".dfs_cache" // Default cache directory, under $HOME
+#define DFS_TAR_CACHE_NAME_MAX (DFS_ROUTES_EXT_MAX + DFS_ROUTES_NAME_MAX + 8) // Longest "<type>files-<instance>", with its NUL
+#define DFS_TAR_ROOT "~S1" // Start of the member names in a share of a unified archive
+#define DFS_TAR_MERGE_BUFFER (256 * 1024) // Bytes read ahead from each share while merging
+
+// One file to be archived, as it was when the archive was planned
+struct dfs_tar_member
+{
+    size_t name; // Offset of the path in the archive's name buffer
+    uint64_t size;
+    time_t mtime;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+};
+
+// An archive planned by dfs_tar_collect() and written by dfs_tar_send()
+struct dfs_tar
+{
+    struct dfs_buf names; // NUL-separated paths of the members
+    struct dfs_tar_member *members;
+    size_t count;
+    size_t cap;
+    uint64_t size; // Total archive size in bytes
+    char root[DFS_WALK_PATH_LEN]; // Directory that ~S1 member names stand for, "" if names are paths
+};
+
+// A planned archive written into a pipe by a second thread
+struct dfs_tar_pipe
+{
+    struct dfs_tar tar;
+    int fd; // Write end of the pipe, closed once the archive is written
+};
+
+// One archive read from a descriptor and merged into a unified archive
+struct dfs_tar_stream
+{
+    int fd;
+    uint64_t left; // Bytes of the archive not yet read
+    char *buf; // Bytes read but not yet copied out
+    size_t start;
+    size_t len;
+    int ended; // End-of-archive blocks reached; the rest is read and dropped
+};
+
+// Files a downltar request selects; a filter with nothing set selects every file
+struct dfs_tar_filter
+{
+    char subdir[DFS_WALK_PATH_LEN]; // Subtree to archive, e.g. "/docs", or "" for everything
+    time_t since; // Only files modified at or after this time (0: any)
+    uint64_t min_size; // Only files of at least this many bytes
+    uint64_t max_size; // Only files of at most this many bytes
+    int unified; // Share of S1's unified archive ("downltar all"): members get ~S1 names
+    int active; // Set if anything is filtered or renamed, so the cached full archive does not apply
+};
+
+// A server's cached archive of one file type
+struct dfs_tar_cache
+{
+    char dir[DFS_WALK_PATH_LEN]; // Directory holding the cached archive
+    char name[DFS_TAR_CACHE_NAME_MAX]; // Archive name without ".tar", e.g. "cfiles"
+    char ext[DFS_ROUTES_EXT_MAX]; // File type archived, e.g. ".c"
+    struct dfs_index *index; // Server's path index, read when planning an archive
+    uint64_t *generation; // Bumped on every change; shared by all processes, NULL if unusable
+};
+
+// Function to write a number as a zero-padded octal header field
+// Returns 0, or -1 if the number needs more digits than the field holds.
+static inline int dfs_tar_octal(char *field, size_t width, uint64_t value)
+{
+    int len = snprintf(field, width, "%0*llo", (int)width - 1, (unsigned long long)value);
+    return (len < 0 || (size_t)len >= width) ? -1 : 0;
+}
+
+// Function to fill in a 512-byte tar header block
+// The name and prefix are copied as given; the checksum is computed over the finished block.
+// Returns 0, or -1 if a number does not fit its field, e.g. an mtime past the year 2242.
+static inline int dfs_tar_block(char *block, const char *name, size_t name_len, const char *prefix, size_t prefix_len, char type, const struct dfs_tar_member *m, uint64_t size)
+{
+    memset(block, 0, DFS_TAR_BLOCK);
+    memcpy(block, name, name_len);
+    if (dfs_tar_octal(block + 100, 8, m->mode & 07777) < 0 || dfs_tar_octal(block + 108, 8, m->uid & 07777777) < 0 ||
+        dfs_tar_octal(block + 116, 8, m->gid & 07777777) < 0 || dfs_tar_octal(block + 124, 12, size) < 0 ||
+        dfs_tar_octal(block + 136, 12, (m->mtime > 0) ? (uint64_t)m->mtime : 0) < 0)
+    {
+        return -1;
+    }
+    block[156] = type;
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    memcpy(block + 345, prefix, prefix_len);
+
+    // The checksum is taken with its own field filled with spaces
+    memset(block + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < DFS_TAR_BLOCK; i++)
+    {
+        sum += (unsigned char)block[i];
+    }
+    snprintf(block + 148, 7, "%06o", sum);
+    return 0;
+}
+
+// Function to append one pax record ("<length> key=value\n") to a buffer
+// The length counts the whole record, including its own digits.
+static inline int dfs_tar_pax_record(struct dfs_buf *out, const char *key, const char *value)
+{
+    size_t body = strlen(key) + strlen(value) + 3; // ' ', '=' and '\n'
+    size_t len = body + 1;
+    while (snprintf(NULL, 0, "%zu", len) + body != len)
+    {
+        len++;
+    }
+
+    char record[DFS_WALK_PATH_LEN * 3];
+    if (len >= sizeof(record)) return -1;
+    snprintf(record, sizeof(record), "%zu %s=%s\n", len, key, value);
+    return dfs_buf_append(out, record, len);
+}
+
+// Function to append the header blocks for one member to a buffer
+// Uses a plain ustar header when the name and size fit, preceded by a pax header otherwise.
+static inline int dfs_tar_headers(struct dfs_buf *out, const char *name, const struct dfs_tar_member *m)
+{
+    char block[DFS_TAR_BLOCK];
+    size_t len = strlen(name);
+    const char *prefix = "";
+    size_t prefix_len = 0;
+    const char *short_name = name;
+    size_t short_len = len;
+    int fits = 1;
+
+    // Long names are split at a '/' into the 155-byte prefix and the 100-byte name fields
+    if (len > 100)
+    {
+        fits = 0;
+        for (const char *slash = strchr(name, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+        {
+            size_t head = slash - name;
+            if (head <= 155 && len - head - 1 <= 100 && len - head - 1 > 0)
+            {
+                prefix = name;
+                prefix_len = head;
+                short_name = slash + 1;
+                short_len = len - head - 1;
+                fits = 1;
+                break;
+            }
+        }
+    }
+
+    if (!fits || m->size > DFS_TAR_MAX_USTAR_SIZE)
+    {
+        // Records go in a pax extended header ahead of the member's own header
+        struct dfs_buf records = { 0 };
+        char size[24];
+        snprintf(size, sizeof(size), "%llu", (unsigned long long)m->size);
+        if ((!fits && dfs_tar_pax_record(&records, "path", name) < 0) ||
+            (m->size > DFS_TAR_MAX_USTAR_SIZE && dfs_tar_pax_record(&records, "size", size) < 0))
+        {
+            free(records.data);
+            return -1;
+        }
+
+        size_t pad = (DFS_TAR_BLOCK - records.len % DFS_TAR_BLOCK) % DFS_TAR_BLOCK;
+        int failed = dfs_tar_block(block, "././@PaxHeader", 14, "", 0, 'x', m, records.len) < 0 ||
+                     dfs_buf_append(out, block, DFS_TAR_BLOCK) < 0 ||
+                     dfs_buf_append(out, records.data, records.len) < 0;
+        memset(block, 0, DFS_TAR_BLOCK);
+        failed = failed || dfs_buf_append(out, block, pad) < 0;
+        free(records.data);
+        if (failed) return -1;
+
+        if (!fits)
+        {
+            // Readers that ignore pax headers still get the end of the name
+            short_name = name + len - 100;
+            short_len = 100;
+            prefix_len = 0;
+        }
+    }
+
+    uint64_t size = (m->size > DFS_TAR_MAX_USTAR_SIZE) ? 0 : m->size;
+    if (dfs_tar_block(block, short_name, short_len, prefix, prefix_len, '0', m, size) < 0) return -1;
+    return dfs_buf_append(out, block, DFS_TAR_BLOCK);
+}
+
+// Function to read a number argument of a downltar filter
+// Returns 0, or -1 if value is not a plain decimal number.
+static inline int dfs_tar_filter_number(const char *value, uint64_t *out)
+{
+    char *end;
+    if (value[0] < '0' || value[0] > '9') return -1;
+    errno = 0;
+    *out = strtoull(value, &end, 10);
+    return (errno != 0 || *end != '\0') ? -1 : 0;
+}
+
+// Function to read the filters of a downltar request
+// A file type of "all" asks for a share of a unified archive. Filters are the arguments after
+// the file type and encodings: "prefix=~S1/dir" (a subtree, named
+// as the client sees it), "since=<seconds since the epoch>", "min=<bytes>" and "max=<bytes>".
+// Returns 0, or -1 if a filter is malformed or its prefix leaves the server's directory.
+static inline int dfs_tar_filter_parse(struct dfs_tar_filter *f, const struct dfs_request *req)
+{
+    memset(f, 0, sizeof(*f));
+    f->max_size = UINT64_MAX;
+    for (int i = DFS_TAR_FILTER_ARG; i < req->argc; i++)
+    {
+        const char *arg = req->argv[i];
+        const char *value = strchr(arg, '=');
+        if (value == NULL) return -1;
+        size_t key_len = value - arg;
+        value++;
+
+        uint64_t number;
+        if (key_len == 6 && strncmp(arg, "prefix", 6) == 0)
+        {
+            // Same root as every other path, with no way back out of it
+            if (strncmp(value, "~S1", 3) != 0 || (value[3] != '/' && value[3] != '\0') ||
+                strlen(value + 3) >= sizeof(f->subdir) || strstr(value, "/../") != NULL ||
+                (strlen(value) >= 3 && strcmp(value + strlen(value) - 3, "/..") == 0))
+            {
+                return -1;
+            }
+            snprintf(f->subdir, sizeof(f->subdir), "%s", value + 3);
+            size_t len = strlen(f->subdir);
+            while (len > 0 && f->subdir[len - 1] == '/')
+            {
+                f->subdir[--len] = '\0';
+            }
+        }
+        else if (key_len == 5 && strncmp(arg, "since", 5) == 0 && dfs_tar_filter_number(value, &number) == 0)
+        {
+            f->since = (time_t)number;
+        }
+        else if (key_len == 3 && strncmp(arg, "min", 3) == 0 && dfs_tar_filter_number(value, &number) == 0)
+        {
+            f->min_size = number;
+        }
+        else if (key_len == 3 && strncmp(arg, "max", 3) == 0 && dfs_tar_filter_number(value, &number) == 0)
+        {
+            f->max_size = number;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    f->unified = (req->argc > 0 && strcmp(req->argv[0], "all") == 0);
+    f->active = (f->subdir[0] != '\0' || f->since != 0 || f->min_size != 0 || f->max_size != UINT64_MAX || f->unified);
+    return 0;
+}
+
+// Function to check whether a file passes a downltar filter
+static inline int dfs_tar_filter_match(const struct dfs_tar_filter *f, const struct dfs_tar_member *m)
+{
+    return f == NULL || (m->mtime >= f->since && m->size >= f->min_size && m->size <= f->max_size);
+}
+
+// Function to find the file behind a member's name
+// The name is the path itself unless the archive uses ~S1 names, which are resolved into buf.
+static inline const char *dfs_tar_path(const struct dfs_tar *t, const char *name, char *buf, size_t size)
+{
+    if (t->root[0] == '\0') return name;
+    snprintf(buf, size, "%s%s", t->root, name + strlen(DFS_TAR_ROOT));
+    return buf;
+}
+
+// Function to give the name a member is stored under
+// Absolute paths lose their leading '/', as tar itself stores them.
+static inline const char *dfs_tar_name(const struct dfs_tar *t, const char *name)
+{
+    return (t->root[0] == '\0' && name[0] == '/') ? name + 1 : name;
+}
+
+// Function to release an archive plan
+static inline void dfs_tar_free(struct dfs_tar *t)
+{
+    free(t->names.data);
+    free(t->members);
+    memset(t, 0, sizeof(*t));
+}
+
+// Function to add a member to an archive plan
+// The member's name must already be in t->names. headers is scratch space. Returns -1 on error.
+static inline int dfs_tar_add(struct dfs_tar *t, struct dfs_buf *headers, const struct dfs_tar_member *m)
+{
+    if (t->count == t->cap)
+    {
+        size_t cap = (t->cap > 0) ? t->cap * 2 : 64;
+        struct dfs_tar_member *members = realloc(t->members, cap * sizeof(*members));
+        if (members == NULL) return -1;
+        t->members = members;
+        t->cap = cap;
+    }
+
+    headers->len = 0;
+    if (dfs_tar_headers(headers, dfs_tar_name(t, t->names.data + m->name), m) < 0) return -1;
+    t->members[t->count++] = *m;
+    t->size += headers->len + (m->size + DFS_TAR_BLOCK - 1) / DFS_TAR_BLOCK * DFS_TAR_BLOCK;
+    return 0;
+}
+
+// Archive being planned from a path index
+struct dfs_tar_scan
+{
+    struct dfs_tar *t;
+    const char *name_root; // What member names start with in place of the storage root
+    const struct dfs_tar_filter *filter;
+    struct dfs_buf headers;
+    char last[DFS_INDEX_KEY_MAX]; // Key of the last file seen, where the next batch resumes
+    int failed;
+};
+
+// Function to add one indexed file to an archive plan if the filter selects it
+static inline int dfs_tar_scan_one(void *arg, const struct dfs_index_leaf *leaf)
+{
+    struct dfs_tar_scan *scan = arg;
+    memcpy(scan->last, leaf->key, leaf->key_len + 1);
+
+    struct dfs_tar_member m;
+    m.size = leaf->size;
+    m.mtime = leaf->mtime;
+    m.mode = leaf->mode;
+    m.uid = leaf->uid;
+    m.gid = leaf->gid;
+    if (!dfs_tar_filter_match(scan->filter, &m)) return 0;
+
+    m.name = scan->t->names.len;
+    if (dfs_buf_append(&scan->t->names, scan->name_root, strlen(scan->name_root)) < 0 ||
+        dfs_buf_append(&scan->t->names, leaf->key, leaf->key_len + 1) < 0 ||
+        dfs_tar_add(scan->t, &scan->headers, &m) < 0)
+    {
+        scan->failed = 1;
+        return 1;
+    }
+    return 0;
+}
+
+// Function to plan an archive from a path index
+// The index is read DFS_INDEX_SCAN_BATCH files at a time so uploads are not held up behind a
+// large archive. Returns the number of members, or -1 on error.
+static inline int dfs_tar_collect_index(struct dfs_tar *t, struct dfs_index *index, const char *dir, const struct dfs_tar_filter *filter)
+{
+    char prefix[DFS_INDEX_KEY_MAX], after[DFS_INDEX_KEY_MAX];
+    struct dfs_tar_scan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.t = t;
+    scan.name_root = (t->root[0] != '\0') ? DFS_TAR_ROOT : dir;
+    scan.filter = filter;
+
+    // The selected subtree is the run of keys under "/subdir/"
+    if (dfs_index_key((filter != NULL) ? filter->subdir : "", prefix, sizeof(prefix) - 1) < 0) return -1;
+    size_t prefix_len = strlen(prefix);
+    if (prefix[prefix_len - 1] != '/')
+    {
+        strcat(prefix, "/");
+    }
+
+    int visited;
+    do
+    {
+        memcpy(after, scan.last, sizeof(after));
+        dfs_index_lock(index->head);
+        visited = dfs_index_walk(index->head, prefix, (after[0] != '\0') ? after : NULL, DFS_INDEX_SCAN_BATCH, dfs_tar_scan_one, &scan);
+        dfs_index_unlock(index->head);
+    } while (visited == DFS_INDEX_SCAN_BATCH && !scan.failed);
+    free(scan.headers.data);
+    return scan.failed ? -1 : 0;
+}
+
+// Function to plan an archive of the files with extension ext under dir that filter selects
+// Records each file's size, times and mode and works out the archive's exact size, from the
+// server's path index when it has a usable one (index may be NULL) and otherwise by walking dir.
+// A NULL filter selects every file. A missing directory gives an empty archive. Returns the
+// number of members, or -1 on error.
+static inline int dfs_tar_collect(struct dfs_tar *t, struct dfs_index *index, const char *dir, const char *ext, const struct dfs_tar_filter *filter)
+{
+    char cursor[32] = "";
+    char base[DFS_WALK_PATH_LEN * 2];
+    char prefix[DFS_WALK_PATH_LEN * 2];
+    char path_buf[DFS_WALK_PATH_LEN * 2];
+    memset(t, 0, sizeof(*t));
+    if (filter != NULL && filter->unified)
+    {
+        snprintf(t->root, sizeof(t->root), "%s", dir);
+    }
+
+    if (dfs_index_usable(index))
+    {
+        if (dfs_tar_collect_index(t, index, dir, filter) < 0)
+        {
+            dfs_tar_free(t);
+            return -1;
+        }
+    }
+    else
+    {
+        // Only the selected subtree is walked
+        const char *subdir = (filter != NULL) ? filter->subdir : "";
+        snprintf(base, sizeof(base), "%s%s", dir, subdir);
+        snprintf(prefix, sizeof(prefix), "%s%s", DFS_TAR_ROOT, subdir);
+        if (dfs_walk_page(base, ext, (t->root[0] != '\0') ? prefix : base, INT_MAX, cursor, sizeof(cursor), &t->names) < 0)
+        {
+            dfs_tar_free(t);
+            return -1;
+        }
+
+        struct dfs_buf headers = { 0 };
+        char *line = t->names.data;
+        char *end = t->names.data + t->names.len;
+        while (line != NULL && line < end)
+        {
+            char *newline = memchr(line, '\n', end - line);
+            if (newline == NULL) break;
+            *newline = '\0';
+
+            struct stat st;
+            const char *path = dfs_tar_path(t, line, path_buf, sizeof(path_buf));
+            if (lstat(path, &st) == 0 && S_ISREG(st.st_mode))
+            {
+                struct dfs_tar_member m;
+                m.name = line - t->names.data;
+                m.size = st.st_size;
+                m.mtime = st.st_mtime;
+                m.mode = st.st_mode;
+                m.uid = st.st_uid;
+                m.gid = st.st_gid;
+                if (dfs_tar_filter_match(filter, &m) && dfs_tar_add(t, &headers, &m) < 0) break;
+            }
+            line = newline + 1;
+        }
+        free(headers.data);
+
+        if (line < end)
+        {
+            dfs_tar_free(t);
+            return -1;
+        }
+    }
+
+    // Two zero blocks mark the end of the archive
+    t->size += 2 * DFS_TAR_BLOCK;
+    return (int)t->count;
+}
+
+// Function to write len zero bytes to a socket
+static inline int dfs_tar_zeros(int fd, uint64_t len)
+{
+    static const char zeros[DFS_TAR_BLOCK * 16];
+    while (len > 0)
+    {
+        size_t chunk = (len < sizeof(zeros)) ? len : sizeof(zeros);
+        if (dfs_write_full(fd, zeros, chunk) < 0) return -1;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Function to write a planned archive to a socket
+// Headers are written from user space and bodies are sent with sendfile(). Returns -1 if the
+// socket fails, after which the archive is incomplete and the session cannot continue.
+static inline int dfs_tar_send(int fd, struct dfs_tar *t)
+{
+    struct dfs_buf headers = { 0 };
+    char path_buf[DFS_WALK_PATH_LEN * 2];
+    for (size_t i = 0; i < t->count; i++)
+    {
+        const struct dfs_tar_member *m = &t->members[i];
+        const char *name = t->names.data + m->name;
+        const char *path = dfs_tar_path(t, name, path_buf, sizeof(path_buf));
+
+        headers.len = 0;
+        if (dfs_tar_headers(&headers, dfs_tar_name(t, name), m) < 0 ||
+            dfs_write_full(fd, headers.data, headers.len) < 0)
+        {
+            free(headers.data);
+            return -1;
+        }
+
+        // Send the body as planned; whatever the file no longer has is sent as zeros
+        uint64_t left = m->size;
+        int file = open(path, O_RDONLY);
+        if (file >= 0)
+        {
+            off_t offset = 0;
+            while (left > 0)
+            {
+                size_t chunk = (left < (1UL << 30)) ? left : (1UL << 30);
+                ssize_t sent = sendfile(fd, file, &offset, chunk);
+                if (sent <= 0) break;
+                left -= sent;
+            }
+            close(file);
+        }
+
+        uint64_t pad = (DFS_TAR_BLOCK - m->size % DFS_TAR_BLOCK) % DFS_TAR_BLOCK;
+        if (dfs_tar_zeros(fd, left + pad) < 0)
+        {
+            free(headers.data);
+            return -1;
+        }
+    }
+    free(headers.data);
+
+    return dfs_tar_zeros(fd, 2 * DFS_TAR_BLOCK);
+}
+
+// Function run by a thread that writes a planned archive into a pipe
+static inline void *dfs_tar_produce(void *arg)
+{
+    struct dfs_tar_pipe *p = arg;
+    dfs_tar_send(p->fd, &p->tar);
+    close(p->fd); // End of input for the reader
+    return NULL;
+}
+
+// Function to read a numeric header field, in octal or (for large values) base-256
+static inline uint64_t dfs_tar_field(const char *field, size_t width)
+{
+    uint64_t value = 0;
+    if ((unsigned char)field[0] & 0x80)
+    {
+        for (size_t i = 1; i < width; i++)
+        {
+            value = (value << 8) | (unsigned char)field[i];
+        }
+        return value;
+    }
+    for (size_t i = 0; i < width && field[i] >= '0' && field[i] <= '7'; i++)
+    {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+// Function to find the size a pax extended header gives the next member
+// Returns UINT64_MAX if the records do not set one.
+static inline uint64_t dfs_tar_pax_size(const char *records, size_t len)
+{
+    size_t off = 0;
+    while (off < len)
+    {
+        // Each record is "<length> <key>=<value>\n", its length counting the whole record
+        size_t rec_len = 0, i = off;
+        while (i < len && records[i] >= '0' && records[i] <= '9')
+        {
+            rec_len = rec_len * 10 + (records[i++] - '0');
+        }
+        if (rec_len == 0 || off + rec_len > len || i >= len || records[i] != ' ') break;
+        if (rec_len - (i + 1 - off) > 5 && strncmp(records + i + 1, "size=", 5) == 0)
+        {
+            return strtoull(records + i + 6, NULL, 10);
+        }
+        off += rec_len;
+    }
+    return UINT64_MAX;
+}
+
+// Function to measure the member at the start of an archive's unread bytes
+// A member is its extended headers (pax or GNU long names), its header and its padded body.
+// Returns 1 and sets *span once all of the member's headers are buffered, 0 if more bytes are
+// needed, 2 at the end-of-archive block and -1 if the archive is malformed.
+static inline int dfs_tar_member_span(const char *buf, size_t len, uint64_t *span)
+{
+    static const char zeros[DFS_TAR_BLOCK];
+    uint64_t pax_size = UINT64_MAX;
+    size_t off = 0;
+    while (1)
+    {
+        if (len - off < DFS_TAR_BLOCK) return 0;
+        const char *h = buf + off;
+        if (memcmp(h, zeros, DFS_TAR_BLOCK) == 0) return (off == 0) ? 2 : -1;
+
+        uint64_t size = dfs_tar_field(h + 124, 12);
+        uint64_t padded = (size + DFS_TAR_BLOCK - 1) / DFS_TAR_BLOCK * DFS_TAR_BLOCK;
+        char type = h[156];
+        if (type == 'x' || type == 'g' || type == 'L' || type == 'K')
+        {
+            // Extended headers are small; one too big to buffer is not worth merging
+            if (padded > DFS_TAR_MERGE_BUFFER / 2) return -1;
+            if (len - off - DFS_TAR_BLOCK < padded) return 0;
+            if (type == 'x')
+            {
+                pax_size = dfs_tar_pax_size(h + DFS_TAR_BLOCK, size);
+            }
+            off += DFS_TAR_BLOCK + padded;
+            continue;
+        }
+
+        if (pax_size != UINT64_MAX)
+        {
+            size = pax_size;
+            padded = (size + DFS_TAR_BLOCK - 1) / DFS_TAR_BLOCK * DFS_TAR_BLOCK;
+        }
+        *span = off + DFS_TAR_BLOCK + padded;
+        return 1;
+    }
+}
+
+// Function to read whatever a merged archive has ready into its buffer
+// Returns -1 if the descriptor fails or ends early.
+static inline int dfs_tar_stream_fill(struct dfs_tar_stream *s)
+{
+    if (s->start > 0)
+    {
+        memmove(s->buf, s->buf + s->start, s->len);
+        s->start = 0;
+    }
+    size_t room = DFS_TAR_MERGE_BUFFER - s->len;
+    ssize_t n = read(s->fd, s->buf + s->len, (room < s->left) ? room : s->left);
+    if (n < 0 && errno == EINTR) return 0;
+    if (n <= 0) return -1;
+    s->len += n;
+    s->left -= n;
+    if (s->ended) s->len = 0; // Past the last member nothing is kept
+    return 0;
+}
+
+// Function to merge complete tar archives into one, written to out
+// Each stream must hold a whole archive of exactly s->left bytes ending in two zero blocks, as
+// dfs_tar_send() writes them, so the merged archive is the streams' sizes added up minus two
+// blocks for each stream but one. Streams are read in parallel; whenever the member being copied
+// is done, the next stream with a whole member's headers buffered (in turn) provides the next
+// one. Returns -1 if a stream is malformed or out fails, leaving the merged archive incomplete.
+static inline int dfs_tar_merge(int out, struct dfs_tar_stream *streams, int n)
+{
+    struct pollfd fds[n];
+    int owner = -1, next = 0, result = 0;
+    uint64_t member_left = 0;
+    for (int i = 0; i < n; i++)
+    {
+        streams[i].buf = malloc(DFS_TAR_MERGE_BUFFER);
+        streams[i].start = streams[i].len = 0;
+        streams[i].ended = 0;
+        if (streams[i].buf == NULL) result = -1;
+    }
+
+    while (result == 0)
+    {
+        // Pick the next stream with a whole member ready, skipping past finished ones
+        int open_streams = 0;
+        for (int k = 0; owner < 0 && k < n; k++)
+        {
+            struct dfs_tar_stream *s = &streams[(next + k) % n];
+            if (s->ended)
+            {
+                open_streams += (s->left > 0);
+                continue;
+            }
+            open_streams++;
+
+            uint64_t span;
+            int found = dfs_tar_member_span(s->buf + s->start, s->len, &span);
+            if (found < 0 || (found == 0 && (s->left == 0 || s->len == DFS_TAR_MERGE_BUFFER)))
+            {
+                result = -1;
+                break;
+            }
+            if (found == 2)
+            {
+                // Only the two end-of-archive blocks may follow the last member
+                if (s->len + s->left != 2 * DFS_TAR_BLOCK)
+                {
+                    result = -1;
+                    break;
+                }
+                s->ended = 1;
+                s->len = 0;
+                open_streams -= (s->left == 0);
+            }
+            else if (found == 1)
+            {
+                owner = (next + k) % n;
+                member_left = span;
+                next = owner + 1;
+            }
+        }
+        if (result < 0) break;
+        if (owner < 0 && open_streams == 0) break;
+
+        // Copy out what the current member has buffered
+        if (owner >= 0 && streams[owner].len > 0)
+        {
+            struct dfs_tar_stream *s = &streams[owner];
+            size_t take = (s->len < member_left) ? s->len : member_left;
+            if (dfs_write_full(out, s->buf + s->start, take) < 0)
+            {
+                result = -1;
+                break;
+            }
+            s->start += take;
+            s->len -= take;
+            member_left -= take;
+            if (member_left == 0) owner = -1;
+            continue;
+        }
+        if (owner >= 0 && streams[owner].left == 0)
+        {
+            result = -1; // The member is cut short
+            break;
+        }
+
+        // Wait for more of any stream that still has room to read ahead
+        int nfds = 0;
+        for (int i = 0; i < n; i++)
+        {
+            fds[i].fd = -1;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+            if (streams[i].left > 0 && streams[i].len < DFS_TAR_MERGE_BUFFER)
+            {
+                fds[i].fd = streams[i].fd;
+                nfds++;
+            }
+        }
+        if (nfds == 0)
+        {
+            result = -1; // Every buffer is full without a whole member in any of them
+            break;
+        }
+        if (poll(fds, n, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            result = -1;
+            break;
+        }
+        for (int i = 0; i < n && result == 0; i++)
+        {
+            if (fds[i].revents != 0 && dfs_tar_stream_fill(&streams[i]) < 0)
+            {
+                result = -1;
+            }
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        free(streams[i].buf);
+        streams[i].buf = NULL;
+    }
+    return (result == 0) ? dfs_tar_zeros(out, 2 * DFS_TAR_BLOCK) : -1;
+}
+
+// Function to send an archive file as a response payload
+// Returns -1 if the socket fails; if the header went out, the session cannot continue.
+static inline int dfs_tar_send_file(int sock, const struct dfs_request *req, int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        dfs_send_status(sock, req, DFS_EIO, "ERROR: Failed to read tar file");
+        return -1;
+    }
+    if (dfs_send_data_header(sock, req, st.st_size) < 0)
+    {
+        return -1;
+    }
+
+    off_t offset = 0;
+    while (offset < st.st_size)
+    {
+        ssize_t sent = sendfile(sock, fd, &offset, st.st_size - offset);
+        if (sent <= 0) return -1;
+    }
+    return 0;
+}
+
+// Function to remove a cache's archives and leftover staging files, except keep
+static inline void dfs_tar_cache_prune(const struct dfs_tar_cache *c, const char *keep)
+{
+    DIR *dir = opendir(c->dir);
+    if (dir == NULL) return;
+
+    size_t len = strlen(c->name);
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        const char *dot = strrchr(ent->d_name, '.');
+        if (strncmp(ent->d_name, c->name, len) != 0 || ent->d_name[len] != '.' ||
+            strcmp(dot, ".lock") == 0 || (keep != NULL && strcmp(ent->d_name, keep) == 0))
+        {
+            continue;
+        }
+        char path[DFS_WALK_PATH_LEN * 2];
+        snprintf(path, sizeof(path), "%s/%s", c->dir, ent->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+// Function to set up a server's archive cache for one file type
+// Must run before the workers are started so they all share the generation counter. index is
+// the server's path index, or NULL. Archives left by an earlier run are removed, since nothing
+// says whether they are current. Returns -1 if the cache cannot be used, e.g. because a name
+// does not fit; archives are then planned afresh for every request.
+static inline int dfs_tar_cache_init(struct dfs_tar_cache *c, const char *name, const char *ext, struct dfs_index *index)
+{
+    c->index = index;
+    c->generation = NULL;
+    if (snprintf(c->ext, sizeof(c->ext), "%s", ext) >= (int)sizeof(c->ext)) return -1;
+    if (snprintf(c->name, sizeof(c->name), "%s", name) >= (int)sizeof(c->name)) return -1;
+
+    const char *dir = getenv("DFS_CACHE_DIR");
+    int len;
+    if (dir != NULL && dir[0] != '\0')
+    {
+        len = snprintf(c->dir, sizeof(c->dir), "%s", dir);
+    }
+    else
+    {
+        len = snprintf(c->dir, sizeof(c->dir), "%s/%s", getenv("HOME"), DFS_TAR_CACHE_DIR);
+    }
+    if (len >= (int)sizeof(c->dir)) return -1;
+
+    c->generation = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (c->generation == MAP_FAILED || (mkdir(c->dir, 0700) < 0 && errno != EEXIST))
+    {
+        c->generation = NULL;
+        return -1;
+    }
+    *c->generation = 0;
+    dfs_tar_cache_prune(c, NULL);
+    return 0;
+}
+
+// Function to mark a cached archive stale after a file of its type changed
+// Must be called after the change is visible, so a rebuild that starts later includes it.
+static inline void dfs_tar_cache_invalidate(struct dfs_tar_cache *c)
+{
+    if (c->generation != NULL)
+    {
+        __atomic_add_fetch(c->generation, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Function to write a fresh archive of base into the cache as path
+// Returns a descriptor for the new archive, or -1 on error.
+static inline int dfs_tar_cache_build(const struct dfs_tar_cache *c, const char *base, const char *path)
+{
+    char tmp_path[DFS_WALK_PATH_LEN * 2];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%s.XXXXXX", c->dir, c->name);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) return -1;
+
+    struct dfs_tar tar;
+    if (dfs_tar_collect(&tar, c->index, base, c->ext, NULL) < 0 || dfs_tar_send(fd, &tar) < 0 || rename(tmp_path, path) < 0)
+    {
+        dfs_tar_free(&tar);
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    dfs_tar_free(&tar);
+    return fd;
+}
+
+// Function to open the current archive of base, rebuilding the cached one if it is stale
+// Only one process rebuilds at a time; the others wait on the lock and then use its archive.
+// Returns a descriptor for the archive, or -1 if the cache cannot be used.
+static inline int dfs_tar_cache_open(struct dfs_tar_cache *c, const char *base)
+{
+    if (c->generation == NULL) return -1;
+
+    char file[DFS_TAR_CACHE_NAME_MAX + 32], path[DFS_WALK_PATH_LEN * 2];
+    snprintf(file, sizeof(file), "%s.%llu.tar", c->name, (unsigned long long)__atomic_load_n(c->generation, __ATOMIC_SEQ_CST));
+    snprintf(path, sizeof(path), "%s/%s", c->dir, file);
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) return fd;
+
+    // Stale: wait for the lock, then check again in case another process rebuilt it meanwhile
+    char lock_path[DFS_WALK_PATH_LEN * 2];
+    snprintf(lock_path, sizeof(lock_path), "%s/%s.lock", c->dir, c->name);
+    int lock = open(lock_path, O_RDWR | O_CREAT, 0600);
+    if (lock < 0) return -1;
+    while (flock(lock, LOCK_EX) < 0)
+    {
+        if (errno != EINTR)
+        {
+            close(lock);
+            return -1;
+        }
+    }
+
+    snprintf(file, sizeof(file), "%s.%llu.tar", c->name, (unsigned long long)__atomic_load_n(c->generation, __ATOMIC_SEQ_CST));
+    snprintf(path, sizeof(path), "%s/%s", c->dir, file);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fd = dfs_tar_cache_build(c, base, path);
+    }
+    if (fd >= 0)
+    {
+        dfs_tar_cache_prune(c, file);
+    }
+    close(lock); // Releases the lock
+    return fd;
+}
+
+#endif
@@ -0,0 +1,129 @@
+// Distributed File System - Access Tokens
+// Short-lived permissions S1 signs so a client can move a file's bytes to or from a backend itself.
+//
+// A token lets its holder make a download or an upload with exactly the arguments S1 was asked
+// about, until a deadline. Backends keep no record of the tokens they have seen, so a token can
+// be presented again, by anyone holding it, until it expires; a short DFS_REDIRECT_TTL keeps that
+// window small. It reads "<expiry>.<mac>": the expiry in seconds since
+// the epoch and, in hex, a SipHash-2-4 of the opcode, the upload size, the expiry and the
+// arguments, keyed from the secret all servers share (DFS_SECRET). A backend checks a token on
+// its own, without asking S1, and a token changed to name another file, a larger upload or a
+// later expiry no longer matches its mac.
+
+#ifndef DFS_TOKEN_H
+#define DFS_TOKEN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "dfs_protocol.h"
+
+#define DFS_TOKEN_MAX 48 // Longest token, with its NUL
+
+// Function to run one SipHash round
+static inline void dfs_sip_round(uint64_t v[4])
+{
+    v[0] += v[1]; v[1] = (v[1] << 13) | (v[1] >> 51); v[1] ^= v[0]; v[0] = (v[0] << 32) | (v[0] >> 32);
+    v[2] += v[3]; v[3] = (v[3] << 16) | (v[3] >> 48); v[3] ^= v[2];
+    v[0] += v[3]; v[3] = (v[3] << 21) | (v[3] >> 43); v[3] ^= v[0];
+    v[2] += v[1]; v[1] = (v[1] << 17) | (v[1] >> 47); v[1] ^= v[2]; v[2] = (v[2] << 32) | (v[2] >> 32);
+}
+
+// Function to compute SipHash-2-4 of len bytes under a 128-bit key
+static inline uint64_t dfs_siphash(const uint64_t key[2], const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t v[4] = { key[0] ^ 0x736f6d6570736575ULL, key[1] ^ 0x646f72616e646f6dULL,
+                      key[0] ^ 0x6c7967656e657261ULL, key[1] ^ 0x7465646279746573ULL };
+    size_t end = len - (len % 8);
+    for (size_t i = 0; i < end; i += 8)
+    {
+        uint64_t m;
+        memcpy(&m, p + i, 8);
+        m = le64toh(m);
+        v[3] ^= m;
+        dfs_sip_round(v);
+        dfs_sip_round(v);
+        v[0] ^= m;
+    }
+
+    // The last block holds the leftover bytes and the length
+    uint64_t b = (uint64_t)len << 56;
+    for (size_t i = 0; i < len % 8; i++)
+    {
+        b |= (uint64_t)p[end + i] << (8 * i);
+    }
+    v[3] ^= b;
+    dfs_sip_round(v);
+    dfs_sip_round(v);
+    v[0] ^= b;
+    v[2] ^= 0xff;
+    for (int i = 0; i < 4; i++)
+    {
+        dfs_sip_round(v);
+    }
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+// Function to compute a token's mac
+// Returns -1 if the arguments are too long to sign.
+static inline int dfs_token_mac(const char *secret, uint8_t opcode, uint64_t size, uint64_t expiry, int argc, char *const *argv, uint64_t *mac)
+{
+    // The key is derived from the secret, so secrets of any length can be used
+    static const uint64_t derive0[2] = { 0, 0 }, derive1[2] = { 1, 0 };
+    uint64_t key[2] = { dfs_siphash(derive0, secret, strlen(secret)), dfs_siphash(derive1, secret, strlen(secret)) };
+
+    unsigned char data[17 + DFS_MAX_ARG_LEN];
+    uint64_t le_size = htole64(size), le_expiry = htole64(expiry);
+    size_t len = 0;
+    data[len++] = opcode;
+    memcpy(data + len, &le_size, 8);
+    memcpy(data + len + 8, &le_expiry, 8);
+    len += 16;
+    for (int i = 0; i < argc; i++)
+    {
+        size_t n = strlen(argv[i]) + 1;
+        if (len + n > sizeof(data)) return -1;
+        memcpy(data + len, argv[i], n);
+        len += n;
+    }
+    *mac = dfs_siphash(key, data, len);
+    return 0;
+}
+
+// Function to issue a token for a request, good for ttl seconds
+// size is the payload length an upload must have (0 for a download). token must have room for
+// DFS_TOKEN_MAX bytes. Returns -1 if the arguments are too long to sign.
+static inline int dfs_token_issue(const char *secret, uint8_t opcode, uint64_t size, long ttl, int argc, char *const *argv, char *token)
+{
+    uint64_t expiry = (uint64_t)time(NULL) + ttl, mac;
+    if (dfs_token_mac(secret, opcode, size, expiry, argc, argv, &mac) < 0) return -1;
+    snprintf(token, DFS_TOKEN_MAX, "%llu.%016llx", (unsigned long long)expiry, (unsigned long long)mac);
+    return 0;
+}
+
+// Function to check a token presented with a request
+// Returns 0 if S1 issued it for this opcode, size and arguments and it has not expired.
+static inline int dfs_token_check(const char *secret, uint8_t opcode, uint64_t size, int argc, char *const *argv, const char *token)
+{
+    char *end;
+    unsigned long long expiry = strtoull(token, &end, 10);
+    if (end == token || *end != '.' || strlen(end + 1) != 16 || expiry < (unsigned long long)time(NULL)) return -1;
+
+    uint64_t mac;
+    char expected[17];
+    if (dfs_token_mac(secret, opcode, size, expiry, argc, argv, &mac) < 0) return -1;
+    snprintf(expected, sizeof(expected), "%016llx", (unsigned long long)mac);
+
+    // Compare without an early exit so timing does not leak the mac
+    unsigned char diff = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        diff |= (unsigned char)(expected[i] ^ end[1 + i]);
+    }
+    return (diff == 0) ? 0 : -1;
+}
+
+#endif
@@ -0,0 +1,458 @@
+// Distributed File System - Change Tracking for the Path Index
+// Keeps a server's path index current with changes made to its storage root by other programs.
+//
+// Files are not only changed through the client: operators and other tools copy files into
+// ~/S2 or delete them from ~/S3 directly. A watcher process subscribes to inotify events for
+// every directory under the storage root and applies each change to the index as it happens
+// (dfs_index_update(), which also logs it), so dispfnames and downltar see it without walking
+// anything; it also marks the server's cached archive stale, so the next downltar rebuilds it
+// with the change. inotify watches single directories, so the watcher adds one per directory: all of
+// them at startup, where it also reconciles each directory's files with the index (catching what
+// changed while the server was down), and new ones as they appear.
+//
+// If changes come faster than the watcher reads them the kernel drops events and reports an
+// overflow. The watcher then rescans, but only what can have changed: it stats each watched
+// directory and re-reads just those whose modification time moved since they were last read.
+// DFS_INDEX_WATCH=0 turns the watcher off.
+
+#ifndef DFS_WATCH_H
+#define DFS_WATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+#include <sys/inotify.h>
+#include "dfs_listing.h"
+#include "dfs_index.h"
+#include "dfs_tar.h"
+
+#define DFS_WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW)
+#define DFS_WATCH_BUFFER (64 * 1024) // Bytes of events read at once
+
+// A watched directory
+struct dfs_watch_dir
+{
+    char *rel; // Key of the directory ("" for the root, "/docs" below it), NULL if not in use
+    int64_t mtime_ns; // Its modification time when its files were last read
+};
+
+// State of the watcher process
+struct dfs_watch
+{
+    struct dfs_index *idx;
+    struct dfs_tar_cache *cache; // Archive of the indexed type, marked stale on every change
+    int fd; // inotify descriptor
+    struct dfs_watch_dir *dirs; // Indexed by watch descriptor
+    int ndirs;
+    int warned; // Set once the watch limit has been reported
+};
+
+// Names read from one directory
+struct dfs_watch_names
+{
+    char **names;
+    size_t count;
+    size_t cap;
+};
+
+// Function to add a copy of a name to a list
+static inline int dfs_watch_name_add(struct dfs_watch_names *l, const char *name, size_t len)
+{
+    if (l->count == l->cap)
+    {
+        size_t cap = (l->cap > 0) ? l->cap * 2 : 64;
+        char **names = realloc(l->names, cap * sizeof(*names));
+        if (names == NULL) return -1;
+        l->names = names;
+        l->cap = cap;
+    }
+    l->names[l->count] = strndup(name, len);
+    return (l->names[l->count++] == NULL) ? -1 : 0;
+}
+
+// Function to release a list of names
+static inline void dfs_watch_names_free(struct dfs_watch_names *l)
+{
+    for (size_t i = 0; i < l->count; i++)
+    {
+        free(l->names[i]);
+    }
+    free(l->names);
+    memset(l, 0, sizeof(*l));
+}
+
+// Function to order names the way the index orders keys
+static inline int dfs_watch_name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Function to check whether a name has the indexed file type
+static inline int dfs_watch_wanted(const struct dfs_watch *w, const char *name)
+{
+    const char *dot = strrchr(name, '.');
+    return dot != NULL && strcmp(dot, w->idx->ext) == 0;
+}
+
+// Function to give a directory's modification time in nanoseconds, or -1 if it is gone
+static inline int64_t dfs_watch_mtime(const char *path)
+{
+    struct stat st;
+    if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode)) return -1;
+    return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+// Function to bring the index in line with one key, whose file is at root + key
+static inline void dfs_watch_update(struct dfs_watch *w, const char *key)
+{
+    char path[DFS_WALK_PATH_LEN * 2];
+    snprintf(path, sizeof(path), "%s%s", w->idx->root, key);
+    if (dfs_index_update(w->idx, path))
+    {
+        dfs_tar_cache_invalidate(w->cache);
+    }
+}
+
+// Index files directly in a directory, gathered by dfs_watch_indexed()
+struct dfs_watch_children
+{
+    size_t skip; // Length of the directory's key prefix
+    struct dfs_watch_names names;
+    char next[DFS_INDEX_KEY_MAX]; // Where to go on after a subdirectory, "" when done
+    int failed;
+};
+
+// Function to collect one file of a directory, or skip past a subdirectory
+static inline int dfs_watch_child(void *arg, const struct dfs_index_leaf *leaf)
+{
+    struct dfs_watch_children *c = arg;
+    const char *rest = leaf->key + c->skip;
+    const char *slash = strchr(rest, '/');
+    if (slash != NULL)
+    {
+        // Everything under "sub/" sorts before "sub0" ('0' follows '/'), so resume there
+        snprintf(c->next, sizeof(c->next), "%.*s0", (int)(slash - leaf->key), leaf->key);
+        return 1;
+    }
+    if (dfs_watch_name_add(&c->names, rest, leaf->key_len - c->skip) < 0)
+    {
+        c->failed = 1;
+        return 1;
+    }
+    return 0;
+}
+
+// Function to list the names of the indexed files directly in directory rel, in key order
+static inline int dfs_watch_indexed(struct dfs_watch *w, const char *rel, struct dfs_watch_names *out)
+{
+    char prefix[DFS_INDEX_KEY_MAX];
+    snprintf(prefix, sizeof(prefix), "%s/", rel);
+
+    struct dfs_watch_children c;
+    memset(&c, 0, sizeof(c));
+    c.skip = strlen(prefix);
+    char start[DFS_INDEX_KEY_MAX];
+    snprintf(start, sizeof(start), "%s", prefix);
+    int strict = 0;
+    while (1)
+    {
+        c.next[0] = '\0';
+        dfs_index_lock(w->idx->head);
+        int visited = dfs_index_walk_from(w->idx->head, prefix, start, strict, DFS_INDEX_SCAN_BATCH, dfs_watch_child, &c);
+        dfs_index_unlock(w->idx->head);
+        if (c.failed) break;
+        if (c.next[0] != '\0')
+        {
+            memcpy(start, c.next, sizeof(start));
+            strict = 0;
+        }
+        else if (visited == DFS_INDEX_SCAN_BATCH)
+        {
+            // A full batch of plain files: go on after the last one
+            snprintf(start, sizeof(start), "%s%s", prefix, c.names.names[c.names.count - 1]);
+            strict = 1;
+        }
+        else
+        {
+            break;
+        }
+    }
+    *out = c.names;
+    return c.failed ? -1 : 0;
+}
+
+// Function to reconcile the index with the files directly in directory rel
+// Files on disk but not in the index are added and indexed files no longer on disk are removed;
+// with refresh set, every file on disk is also looked at again in case it changed in place.
+// Subdirectories found are added to subdirs. Returns -1 if the directory cannot be read.
+static inline int dfs_watch_sync_dir(struct dfs_watch *w, const char *rel, int refresh, struct dfs_watch_names *subdirs)
+{
+    char path[DFS_WALK_PATH_LEN * 2];
+    snprintf(path, sizeof(path), "%s%s", w->idx->root, rel);
+    DIR *d = opendir(path);
+    if (d == NULL) return -1;
+
+    struct dfs_watch_names disk = { 0 }, indexed = { 0 };
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        int type = ent->d_type;
+        if (type == DT_UNKNOWN)
+        {
+            struct stat st;
+            char child[DFS_WALK_PATH_LEN * 2];
+            if (snprintf(child, sizeof(child), "%s/%s", path, ent->d_name) >= (int)sizeof(child) || lstat(child, &st) != 0) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR && subdirs != NULL)
+        {
+            dfs_watch_name_add(subdirs, ent->d_name, strlen(ent->d_name));
+        }
+        else if (type == DT_REG && dfs_watch_wanted(w, ent->d_name))
+        {
+            dfs_watch_name_add(&disk, ent->d_name, strlen(ent->d_name));
+        }
+    }
+    closedir(d);
+
+    // Walk both sorted lists side by side; whatever is only on one side is out of date
+    if (dfs_watch_indexed(w, rel, &indexed) == 0)
+    {
+        qsort(disk.names, disk.count, sizeof(char *), dfs_watch_name_cmp);
+        size_t i = 0, j = 0;
+        char key[DFS_INDEX_KEY_MAX];
+        while (i < disk.count || j < indexed.count)
+        {
+            int cmp = (i == disk.count) ? 1 : (j == indexed.count) ? -1 : strcmp(disk.names[i], indexed.names[j]);
+            const char *name = (cmp <= 0) ? disk.names[i] : indexed.names[j];
+            if (cmp != 0 || refresh)
+            {
+                snprintf(key, sizeof(key), "%s/%s", rel, name);
+                dfs_watch_update(w, key);
+            }
+            if (cmp <= 0) i++;
+            if (cmp >= 0) j++;
+        }
+    }
+    dfs_watch_names_free(&disk);
+    dfs_watch_names_free(&indexed);
+    return 0;
+}
+
+// Function to remember which directory a watch descriptor belongs to
+static inline void dfs_watch_remember(struct dfs_watch *w, int wd, const char *rel, int64_t mtime_ns)
+{
+    if (wd >= w->ndirs)
+    {
+        int n = (wd + 1 > w->ndirs * 2) ? wd + 1 : w->ndirs * 2;
+        struct dfs_watch_dir *dirs = realloc(w->dirs, n * sizeof(*dirs));
+        if (dirs == NULL) return;
+        memset(dirs + w->ndirs, 0, (n - w->ndirs) * sizeof(*dirs));
+        w->dirs = dirs;
+        w->ndirs = n;
+    }
+    free(w->dirs[wd].rel); // The same directory seen under a new name after a move
+    w->dirs[wd].rel = strdup(rel);
+    w->dirs[wd].mtime_ns = mtime_ns;
+}
+
+// Function to watch directory rel and everything below it, reconciling each with the index
+static inline void dfs_watch_tree(struct dfs_watch *w, const char *rel, int depth)
+{
+    char path[DFS_WALK_PATH_LEN * 2];
+    snprintf(path, sizeof(path), "%s%s", w->idx->root, rel);
+
+    // Watch first and read second, so nothing created in between is missed; the time is taken
+    // before reading too, so a change made during the read makes the directory look changed
+    int wd = inotify_add_watch(w->fd, path, DFS_WATCH_MASK);
+    if (wd < 0 && errno != ENOSPC) return;
+    if (wd < 0 && !w->warned)
+    {
+        // Still reconciled now, but later changes below here go unnoticed
+        fprintf(stderr, "WARNING: Out of inotify watches at %s; raise fs.inotify.max_user_watches\n", path);
+        w->warned = 1;
+    }
+    int64_t mtime_ns = dfs_watch_mtime(path);
+
+    struct dfs_watch_names subdirs = { 0 };
+    if (dfs_watch_sync_dir(w, rel, 0, &subdirs) < 0)
+    {
+        return;
+    }
+    if (wd >= 0)
+    {
+        dfs_watch_remember(w, wd, rel, mtime_ns);
+    }
+    for (size_t i = 0; i < subdirs.count && depth + 1 < DFS_WALK_MAX_DEPTH; i++)
+    {
+        char child[DFS_INDEX_KEY_MAX];
+        if (snprintf(child, sizeof(child), "%s/%s", rel, subdirs.names[i]) >= (int)sizeof(child)) continue;
+        dfs_watch_tree(w, child, depth + 1);
+    }
+    dfs_watch_names_free(&subdirs);
+}
+
+// Function to check whether a directory is being followed
+static inline int dfs_watch_known(const struct dfs_watch *w, const char *rel)
+{
+    for (int i = 0; i < w->ndirs; i++)
+    {
+        if (w->dirs[i].rel != NULL && strcmp(w->dirs[i].rel, rel) == 0) return 1;
+    }
+    return 0;
+}
+
+// Function to stop following a directory and everything below it that was moved or deleted
+// Their watches are left in place: a directory moved back in gets the same ones again.
+static inline void dfs_watch_forget(struct dfs_watch *w, const char *rel)
+{
+    size_t len = strlen(rel);
+    for (int i = 0; i < w->ndirs; i++)
+    {
+        const char *dir = w->dirs[i].rel;
+        if (dir != NULL && strncmp(dir, rel, len) == 0 && (dir[len] == '\0' || dir[len] == '/'))
+        {
+            free(w->dirs[i].rel);
+            w->dirs[i].rel = NULL;
+        }
+    }
+    if (dfs_index_remove_tree(w->idx, rel) > 0)
+    {
+        dfs_tar_cache_invalidate(w->cache);
+    }
+}
+
+// Function to catch up after the kernel dropped events
+// Stats every watched directory and re-reads only those whose modification time moved, which
+// covers every file added, removed or renamed; files there are also looked at again.
+static inline void dfs_watch_rescan(struct dfs_watch *w)
+{
+    fprintf(stderr, "WARNING: inotify queue overflowed under %s; rescanning changed folders\n", w->idx->root);
+    for (int i = 0; i < w->ndirs; i++)
+    {
+        if (w->dirs[i].rel == NULL) continue;
+
+        char path[DFS_WALK_PATH_LEN * 2];
+        char *rel = strdup(w->dirs[i].rel);
+        if (rel == NULL) continue;
+        snprintf(path, sizeof(path), "%s%s", w->idx->root, rel);
+        int64_t mtime_ns = dfs_watch_mtime(path);
+        if (mtime_ns < 0)
+        {
+            dfs_watch_forget(w, rel); // Gone, or moved somewhere its parent's re-read will find
+        }
+        else if (mtime_ns != w->dirs[i].mtime_ns)
+        {
+            struct dfs_watch_names subdirs = { 0 };
+            w->dirs[i].mtime_ns = mtime_ns;
+            dfs_watch_sync_dir(w, rel, 1, &subdirs);
+
+            // Subdirectories that appeared meanwhile are followed from now on
+            for (size_t j = 0; j < subdirs.count; j++)
+            {
+                char child[DFS_INDEX_KEY_MAX];
+                if (snprintf(child, sizeof(child), "%s/%s", rel, subdirs.names[j]) >= (int)sizeof(child)) continue;
+                if (!dfs_watch_known(w, child)) dfs_watch_tree(w, child, 1);
+            }
+            dfs_watch_names_free(&subdirs);
+        }
+        free(rel);
+    }
+}
+
+// Function to apply one event to the index
+static inline void dfs_watch_event(struct dfs_watch *w, const struct inotify_event *ev)
+{
+    if (ev->mask & IN_Q_OVERFLOW)
+    {
+        dfs_watch_rescan(w);
+        return;
+    }
+    if (ev->wd < 0 || ev->wd >= w->ndirs || w->dirs[ev->wd].rel == NULL) return; // Not followed (any more)
+    if (ev->mask & IN_IGNORED)
+    {
+        free(w->dirs[ev->wd].rel); // The directory itself is gone
+        w->dirs[ev->wd].rel = NULL;
+        return;
+    }
+    if (ev->len == 0) return;
+
+    char key[DFS_INDEX_KEY_MAX];
+    if (snprintf(key, sizeof(key), "%s/%s", w->dirs[ev->wd].rel, ev->name) >= (int)sizeof(key)) return;
+    if (ev->mask & IN_ISDIR)
+    {
+        if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+        {
+            dfs_watch_forget(w, key);
+        }
+        else if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+        {
+            dfs_watch_tree(w, key, 1);
+        }
+    }
+    else if (dfs_watch_wanted(w, ev->name))
+    {
+        dfs_watch_update(w, key);
+    }
+}
+
+// Function run by the watcher process: applies events to the index while the server runs
+static inline void dfs_watch_run(struct dfs_watch *w)
+{
+    char *buf = malloc(DFS_WATCH_BUFFER);
+    if (buf == NULL) return;
+
+    dfs_watch_tree(w, "", 0);
+    while (1)
+    {
+        ssize_t n = read(w->fd, buf, DFS_WATCH_BUFFER);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        for (char *p = buf; p < buf + n;)
+        {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            dfs_watch_event(w, ev);
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+    free(buf);
+}
+
+// Function to start the process that keeps the index current with outside changes
+// Must run in the main process before the workers are started, and after cache was set up with
+// dfs_tar_cache_init(); the watcher exits with the server. Does nothing if the index is disabled
+// or DFS_INDEX_WATCH=0.
+static inline void dfs_watch_start(struct dfs_index *idx, struct dfs_tar_cache *cache)
+{
+    const char *value = getenv("DFS_INDEX_WATCH");
+    if (!dfs_index_usable(idx) || (value != NULL && atoi(value) == 0)) return;
+
+    pid_t pid = fork();
+    if (pid != 0) return;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1) _exit(0);
+
+    struct dfs_watch w;
+    memset(&w, 0, sizeof(w));
+    w.idx = idx;
+    w.cache = cache;
+    w.fd = inotify_init1(IN_CLOEXEC);
+    if (w.fd < 0)
+    {
+        perror("ERROR starting the index watcher");
+        _exit(1);
+    }
+    dfs_watch_run(&w);
+    _exit(0);
+}
+
+#endif
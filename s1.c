@@ -1,845 +1,3578 @@
-// Distributed File System - S1 Server Implementation
-// This file implements the main server (S1) which interacts with the client and other servers (S2, S3, S4).
-// S1 handles .c files locally and forwards other file types to the appropriate servers.
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/socket.h> // for socket()
-#include <netinet/in.h> // for sockaddr_in
-#include <netdb.h> // for gethostbyname()
-#include <arpa/inet.h> // for inet_ntoa()
-#include <sys/stat.h> // for stat()
-#include <fcntl.h> // for open()
-#include <dirent.h> // for opendir()
-#include <libgen.h> // for basename()
-#include <sys/wait.h> // for waitpid()
-#include <sys/sendfile.h> // for sendfile()
-#include <time.h> // for time()
-#include <errno.h> // for errno
-
-#define PORT 4307 // S1 server port
-#define MAX_CLIENTS 5 // Maximum number of clients
-#define BUFFER_SIZE 1024 // Buffer size for file transfer
-#define MAX_PATH_LEN 1024 // Maximum path length
-
-// Server ports for S2, S3, S4
-#define S2_PORT 4308
-#define S3_PORT 4309
-#define S4_PORT 4310
-
-// Function prototypes
-void handle_client(int client_sock);
-int upload_file(int client_sock, char *filename, char *dest_path);
-int download_file(int client_sock, char *filename);
-int remove_file(int client_sock, char *filename);
-int download_tar(int client_sock, char *filetype);
-int display_filenames(int client_sock, char *pathname);
-int send_to_server(int port, char *command, char *response);
-int create_directory_tree(char *path);
-void error(const char *msg);
-
-// Main function initializes the server and listens for client connections.
-// It creates a child process for each client to handle requests concurrently.
-int main() 
-{
-    // Create socket
-    int sockfd, newsockfd;
-    socklen_t clilen;
-    struct sockaddr_in serv_addr, cli_addr;
-    pid_t pid;
-
-    // Create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) 
-    {
-        error("ERROR opening socket");
-    }
-
-    // Initialize socket structure
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(PORT);
-
-    // Bind the host address
-    if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) 
-    {
-        error("ERROR on binding");
-    }
-
-    // Start listening for the clients
-    listen(sockfd, MAX_CLIENTS);
-    clilen = sizeof(cli_addr);
-
-    // Print server start message
-    printf("S1 (MAIN SERVER) started on port %d\n", PORT);
-
-    // Main loop to accept clients
-    while (1) 
-    {
-        // Accept connection from client
-        newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
-        if (newsockfd < 0) {
-            error("ERROR on accept");
-        }
-
-        // Create child process to handle client
-        pid = fork();
-        if (pid < 0) 
-        {
-            error("ERROR on fork");
-        }
-
-        if (pid == 0) 
-        {
-            // Child process
-            close(sockfd);
-            handle_client(newsockfd);
-            close(newsockfd);
-            exit(0);
-        } 
-
-        else 
-        {
-            // Parent process
-            close(newsockfd);
-            // Clean up zombie processes
-            while (waitpid(-1, NULL, WNOHANG) > 0);
-        }
-    }
-
-    close(sockfd); // Close the socket
-    return 0;
-}
-
-// Function to handle client requests
-// Parses the command received from the client and calls the appropriate function.
-void handle_client(int client_sock) 
-{
-    char buffer[BUFFER_SIZE]; // Buffer for commands
-    int n;
-    
-    // Read command from client
-    bzero(buffer, BUFFER_SIZE);
-    n = read(client_sock, buffer, BUFFER_SIZE - 1);
-    if (n < 0) 
-    {
-        error("ERROR reading from socket");
-    }
-    
-    printf("Received command: %s\n", buffer);
-    
-    // Parse command
-    char *cmd = strtok(buffer, " ");
-    if (cmd == NULL) 
-    {
-        write(client_sock, "ERROR: Invalid command", 22);
-        return;
-    }
-    
-    if (strcmp(cmd, "uploadf") == 0) 
-    {
-        // Handle file upload
-        char *filename = strtok(NULL, " ");
-        char *dest_path = strtok(NULL, " ");
-        if (filename == NULL || dest_path == NULL) 
-        {
-            write(client_sock, "ERROR: Invalid uploadf command format", 36);
-            return;
-        }
-        upload_file(client_sock, filename, dest_path);
-    } 
-    else if (strcmp(cmd, "downlf") == 0) 
-    {
-        // Handle file download
-        char *filename = strtok(NULL, " ");
-        if (filename == NULL) 
-        {
-            write(client_sock, "ERROR: Invalid downlf command format", 34);
-            return;
-        }
-        download_file(client_sock, filename);
-    } 
-    else if (strcmp(cmd, "removef") == 0) 
-    {
-        // Handle file removal
-        char *filename = strtok(NULL, " ");
-        if (filename == NULL) 
-        {
-            write(client_sock, "ERROR: Invalid removef command format", 35);
-            return;
-        }
-        remove_file(client_sock, filename);
-    } 
-    else if (strcmp(cmd, "downltar") == 0) 
-    {
-        // Handle tar file download
-        char *filetype = strtok(NULL, " ");
-        if (filetype == NULL) 
-        {
-            write(client_sock, "ERROR: Invalid downltar command format", 36);
-            return;
-        }
-        download_tar(client_sock, filetype);
-    } 
-    else if (strcmp(cmd, "dispfnames") == 0) 
-    {
-        // Handle display filenames request
-        char *pathname = strtok(NULL, " ");
-        if (pathname == NULL) 
-        {
-            write(client_sock, "ERROR: Invalid dispfnames command format", 38);
-            return;
-        }
-        display_filenames(client_sock, pathname);
-    } 
-    else 
-    {
-        // Handle unknown command
-        write(client_sock, "ERROR: Unknown command", 21);
-    }
-}
-
-// Function to upload a file to S1 or forward it to the appropriate server
-// Receives the file from the client and determines its type based on the extension.
-int upload_file(int client_sock, char *filename, char *dest_path) 
-{
-    // First, receive the file from client
-    char buffer[BUFFER_SIZE];
-    int n;
-    
-    // Send acknowledgment to client to start sending file
-    write(client_sock, "READY", 5);
-    
-    // Get file size
-    off_t file_size;
-    read(client_sock, &file_size, sizeof(off_t));
-    
-    // Determine file type
-    char *ext = strrchr(filename, '.');
-    if (ext == NULL) 
-    {
-        write(client_sock, "ERROR: File has no extension", 27);
-        return -1;
-    }
-    
-    // Create destination path in S1
-    char s1_path[MAX_PATH_LEN];
-    snprintf(s1_path, MAX_PATH_LEN, "%s/S1%s", getenv("HOME"), dest_path + 3); // +3 to skip "~S1"
-    
-    // Create directory tree if needed
-    if (create_directory_tree(s1_path) < 0) 
-    {
-        write(client_sock, "ERROR: Failed to create directory", 32);
-        return -1;
-    }
-    
-    // Construct full file path
-    char *base_name = basename(filename);
-    char full_path[MAX_PATH_LEN];
-    snprintf(full_path, MAX_PATH_LEN, "%s/%s", s1_path, base_name);
-    
-    // Open file for writing
-    int fd = open(full_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0) 
-    {
-        write(client_sock, "ERROR: Failed to create file", 27);
-        return -1;
-    }
-    
-    // Receive file data
-    off_t remaining = file_size;
-    while (remaining > 0) 
-    {
-        n = read(client_sock, buffer, BUFFER_SIZE);
-        if (n <= 0) 
-        {
-            close(fd);
-            write(client_sock, "ERROR: File transfer failed", 27);
-            return -1;
-        }
-        write(fd, buffer, n);
-        remaining -= n;
-    }
-    close(fd);
-    
-    // Determine which server should handle this file
-    int target_port = 0;
-    if (strcmp(ext, ".c") == 0) 
-    {
-        // File stays in S1
-        write(client_sock, "SUCCESS: File uploaded to S1", 27);
-        return 0;
-    } 
-    else if (strcmp(ext, ".pdf") == 0) 
-    {
-        target_port = S2_PORT;
-    } 
-    else if (strcmp(ext, ".txt") == 0) 
-    {
-        target_port = S3_PORT;
-    } 
-    else if (strcmp(ext, ".zip") == 0) 
-    {
-        target_port = S4_PORT;
-    } 
-    else 
-    {
-        write(client_sock, "ERROR: Unsupported file type", 27);
-        return -1;
-    }
-    
-    // Forward file to appropriate server
-    char command[MAX_PATH_LEN * 2];
-    snprintf(command, MAX_PATH_LEN * 2, "uploadf %s %s", full_path, dest_path);
-    
-    char response[BUFFER_SIZE];
-    if (send_to_server(target_port, command, response) < 0) 
-    {
-        write(client_sock, "ERROR: Failed to forward file to target server", 44);
-        return -1;
-    }
-    
-    // Remove the file from S1 after forwarding
-    unlink(full_path);
-    
-    write(client_sock, response, strlen(response));
-    return 0;
-}
-
-// Function to download a file from S1 or request it from the appropriate server
-// Checks if the file exists in S1 and sends it to the client, or forwards the request to another server.
-int download_file(int client_sock, char *filename) 
-{
-    // Check if file exists in S1
-    char s1_path[MAX_PATH_LEN];
-    snprintf(s1_path, MAX_PATH_LEN, "%s/S1%s", getenv("HOME"), filename + 3); // +3 to skip "~S1"
-    
-    struct stat st;
-    if (stat(s1_path, &st) == 0) 
-    {
-        // File exists in S1 - send it directly
-        int fd = open(s1_path, O_RDONLY);
-        if (fd < 0) 
-        {
-            write(client_sock, "ERROR: Failed to open file", 25);
-            return -1;
-        }
-        
-        // Send file size
-        if (write(client_sock, &st.st_size, sizeof(off_t)) != sizeof(off_t)) 
-        {
-            close(fd);
-            write(client_sock, "ERROR: Failed to send file size", 31);
-            return -1;
-        }
-        
-        // Send file data
-        off_t remaining = st.st_size;
-        char buffer[BUFFER_SIZE];
-        while (remaining > 0) 
-        {
-            ssize_t n = read(fd, buffer, (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE);
-            if (n <= 0) 
-            {
-                close(fd);
-                write(client_sock, "ERROR: File transfer failed", 27);
-                return -1;
-            }
-            if (write(client_sock, buffer, n) != n) 
-            {
-                close(fd);
-                write(client_sock, "ERROR: File transfer failed", 27);
-                return -1;
-            }
-            remaining -= n;
-        }
-        close(fd);
-        return 0;
-    }
-    
-    // File not in S1 - forward to appropriate server
-    char *ext = strrchr(filename, '.');
-    int target_port = 0;
-    if (strcmp(ext, ".pdf") == 0) 
-    {
-        target_port = S2_PORT;
-    } 
-    else if (strcmp(ext, ".txt") == 0) 
-    {
-        target_port = S3_PORT;
-    } 
-    else if (strcmp(ext, ".zip") == 0) 
-    {
-        target_port = S4_PORT;
-    } 
-    else 
-    {
-        write(client_sock, "ERROR: Unsupported file type", 28);
-        return -1;
-    }
-    
-    // Forward request to target server
-    char command[BUFFER_SIZE];
-    snprintf(command, BUFFER_SIZE, "downlf %s", filename);
-    int sockfd;
-    struct sockaddr_in serv_addr;
-    struct hostent *server;
-
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) 
-    {
-        write(client_sock, "ERROR: Socket creation failed", 29);
-        return -1;
-    }
-
-    server = gethostbyname("localhost");
-    if (server == NULL) 
-    {
-        close(sockfd);
-        write(client_sock, "ERROR: Host resolution failed", 29);
-        return -1;
-    }
-
-    bzero((char *)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
-    serv_addr.sin_port = htons(target_port);
-
-    if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) 
-    {
-        close(sockfd);
-        write(client_sock, "ERROR: Connection to server failed", 34);
-        return -1;
-    }
-
-    // Send command to target server
-    if (write(sockfd, command, strlen(command)) < 0) 
-    {
-        close(sockfd);
-        write(client_sock, "ERROR: Command send failed", 26);
-        return -1;
-    }
-
-    // Read file size from target server
-    off_t filesize;
-    if (read(sockfd, &filesize, sizeof(off_t)) != sizeof(off_t)) 
-    {
-        close(sockfd);
-        write(client_sock, "ERROR: Failed to read file size", 31);
-        return -1;
-    }
-
-    // Send file size to client
-    if (write(client_sock, &filesize, sizeof(off_t)) != sizeof(off_t)) 
-    {
-        close(sockfd);
-        return -1;
-    }
-
-    // Relay file content from target server to client
-    off_t remaining = filesize;
-    char buffer[BUFFER_SIZE];
-    while (remaining > 0) 
-    {
-        ssize_t bytes_read = read(sockfd, buffer, sizeof(buffer));
-        if (bytes_read <= 0) break;
-        write(client_sock, buffer, bytes_read);
-        remaining -= bytes_read;
-    }
-
-    close(sockfd);
-    return 0;
-}
-
-// Function to remove a file from S1 or request its removal from another server
-// Determines the file's location based on its extension and sends the removal request.
-int remove_file(int client_sock, char *filename) 
-{
-    // Check if file exists in S1
-    char s1_path[MAX_PATH_LEN];
-    snprintf(s1_path, MAX_PATH_LEN, "%s/S1%s", getenv("HOME"), filename + 3); // +3 to skip "~S1"
-    
-    if (unlink(s1_path) == 0) 
-    {
-        write(client_sock, "SUCCESS: File deleted from S1", 28);
-        return 0;
-    }
-    
-    // File not in S1 - check other servers based on extension
-    char *ext = strrchr(filename, '.');
-    if (ext == NULL) 
-    {
-        write(client_sock, "ERROR: File has no extension", 27);
-        return -1;
-    }
-    
-    int target_port = 0;
-    if (strcmp(ext, ".pdf") == 0) 
-    {
-        target_port = S2_PORT;
-    } 
-    else if (strcmp(ext, ".txt") == 0) 
-    {
-        target_port = S3_PORT;
-    } 
-    else if (strcmp(ext, ".zip") == 0) 
-    {
-        target_port = S4_PORT;
-    } 
-    else 
-    {
-        write(client_sock, "ERROR: File not found", 21);
-        return -1;
-    }
-    
-    // Request deletion from appropriate server
-    char command[MAX_PATH_LEN];
-    snprintf(command, MAX_PATH_LEN, "removef %s", filename);
-    
-    char response[BUFFER_SIZE];
-    if (send_to_server(target_port, command, response) < 0) 
-    {
-        write(client_sock, "ERROR: Failed to delete file from target server", 45);
-        return -1;
-    }
-    
-    write(client_sock, response, strlen(response));
-    return 0;
-}
-
-// Function to download a tar file containing files of a specific type
-// Handles .c files locally and forwards requests for other file types to the appropriate server.
-int download_tar(int client_sock, char *filetype) 
-{
-    if (strcmp(filetype, ".c") == 0) 
-    {
-        // Handle .c files in S1
-        char s1_dir[MAX_PATH_LEN];
-        snprintf(s1_dir, MAX_PATH_LEN, "%s/S1", getenv("HOME"));
-
-        // Find all .c files recursively and tar them
-        char find_cmd[MAX_PATH_LEN * 2];
-        snprintf(find_cmd, sizeof(find_cmd), "find %s -type f -name \"*.c\" | tar -cf /tmp/cfiles.tar -T -", s1_dir);
-
-        if (system(find_cmd) != 0) 
-        {
-            write(client_sock, "ERROR: Failed to create tar file", 32);
-            return -1;
-        }
-
-        // Send tar file to client
-        struct stat st;
-        if (stat("/tmp/cfiles.tar", &st) != 0) 
-        {
-            write(client_sock, "ERROR: Tar file not found", 25);
-            return -1;
-        }
-
-        int fd = open("/tmp/cfiles.tar", O_RDONLY);
-        if (fd < 0) 
-        {
-            write(client_sock, "ERROR: Failed to open tar file", 30);
-            return -1;
-        }
-
-        // Send file size
-        write(client_sock, &st.st_size, sizeof(off_t));
-
-        // Send file data
-        off_t remaining = st.st_size;
-        while (remaining > 0) 
-        {
-            ssize_t sent = sendfile(client_sock, fd, NULL, remaining);
-            if (sent <= 0) 
-            {
-                close(fd);
-                write(client_sock, "ERROR: File transfer failed", 28);
-                return -1;
-            }
-            remaining -= sent;
-        }
-        close(fd);
-
-        // Clean up
-        unlink("/tmp/cfiles.tar");
-        return 0;
-
-    } 
-    else if (strcmp(filetype, ".pdf") == 0 || strcmp(filetype, ".txt") == 0) 
-    {
-        // Handle .pdf and .txt files from other servers
-        int target_port = (strcmp(filetype, ".pdf") == 0) ? S2_PORT : S3_PORT;
-
-        char command[BUFFER_SIZE];
-        snprintf(command, BUFFER_SIZE, "downltar %s", filetype);
-
-        int sockfd;
-        struct sockaddr_in serv_addr;
-        struct hostent *server;
-
-        sockfd = socket(AF_INET, SOCK_STREAM, 0);
-        if (sockfd < 0) 
-        {
-            write(client_sock, "ERROR: Socket creation failed", 29);
-            return -1;
-        }
-
-        server = gethostbyname("localhost");
-        if (server == NULL) 
-        {
-            close(sockfd);
-            write(client_sock, "ERROR: Host resolution failed", 29);
-            return -1;
-        }
-
-        bzero((char *)&serv_addr, sizeof(serv_addr));
-        serv_addr.sin_family = AF_INET;
-        bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
-        serv_addr.sin_port = htons(target_port);
-
-        if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) 
-        {
-            close(sockfd);
-            write(client_sock, "ERROR: Connection to server failed", 34);
-            return -1;
-        }
-
-        // Send command to target server
-        if (write(sockfd, command, strlen(command)) < 0) 
-        {
-            close(sockfd);
-            write(client_sock, "ERROR: Command send failed", 26);
-            return -1;
-        }
-
-        // Read tar file size
-        off_t filesize;
-        if (read(sockfd, &filesize, sizeof(off_t)) != sizeof(off_t)) 
-        {
-            close(sockfd);
-            write(client_sock, "ERROR: Failed to read file size", 31);
-            return -1;
-        }
-
-        // Send file size to client
-        write(client_sock, &filesize, sizeof(off_t));
-
-        // Relay tar file content from target server to client
-        off_t remaining = filesize;
-        char buffer[1024];
-        while (remaining > 0) 
-        {
-            ssize_t bytes_read = read(sockfd, buffer, sizeof(buffer));
-            if (bytes_read <= 0) break;
-            write(client_sock, buffer, bytes_read);
-            remaining -= bytes_read;
-        }
-
-        close(sockfd);
-        return 0;
-    } 
-    else 
-    {
-        write(client_sock, "ERROR: Unsupported file type for tar", 36);
-        return -1;
-    }
-}
-
-// Function to display filenames from S1 and other servers
-// Recursively lists files in S1 and sends requests to other servers for their file lists.
-int display_filenames(int client_sock, char *pathname) 
-{
-    // Get the corresponding path in S1
-    char s1_path[MAX_PATH_LEN];
-    snprintf(s1_path, MAX_PATH_LEN, "%s/S1%s", getenv("HOME"), 
-             (strcmp(pathname, "~S1") == 0) ? "" : (pathname + 3)); // Handle root case
-
-    // Check if path exists and is a directory
-    struct stat st;
-    if (stat(s1_path, &st) != 0 || !S_ISDIR(st.st_mode)) 
-    {
-        write(client_sock, "ERROR: Invalid directory path", 29);
-        return -1;
-    }
-
-    // Get files from S1 (.c files) recursively
-    char file_list[BUFFER_SIZE] = {0};
-    DIR *dir;
-    struct dirent *ent;
-
-    // Function to recursively list files
-    void list_files_recursive(const char *base_path, const char *relative_path) 
-    {
-        char path[MAX_PATH_LEN];
-        struct dirent *dp;
-        DIR *dir = opendir(base_path);
-
-        if (!dir) return;
-
-        while ((dp = readdir(dir)) != NULL) 
-        {
-            if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
-                continue;
-
-            snprintf(path, MAX_PATH_LEN, "%s/%s", base_path, dp->d_name);
-
-            char new_relative_path[MAX_PATH_LEN];
-            if (strcmp(relative_path, "") == 0) 
-            {
-                snprintf(new_relative_path, sizeof(new_relative_path), "%s", dp->d_name);
-            } 
-            else 
-            {
-                snprintf(new_relative_path, sizeof(new_relative_path), "%s/%s", relative_path, dp->d_name);
-            }
-
-            if (dp->d_type == DT_REG) {
-                char *ext = strrchr(dp->d_name, '.');
-                if (ext && strcmp(ext, ".c") == 0) 
-                {
-                    // Build ~S1-style path
-                    char output_path[MAX_PATH_LEN];
-                    snprintf(output_path, sizeof(output_path), "~S1/%s", new_relative_path);
-                    strncat(file_list, output_path, BUFFER_SIZE - strlen(file_list) - 1);
-                    strncat(file_list, "\n", BUFFER_SIZE - strlen(file_list) - 1);
-                }
-            } 
-            else if (dp->d_type == DT_DIR) 
-            {
-                list_files_recursive(path, new_relative_path);
-            }
-        }
-        closedir(dir);
-    }
-
-    // Start recursive traversal from the base path
-    list_files_recursive(s1_path, "");
-
-    // Get files from other servers
-    char command[MAX_PATH_LEN];
-    snprintf(command, MAX_PATH_LEN, "dispfnames %s", pathname);
-    char response[BUFFER_SIZE];
-
-    // Get PDF files from S2
-    if (send_to_server(S2_PORT, command, response) == 0) 
-    {
-        strncat(file_list, response, BUFFER_SIZE - strlen(file_list) - 1);
-    }
-
-    // Get TXT files from S3
-    if (send_to_server(S3_PORT, command, response) == 0) 
-    {
-        strncat(file_list, response, BUFFER_SIZE - strlen(file_list) - 1);
-    }
-
-    // Get ZIP files from S4
-    if (send_to_server(S4_PORT, command, response) == 0) 
-    {
-        strncat(file_list, response, BUFFER_SIZE - strlen(file_list) - 1);
-    }
-
-    // Send the combined list to client
-    write(client_sock, file_list, strlen(file_list));
-    return 0;
-}
-
-// Function to send a command to another server and receive its response
-// Establishes a connection to the target server, sends the command, and reads the response.
-int send_to_server(int port, char *command, char *response) 
-{
-    int sockfd;
-    struct sockaddr_in serv_addr;
-    struct hostent *server;
-    
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) 
-    {
-        return -1;
-    }
-    
-    server = gethostbyname("localhost");
-    if (server == NULL) 
-    {
-        close(sockfd);
-        return -1;
-    }
-    
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
-    serv_addr.sin_port = htons(port);
-    
-    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) 
-    {
-        close(sockfd);
-        return -1;
-    }
-    
-    // Send command
-    if (write(sockfd, command, strlen(command)) < 0) 
-    {
-        close(sockfd);
-        return -1;
-    }
-    
-    // Read response
-    bzero(response, BUFFER_SIZE);
-    if (read(sockfd, response, BUFFER_SIZE - 1) < 0) 
-    {
-        close(sockfd);
-        return -1;
-    }
-    
-    close(sockfd);
-    return 0;
-}
-
-// Function to create a directory tree for a given path
-// Ensures that all intermediate directories in the path exist.
-int create_directory_tree(char *path) 
-{
-    char *p;
-    char tmp[MAX_PATH_LEN];
-    
-    snprintf(tmp, MAX_PATH_LEN, "%s", path);
-    
-    // Skip leading slash if present
-    if (tmp[0] == '/') 
-    {
-        p = tmp + 1;
-    } else {
-        p = tmp;
-    }
-    
-    // Create each directory in the path
-    while ((p = strchr(p, '/'))) 
-    {
-        *p = '\0';
-        if (mkdir(tmp, 0755) && errno != EEXIST) 
-        {
-            return -1;
-        }
-        *p = '/';
-        p++;
-    }
-    
-    // Create the final directory
-    if (mkdir(tmp, 0755) && errno != EEXIST) 
-    {
-        return -1;
-    }
-    
-    return 0;
-}
-
-// Function to handle errors
-// Prints the error message and exits the program.
-void error(const char *msg) 
-{
-    perror(msg);
-    exit(1);
+// Distributed File System - S1 Server Implementation
+// This file implements the main server (S1) which interacts with the client and other servers (S2, S3, S4).
+// S1 handles .c files locally and forwards other file types to the servers its routing table names.
+
+#define _GNU_SOURCE // for accept4(), splice() and sched_setaffinity()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h> // for socket()
+#include <netinet/in.h> // for sockaddr_in
+#include <netdb.h> // for gethostbyname()
+#include <arpa/inet.h> // for inet_ntoa()
+#include <sys/stat.h> // for stat()
+#include <fcntl.h> // for open()
+#include <dirent.h> // for opendir()
+#include <libgen.h> // for basename()
+#include <sys/wait.h> // for waitpid()
+#include <sys/sendfile.h> // for sendfile()
+#include <time.h> // for time()
+#include <errno.h> // for errno
+#include <signal.h> // for sigprocmask()
+#include <sys/epoll.h> // for epoll_create1()
+#include <sys/signalfd.h> // for signalfd()
+#include <sys/resource.h> // for setrlimit()
+#include <sys/prctl.h> // for prctl()
+#include <sched.h> // for sched_setaffinity()
+#include <stdint.h> // for uint32_t
+#include <netinet/tcp.h> // for TCP_NODELAY
+#include <poll.h> // for poll()
+#include <sys/mman.h> // for mmap()
+#include "dfs_protocol.h" // for the wire protocol
+#include "dfs_listing.h" // for paged directory listings
+#include "dfs_index.h" // for the in-memory path index
+#include "dfs_watch.h" // for following outside changes to the index
+#include "dfs_directory.h" // for the namespace directory of remote files
+#include "dfs_routes.h" // for the servers each file type is spread over
+#include "dfs_token.h" // for tokens that let clients reach the backends directly
+#include "dfs_checksum.h" // for verifying files moved between instances
+#include "dfs_tar.h" // for streaming tar archives
+#include "dfs_gzip.h" // for compressed tar archives
+#include <pthread.h> // for pthread_create()
+
+#define PORT 4307 // S1 server port
+#define MAX_CLIENTS 4096 // Listen backlog of each worker
+#define BUFFER_SIZE 1024 // Buffer size for file transfer
+#define MAX_PATH_LEN 1024 // Maximum path length
+#define RELAY_BUFFER_SIZE 65536 // Chunk size when streaming between sockets
+#define SPLICE_PIPE_SIZE (1024 * 1024) // Pipe capacity used for zero-copy relays
+#define SPLICE_MIN_SIZE 65536 // Smaller transfers are copied; a pipe costs more than it saves
+#define MAX_EVENTS 256 // Events handled per epoll_wait() call
+#define MAX_WORKERS 256 // Upper bound on the worker pool size
+#define DEFAULT_IDLE_TIMEOUT 60 // Seconds a client session may stay idle (DFS_IDLE_TIMEOUT)
+#define DEFAULT_LIST_DEADLINE_MS 2000 // Milliseconds the backends get to answer a listing (DFS_LIST_DEADLINE_MS)
+#define DEFAULT_REDIRECT_TTL 30 // Seconds a redirect token stays valid; 0 turns redirects off (DFS_REDIRECT_TTL)
+#define DEFAULT_REBALANCE_SECS 60 // Seconds between passes moving misplaced files; 0 turns them off (DFS_REBALANCE_SECS)
+#define DEFAULT_REBALANCE_MBPS 50 // Megabytes per second moving files may use (DFS_REBALANCE_MBPS)
+#define REBALANCE_GRACE_SECS 1 // Seconds a moved file's old copy outlives any redirect to it
+#define REBALANCE_PENDING 64 // Old copies waiting out their grace period at once
+#define REPLICA_RETRY_SECS 5 // Seconds a replica that could not be reached is passed over
+#define REPLICA_STALL_SECS 5 // Seconds a replica may take to take in data or start an answer
+#define REPLICA_MAX_LAG (4 * 1024 * 1024) // Bytes of an upload a replica may fall behind the others
+#define REPLICA_LAG_MS 1000 // Milliseconds a replica that far behind may hold the others back
+
+// Routing table used without DFS_ROUTES: one instance each of S2, S3 and S4
+#define DEFAULT_ROUTES ".pdf S2@localhost:4308\n" \
+                       ".txt S3@localhost:4309\n" \
+                       ".zip S4@localhost:4310\n"
+
+// Connection pool settings for S1 -> S2/S3/S4 traffic
+#define POOL_MAX_IDLE 8 // Idle connections kept per backend
+#define POOL_IDLE_TIMEOUT 30 // Seconds before an idle connection is closed
+#define POOL_AUTH_TIMEOUT 5 // Seconds a new connection's backend may take to accept it
+#define INLINE_TIMEOUT 10 // Seconds a request served inline may wait on its client or a backend
+#define DEFAULT_SECRET "dfs-shared-secret" // Used when DFS_SECRET is not set
+
+// Connection states for the event loop
+enum conn_state
+{
+    CONN_READ_HEADER, // Waiting for the client's request header
+    CONN_READ_ARGS, // Waiting for the request's argument block
+    CONN_DISPATCH, // Request is complete and ready to run
+    CONN_DONE // Connection can be closed
+};
+
+// Per-connection state tracked by the event loop
+struct conn
+{
+    int fd; // Client socket
+    enum conn_state state; // Current state
+    size_t len; // Bytes of the current header or argument block received so far
+    unsigned char header[DFS_HEADER_SIZE]; // Raw request header
+    char *args; // Argument block of the current request
+    struct dfs_request req; // Decoded request
+    time_t last_active; // When the client last sent data
+    struct conn *prev, *next; // Neighbours in the list of open connections
+};
+
+// Open client connections, least recently active first
+struct conn *conn_head = NULL;
+struct conn *conn_tail = NULL;
+int loop_listener = -1; // This worker's listening socket
+int loop_epfd = -1; // This worker's epoll instance
+int loop_sigfd = -1; // This worker's SIGCHLD descriptor
+int idle_timeout = DEFAULT_IDLE_TIMEOUT; // Seconds before an idle client session is closed
+int list_deadline_ms = DEFAULT_LIST_DEADLINE_MS; // Milliseconds the backends get to answer a listing
+int redirect_ttl = DEFAULT_REDIRECT_TTL; // Seconds a redirect token stays valid, 0 if redirects are off
+const char *redirect_host = NULL; // Backend host as clients reach it, if not the one in the routing table
+struct dfs_routes routes; // Which servers hold each file type
+struct dfs_tar_cache tar_cache; // Cached archive of the .c files
+struct dfs_index path_index; // Index of the .c files, shared by all processes
+struct dfs_directory directory; // Where every remote file lives, shared by all processes
+struct rebalancer rebalancer; // Used by the rebalancing process only
+struct backend_load *loads; // Indexed by server number, shared by all processes
+struct timeval io_timeout = { 0, 0 }; // Send and receive timeout of sockets the running request uses
+
+// Idle connection kept in the pool
+struct pooled_conn
+{
+    int fd; // Authenticated socket to the backend
+    time_t last_used; // When the connection was last returned
+};
+
+// Idle connections to one backend, oldest first
+struct backend_pool
+{
+    int nidle; // Number of idle connections
+    struct pooled_conn idle[POOL_MAX_IDLE];
+};
+
+// Progress of a listing request sent to one backend
+enum list_state
+{
+    LIST_SKIPPED, // Not asked for this page
+    LIST_PENDING, // Waiting for the reply
+    LIST_DONE, // Reply received in full
+    LIST_FAILED, // Backend unreachable or the connection broke
+    LIST_TIMED_OUT // No complete reply before the deadline
+};
+
+// Listing request outstanding at one backend during a scatter-gather
+struct list_part
+{
+    int server; // Backend's server number
+    const char *name; // Backend name used in warnings
+    struct dfs_request req; // Request sent to the backend
+    char share[16]; // Page size asked of the backend
+    enum list_state state; // Current progress
+    int fd; // Pooled connection, -1 when not held
+    int reused; // Whether fd came from the pool (and may be retried once)
+    int authenticating; // Whether the next reply answers the AUTH sent on a new connection
+    unsigned char raw[DFS_HEADER_SIZE]; // Raw reply header
+    size_t got; // Header bytes received so far
+    struct dfs_header hdr; // Decoded reply header
+    char args[DFS_MAX_ARG_LEN + 1]; // Reply message (and cursor), NUL-terminated
+    uint32_t arg_got; // Message bytes received so far
+    char *data; // Reply payload, NUL-terminated once complete
+    size_t len; // Payload bytes received so far
+};
+
+// One backend's share of a unified archive ("downltar all")
+struct tar_share
+{
+    int server; // Backend's server number
+    int fd; // Pooled connection, -1 when not held
+    int reused; // Whether fd came from the pool (and may be retried once)
+    struct dfs_header hdr; // Reply header
+    char message[BUFFER_SIZE]; // Reply message
+};
+
+// Merge of a unified archive run on a second thread while the main one compresses it
+struct tar_merge_job
+{
+    int out; // Write end of the pipe to the compressor
+    int client_sock; // Shut down if the merge fails, so a cut-short archive is never taken as whole
+    struct dfs_tar_stream *streams;
+    int nstreams;
+    int result;
+};
+
+// Old copy of a moved file, removed once the reads sent to it before the move are over
+struct rebalance_removal
+{
+    int server;
+    char path[MAX_PATH_LEN];
+    char checksum[DFS_CHECKSUM_MAX]; // Removed only if it still has this checksum
+    time_t due; // When its grace period ends
+};
+
+// State of the process moving misplaced files
+struct rebalancer
+{
+    long rate; // Bytes per second copies may use
+    double allowance; // Bytes that may be sent now, at most one second's worth
+    struct timespec refilled; // When the allowance was last topped up
+    struct rebalance_removal pending[REBALANCE_PENDING]; // Oldest first
+    int npending;
+};
+
+// How busy a backend is; shared by all processes, so reads go to the least-loaded replica
+struct backend_load
+{
+    int inflight; // Requests it is serving for S1 right now
+    time_t down_until; // Until when it is passed over, after it could not be reached
+};
+
+// Backend addresses (resolved once) and per-backend connection pools, by server number
+struct sockaddr_in backend_addrs[DFS_ROUTES_MAX_SERVERS];
+struct backend_pool pools[DFS_ROUTES_MAX_SERVERS];
+
+// Function prototypes
+int configured_workers();
+int configured_idle_timeout();
+int configured_list_deadline();
+int configured_redirect_ttl();
+int configured_rebalance_secs();
+long configured_rebalance_rate();
+int open_listener(int port);
+pid_t start_worker(int index, int *listeners, int nworkers);
+void pin_to_cpu(int index);
+void event_loop(int listen_sock);
+void accept_clients(int epfd, int listen_sock);
+void conn_touch(struct conn *c, time_t now);
+void conn_close(int epfd, struct conn *c);
+void conn_sweep(int epfd, time_t now);
+int next_timeout_ms(time_t now);
+void conn_on_readable(struct conn *c);
+int conn_parse_header(struct conn *c);
+void dispatch_request(struct conn *c);
+void run_request(struct conn *c);
+void serve_session(struct conn *c);
+void leave_event_loop(struct conn *keep);
+int is_bulk_request(const struct dfs_request *req);
+void handle_client(int client_sock, struct dfs_request *req);
+int upload_file(int client_sock, struct dfs_request *req, char *filename, char *dest_path);
+int stream_upload(int client_sock, struct dfs_request *req, const struct dfs_route *route, char *base_name, char *dest_path);
+int stream_upload_replicas(int client_sock, struct dfs_request *req, const struct dfs_route *route, char *base_name, char *dest_path);
+int download_file(int client_sock, struct dfs_request *req, char *filename);
+int remove_file(int client_sock, struct dfs_request *req, char *filename);
+int redirect_transfer(int client_sock, struct dfs_request *req);
+int download_tar(int client_sock, struct dfs_request *req, char *filetype);
+int download_tar_merged(int client_sock, struct dfs_request *req, const struct dfs_tar_filter *filter, int first, int count);
+int tar_share_start(struct tar_share *share, uint32_t request_id, int argc, char **argv);
+int tar_share_reply(struct tar_share *share, uint32_t request_id, int argc, char **argv);
+void *tar_merge_thread(void *arg);
+int display_filenames(int client_sock, struct dfs_request *req, char *pathname);
+int locate_file(const struct dfs_route *route, const char *path, int *known);
+int order_replicas(const struct dfs_route *route, int *order);
+int pick_replica(const struct dfs_route *route);
+void mark_replica(int server, int reachable);
+void drop_replica(int server, int *fd, const char *path, const char *reason);
+long monotonic_ms();
+int request_replica(int server, const struct dfs_request *req, struct dfs_header *reply);
+int forward_to_replica(const struct dfs_route *route, int client_sock, struct dfs_request *req);
+int remove_from_replicas(const struct dfs_route *route, int client_sock, struct dfs_request *req, char *filename);
+pid_t start_directory_sync();
+int sync_directory(int server);
+int sync_filter(int server);
+pid_t start_rebalancer();
+void rebalance_group(const struct dfs_route *route);
+int rebalance_file(const struct dfs_route *route, int from, const char *key);
+int rebalance_copy(int from, int to, char *path, char *checksum);
+void rebalance_throttle(size_t len);
+void rebalance_defer(int server, const char *path, const char *checksum);
+void rebalance_flush(int wait);
+int backend_checksum(int server, char *path, char *checksum);
+int backend_remove(int server, char *path, char *checksum);
+int fetch_from_backend(int server, uint8_t opcode, int argc, char **argv, char *message, char **payload, uint64_t *length);
+int forward_to_server(int server, int client_sock, struct dfs_request *req);
+int forward_reply(int sockfd, int client_sock, struct dfs_request *req, struct dfs_header *reply);
+int send_to_server(int server, const struct dfs_request *req, struct dfs_header *reply, char *response);
+int read_reply(int sockfd, struct dfs_header *reply, char *response, int *got_reply);
+int split_list_cursor(const char *cursor, char cursors[][DFS_MAX_CURSOR], int n);
+void join_list_cursor(char cursors[][DFS_MAX_CURSOR], int n, char *out, size_t size);
+int list_part_start(struct list_part *part);
+int list_part_read(struct list_part *part);
+void list_parts_gather(struct list_part *parts, int nparts, const struct timespec *start);
+void list_part_finish(struct list_part *part);
+int relay_stream(int from_sock, int to_sock, off_t len);
+int splice_stream(int from_sock, int to_sock, int pipefd[2], off_t len, off_t *taken);
+int copy_stream(int from_sock, int to_sock, off_t len);
+int resolve_backends();
+int connect_backend(int server);
+int pool_acquire(int server, int *reused);
+int pool_take(int server);
+void pool_release(int server, int sockfd);
+int pool_healthy(int sockfd);
+void pool_reap(time_t now);
+void pool_forget();
+const char *pool_secret();
+int create_directory_tree(char *path);
+void error(const char *msg);
+
+// Main function initializes the server and supervises its worker processes.
+// Every worker owns a SO_REUSEPORT listener pinned to a CPU and runs its own event loop.
+int main()
+{
+    // Raise the descriptor limit so one process can hold many connections
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // A peer that hangs up mid-transfer should fail the write, not kill the worker
+    signal(SIGPIPE, SIG_IGN);
+
+    // Read the routing table and resolve the backend hosts once; connections reuse the cached addresses
+    char reason[BUFFER_SIZE];
+    if (dfs_routes_load(&routes, getenv("DFS_ROUTES"), DEFAULT_ROUTES, PORT, reason, sizeof(reason)) < 0)
+    {
+        fprintf(stderr, "ERROR: Invalid routing table: %s\n", reason);
+        exit(1);
+    }
+    if (resolve_backends() < 0)
+    {
+        error("ERROR, no such host");
+    }
+
+    // Open one listener per worker up front so binding errors surface immediately
+    // and a respawned worker inherits the connections queued on its listener.
+    int nworkers = configured_workers();
+    idle_timeout = configured_idle_timeout();
+    list_deadline_ms = configured_list_deadline();
+    redirect_ttl = configured_redirect_ttl();
+    if (getenv("DFS_REDIRECT_HOST") != NULL)
+    {
+        redirect_host = getenv("DFS_REDIRECT_HOST");
+    }
+    char store_dir[MAX_PATH_LEN];
+    snprintf(store_dir, MAX_PATH_LEN, "%s/S1", getenv("HOME"));
+    dfs_index_init(&path_index, store_dir, ".c"); // Before the workers, who share it
+    if (dfs_tar_cache_init(&tar_cache, "cfiles", ".c", &path_index) < 0)
+    {
+        fprintf(stderr, "WARNING: Archive cache unavailable; every downltar plans its archive afresh\n");
+    }
+    dfs_watch_start(&path_index, &tar_cache); // Follows changes made to store_dir by other programs
+    dfs_directory_init(&directory, routes.nservers);
+    // An upload that ends as its token runs out still has one sync's time to be reported
+    directory.expect_secs = redirect_ttl + dfs_index_setting("DFS_DIRECTORY_SYNC_SECS", DFS_DIRECTORY_SYNC_SECS) + 1;
+    loads = mmap(NULL, DFS_ROUTES_MAX_SERVERS * sizeof(struct backend_load), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (loads == MAP_FAILED)
+    {
+        error("ERROR allocating backend load table");
+    }
+    for (int i = 0; i < routes.ntypes; i++)
+    {
+        if (routes.types[i].replicas > 1)
+        {
+            dfs_directory_mirror(&directory, routes.types[i].first, routes.types[i].count);
+        }
+    }
+    pid_t syncer = start_directory_sync(); // Fills the directory in from the backends and keeps it current
+    pid_t mover = start_rebalancer(); // Moves files the routing table now places on another instance
+    int *listeners = malloc(nworkers * sizeof(int));
+    pid_t *workers = malloc(nworkers * sizeof(pid_t));
+    if (listeners == NULL || workers == NULL)
+    {
+        error("ERROR allocating worker table");
+    }
+    for (int i = 0; i < nworkers; i++)
+    {
+        listeners[i] = open_listener(PORT);
+    }
+
+    // Print server start message
+    printf("S1 (MAIN SERVER) started on port %d with %d workers\n", PORT, nworkers);
+    fflush(stdout);
+
+    for (int i = 0; i < nworkers; i++)
+    {
+        workers[i] = start_worker(i, listeners, nworkers);
+    }
+
+    // Respawn workers that die, and the directory sync and the rebalancer, since without them
+    // the directory goes stale and misplaced files stay put; the listeners stay open in the supervisor
+    while (1)
+    {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+        {
+            if (errno == EINTR) continue;
+            error("ERROR waiting for workers");
+        }
+        for (int i = 0; i < nworkers; i++)
+        {
+            if (workers[i] == pid)
+            {
+                fprintf(stderr, "S1 worker %d (pid %d) exited, restarting\n", i, (int)pid);
+                sleep(1); // Avoid a tight crash loop
+                workers[i] = start_worker(i, listeners, nworkers);
+            }
+        }
+        if (pid == syncer)
+        {
+            fprintf(stderr, "S1 directory sync (pid %d) exited, restarting\n", (int)pid);
+            sleep(1);
+            syncer = start_directory_sync();
+        }
+        else if (pid == mover)
+        {
+            fprintf(stderr, "S1 rebalancer (pid %d) exited, restarting\n", (int)pid);
+            sleep(1);
+            mover = start_rebalancer();
+        }
+    }
+
+    return 0;
+}
+
+// Function to read the configured worker pool size
+// Uses DFS_WORKERS when set, otherwise one worker per online CPU.
+int configured_workers()
+{
+    char *env = getenv("DFS_WORKERS");
+    int n = (env != NULL) ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > MAX_WORKERS) n = MAX_WORKERS;
+    return n;
+}
+
+// Function to read how long a client session may stay idle
+// Uses DFS_IDLE_TIMEOUT (seconds) when set, otherwise DEFAULT_IDLE_TIMEOUT.
+int configured_idle_timeout()
+{
+    char *env = getenv("DFS_IDLE_TIMEOUT");
+    int secs = (env != NULL) ? atoi(env) : DEFAULT_IDLE_TIMEOUT;
+    return (secs > 0) ? secs : DEFAULT_IDLE_TIMEOUT;
+}
+
+// Function to read how long the backends get to answer a listing
+// Uses DFS_LIST_DEADLINE_MS (milliseconds) when set, otherwise DEFAULT_LIST_DEADLINE_MS.
+int configured_list_deadline()
+{
+    char *env = getenv("DFS_LIST_DEADLINE_MS");
+    int ms = (env != NULL) ? atoi(env) : DEFAULT_LIST_DEADLINE_MS;
+    return (ms > 0) ? ms : DEFAULT_LIST_DEADLINE_MS;
+}
+
+// Function to read how long redirect tokens stay valid
+// Uses DFS_REDIRECT_TTL (seconds) when set, otherwise DEFAULT_REDIRECT_TTL; 0 turns redirects off.
+int configured_redirect_ttl()
+{
+    char *env = getenv("DFS_REDIRECT_TTL");
+    int secs = (env != NULL) ? atoi(env) : DEFAULT_REDIRECT_TTL;
+    return (secs > 0) ? secs : 0;
+}
+
+// Function to read how often files placed on the wrong instance are moved
+// Uses DFS_REBALANCE_SECS (seconds) when set, otherwise DEFAULT_REBALANCE_SECS; 0 turns moving off.
+int configured_rebalance_secs()
+{
+    char *env = getenv("DFS_REBALANCE_SECS");
+    int secs = (env != NULL) ? atoi(env) : DEFAULT_REBALANCE_SECS;
+    return (secs > 0) ? secs : 0;
+}
+
+// Function to read how fast files may be moved between instances, in bytes per second
+// Uses DFS_REBALANCE_MBPS (megabytes per second) when set, otherwise DEFAULT_REBALANCE_MBPS.
+long configured_rebalance_rate()
+{
+    char *env = getenv("DFS_REBALANCE_MBPS");
+    long mbps = (env != NULL) ? atol(env) : DEFAULT_REBALANCE_MBPS;
+    return ((mbps > 0) ? mbps : DEFAULT_REBALANCE_MBPS) * 1024 * 1024;
+}
+
+// Function to open a non-blocking listening socket on the given port
+// SO_REUSEPORT lets every worker bind its own socket so the kernel spreads accepts across them.
+int open_listener(int port)
+{
+    int sockfd;
+    struct sockaddr_in serv_addr;
+
+    // Create socket
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sockfd < 0)
+    {
+        error("ERROR opening socket");
+    }
+
+    // Allow quick restarts and several listeners on the same port
+    int opt = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+    {
+        error("ERROR setting SO_REUSEPORT");
+    }
+
+    // Initialize socket structure
+    bzero((char *) &serv_addr, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(port);
+
+    // Bind the host address
+    if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
+    {
+        error("ERROR on binding");
+    }
+
+    // Start listening for the clients
+    if (listen(sockfd, MAX_CLIENTS) < 0)
+    {
+        error("ERROR on listen");
+    }
+    return sockfd;
+}
+
+// Function to fork a worker process for the given slot
+// The worker keeps only its own listener, pins itself to a CPU and runs the event loop.
+pid_t start_worker(int index, int *listeners, int nworkers)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        error("ERROR on fork");
+    }
+    if (pid > 0)
+    {
+        return pid;
+    }
+
+    // Worker process: exit together with the supervisor
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1)
+    {
+        exit(0);
+    }
+
+    for (int i = 0; i < nworkers; i++)
+    {
+        if (i != index) close(listeners[i]);
+    }
+    pin_to_cpu(index);
+    event_loop(listeners[index]);
+    exit(0);
+}
+
+// Function to pin the calling process to one of the CPUs it may run on
+// Workers are spread round-robin over the allowed CPU set.
+void pin_to_cpu(int index)
+{
+    cpu_set_t allowed, target;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    {
+        return;
+    }
+
+    int ncpus = CPU_COUNT(&allowed);
+    if (ncpus <= 0) return;
+    int wanted = index % ncpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        if (wanted-- == 0)
+        {
+            CPU_ZERO(&target);
+            CPU_SET(cpu, &target);
+            sched_setaffinity(0, sizeof(target), &target);
+            return;
+        }
+    }
+}
+
+// Function to run the epoll event loop
+// Accepts clients, collects their requests without blocking and dispatches complete ones.
+// Short requests run inline; bulk transfers are handed to a child process.
+void event_loop(int listen_sock)
+{
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        error("ERROR creating epoll instance");
+    }
+    loop_listener = listen_sock;
+    loop_epfd = epfd;
+
+    // Deliver SIGCHLD through a descriptor so children are reaped from the loop
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd < 0)
+    {
+        error("ERROR creating signalfd");
+    }
+    loop_sigfd = sigfd;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_sock;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_sock, &ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &sigfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1)
+    {
+        // Wake up in time to close idle sessions and idle pooled connections
+        int nready = epoll_wait(epfd, events, MAX_EVENTS, next_timeout_ms(time(NULL)));
+        if (nready < 0)
+        {
+            if (errno == EINTR) continue;
+            error("ERROR on epoll_wait");
+        }
+        time_t now = time(NULL);
+
+        for (int i = 0; i < nready; i++)
+        {
+            if (events[i].data.ptr == &listen_sock)
+            {
+                // Accept every pending connection
+                accept_clients(epfd, listen_sock);
+            }
+            else if (events[i].data.ptr == &sigfd)
+            {
+                // Drain pending signals and clean up zombie processes
+                struct signalfd_siginfo si;
+                while (read(sigfd, &si, sizeof(si)) == sizeof(si));
+                while (waitpid(-1, NULL, WNOHANG) > 0);
+            }
+            else
+            {
+                struct conn *c = events[i].data.ptr;
+                conn_on_readable(c);
+                if (c->state == CONN_DONE)
+                {
+                    conn_close(epfd, c);
+                }
+                else
+                {
+                    conn_touch(c, time(NULL));
+                }
+            }
+        }
+
+        // Only expire connections once this batch of events no longer refers to them
+        conn_sweep(epfd, now);
+        pool_reap(now);
+    }
+}
+
+// Function to accept all pending connections on the non-blocking listener
+// Each new client gets its own connection state and is registered edge-triggered.
+void accept_clients(int epfd, int listen_sock)
+{
+    while (1)
+    {
+        int newsockfd = accept4(listen_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newsockfd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("ERROR on accept");
+            }
+            return;
+        }
+
+        // Responses are small frames written back to back on a session; do not let
+        // Nagle hold one back until the previous one is acknowledged
+        int opt = 1;
+        setsockopt(newsockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+        struct conn *c = calloc(1, sizeof(struct conn));
+        if (c == NULL)
+        {
+            close(newsockfd);
+            continue;
+        }
+        c->fd = newsockfd;
+        c->state = CONN_READ_HEADER;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, newsockfd, &ev) < 0)
+        {
+            close(newsockfd);
+            free(c);
+            continue;
+        }
+        conn_touch(c, time(NULL));
+    }
+}
+
+// Function to record activity on a connection
+// Moves it to the tail of the connection list, which therefore stays ordered by last activity.
+void conn_touch(struct conn *c, time_t now)
+{
+    c->last_active = now;
+    if (conn_tail == c) return;
+
+    // Unlink (a new connection is not linked yet)
+    if (c->prev != NULL) c->prev->next = c->next;
+    if (c->next != NULL) c->next->prev = c->prev;
+    if (conn_head == c) conn_head = c->next;
+
+    c->prev = conn_tail;
+    c->next = NULL;
+    if (conn_tail != NULL) conn_tail->next = c;
+    conn_tail = c;
+    if (conn_head == NULL) conn_head = c;
+}
+
+// Function to close a connection and release its state
+// A forked child may still hold the socket, so it is deregistered from epoll explicitly.
+void conn_close(int epfd, struct conn *c)
+{
+    if (c->prev != NULL) c->prev->next = c->next;
+    if (c->next != NULL) c->next->prev = c->prev;
+    if (conn_head == c) conn_head = c->next;
+    if (conn_tail == c) conn_tail = c->prev;
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->args);
+    free(c);
+}
+
+// Function to close client sessions that have been idle for too long
+// The list is ordered by last activity, so expired connections are at the front.
+void conn_sweep(int epfd, time_t now)
+{
+    while (conn_head != NULL && now - conn_head->last_active >= idle_timeout)
+    {
+        conn_close(epfd, conn_head);
+    }
+}
+
+// Function to compute how long epoll_wait() may sleep
+// Wakes up when the oldest session expires, and at least every POOL_IDLE_TIMEOUT seconds.
+int next_timeout_ms(time_t now)
+{
+    time_t wait = POOL_IDLE_TIMEOUT;
+    if (conn_head != NULL)
+    {
+        time_t left = conn_head->last_active + idle_timeout - now;
+        if (left < wait) wait = (left > 0) ? left : 0;
+    }
+    return (int)wait * 1000;
+}
+
+// Function to advance a connection's state machine when its socket becomes readable
+// Reads until the socket is drained (edge-triggered) and dispatches each request once its
+// header and arguments have arrived.
+void conn_on_readable(struct conn *c)
+{
+    while (c->state == CONN_READ_HEADER || c->state == CONN_READ_ARGS)
+    {
+        // Read exactly the header and then exactly the argument block, so an
+        // upload's payload is left in the socket for the handler
+        int in_header = (c->state == CONN_READ_HEADER);
+        size_t total = in_header ? DFS_HEADER_SIZE : c->req.hdr.arg_len;
+        char *dst = in_header ? (char *)c->header : c->args;
+
+        ssize_t n = read(c->fd, dst + c->len, total - c->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0)
+        {
+            // The client hung up or the socket failed
+            c->state = CONN_DONE;
+            return;
+        }
+        c->len += n;
+        if (c->len < total) continue;
+
+        c->len = 0;
+        if (in_header)
+        {
+            conn_parse_header(c);
+        }
+        else
+        {
+            c->state = CONN_DISPATCH;
+        }
+
+        // The session comes back here to pick up requests that are already queued
+        if (c->state == CONN_DISPATCH)
+        {
+            dispatch_request(c);
+        }
+    }
+}
+
+// Function to decode a complete request header and prepare for its arguments
+// A frame that is not DFS or announces an oversized argument block ends the connection.
+int conn_parse_header(struct conn *c)
+{
+    if (dfs_decode_header(c->header, &c->req.hdr) < 0)
+    {
+        dfs_send_status(c->fd, &c->req, DFS_EPROTO, "ERROR: Malformed request");
+        c->state = CONN_DONE;
+        return -1;
+    }
+
+    c->args = malloc(c->req.hdr.arg_len + 1);
+    if (c->args == NULL)
+    {
+        c->state = CONN_DONE;
+        return -1;
+    }
+    c->state = (c->req.hdr.arg_len > 0) ? CONN_READ_ARGS : CONN_DISPATCH;
+    return 0;
+}
+
+// Function to run a complete request for a connection
+// Short requests run inline and the session goes back to reading the next one. A bulk
+// transfer is handed to a child process, which then owns the session for good.
+void dispatch_request(struct conn *c)
+{
+    // The request handlers use blocking I/O on the client socket
+    int flags = fcntl(c->fd, F_GETFL, 0);
+    fcntl(c->fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    if (is_bulk_request(&c->req))
+    {
+        // Bulk transfers can take a long time, so they run in a child process
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("ERROR on fork");
+            dfs_reject(c->fd, &c->req, DFS_EIO, "ERROR: Server busy");
+        }
+        else if (pid == 0)
+        {
+            // Child process
+            sigset_t mask;
+            sigemptyset(&mask);
+            sigprocmask(SIG_SETMASK, &mask, NULL);
+            leave_event_loop(c);
+            pool_forget();
+            run_request(c);
+            serve_session(c);
+            close(c->fd);
+            exit(0);
+        }
+        free(c->args);
+        c->args = NULL;
+        c->state = CONN_DONE;
+        return;
+    }
+
+    // An inline request holds up every connection of this worker, so neither a slow client nor
+    // a stalled backend may keep it waiting for long
+    struct timeval wait = { INLINE_TIMEOUT, 0 }, none = { 0, 0 };
+    io_timeout = wait;
+    setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &wait, sizeof(wait));
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+    run_request(c);
+    io_timeout = none;
+    setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &none, sizeof(none));
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+
+    free(c->args);
+    c->args = NULL;
+    fcntl(c->fd, F_SETFL, flags | O_NONBLOCK);
+    c->state = CONN_READ_HEADER;
+}
+
+// Function to check a request's arguments and hand it to handle_client()
+void run_request(struct conn *c)
+{
+    c->req.argc = dfs_split_args(c->args, c->req.hdr.arg_len, c->req.argv, DFS_MAX_ARGS);
+    if (c->req.argc < 0)
+    {
+        dfs_reject(c->fd, &c->req, DFS_EINVAL, "ERROR: Malformed request arguments");
+        return;
+    }
+    handle_client(c->fd, &c->req);
+}
+
+// Function to let go of what a bulk child inherits from its worker, except the connection it serves
+// Left open, the listener would stay in the SO_REUSEPORT group after the worker dies and be handed
+// connections nobody accepts, and connections the worker closes would stay open for their peers.
+void leave_event_loop(struct conn *keep)
+{
+    close(loop_listener);
+    close(loop_epfd);
+    close(loop_sigfd);
+    for (struct conn *c = conn_head; c != NULL; c = c->next)
+    {
+        if (c != keep)
+        {
+            close(c->fd);
+        }
+    }
+}
+
+// Function to keep serving a session in a bulk child
+// The child owns the connection after its transfer, so it serves the client's later
+// requests itself with blocking I/O until the client hangs up or stays idle too long.
+void serve_session(struct conn *c)
+{
+    while (1)
+    {
+        struct pollfd pfd = { c->fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, idle_timeout * 1000);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) return;
+
+        if (dfs_read_full(c->fd, c->header, DFS_HEADER_SIZE) < 0)
+        {
+            return;
+        }
+        if (dfs_decode_header(c->header, &c->req.hdr) < 0)
+        {
+            dfs_send_status(c->fd, &c->req, DFS_EPROTO, "ERROR: Malformed request");
+            return;
+        }
+
+        c->args = malloc(c->req.hdr.arg_len + 1);
+        if (c->args == NULL || dfs_read_full(c->fd, c->args, c->req.hdr.arg_len) < 0)
+        {
+            return;
+        }
+        run_request(c);
+        free(c->args);
+        c->args = NULL;
+    }
+}
+
+// Function to decide whether a request should leave the event loop
+// File transfers are bulk; listings, removals and redirects are served inline.
+int is_bulk_request(const struct dfs_request *req)
+{
+    if (req->hdr.flags & DFS_FLAG_REDIRECT)
+    {
+        return 0;
+    }
+    return req->hdr.opcode == DFS_OP_UPLOAD || req->hdr.opcode == DFS_OP_DOWNLOAD ||
+           req->hdr.opcode == DFS_OP_TAR;
+}
+
+// Function to handle client requests
+// Checks the request's arguments and calls the appropriate function.
+void handle_client(int client_sock, struct dfs_request *req)
+{
+    printf("Received request %u: opcode %d", req->hdr.request_id, req->hdr.opcode);
+    for (int i = 0; i < req->argc; i++)
+    {
+        printf(" %s", req->argv[i]);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    if (req->hdr.opcode == DFS_OP_UPLOAD)
+    {
+        // Handle file upload; a redirected one gives the file's size instead of sending it
+        if (req->argc != ((req->hdr.flags & DFS_FLAG_REDIRECT) ? 3 : 2))
+        {
+            dfs_reject(client_sock, req, DFS_EINVAL, "ERROR: Invalid uploadf command format");
+            return;
+        }
+        if (req->hdr.flags & DFS_FLAG_REDIRECT)
+        {
+            redirect_transfer(client_sock, req);
+            return;
+        }
+        upload_file(client_sock, req, req->argv[0], req->argv[1]);
+    }
+    else if (req->hdr.opcode == DFS_OP_DOWNLOAD)
+    {
+        // Handle file download
+        if (req->argc != 1)
+        {
+            dfs_reject(client_sock, req, DFS_EINVAL, "ERROR: Invalid downlf command format");
+            return;
+        }
+        if (req->hdr.flags & DFS_FLAG_REDIRECT)
+        {
+            redirect_transfer(client_sock, req);
+            return;
+        }
+        download_file(client_sock, req, req->argv[0]);
+    }
+    else if (req->hdr.opcode == DFS_OP_REMOVE)
+    {
+        // Handle file removal
+        if (req->argc != 1)
+        {
+            dfs_reject(client_sock, req, DFS_EINVAL, "ERROR: Invalid removef command format");
+            return;
+        }
+        remove_file(client_sock, req, req->argv[0]);
+    }
+    else if (req->hdr.opcode == DFS_OP_TAR)
+    {
+        // Handle tar file download
+        if (req->argc < 1)
+        {
+            dfs_reject(client_sock, req, DFS_EINVAL, "ERROR: Invalid downltar command format");
+            return;
+        }
+        download_tar(client_sock, req, req->argv[0]);
+    }
+    else if (req->hdr.opcode == DFS_OP_LIST)
+    {
+        // Handle display filenames request (path, optional page size and cursor)
+        if (req->argc < 1 || req->argc > 3)
+        {
+            dfs_reject(client_sock, req, DFS_EINVAL, "ERROR: Invalid dispfnames command format");
+            return;
+        }
+        display_filenames(client_sock, req, req->argv[0]);
+    }
+    else
+    {
+        // Handle unknown request
+        dfs_reject(client_sock, req, DFS_EINVAL, "ERROR: Unknown command");
+    }
+}
+
+// Function to upload a file to S1 or stream it to the appropriate server
+// .c files are stored in S1; other types are piped to their backend while they arrive.
+int upload_file(int client_sock, struct dfs_request *req, char *filename, char *dest_path)
+{
+    // Determine file type
+    char *ext = strrchr(filename, '.');
+    if (ext == NULL)
+    {
+        dfs_reject(client_sock, req, DFS_EINVAL, "ERROR: File has no extension");
+        return -1;
+    }
+
+    // Determine which servers handle files of this type
+    char *base_name = basename(filename);
+    const struct dfs_route *route = dfs_routes_find(&routes, ext);
+    if (route == NULL)
+    {
+        dfs_reject(client_sock, req, DFS_EINVAL, "ERROR: Unsupported file type");
+        return -1;
+    }
+    else if (route->replicas > 1)
+    {
+        return stream_upload_replicas(client_sock, req, route, base_name, dest_path);
+    }
+    else if (route->first != 1)
+    {
+        return stream_upload(client_sock, req, route, base_name, dest_path);
+    }
+
+    // File stays in S1
+    char buffer[BUFFER_SIZE];
+    int n;
+
+    // Create destination path in S1
+    // A path cut short would store the file somewhere other than asked
+    char s1_path[MAX_PATH_LEN], full_path[MAX_PATH_LEN];
+    if (snprintf(s1_path, MAX_PATH_LEN, "%s/S1%s", getenv("HOME"), dest_path + 3) >= MAX_PATH_LEN || // +3 to skip "~S1"
+        snprintf(full_path, MAX_PATH_LEN, "%s/%s", s1_path, base_name) >= MAX_PATH_LEN)
+    {
+        dfs_reject(client_sock, req, DFS_EINVAL, "ERROR: Destination path too long");
+        return -1;
+    }
+
+    // Create directory tree if needed
+    if (create_directory_tree(s1_path) < 0)
+    {
+        dfs_reject(client_sock, req, DFS_EIO, "ERROR: Failed to create directory");
+        return -1;
+    }
+
+    // Open file for writing
+    int fd = open(full_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        dfs_reject(client_sock, req, DFS_EIO, "ERROR: Failed to create file");
+        return -1;
+    }
+
+    // Receive file data; the payload follows the request header directly
+    off_t remaining = req->hdr.length;
+    while (remaining > 0)
+    {
+        n = read(client_sock, buffer, (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            // The client gave up: drop the partial file
+            close(fd);
+            unlink(full_path);
+            dfs_index_update(&path_index, full_path);
+            dfs_tar_cache_invalidate(&tar_cache);
+            return -1;
+        }
+        if (dfs_write_full(fd, buffer, n) < 0)
+        {
+            close(fd);
+            unlink(full_path);
+            dfs_index_update(&path_index, full_path);
+            dfs_tar_cache_invalidate(&tar_cache);
+            dfs_discard(client_sock, remaining - n);
+            dfs_send_status(client_sock, req, DFS_EIO, "ERROR: File transfer failed");
+            return -1;
+        }
+        remaining -= n;
+    }
+    close(fd);
+    dfs_index_update(&path_index, full_path);
+    dfs_tar_cache_invalidate(&tar_cache);
+
+    dfs_send_status(client_sock, req, DFS_OK, "SUCCESS: File uploaded to S1");
+    return 0;
+}
+
+// Function to stream an upload from the client straight to a backend server
+// The request is forwarded with the same payload length and the payload is relayed as it
+// arrives, so S1 never stages the file; TCP backpressure on either socket paces the other side.
+// A file already stored is replaced where it is; a new one goes where the routing table places
+// it. Once the backend has stored it, the file is entered in the directory.
+int stream_upload(int client_sock, struct dfs_request *req, const struct dfs_route *route, char *base_name, char *dest_path)
+{
+    char path[MAX_PATH_LEN];
+    int known;
+    snprintf(path, MAX_PATH_LEN, "%s/%s", dest_path, base_name);
+    int server = locate_file(route, path, &known);
+
+    // Pooled connections are health-checked, but a payload cannot be replayed, so
+    // unlike short requests an upload is not retried on a second connection
+    int reused;
+    int sockfd = pool_acquire(server, &reused);
+    if (sockfd < 0)
+    {
+        dfs_reject(client_sock, req, DFS_EUNAVAIL, "ERROR: Connection to server failed");
+        return -1;
+    }
+
+    char *argv[] = { base_name, dest_path };
+    if (dfs_send_request(sockfd, DFS_OP_UPLOAD, req->hdr.request_id, req->hdr.length, 2, argv) < 0 ||
+        relay_stream(client_sock, sockfd, req->hdr.length) < 0)
+    {
+        // Closing the backend connection early makes it discard the partial file. The rest
+        // of the client's payload is still in flight, so the session cannot continue either.
+        close(sockfd);
+        dfs_send_status(client_sock, req, DFS_EIO, "ERROR: Failed to forward file to target server");
+        shutdown(client_sock, SHUT_RDWR);
+        return -1;
+    }
+
+    // Relay the backend's final status once it has committed the file
+    struct dfs_header reply;
+    if (dfs_read_header(sockfd, &reply) < 0)
+    {
+        close(sockfd);
+        dfs_send_status(client_sock, req, DFS_EUNAVAIL, "ERROR: No response from target server");
+        return -1;
+    }
+    if (forward_reply(sockfd, client_sock, req, &reply) < 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+    pool_release(server, sockfd);
+    if (reply.status != DFS_OK)
+    {
+        return -1;
+    }
+    dfs_directory_add(&directory, path, server, req->hdr.length);
+    return 0;
+}
+
+// Function to stream an upload to every replica of a mirrored type at once
+// The payload is read from the client once and written to each replica as fast as that replica
+// takes it, so a slow replica does not hold up the others. A replica that cannot be reached,
+// stalls for REPLICA_STALL_SECS, or holds the others back for REPLICA_LAG_MS by falling
+// REPLICA_MAX_LAG bytes behind while the route's writes are ahead of it is dropped, and the upload
+// fails if fewer than the route's writes remain. The client is answered as soon as that many replicas have
+// stored the file; the rest are waited for only so their connections can be kept. Every replica
+// that stored the file is entered in the directory.
+int stream_upload_replicas(int client_sock, struct dfs_request *req, const struct dfs_route *route, char *base_name, char *dest_path)
+{
+    char path[MAX_PATH_LEN];
+    snprintf(path, MAX_PATH_LEN, "%s/%s", dest_path, base_name);
+    struct timeval stall = { REPLICA_STALL_SECS, 0 };
+    char *argv[] = { base_name, dest_path };
+    int fds[DFS_ROUTES_MAX_SERVERS];
+    int live = 0;
+    for (int i = 0; i < route->count; i++)
+    {
+        int server = route->first + i, reused;
+        fds[i] = pool_acquire(server, &reused);
+        if (fds[i] >= 0)
+        {
+            setsockopt(fds[i], SOL_SOCKET, SO_SNDTIMEO, &stall, sizeof(stall));
+            setsockopt(fds[i], SOL_SOCKET, SO_RCVTIMEO, &stall, sizeof(stall));
+            if (dfs_send_request(fds[i], DFS_OP_UPLOAD, req->hdr.request_id, req->hdr.length, 2, argv) < 0)
+            {
+                close(fds[i]);
+                fds[i] = -1;
+            }
+        }
+        mark_replica(server, fds[i] >= 0);
+        if (fds[i] >= 0)
+        {
+            __atomic_add_fetch(&loads[server].inflight, 1, __ATOMIC_RELAXED);
+            live++;
+        }
+    }
+    if (live < route->writes)
+    {
+        for (int i = 0; i < route->count; i++)
+        {
+            if (fds[i] >= 0)
+            {
+                close(fds[i]);
+                __atomic_sub_fetch(&loads[route->first + i].inflight, 1, __ATOMIC_RELAXED);
+            }
+        }
+        dfs_reject(client_sock, req, DFS_EUNAVAIL, "ERROR: Not enough replicas available");
+        return -1;
+    }
+
+    // Relay the payload through a window of REPLICA_MAX_LAG bytes: the client is read while the
+    // slowest replica is less than that behind, and each replica is written as much as it takes
+    // without blocking. Closing a replica's connection early makes it discard the partial file.
+    char *window = malloc(REPLICA_MAX_LAG);
+    off_t length = req->hdr.length, received = 0, sent[DFS_ROUTES_MAX_SERVERS] = { 0 };
+    long progress[DFS_ROUTES_MAX_SERVERS], behind[DFS_ROUTES_MAX_SERVERS] = { 0 };
+    int client_failed = 0, relayed = 0;
+    for (int i = 0; i < route->count; i++)
+    {
+        if (fds[i] >= 0)
+        {
+            fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL, 0) | O_NONBLOCK);
+        }
+        progress[i] = monotonic_ms();
+    }
+    while (window != NULL && live >= route->writes && !client_failed)
+    {
+        long now = monotonic_ms();
+        int ahead = 0;
+        relayed = 1;
+        for (int i = 0; i < route->count; i++)
+        {
+            if (fds[i] >= 0)
+            {
+                ahead += (received - sent[i] < REPLICA_MAX_LAG);
+                relayed &= (sent[i] == length);
+            }
+        }
+        if (relayed)
+        {
+            break;
+        }
+
+        // A replica a whole window behind is dropped if enough others have been kept waiting on it
+        // for REPLICA_LAG_MS, and one that has taken nothing for REPLICA_STALL_SECS in any case
+        off_t slowest = received;
+        for (int i = 0; i < route->count; i++)
+        {
+            if (fds[i] < 0)
+            {
+                continue;
+            }
+            if (received - sent[i] < REPLICA_MAX_LAG || ahead < route->writes)
+            {
+                behind[i] = 0;
+            }
+            else if (behind[i] == 0)
+            {
+                behind[i] = now;
+            }
+            if (behind[i] != 0 && now - behind[i] >= REPLICA_LAG_MS)
+            {
+                drop_replica(route->first + i, &fds[i], path, "fell behind");
+                live--;
+            }
+            else if (sent[i] < received && now - progress[i] >= REPLICA_STALL_SECS * 1000L)
+            {
+                drop_replica(route->first + i, &fds[i], path, "stalled");
+                live--;
+            }
+            else if (sent[i] < slowest)
+            {
+                slowest = sent[i];
+            }
+        }
+        if (live < route->writes)
+        {
+            break;
+        }
+
+        struct pollfd pfds[DFS_ROUTES_MAX_SERVERS + 1];
+        int replica[DFS_ROUTES_MAX_SERVERS + 1], npfds = 0;
+        if (received < length && received - slowest < REPLICA_MAX_LAG)
+        {
+            pfds[npfds].fd = client_sock;
+            pfds[npfds].events = POLLIN;
+            replica[npfds++] = -1;
+        }
+        for (int i = 0; i < route->count; i++)
+        {
+            if (fds[i] >= 0 && sent[i] < received)
+            {
+                pfds[npfds].fd = fds[i];
+                pfds[npfds].events = POLLOUT;
+                replica[npfds++] = i;
+            }
+        }
+        int ready = poll(pfds, npfds, 100);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0)
+        {
+            break;
+        }
+        now = monotonic_ms();
+        for (int k = 0; k < npfds; k++)
+        {
+            if (pfds[k].revents == 0)
+            {
+                continue;
+            }
+            int i = replica[k];
+            if (i < 0)
+            {
+                // Read up to the end of the window, the slowest replica's data or the payload
+                size_t at = received % REPLICA_MAX_LAG;
+                off_t want = REPLICA_MAX_LAG - (received - slowest);
+                if (want > REPLICA_MAX_LAG - (off_t)at) want = REPLICA_MAX_LAG - at;
+                if (want > length - received) want = length - received;
+                ssize_t n = read(client_sock, window + at, want);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0)
+                {
+                    client_failed = 1;
+                    break;
+                }
+                for (int j = 0; j < route->count; j++)
+                {
+                    if (fds[j] >= 0 && sent[j] == received)
+                    {
+                        progress[j] = now; // Its stall clock starts with the data it now lacks
+                    }
+                }
+                received += n;
+                continue;
+            }
+
+            size_t at = sent[i] % REPLICA_MAX_LAG;
+            off_t want = received - sent[i];
+            if (want > REPLICA_MAX_LAG - (off_t)at) want = REPLICA_MAX_LAG - at;
+            ssize_t n = write(fds[i], window + at, want);
+            if (n > 0)
+            {
+                sent[i] += n;
+                progress[i] = now;
+            }
+            else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            {
+                drop_replica(route->first + i, &fds[i], path, "connection failed");
+                live--;
+            }
+        }
+    }
+    free(window);
+    if (!relayed)
+    {
+        for (int i = 0; i < route->count; i++)
+        {
+            if (fds[i] >= 0)
+            {
+                close(fds[i]);
+                __atomic_sub_fetch(&loads[route->first + i].inflight, 1, __ATOMIC_RELAXED);
+            }
+        }
+        if (!client_failed)
+        {
+            // The rest of the client's payload is still in flight, so the session cannot continue
+            dfs_send_status(client_sock, req, DFS_EIO, "ERROR: Failed to forward file to target server");
+            shutdown(client_sock, SHUT_RDWR);
+        }
+        return -1;
+    }
+    for (int i = 0; i < route->count; i++)
+    {
+        if (fds[i] >= 0)
+        {
+            fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL, 0) & ~O_NONBLOCK);
+        }
+    }
+
+    // Answer the client once enough replicas have stored the file, then hear out the others
+    int stored = 0, answered = 0;
+    uint16_t status = DFS_EIO;
+    char message[BUFFER_SIZE], answer[BUFFER_SIZE] = "ERROR: Failed to store file on enough replicas";
+    while (live > 0)
+    {
+        struct pollfd pfds[DFS_ROUTES_MAX_SERVERS];
+        int replica[DFS_ROUTES_MAX_SERVERS], npfds = 0;
+        for (int i = 0; i < route->count; i++)
+        {
+            if (fds[i] >= 0)
+            {
+                pfds[npfds].fd = fds[i];
+                pfds[npfds].events = POLLIN;
+                replica[npfds++] = i;
+            }
+        }
+        int ready = poll(pfds, npfds, REPLICA_STALL_SECS * 1000);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0)
+        {
+            break;
+        }
+        for (int k = 0; k < npfds; k++)
+        {
+            if (pfds[k].revents == 0)
+            {
+                continue;
+            }
+            int i = replica[k], server = route->first + i;
+            struct dfs_header reply;
+            if (dfs_read_header(fds[i], &reply) < 0 || dfs_read_message(fds[i], &reply, message, sizeof(message)) < 0 ||
+                reply.length != 0)
+            {
+                close(fds[i]);
+                mark_replica(server, 0);
+            }
+            else
+            {
+                setsockopt(fds[i], SOL_SOCKET, SO_SNDTIMEO, &io_timeout, sizeof(io_timeout));
+                setsockopt(fds[i], SOL_SOCKET, SO_RCVTIMEO, &io_timeout, sizeof(io_timeout));
+                pool_release(server, fds[i]);
+                if (reply.status == DFS_OK)
+                {
+                    if (stored++ == 0)
+                    {
+                        snprintf(answer, sizeof(answer), "%s", message);
+                    }
+                    dfs_directory_add(&directory, path, server, req->hdr.length);
+                }
+                else if (stored == 0)
+                {
+                    status = reply.status;
+                    snprintf(answer, sizeof(answer), "%s", message);
+                }
+            }
+            fds[i] = -1;
+            live--;
+            __atomic_sub_fetch(&loads[server].inflight, 1, __ATOMIC_RELAXED);
+        }
+        if (!answered && (stored >= route->writes || stored + live < route->writes))
+        {
+            dfs_send_status(client_sock, req, (stored >= route->writes) ? DFS_OK : status, answer);
+            answered = 1;
+        }
+    }
+
+    // Replicas that never answered are taken to have stalled
+    for (int i = 0; i < route->count; i++)
+    {
+        if (fds[i] >= 0)
+        {
+            close(fds[i]);
+            mark_replica(route->first + i, 0);
+            __atomic_sub_fetch(&loads[route->first + i].inflight, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (!answered)
+    {
+        dfs_send_status(client_sock, req, (stored >= route->writes) ? DFS_OK : status, answer);
+    }
+    return (stored >= route->writes) ? 0 : -1;
+}
+
+// Function to download a file from S1 or request it from the server holding it
+// Sends .c files from S1 directly. Other files are requested from the server the directory says
+// holds them, and a file the directory rules out is reported missing without asking anyone.
+int download_file(int client_sock, struct dfs_request *req, char *filename)
+{
+    // Determine which servers keep files of this type
+    char *ext = strrchr(filename, '.');
+    if (ext == NULL)
+    {
+        dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: File has no extension");
+        return -1;
+    }
+    const struct dfs_route *route = dfs_routes_find(&routes, ext);
+    if (route == NULL)
+    {
+        dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Unsupported file type");
+        return -1;
+    }
+    else if (route->first != 1)
+    {
+        int known;
+        int server = locate_file(route, filename, &known);
+        if (known == 0)
+        {
+            dfs_send_status(client_sock, req, DFS_ENOENT, route->missing);
+            return -1;
+        }
+        if (route->replicas > 1)
+        {
+            return forward_to_replica(route, client_sock, req);
+        }
+
+        // Relay the file (or the backend's error) from the server holding it to the client
+        return forward_to_server(server, client_sock, req);
+    }
+
+    // Check if file exists in S1
+    char s1_path[MAX_PATH_LEN];
+    snprintf(s1_path, MAX_PATH_LEN, "%s/S1%s", getenv("HOME"), filename + 3); // +3 to skip "~S1"
+
+    struct stat st;
+    if (stat(s1_path, &st) != 0)
+    {
+        dfs_send_status(client_sock, req, DFS_ENOENT, "ERROR: File not found in S1");
+        return -1;
+    }
+
+    // File exists in S1 - send it directly
+    int fd = open(s1_path, O_RDONLY);
+    if (fd < 0)
+    {
+        dfs_send_status(client_sock, req, DFS_EIO, "ERROR: Failed to open file");
+        return -1;
+    }
+
+    // Send the response header announcing the file size
+    if (dfs_send_data_header(client_sock, req, st.st_size) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    // Send file data
+    off_t remaining = st.st_size;
+    char buffer[BUFFER_SIZE];
+    while (remaining > 0)
+    {
+        ssize_t n = read(fd, buffer, (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE);
+        if (n <= 0 || dfs_write_full(client_sock, buffer, n) < 0)
+        {
+            // The client expects the rest of the file, so the session cannot continue
+            close(fd);
+            shutdown(client_sock, SHUT_RDWR);
+            return -1;
+        }
+        remaining -= n;
+    }
+    close(fd);
+    return 0;
+}
+
+// Function to send the client to the backend that holds a file, or will, instead of relaying it
+// Answers a download or upload the client offered to make itself (DFS_FLAG_REDIRECT) with the
+// backend's host and port and a token good for DFS_REDIRECT_TTL seconds. Files S1 keeps, and all
+// files while redirects are off, get DFS_EUNAVAIL, and the client sends the request the usual
+// way. The client does not report back after a redirected upload, so its file is only expected in
+// the directory (dfs_directory_expect()) until the next sync of the backend reports it. If the
+// upload never happens, the entry goes once the token has run out; an upload still running then
+// is entered by the sync after it ends.
+int redirect_transfer(int client_sock, struct dfs_request *req)
+{
+    int upload = (req->hdr.opcode == DFS_OP_UPLOAD);
+    char *ext = strrchr(req->argv[0], '.');
+    const struct dfs_route *route = (ext != NULL) ? dfs_routes_find(&routes, ext) : NULL;
+    if (route == NULL)
+    {
+        dfs_send_status(client_sock, req, DFS_EINVAL, (ext == NULL) ? "ERROR: File has no extension" : "ERROR: Unsupported file type");
+        return -1;
+    }
+    // A mirrored type's uploads must reach every replica through S1, and its downloads are only
+    // sent to a single replica when every upload had to reach them all
+    if (redirect_ttl <= 0 || route->first == 1 || (route->replicas > 1 && (upload || route->writes < route->replicas)))
+    {
+        dfs_send_status(client_sock, req, DFS_EUNAVAIL, "ERROR: Direct transfer not available");
+        return -1;
+    }
+
+    uint64_t size = 0;
+    char path[MAX_PATH_LEN];
+    int known, server;
+    if (upload)
+    {
+        char *end;
+        size = strtoull(req->argv[2], &end, 10);
+        if (end == req->argv[2] || *end != '\0')
+        {
+            dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Invalid uploadf command format");
+            return -1;
+        }
+        snprintf(path, MAX_PATH_LEN, "%s/%s", req->argv[1], basename(req->argv[0]));
+        server = locate_file(route, path, &known);
+    }
+    else
+    {
+        server = locate_file(route, req->argv[0], &known);
+        if (known == 0)
+        {
+            dfs_send_status(client_sock, req, DFS_ENOENT, route->missing);
+            return -1;
+        }
+    }
+
+    // The token covers the request's own arguments, which the client passes on unchanged
+    char token[DFS_TOKEN_MAX], message[BUFFER_SIZE];
+    if (dfs_token_issue(pool_secret(), req->hdr.opcode, size, redirect_ttl, upload ? 2 : 1, req->argv, token) < 0)
+    {
+        dfs_send_status(client_sock, req, DFS_EUNAVAIL, "ERROR: Direct transfer not available");
+        return -1;
+    }
+    snprintf(message, sizeof(message), "%s %d %s", (redirect_host != NULL) ? redirect_host : routes.servers[server].host,
+             routes.servers[server].port, token);
+    if (upload)
+    {
+        dfs_directory_expect(&directory, path, server, size);
+    }
+    return dfs_send_redirect(client_sock, req, message);
+}
+
+// Function to remove a file from S1 or request its removal from the server holding it
+// Deletes .c files in S1 directly. Other files are removed by the server the directory says
+// holds them, and a file the directory rules out is reported missing without asking anyone.
+int remove_file(int client_sock, struct dfs_request *req, char *filename)
+{
+    // Determine which servers keep files of this type
+    char *ext = strrchr(filename, '.');
+    if (ext == NULL)
+    {
+        dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: File has no extension");
+        return -1;
+    }
+    const struct dfs_route *route = dfs_routes_find(&routes, ext);
+    if (route != NULL && route->first == 1)
+    {
+        char s1_path[MAX_PATH_LEN];
+        snprintf(s1_path, MAX_PATH_LEN, "%s/S1%s", getenv("HOME"), filename + 3); // +3 to skip "~S1"
+        if (unlink(s1_path) < 0)
+        {
+            dfs_send_status(client_sock, req, DFS_ENOENT, "ERROR: File not found");
+            return -1;
+        }
+        dfs_index_update(&path_index, s1_path);
+        dfs_tar_cache_invalidate(&tar_cache);
+        dfs_send_status(client_sock, req, DFS_OK, "SUCCESS: File deleted from S1");
+        return 0;
+    }
+
+    int known = 0;
+    int server = (route == NULL) ? 0 : locate_file(route, filename, &known);
+    if (known == 0)
+    {
+        dfs_send_status(client_sock, req, DFS_ENOENT, (route == NULL) ? "ERROR: File not found" : route->missing);
+        return -1;
+    }
+    if (route->replicas > 1)
+    {
+        return remove_from_replicas(route, client_sock, req, filename);
+    }
+
+    // Request deletion from the server holding the file
+    struct dfs_header reply;
+    char response[BUFFER_SIZE];
+    if (send_to_server(server, req, &reply, response) < 0)
+    {
+        dfs_send_status(client_sock, req, DFS_EUNAVAIL, "ERROR: Failed to delete file from target server");
+        return -1;
+    }
+    if (reply.status == DFS_OK || reply.status == DFS_ENOENT)
+    {
+        // A file moved to another instance while the request was on its way goes from there too
+        struct dfs_directory_entry entry;
+        struct dfs_header moved;
+        char moved_response[BUFFER_SIZE];
+        if (route->count > 1 && dfs_index_usable(&directory.names) &&
+            dfs_directory_lookup(&directory, filename, route->first, route->count, &entry) == 1 && entry.server != server &&
+            send_to_server(entry.server, req, &moved, moved_response) < 0)
+        {
+            dfs_send_status(client_sock, req, DFS_EUNAVAIL, "ERROR: Failed to delete file from target server");
+            return -1;
+        }
+        dfs_directory_forget(&directory, filename);
+    }
+
+    dfs_send_status(client_sock, req, reply.status, response);
+    return (reply.status == DFS_OK) ? 0 : -1;
+}
+
+// Function to download a tar file containing files of a specific type
+// Streams .c files from S1 itself and forwards requests for other file types to the server holding
+// them, or merges the archives of all the servers a type is spread over; "all" merges every
+// server's files into one archive.
+int download_tar(int client_sock, struct dfs_request *req, char *filetype)
+{
+    // Reject malformed filters here rather than a round trip away
+    struct dfs_tar_filter filter;
+    if (dfs_tar_filter_parse(&filter, req) < 0)
+    {
+        dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Invalid downltar filter");
+        return -1;
+    }
+
+    if (strcmp(filetype, "all") == 0)
+    {
+        // Every file type, merged from all servers into one archive
+        return download_tar_merged(client_sock, req, &filter, 1, routes.nservers - 1);
+    }
+    else if (strcmp(filetype, ".c") == 0)
+    {
+        // Handle .c files in S1
+        char s1_dir[MAX_PATH_LEN];
+        snprintf(s1_dir, MAX_PATH_LEN, "%s/S1", getenv("HOME"));
+
+        // Compress the archive on the fly when the client accepts gzip
+        if (dfs_gzip_accepted(req))
+        {
+            return dfs_tar_send_gzip(client_sock, req, &tar_cache, s1_dir, &filter);
+        }
+
+        // Serve the cached archive, rebuilt first if anything changed since it was made;
+        // a filtered archive is always planned fresh
+        int cached = filter.active ? -1 : dfs_tar_cache_open(&tar_cache, s1_dir);
+        if (cached >= 0)
+        {
+            int result = dfs_tar_send_file(client_sock, req, cached);
+            close(cached);
+            if (result < 0)
+            {
+                // The archive is incomplete, so the session cannot continue
+                shutdown(client_sock, SHUT_RDWR);
+            }
+            return result;
+        }
+
+        // Without a usable cache, plan a fresh archive so its exact size can be announced
+        struct dfs_tar tar;
+        if (dfs_tar_collect(&tar, &path_index, s1_dir, ".c", &filter) < 0)
+        {
+            dfs_send_status(client_sock, req, DFS_EIO, "ERROR: Failed to create tar file");
+            return -1;
+        }
+
+        // Send the response header announcing the archive size
+        if (dfs_send_data_header(client_sock, req, tar.size) < 0)
+        {
+            dfs_tar_free(&tar);
+            return -1;
+        }
+
+        // Stream the archive, member by member
+        if (dfs_tar_send(client_sock, &tar) < 0)
+        {
+            // The archive is incomplete, so the session cannot continue
+            dfs_tar_free(&tar);
+            shutdown(client_sock, SHUT_RDWR);
+            return -1;
+        }
+        dfs_tar_free(&tar);
+        return 0;
+    }
+    else if (dfs_routes_find(&routes, filetype) != NULL)
+    {
+        // Handle the other types on the servers the routing table names
+        const struct dfs_route *route = dfs_routes_find(&routes, filetype);
+        if (route->replicas > 1)
+        {
+            return forward_to_replica(route, client_sock, req);
+        }
+        if (route->count > 1)
+        {
+            return download_tar_merged(client_sock, req, &filter, route->first, route->count);
+        }
+
+        // Relay the tar file (or the backend's error) from target server to client
+        return forward_to_server(route->first, client_sock, req);
+    }
+    else
+    {
+        dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Unsupported file type for tar");
+        return -1;
+    }
+}
+
+// Function to send one archive merged from the servers numbered first to first + count - 1
+// Serves "all" (S1 and every backend) and the types spread over several backends; a mirrored
+// type's share comes from one of its replicas. The backends
+// are asked for their shares at once and S1, if included, plans its own .c share meanwhile; whole
+// members are then copied from whichever share has one ready, so the export takes about as long
+// as the slowest server rather than all of them in turn. Members are named by their ~S1 path.
+int download_tar_merged(int client_sock, struct dfs_request *req, const struct dfs_tar_filter *filter, int first, int count)
+{
+    struct tar_share shares[DFS_ROUTES_MAX_SERVERS];
+    struct dfs_tar_stream streams[DFS_ROUTES_MAX_SERVERS];
+    struct dfs_tar_pipe local;
+    int with_local = (first == 1); // Whether S1's own share is included, as stream 0
+    int nshares = 0;
+    char s1_dir[MAX_PATH_LEN];
+    snprintf(s1_dir, MAX_PATH_LEN, "%s/S1", getenv("HOME"));
+    memset(&local, 0, sizeof(local));
+
+    // The backends send plain shares; any compression is applied to the merged archive
+    char *argv[DFS_MAX_ARGS] = { "all", "" };
+    for (int i = DFS_TAR_FILTER_ARG; i < req->argc; i++)
+    {
+        argv[i] = req->argv[i];
+    }
+    int argc = (req->argc > DFS_TAR_FILTER_ARG) ? req->argc : 1;
+    for (int server = with_local ? first + 1 : first; server < first + count; server++)
+    {
+        const struct dfs_route *group = dfs_routes_group(&routes, server);
+        if (group->replicas > 1 && server != group->first)
+        {
+            continue;
+        }
+        shares[nshares].server = (group->replicas > 1) ? pick_replica(group) : server;
+        tar_share_start(&shares[nshares++], req->hdr.request_id, argc, argv);
+    }
+
+    // Plan S1's own share while the backends walk theirs
+    int status = DFS_OK;
+    char message[BUFFER_SIZE] = "";
+    if (with_local && dfs_tar_collect(&local.tar, &path_index, s1_dir, ".c", filter) < 0)
+    {
+        status = DFS_EIO;
+        snprintf(message, sizeof(message), "ERROR: Failed to create tar file");
+    }
+
+    // Every share must be on its way before the merged archive's size can be announced
+    uint64_t total = with_local ? local.tar.size : 2 * DFS_TAR_BLOCK;
+    for (int i = 0; i < nshares; i++)
+    {
+        if (tar_share_reply(&shares[i], req->hdr.request_id, argc, argv) < 0)
+        {
+            if (status == DFS_OK)
+            {
+                status = DFS_EUNAVAIL;
+                snprintf(message, sizeof(message), "ERROR: Connection to server failed");
+            }
+        }
+        else if (shares[i].hdr.status != DFS_OK || (shares[i].hdr.flags & DFS_FLAG_CHUNKED) ||
+                 shares[i].hdr.length < 2 * DFS_TAR_BLOCK)
+        {
+            if (status == DFS_OK)
+            {
+                status = (shares[i].hdr.status != DFS_OK) ? shares[i].hdr.status : DFS_EIO;
+                snprintf(message, sizeof(message), "%s", (shares[i].hdr.status != DFS_OK) ? shares[i].message : "ERROR: Failed to create tar file");
+            }
+        }
+        else
+        {
+            total += shares[i].hdr.length - 2 * DFS_TAR_BLOCK; // Only one end-of-archive marker is kept
+        }
+    }
+
+    // Start writing S1's share into a pipe, to be merged like the others
+    int pipefd[2] = { -1, -1 };
+    pthread_t producer;
+    int producing = 0;
+    if (with_local && status == DFS_OK && pipe(pipefd) == 0)
+    {
+        local.fd = pipefd[1];
+        producing = (pthread_create(&producer, NULL, dfs_tar_produce, &local) == 0);
+        if (!producing)
+        {
+            close(pipefd[0]);
+            close(pipefd[1]);
+        }
+    }
+    if (with_local && status == DFS_OK && !producing)
+    {
+        status = DFS_EIO;
+        snprintf(message, sizeof(message), "ERROR: Failed to create tar file");
+    }
+
+    int result = -1;
+    if (status != DFS_OK)
+    {
+        dfs_send_status(client_sock, req, status, message);
+    }
+    else
+    {
+        int nstreams = 0;
+        if (with_local)
+        {
+            streams[nstreams].fd = pipefd[0];
+            streams[nstreams++].left = local.tar.size;
+        }
+        for (int i = 0; i < nshares; i++)
+        {
+            streams[nstreams].fd = shares[i].fd;
+            streams[nstreams++].left = shares[i].hdr.length;
+        }
+
+        if (dfs_gzip_accepted(req))
+        {
+            // Compress the merged archive as it is written, on its way to the client
+            int gzfd[2];
+            pthread_t merger;
+            struct tar_merge_job job = { -1, client_sock, streams, nstreams, -1 };
+            if (pipe(gzfd) == 0)
+            {
+                job.out = gzfd[1];
+                if (pthread_create(&merger, NULL, tar_merge_thread, &job) == 0)
+                {
+                    result = dfs_send_chunked_header(client_sock, req, "gzip");
+                    if (result == 0)
+                    {
+                        result = dfs_gzip_stream(gzfd[0], client_sock);
+                    }
+                    close(gzfd[0]); // A merge still writing gets EPIPE and stops
+                    pthread_join(merger, NULL);
+                    result = (result == 0 && job.result == 0) ? 0 : -1;
+                }
+                else
+                {
+                    close(gzfd[0]);
+                    close(gzfd[1]);
+                    dfs_send_status(client_sock, req, DFS_EIO, "ERROR: Failed to create tar file");
+                }
+            }
+            else
+            {
+                dfs_send_status(client_sock, req, DFS_EIO, "ERROR: Failed to create tar file");
+            }
+        }
+        else if (dfs_send_data_header(client_sock, req, total) == 0)
+        {
+            result = dfs_tar_merge(client_sock, streams, nstreams);
+        }
+        if (result < 0)
+        {
+            // The archive is incomplete, so the session cannot continue
+            shutdown(client_sock, SHUT_RDWR);
+        }
+    }
+
+    if (producing)
+    {
+        close(pipefd[0]); // A producer still writing gets EPIPE and stops
+        pthread_join(producer, NULL);
+    }
+    dfs_tar_free(&local.tar);
+
+    // A share read in full, or an error without payload, leaves its connection in sync
+    for (int i = 0; i < nshares; i++)
+    {
+        if (shares[i].fd < 0)
+        {
+            continue;
+        }
+        if (result == 0 || (shares[i].hdr.status != DFS_OK && shares[i].hdr.length == 0))
+        {
+            pool_release(shares[i].server, shares[i].fd);
+        }
+        else
+        {
+            close(shares[i].fd);
+        }
+    }
+    return result;
+}
+
+// Function to send the request for one backend's share of a unified archive
+// Uses a pooled connection; a reused one the backend has closed is replaced once by a fresh one.
+// Returns -1, leaving share->fd at -1, if the backend cannot be reached.
+int tar_share_start(struct tar_share *share, uint32_t request_id, int argc, char **argv)
+{
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        share->fd = pool_acquire(share->server, &share->reused);
+        if (share->fd < 0)
+        {
+            return -1;
+        }
+        if (dfs_send_request(share->fd, DFS_OP_TAR, request_id, 0, argc, argv) == 0)
+        {
+            return 0;
+        }
+        close(share->fd);
+        share->fd = -1;
+        if (!share->reused)
+        {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// Function to read the reply header and message of one backend's share
+// A reused connection that fails before answering is retried once on a fresh one.
+// Returns -1 if the backend did not answer.
+int tar_share_reply(struct tar_share *share, uint32_t request_id, int argc, char **argv)
+{
+    for (int attempt = 0; attempt < 2 && share->fd >= 0; attempt++)
+    {
+        if (dfs_read_header(share->fd, &share->hdr) == 0 &&
+            dfs_read_message(share->fd, &share->hdr, share->message, sizeof(share->message)) == 0)
+        {
+            return 0;
+        }
+        close(share->fd);
+        share->fd = -1;
+        if (!share->reused || tar_share_start(share, request_id, argc, argv) < 0)
+        {
+            break;
+        }
+    }
+    return -1;
+}
+
+// Function run by the thread that merges a unified archive into the compression pipe
+void *tar_merge_thread(void *arg)
+{
+    struct tar_merge_job *job = arg;
+    job->result = dfs_tar_merge(job->out, job->streams, job->nstreams);
+    if (job->result < 0)
+    {
+        // Before the compressor sees the end of its input and ends the payload
+        shutdown(job->client_sock, SHUT_RDWR);
+    }
+    close(job->out);
+    return NULL;
+}
+
+// Function to display filenames from S1 and other servers
+// Answers one page of the listing. Every backend is asked for its share of the page at once,
+// S1 lists its own files while they work, and whatever arrived before the deadline is merged.
+// Backends that did not answer are named in the response's message.
+int display_filenames(int client_sock, struct dfs_request *req, char *pathname) 
+{
+    // The page size and the cursor (one position per server, S1 first) are optional
+    int page = (req->argc > 1) ? atoi(req->argv[1]) : DFS_DEFAULT_PAGE;
+    if (page < 1 || page > DFS_MAX_PAGE) 
+    {
+        dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Invalid page size");
+        return -1;
+    }
+    int nservers = routes.nservers - 1; // S1 and the backends, in server order
+    int nparts = nservers - 1;
+    char (*cursors)[DFS_MAX_CURSOR] = malloc(nservers * sizeof(*cursors));
+    struct list_part *parts = calloc(nparts, sizeof(struct list_part));
+    const char *cursor = (req->argc > 2) ? req->argv[2] : "";
+    if (cursors == NULL || parts == NULL)
+    {
+        free(cursors);
+        free(parts);
+        dfs_send_status(client_sock, req, DFS_EIO, "ERROR: Server busy");
+        return -1;
+    }
+    if (split_list_cursor(cursor, cursors, nservers) < 0) 
+    {
+        free(cursors);
+        free(parts);
+        dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Invalid listing cursor");
+        return -1;
+    }
+
+    // Get the corresponding path in S1
+    char s1_path[MAX_PATH_LEN];
+    snprintf(s1_path, MAX_PATH_LEN, "%s/S1%s", getenv("HOME"), 
+             (strcmp(pathname, "~S1") == 0) ? "" : (pathname + 3)); // Handle root case
+
+    // The directory may exist only on the backends, since uploads of other
+    // types are streamed there without touching S1's disk
+    struct stat st;
+    int local_dir = (stat(s1_path, &st) == 0 && S_ISDIR(st.st_mode));
+    if (!local_dir) 
+    {
+        strcpy(cursors[0], "-");
+    }
+
+    // A mirrored type is listed from one of its replicas, at its first instance's position
+    for (int i = 1; i < nservers; i++) 
+    {
+        const struct dfs_route *group = dfs_routes_group(&routes, i + 1);
+        if (group->replicas > 1 && i + 1 != group->first) 
+        {
+            strcpy(cursors[i], "-");
+        }
+    }
+
+    // Share the page between the servers that still have files to list
+    int share[DFS_ROUTES_MAX_SERVERS];
+    int active = 0, k = 0;
+    for (int i = 0; i < nservers; i++) 
+    {
+        active += (strcmp(cursors[i], "-") != 0);
+    }
+    for (int i = 0; i < nservers; i++) 
+    {
+        share[i] = (active > 0 && strcmp(cursors[i], "-") != 0) ? page / active + (k++ < page % active) : 0;
+    }
+
+    // Send the request to the backends first so they all work in parallel with S1
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < nparts; i++) 
+    {
+        struct list_part *part = &parts[i];
+        const struct dfs_route *group = dfs_routes_group(&routes, i + 2);
+        part->server = (group->replicas > 1 && share[i + 1] > 0) ? pick_replica(group) : i + 2;
+        part->name = routes.servers[i + 2].name;
+        part->state = LIST_SKIPPED;
+        part->fd = -1;
+        if (share[i + 1] > 0) 
+        {
+            snprintf(part->share, sizeof(part->share), "%d", share[i + 1]);
+            part->req = *req;
+            part->req.argc = 3;
+            part->req.argv[0] = pathname;
+            part->req.argv[1] = part->share;
+            part->req.argv[2] = cursors[i + 1];
+            list_part_start(part);
+        }
+    }
+
+    // Get S1's own share (.c files), from the index when there is one
+    struct dfs_buf files = { 0 };
+    if (share[0] > 0) 
+    {
+        int found = dfs_index_usable(&path_index) ? dfs_index_page(&path_index, pathname, share[0], cursors[0], DFS_MAX_CURSOR, &files)
+                                                  : dfs_walk_page(s1_path, ".c", pathname, share[0], cursors[0], DFS_MAX_CURSOR, &files);
+        if (found < 0) 
+        {
+            for (int i = 0; i < nparts; i++) 
+            {
+                list_part_finish(&parts[i]);
+            }
+            free(files.data);
+            free(cursors);
+            free(parts);
+            dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Invalid listing cursor");
+            return -1;
+        }
+        if (cursors[0][0] == '\0') 
+        {
+            strcpy(cursors[0], "-");
+        }
+    }
+
+    // Collect the backends' shares in the routing table's order (PDF from S2, TXT from S3, ZIP
+    // from S4 by default) and note the ones that are missing. A backend that failed is skipped
+    // from then on.
+    list_parts_gather(parts, nparts, &start);
+    char warning[BUFFER_SIZE] = {0};
+    for (int i = 0; i < nparts; i++) 
+    {
+        struct list_part *part = &parts[i];
+        char *next = cursors[i + 1];
+        if (part->state == LIST_DONE && part->hdr.status == DFS_OK) 
+        {
+            const char *more = dfs_page_cursor(&part->hdr, part->args);
+            snprintf(next, DFS_MAX_CURSOR, "%s", (more != NULL) ? more : "-");
+            if (dfs_buf_append(&files, part->data, part->len) < 0) 
+            {
+                strcpy(next, "-");
+            }
+        }
+        else if (part->state == LIST_DONE) 
+        {
+            strcpy(next, "-"); // Nothing in this directory on that backend
+        }
+        else if (part->state == LIST_TIMED_OUT || part->state == LIST_FAILED) 
+        {
+            strcpy(next, "-");
+            snprintf(warning + strlen(warning), sizeof(warning) - strlen(warning), "%s%s %s",
+                     (warning[0] == '\0') ? "WARNING: Listing incomplete (" : ", ", part->name,
+                     (part->state == LIST_TIMED_OUT) ? "timed out" : "unavailable");
+        }
+        list_part_finish(part);
+    }
+    if (warning[0] != '\0') 
+    {
+        strncat(warning, ")", sizeof(warning) - strlen(warning) - 1);
+    }
+    char next_cursor[DFS_MAX_CURSOR];
+    join_list_cursor(cursors, nservers, next_cursor, sizeof(next_cursor));
+    free(cursors);
+    free(parts);
+
+    // Only claim the directory does not exist if every backend could be asked
+    if (cursor[0] == '\0' && !local_dir && files.len == 0 && warning[0] == '\0' && next_cursor[0] == '\0') 
+    {
+        free(files.data);
+        dfs_send_status(client_sock, req, DFS_ENOENT, "ERROR: Invalid directory path");
+        return -1;
+    }
+
+    // Send the combined page to the client
+    dfs_send_page(client_sock, req, warning, next_cursor, files.data, files.len);
+    free(files.data);
+    return 0;
+}
+
+// Function to split a listing cursor into one position for each of n servers (S1 first)
+// An empty cursor starts every server from the beginning; "-" marks a server that is done.
+int split_list_cursor(const char *cursor, char cursors[][DFS_MAX_CURSOR], int n)
+{
+    const char *p = cursor;
+    for (int i = 0; i < n; i++)
+    {
+        const char *end = strchr(p, ',');
+        size_t len = (end != NULL) ? (size_t)(end - p) : strlen(p);
+        if (len >= DFS_MAX_CURSOR || (i < n - 1 && cursor[0] != '\0' && end == NULL))
+        {
+            return -1;
+        }
+        memcpy(cursors[i], p, len);
+        cursors[i][len] = '\0';
+        p += len + (end != NULL);
+    }
+    return (*p == '\0') ? 0 : -1;
+}
+
+// Function to join the servers' positions into the cursor for the next page
+// The cursor is empty once every server is done.
+void join_list_cursor(char cursors[][DFS_MAX_CURSOR], int n, char *out, size_t size)
+{
+    size_t used = 0;
+    int done = 1;
+    for (int i = 0; i < n; i++)
+    {
+        done &= (strcmp(cursors[i], "-") == 0);
+        used += snprintf(out + used, (used < size) ? size - used : 0, "%s%s", (i > 0) ? "," : "", cursors[i]);
+    }
+    if (done || used >= size)
+    {
+        out[0] = '\0';
+    }
+}
+
+// Function to send a listing request to one backend
+// A new connection sends its AUTH frame and the request back to back instead of waiting for the
+// AUTH reply, so a stalled backend cannot block S1 here. The connection is left non-blocking so
+// list_parts_gather() can wait on all backends at once.
+int list_part_start(struct list_part *part)
+{
+    const struct dfs_request *req = &part->req;
+    part->state = LIST_FAILED;
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        part->fd = pool_take(part->server);
+        part->reused = (part->fd >= 0);
+        part->authenticating = !part->reused;
+        if (!part->reused)
+        {
+            part->fd = connect_backend(part->server);
+            if (part->fd < 0)
+            {
+                return -1;
+            }
+        }
+
+        char *auth_argv[] = { (char *)pool_secret() };
+        if ((!part->authenticating || dfs_send_request(part->fd, DFS_OP_AUTH, 0, 0, 1, auth_argv) == 0) &&
+            dfs_send_request(part->fd, req->hdr.opcode, req->hdr.request_id, 0, req->argc, req->argv) == 0)
+        {
+            fcntl(part->fd, F_SETFL, fcntl(part->fd, F_GETFL, 0) | O_NONBLOCK);
+            part->state = LIST_PENDING;
+            return 0;
+        }
+
+        // A pooled connection may have been closed by the peer; retry once on a fresh one
+        close(part->fd);
+        part->fd = -1;
+        if (!part->reused)
+        {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// Function to read whatever part of a backend's listing has arrived
+// Returns 1 once the reply is complete, 0 if more is expected and -1 if the connection failed.
+int list_part_read(struct list_part *part)
+{
+    while (1)
+    {
+        if (part->got == DFS_HEADER_SIZE && part->arg_got == part->hdr.arg_len && part->len == part->hdr.length)
+        {
+            if (!part->authenticating)
+            {
+                break;
+            }
+
+            // That was the AUTH reply; the listing follows it
+            part->authenticating = 0;
+            part->got = 0;
+            part->arg_got = 0;
+            continue;
+        }
+
+        // Header first, then the message, then the payload
+        char *dst = part->data + part->len;
+        size_t want = part->hdr.length - part->len;
+        if (part->got < DFS_HEADER_SIZE)
+        {
+            dst = (char *)part->raw + part->got;
+            want = DFS_HEADER_SIZE - part->got;
+        }
+        else if (part->arg_got < part->hdr.arg_len)
+        {
+            dst = part->args + part->arg_got;
+            want = part->hdr.arg_len - part->arg_got;
+        }
+
+        ssize_t n = read(part->fd, dst, want);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) return -1;
+
+        if (part->got < DFS_HEADER_SIZE)
+        {
+            part->got += n;
+            if (part->got == DFS_HEADER_SIZE)
+            {
+                if (dfs_decode_header(part->raw, &part->hdr) < 0) return -1;
+                if (part->authenticating && (part->hdr.status != DFS_OK || part->hdr.length > 0)) return -1;
+                if (!part->authenticating)
+                {
+                    part->data = malloc(part->hdr.length + 1);
+                    if (part->data == NULL) return -1;
+                }
+            }
+        }
+        else if (part->arg_got < part->hdr.arg_len)
+        {
+            part->arg_got += n;
+        }
+        else
+        {
+            part->len += n;
+        }
+    }
+
+    part->args[part->arg_got] = '\0';
+    part->data[part->len] = '\0';
+    part->state = LIST_DONE;
+    return 1;
+}
+
+// Function to wait for the backends' listings until all have answered or the deadline passes
+// The deadline (DFS_LIST_DEADLINE_MS) runs from start, so one slow backend delays the listing
+// by at most that long and never holds up the others' replies.
+void list_parts_gather(struct list_part *parts, int nparts, const struct timespec *start)
+{
+    while (1)
+    {
+        struct pollfd pfds[DFS_ROUTES_MAX_SERVERS];
+        struct list_part *waiting[DFS_ROUTES_MAX_SERVERS];
+        int nwaiting = 0;
+        for (int i = 0; i < nparts; i++)
+        {
+            if (parts[i].state == LIST_PENDING)
+            {
+                pfds[nwaiting].fd = parts[i].fd;
+                pfds[nwaiting].events = POLLIN;
+                waiting[nwaiting++] = &parts[i];
+            }
+        }
+        if (nwaiting == 0)
+        {
+            return;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long left = list_deadline_ms - ((now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000);
+        int ready = (left > 0) ? poll(pfds, nwaiting, left) : 0;
+        if (ready < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ready <= 0)
+        {
+            // Out of time (or poll failed): whoever has not answered is reported as timed out
+            for (int i = 0; i < nwaiting; i++)
+            {
+                waiting[i]->state = LIST_TIMED_OUT;
+            }
+            return;
+        }
+
+        for (int i = 0; i < nwaiting; i++)
+        {
+            struct list_part *part = waiting[i];
+            if (pfds[i].revents == 0 || list_part_read(part) >= 0)
+            {
+                continue;
+            }
+
+            // A pooled connection that closed before replying is retried once on a fresh one
+            close(part->fd);
+            part->fd = -1;
+            part->state = LIST_FAILED;
+            if (part->got == 0 && part->reused)
+            {
+                list_part_start(part);
+            }
+        }
+    }
+}
+
+// Function to hand a backend's connection back after a listing and free its reply
+// Only a connection whose reply was read in full is in sync and can go back to the pool.
+void list_part_finish(struct list_part *part)
+{
+    if (part->fd >= 0 && part->state == LIST_DONE)
+    {
+        fcntl(part->fd, F_SETFL, fcntl(part->fd, F_GETFL, 0) & ~O_NONBLOCK);
+        pool_release(part->server, part->fd);
+    }
+    else if (part->fd >= 0)
+    {
+        close(part->fd);
+    }
+    part->fd = -1;
+    free(part->data);
+    part->data = NULL;
+}
+
+// Function to find the server of a type's group that holds a file, or would
+// Gives the server the directory names for path, or else the one the routing table places it on;
+// for a mirrored type, the replica a read should go to.
+// *known is what the directory said: 0 if the file certainly does not exist (see
+// dfs_directory_lookup()).
+int locate_file(const struct dfs_route *route, const char *path, int *known)
+{
+    struct dfs_directory_entry entry;
+    *known = dfs_directory_lookup(&directory, path, route->first, route->count, &entry);
+    if (route->replicas > 1)
+    {
+        return pick_replica(route);
+    }
+    if (*known == 1)
+    {
+        return entry.server;
+    }
+    if (route->count == 1)
+    {
+        return route->first;
+    }
+    char key[DFS_INDEX_KEY_MAX];
+    return dfs_routes_place(&routes, route, (dfs_directory_key(path, key, sizeof(key)) == 0) ? key : path);
+}
+
+// Function to order the replicas of a mirrored type for a read
+// Fills order with the group's servers: the ones not marked down first, the least busy of those
+// first, and equally busy ones in turn so idle replicas share the reads. Returns the number of
+// servers.
+int order_replicas(const struct dfs_route *route, int *order)
+{
+    static unsigned int turn = 0;
+    time_t now = time(NULL);
+    long cost[DFS_ROUTES_MAX_SERVERS];
+    int start = turn++ % route->count;
+    for (int n = 0; n < route->count; n++)
+    {
+        int server = route->first + (start + n) % route->count;
+        long c = __atomic_load_n(&loads[server].inflight, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&loads[server].down_until, __ATOMIC_RELAXED) > now)
+        {
+            c += 1L << 32; // Tried only after every reachable one
+        }
+        int i = n;
+        while (i > 0 && cost[i - 1] > c)
+        {
+            cost[i] = cost[i - 1];
+            order[i] = order[i - 1];
+            i--;
+        }
+        cost[i] = c;
+        order[i] = server;
+    }
+    return route->count;
+}
+
+// Function to choose the replica of a mirrored type a read goes to
+int pick_replica(const struct dfs_route *route)
+{
+    int order[DFS_ROUTES_MAX_SERVERS];
+    order_replicas(route, order);
+    return order[0];
+}
+
+// Function to note whether a replica could be reached
+// One that could not is passed over for REPLICA_RETRY_SECS unless every other is down too.
+void mark_replica(int server, int reachable)
+{
+    __atomic_store_n(&loads[server].down_until, reachable ? 0 : time(NULL) + REPLICA_RETRY_SECS, __ATOMIC_RELAXED);
+}
+
+// Function to give up on a replica partway through a mirrored upload
+// Closing its connection makes it discard the partial file. It is marked down, and logged, since
+// it will not have the file until it is copied there.
+void drop_replica(int server, int *fd, const char *path, const char *reason)
+{
+    close(*fd);
+    *fd = -1;
+    mark_replica(server, 0);
+    __atomic_sub_fetch(&loads[server].inflight, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "Replica %s dropped from the upload of %s: %s\n", routes.servers[server].name, path, reason);
+}
+
+// Function to read the monotonic clock in milliseconds
+long monotonic_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+// Function to send a request to one replica and wait for the start of its answer
+// A replica that cannot be reached, or does not start answering within REPLICA_STALL_SECS, is
+// marked down. Returns the connection, with reply filled in, or -1.
+int request_replica(int server, const struct dfs_request *req, struct dfs_header *reply)
+{
+    struct timeval stall = { REPLICA_STALL_SECS, 0 };
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        int reused;
+        int sockfd = pool_acquire(server, &reused);
+        if (sockfd < 0)
+        {
+            break;
+        }
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &stall, sizeof(stall));
+        if (dfs_send_request(sockfd, req->hdr.opcode, req->hdr.request_id, 0, req->argc, req->argv) == 0 &&
+            dfs_read_header(sockfd, reply) == 0)
+        {
+            setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &io_timeout, sizeof(io_timeout));
+            mark_replica(server, 1);
+            return sockfd;
+        }
+        close(sockfd);
+        if (!reused)
+        {
+            break;
+        }
+    }
+    mark_replica(server, 0);
+    return -1;
+}
+
+// Function to forward a read to the least-loaded healthy replica of a mirrored type
+// Replicas are tried in order_replicas() order: one that cannot be reached or stalls, or does not
+// have the file (it may have missed an upload), hands the request on to the next.
+int forward_to_replica(const struct dfs_route *route, int client_sock, struct dfs_request *req)
+{
+    int order[DFS_ROUTES_MAX_SERVERS];
+    int n = order_replicas(route, order);
+    int missing = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int server = order[i];
+        struct dfs_header reply;
+        __atomic_add_fetch(&loads[server].inflight, 1, __ATOMIC_RELAXED);
+        int sockfd = request_replica(server, req, &reply);
+        if (sockfd >= 0 && reply.status == DFS_ENOENT && reply.length == 0)
+        {
+            char message[BUFFER_SIZE];
+            if (dfs_read_message(sockfd, &reply, message, sizeof(message)) == 0)
+            {
+                pool_release(server, sockfd);
+            }
+            else
+            {
+                close(sockfd);
+            }
+            missing = 1;
+        }
+        else if (sockfd >= 0)
+        {
+            int result = forward_reply(sockfd, client_sock, req, &reply);
+            if (result == 0)
+            {
+                pool_release(server, sockfd);
+            }
+            else
+            {
+                close(sockfd);
+            }
+            __atomic_sub_fetch(&loads[server].inflight, 1, __ATOMIC_RELAXED);
+            return (result == 0 && reply.status == DFS_OK) ? 0 : -1;
+        }
+        __atomic_sub_fetch(&loads[server].inflight, 1, __ATOMIC_RELAXED);
+    }
+
+    if (missing)
+    {
+        dfs_send_status(client_sock, req, DFS_ENOENT, route->missing);
+    }
+    else
+    {
+        dfs_send_status(client_sock, req, DFS_EUNAVAIL, "ERROR: Connection to server failed");
+    }
+    return -1;
+}
+
+// Function to remove a file from every replica of a mirrored type
+// The removal succeeds once the route's writes of the replicas no longer have the file; the
+// directory keeps the file until then, since the replicas that could not be asked still hold it.
+int remove_from_replicas(const struct dfs_route *route, int client_sock, struct dfs_request *req, char *filename)
+{
+    int gone = 0, removed = 0;
+    char answer[BUFFER_SIZE] = "";
+    for (int server = route->first; server < route->first + route->count; server++)
+    {
+        struct dfs_header reply;
+        char response[BUFFER_SIZE];
+        if (send_to_server(server, req, &reply, response) < 0)
+        {
+            mark_replica(server, 0);
+            continue;
+        }
+        gone += (reply.status == DFS_OK || reply.status == DFS_ENOENT);
+        if (reply.status == DFS_OK && removed++ == 0)
+        {
+            snprintf(answer, sizeof(answer), "%s", response);
+        }
+    }
+    if (gone < route->writes)
+    {
+        dfs_send_status(client_sock, req, DFS_EUNAVAIL, "ERROR: Failed to delete file from target server");
+        return -1;
+    }
+    dfs_directory_forget(&directory, filename);
+    if (removed == 0)
+    {
+        dfs_send_status(client_sock, req, DFS_ENOENT, route->missing);
+        return -1;
+    }
+    dfs_send_status(client_sock, req, DFS_OK, answer);
+    return 0;
+}
+
+// Function to start the process that keeps the directory in step with the backends
+// Polls every backend for changes to its files straight away and then every
+// DFS_DIRECTORY_SYNC_SECS seconds. Forked by the supervisor, which starts it again if it dies;
+// it exits with the server. Returns its pid, or 0 if there is nothing to sync or fork() failed.
+pid_t start_directory_sync()
+{
+    if (directory.peers == NULL)
+    {
+        return 0;
+    }
+    pid_t pid = fork();
+    if (pid != 0)
+    {
+        return (pid > 0) ? pid : 0;
+    }
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1)
+    {
+        exit(0);
+    }
+    long interval = dfs_index_setting("DFS_DIRECTORY_SYNC_SECS", DFS_DIRECTORY_SYNC_SECS);
+    while (1)
+    {
+        for (int server = 2; server < routes.nservers; server++)
+        {
+            // Until it can be reached again, requests for the backend's files are forwarded
+            if (sync_directory(server) < 0)
+            {
+                dfs_directory_set_synced(&directory, server, 0);
+            }
+        }
+        sleep(interval);
+    }
+}
+
+// Function to bring the directory up to date with one backend
+// Asks for the changes since the last sync of the same epoch and applies them. Returns -1 if the
+// backend could not be reached or its answer could not be used.
+int sync_directory(int server)
+{
+    // Without room for the paths, the directory keeps a filter of each backend's files
+    if (!dfs_index_usable(&directory.names))
+    {
+        return sync_filter(server);
+    }
+
+    struct dfs_directory_peer *peer = &directory.peers[server];
+    char epoch[24], since[24];
+    snprintf(epoch, sizeof(epoch), "%llu", (unsigned long long)peer->epoch);
+    snprintf(since, sizeof(since), "%llu", (unsigned long long)peer->seq);
+    char *argv[] = { epoch, since };
+    uint64_t guard = dfs_directory_guard(&directory);
+
+    char message[BUFFER_SIZE], *entries;
+    uint64_t length;
+    if (fetch_from_backend(server, DFS_OP_SYNC, 2, argv, message, &entries, &length) < 0)
+    {
+        return -1;
+    }
+
+    // The message tells "changes" from "full" and names the epoch and last change covered
+    char kind[16];
+    unsigned long long new_epoch, new_seq;
+    int result = -1;
+    if (sscanf(message, "%15s %llu %llu", kind, &new_epoch, &new_seq) == 3 &&
+        dfs_directory_apply(&directory, server, strcmp(kind, "full") == 0, guard, entries, length) == 0)
+    {
+        peer->epoch = new_epoch;
+        peer->seq = new_seq;
+        dfs_directory_set_synced(&directory, server, 1);
+        result = 0;
+    }
+    free(entries);
+    return result;
+}
+
+// Function to bring the directory's filter of one backend up to date
+// Fetches a fresh filter when there is none or it is DFS_FILTER_REFRESH_SECS old, then adds the
+// files added on the backend since it was built. Returns -1 if the backend could not be reached
+// or its answer could not be used.
+int sync_filter(int server)
+{
+    struct dfs_directory_peer *peer = &directory.peers[server];
+    char message[BUFFER_SIZE], *payload;
+    uint64_t length;
+    unsigned long long new_epoch, new_seq, nbits;
+    int slot = peer->filter_active;
+    long refresh = dfs_index_setting("DFS_FILTER_REFRESH_SECS", DFS_DIRECTORY_FILTER_SECS);
+    if (slot < 0 || time(NULL) - peer->filter_time >= refresh)
+    {
+        if (fetch_from_backend(server, DFS_OP_FILTER, 0, NULL, message, &payload, &length) < 0)
+        {
+            return -1;
+        }
+        if (sscanf(message, "%llu %llu %llu", &new_epoch, &new_seq, &nbits) != 3 || length != nbits / 8 ||
+            (slot = dfs_directory_filter_open(&directory, server, nbits)) < 0)
+        {
+            free(payload);
+            return -1;
+        }
+        dfs_directory_filter_merge(&directory, server, slot, payload);
+        free(payload);
+        peer->epoch = new_epoch;
+        peer->seq = new_seq;
+    }
+
+    // Uploads through S1 are already in the filter; this catches files added by other means
+    char epoch[24], since[24], kind[16];
+    snprintf(epoch, sizeof(epoch), "%llu", (unsigned long long)peer->epoch);
+    snprintf(since, sizeof(since), "%llu", (unsigned long long)peer->seq);
+    char *argv[] = { epoch, since };
+    if (fetch_from_backend(server, DFS_OP_SYNC, 2, argv, message, &payload, &length) < 0)
+    {
+        dfs_directory_filter_abandon(&directory, server, slot);
+        return -1;
+    }
+    if (sscanf(message, "%15s %llu %llu", kind, &new_epoch, &new_seq) != 3 ||
+        dfs_directory_filter_apply(&directory, server, slot, payload, length) < 0)
+    {
+        free(payload);
+        dfs_directory_filter_abandon(&directory, server, slot);
+        return -1;
+    }
+    free(payload);
+    peer->epoch = new_epoch;
+    peer->seq = new_seq;
+
+    if (slot != peer->filter_active)
+    {
+        dfs_directory_filter_publish(&directory, server, slot);
+    }
+    dfs_directory_set_synced(&directory, server, 1);
+    return 0;
+}
+
+// Function to start the process that moves files the routing table now places elsewhere
+// Every DFS_REBALANCE_SECS seconds, each instance of a type spread over several is listed in full
+// and the files it holds that belong on another instance of the group are moved there, one at a
+// time (rebalance_file()). Deciding which copy is current needs the directory's paths, so nothing
+// is moved while it keeps only filters. Forked by the supervisor, which starts it again if it
+// dies; it exits with the server. Returns its pid, or 0 if nothing is to be moved or fork() failed.
+pid_t start_rebalancer()
+{
+    int secs = configured_rebalance_secs();
+    int spread = 0;
+    for (int i = 0; i < routes.ntypes; i++)
+    {
+        spread |= (routes.types[i].count > 1 && routes.types[i].replicas == 1);
+    }
+    if (secs == 0 || !spread || directory.peers == NULL || !dfs_index_usable(&directory.names))
+    {
+        return 0;
+    }
+    pid_t pid = fork();
+    if (pid != 0)
+    {
+        return (pid > 0) ? pid : 0;
+    }
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1)
+    {
+        exit(0);
+    }
+    rebalancer.rate = configured_rebalance_rate();
+    clock_gettime(CLOCK_MONOTONIC, &rebalancer.refilled);
+    while (1)
+    {
+        // The first pass waits too, giving the directory time to sync
+        sleep(secs);
+        for (int i = 0; i < routes.ntypes; i++)
+        {
+            if (routes.types[i].count > 1 && routes.types[i].replicas == 1)
+            {
+                rebalance_group(&routes.types[i]);
+            }
+        }
+        rebalance_flush(0);
+    }
+}
+
+// Function to move the misplaced files of one group
+// Waits until the directory is synced with every instance of the group, since it is what says
+// which copy of a file reads go to.
+void rebalance_group(const struct dfs_route *route)
+{
+    if (!dfs_directory_synced(&directory, route->first, route->count))
+    {
+        return;
+    }
+    for (int server = route->first; server < route->first + route->count; server++)
+    {
+        // A sync from beyond the last change asks for every file the instance holds
+        char epoch[] = "0", since[] = "18446744073709551615";
+        char *argv[] = { epoch, since };
+        char message[BUFFER_SIZE], *entries;
+        uint64_t length;
+        if (fetch_from_backend(server, DFS_OP_SYNC, 2, argv, message, &entries, &length) < 0)
+        {
+            continue;
+        }
+        for (size_t pos = 0; length > 0 && entries[length - 1] == '\0' && pos < length; pos += strlen(entries + pos) + 1)
+        {
+            struct stat st;
+            char *key = dfs_directory_entry_key(entries + pos, &st);
+            if (key != NULL && entries[pos] == '+' && dfs_routes_place(&routes, route, key) != server)
+            {
+                rebalance_file(route, server, key);
+            }
+        }
+        free(entries);
+        rebalance_flush(0);
+    }
+}
+
+// Function to move one file from an instance to the one the routing table now places it on
+// The file is copied at the configured rate while its checksum is computed, and the copy is kept
+// only if both instances then report that checksum. The directory is switched to the new copy
+// unless the file was changed or removed meanwhile, so reads find one complete copy or the other
+// throughout. The old copy is removed after a grace period, and only if it is still the same.
+// Returns -1 if the file was not moved.
+int rebalance_file(const struct dfs_route *route, int from, const char *key)
+{
+    int to = dfs_routes_place(&routes, route, key);
+    char path[MAX_PATH_LEN], copied[DFS_CHECKSUM_MAX], checksum[DFS_CHECKSUM_MAX];
+    snprintf(path, sizeof(path), "~S1%s", key);
+    struct dfs_directory_entry entry;
+    if (dfs_directory_lookup(&directory, path, route->first, route->count, &entry) != 1)
+    {
+        return -1;
+    }
+
+    // A copy left behind by an earlier move is removed once it matches the one in use
+    if (entry.server == to)
+    {
+        if (backend_checksum(from, path, checksum) == 0 && backend_checksum(to, path, copied) == 0 &&
+            strcmp(checksum, copied) == 0)
+        {
+            rebalance_defer(from, path, checksum);
+        }
+        return -1;
+    }
+
+    // Only the copy reads go to is moved, and not while a redirected upload of it may still arrive
+    if (entry.server != from || entry.mtime > (int64_t)time(NULL) - redirect_ttl - REBALANCE_GRACE_SECS)
+    {
+        return -1;
+    }
+    if (rebalance_copy(from, to, path, copied) < 0)
+    {
+        return -1;
+    }
+    if (backend_checksum(to, path, checksum) < 0 || strcmp(checksum, copied) != 0 ||
+        backend_checksum(from, path, checksum) < 0 || strcmp(checksum, copied) != 0 ||
+        dfs_directory_move(&directory, path, from, to, entry.version) < 0)
+    {
+        // The file stays where it is; a later pass tries again
+        backend_remove(to, path, copied);
+        return -1;
+    }
+    rebalance_defer(from, path, copied);
+    return 0;
+}
+
+// Function to copy a file from one backend to another at the rebalancer's rate
+// Fills in the checksum of the bytes copied. Returns -1 if either backend failed; a file the
+// destination did not receive in full is discarded there.
+int rebalance_copy(int from, int to, char *path, char *checksum)
+{
+    // The upload names the file and the folder it goes in ("~S1/docs/"), as a client's would
+    char base_name[MAX_PATH_LEN], dest_path[MAX_PATH_LEN];
+    char *slash = strrchr(path, '/');
+    snprintf(base_name, sizeof(base_name), "%s", slash + 1);
+    snprintf(dest_path, sizeof(dest_path), "%.*s", (int)(slash - path + 1), path);
+    char *argv[] = { base_name, dest_path };
+
+    int reused;
+    int src = pool_acquire(from, &reused);
+    if (src < 0)
+    {
+        return -1;
+    }
+    struct dfs_header reply;
+    char message[BUFFER_SIZE];
+    if (dfs_send_request(src, DFS_OP_DOWNLOAD, 0, 0, 1, &path) < 0 || dfs_read_header(src, &reply) < 0 ||
+        dfs_read_message(src, &reply, message, sizeof(message)) < 0 || reply.status != DFS_OK ||
+        (reply.flags & DFS_FLAG_CHUNKED))
+    {
+        close(src);
+        return -1;
+    }
+    int dst = pool_acquire(to, &reused);
+    char *buffer = malloc(RELAY_BUFFER_SIZE);
+    if (dst < 0 || buffer == NULL || dfs_send_request(dst, DFS_OP_UPLOAD, 0, reply.length, 2, argv) < 0)
+    {
+        free(buffer);
+        close(src);
+        if (dst >= 0) close(dst);
+        return -1;
+    }
+
+    uint32_t crc = 0;
+    uint64_t remaining = reply.length;
+    while (remaining > 0)
+    {
+        size_t len = (remaining < RELAY_BUFFER_SIZE) ? remaining : RELAY_BUFFER_SIZE;
+        rebalance_throttle(len);
+        if (dfs_read_full(src, buffer, len) < 0 || dfs_write_full(dst, buffer, len) < 0)
+        {
+            // Closing the connection early makes the destination discard the partial file
+            free(buffer);
+            close(src);
+            close(dst);
+            return -1;
+        }
+        crc = dfs_checksum_update(crc, buffer, len);
+        remaining -= len;
+    }
+    free(buffer);
+    pool_release(from, src);
+
+    struct dfs_header done;
+    if (dfs_read_header(dst, &done) < 0 || dfs_read_message(dst, &done, message, sizeof(message)) < 0 ||
+        done.length != 0)
+    {
+        close(dst);
+        return -1;
+    }
+    pool_release(to, dst);
+    dfs_checksum_format(crc, reply.length, checksum);
+    return (done.status == DFS_OK) ? 0 : -1;
+}
+
+// Function to wait until the rebalancer may send len more bytes
+// The allowance grows at the configured rate up to one second's worth, so copies average that
+// rate and never burst past it for long.
+void rebalance_throttle(size_t len)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - rebalancer.refilled.tv_sec) + (now.tv_nsec - rebalancer.refilled.tv_nsec) / 1e9;
+    rebalancer.refilled = now;
+    rebalancer.allowance += elapsed * rebalancer.rate;
+    if (rebalancer.allowance > rebalancer.rate)
+    {
+        rebalancer.allowance = rebalancer.rate;
+    }
+    rebalancer.allowance -= len;
+    if (rebalancer.allowance < 0)
+    {
+        double wait = -rebalancer.allowance / rebalancer.rate;
+        struct timespec pause = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+        nanosleep(&pause, NULL);
+    }
+}
+
+// Function to schedule the removal of a moved file's old copy
+// A worker that looked the file up just before the move, or a client holding a redirect token for
+// the old instance, may still read it, so it is kept for the redirect TTL and
+// REBALANCE_GRACE_SECS more.
+void rebalance_defer(int server, const char *path, const char *checksum)
+{
+    if (rebalancer.npending == REBALANCE_PENDING)
+    {
+        rebalance_flush(1);
+    }
+    struct rebalance_removal *r = &rebalancer.pending[rebalancer.npending++];
+    r->server = server;
+    snprintf(r->path, sizeof(r->path), "%s", path);
+    snprintf(r->checksum, sizeof(r->checksum), "%s", checksum);
+    r->due = time(NULL) + redirect_ttl + REBALANCE_GRACE_SECS;
+}
+
+// Function to remove the old copies whose grace period is over
+// With wait set, first waits for the oldest one's to end, making room for another.
+void rebalance_flush(int wait)
+{
+    time_t now = time(NULL);
+    if (wait && rebalancer.npending > 0 && rebalancer.pending[0].due > now)
+    {
+        sleep(rebalancer.pending[0].due - now);
+        now = time(NULL);
+    }
+    int done = 0;
+    while (done < rebalancer.npending && rebalancer.pending[done].due <= now)
+    {
+        // A copy changed since the move was written by someone else and stays
+        struct rebalance_removal *r = &rebalancer.pending[done++];
+        backend_remove(r->server, r->path, r->checksum);
+    }
+    memmove(rebalancer.pending, rebalancer.pending + done, (rebalancer.npending - done) * sizeof(struct rebalance_removal));
+    rebalancer.npending -= done;
+}
+
+// Function to ask a backend for the checksum of one of its files
+// checksum must have room for DFS_CHECKSUM_MAX bytes. Returns -1 if the file cannot be read.
+int backend_checksum(int server, char *path, char *checksum)
+{
+    char message[BUFFER_SIZE], *payload;
+    uint64_t length;
+    char *argv[] = { path };
+    if (fetch_from_backend(server, DFS_OP_CHECKSUM, 1, argv, message, &payload, &length) < 0)
+    {
+        return -1;
+    }
+    free(payload);
+
+    // A checksum cut short would never match the other instance's
+    if (snprintf(checksum, DFS_CHECKSUM_MAX, "%s", message) >= DFS_CHECKSUM_MAX) return -1;
+    return 0;
+}
+
+// Function to remove a file from a backend if it still has the given checksum
+// Returns -1 if it was not removed.
+int backend_remove(int server, char *path, char *checksum)
+{
+    char message[BUFFER_SIZE], *payload;
+    uint64_t length;
+    char *argv[] = { path, checksum };
+    if (fetch_from_backend(server, DFS_OP_REMOVE, 2, argv, message, &payload, &length) < 0)
+    {
+        return -1;
+    }
+    free(payload);
+    return 0;
+}
+
+// Function to ask a backend for something the directory needs
+// Sends the request on a pooled connection and reads the whole answer: its message into message
+// (BUFFER_SIZE bytes) and its payload into *payload, which the caller frees. Returns -1 if the
+// backend could not be reached or did not answer with success.
+int fetch_from_backend(int server, uint8_t opcode, int argc, char **argv, char *message, char **payload, uint64_t *length)
+{
+    // A pooled connection may have been closed by the peer; retry once on a fresh one
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        int reused;
+        int sockfd = pool_acquire(server, &reused);
+        if (sockfd < 0)
+        {
+            return -1;
+        }
+
+        struct dfs_header reply;
+        if (dfs_send_request(sockfd, opcode, 0, 0, argc, argv) < 0 || dfs_read_header(sockfd, &reply) < 0)
+        {
+            close(sockfd);
+            if (!reused)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        char *data = malloc(reply.length + 1);
+        if (data == NULL || dfs_read_message(sockfd, &reply, message, BUFFER_SIZE) < 0 ||
+            dfs_read_full(sockfd, data, reply.length) < 0)
+        {
+            free(data);
+            close(sockfd);
+            return -1;
+        }
+        pool_release(server, sockfd);
+        if (reply.status != DFS_OK)
+        {
+            free(data);
+            return -1;
+        }
+        *payload = data;
+        *length = reply.length;
+        return 0;
+    }
+    return -1;
+}
+
+// Function to forward a bulk request to a backend and stream its response to the client
+// Uses a pooled connection; a reused one that fails before answering is retried once on a fresh one.
+int forward_to_server(int server, int client_sock, struct dfs_request *req)
+{
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        int reused;
+        int sockfd = pool_acquire(server, &reused);
+        if (sockfd < 0)
+        {
+            break;
+        }
+
+        struct dfs_header reply;
+        if (dfs_send_request(sockfd, req->hdr.opcode, req->hdr.request_id, 0, req->argc, req->argv) == 0 &&
+            dfs_read_header(sockfd, &reply) == 0)
+        {
+            if (forward_reply(sockfd, client_sock, req, &reply) < 0)
+            {
+                close(sockfd);
+                return -1;
+            }
+            pool_release(server, sockfd);
+            return (reply.status == DFS_OK) ? 0 : -1;
+        }
+
+        close(sockfd);
+        if (!reused)
+        {
+            break;
+        }
+    }
+
+    dfs_send_status(client_sock, req, DFS_EUNAVAIL, "ERROR: Connection to server failed");
+    return -1;
+}
+
+// Function to pass a backend's response on to the client
+// Status messages are forwarded as they are; a payload is streamed through with relay_stream().
+// Returns -1 if either connection failed, leaving the backend connection unusable.
+int forward_reply(int sockfd, int client_sock, struct dfs_request *req, struct dfs_header *reply)
+{
+    char message[BUFFER_SIZE];
+    if (dfs_read_message(sockfd, reply, message, sizeof(message)) < 0)
+    {
+        dfs_send_status(client_sock, req, DFS_EUNAVAIL, "ERROR: No response from target server");
+        return -1;
+    }
+
+    if (reply->status == DFS_OK && (reply->flags & DFS_FLAG_CHUNKED))
+    {
+        // Relay a chunked payload chunk by chunk, up to the empty chunk that ends it
+        uint32_t len;
+        if (dfs_send_chunked_header(client_sock, req, message) < 0)
+        {
+            shutdown(client_sock, SHUT_RDWR);
+            return -1;
+        }
+        do
+        {
+            if (dfs_read_chunk_size(sockfd, &len) < 0)
+            {
+                shutdown(client_sock, SHUT_RDWR);
+                return -1;
+            }
+            uint32_t size = htobe32(len);
+            if (dfs_write_full(client_sock, &size, sizeof(size)) < 0 ||
+                (len > 0 && relay_stream(sockfd, client_sock, len) < 0))
+            {
+                shutdown(client_sock, SHUT_RDWR);
+                return -1;
+            }
+        } while (len > 0);
+        return 0;
+    }
+
+    if (reply->length == 0)
+    {
+        return dfs_send_status(client_sock, req, reply->status, message);
+    }
+
+    if (dfs_send_data_header(client_sock, req, reply->length) < 0 ||
+        relay_stream(sockfd, client_sock, reply->length) < 0)
+    {
+        // The client expects the rest of the payload, so the session cannot continue
+        shutdown(client_sock, SHUT_RDWR);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to send a request to another server and receive its response
+// Borrows an authenticated connection from the pool, forwards the client's request and reads the reply.
+int send_to_server(int server, const struct dfs_request *req, struct dfs_header *reply, char *response)
+{
+    bzero(response, BUFFER_SIZE);
+
+    // A pooled connection may have been closed by the peer; retry once on a fresh one
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        int reused;
+        int sockfd = pool_acquire(server, &reused);
+        if (sockfd < 0)
+        {
+            return -1;
+        }
+
+        int got_reply = 0;
+        if (dfs_send_request(sockfd, req->hdr.opcode, req->hdr.request_id, 0, req->argc, req->argv) == 0 &&
+            read_reply(sockfd, reply, response, &got_reply) == 0)
+        {
+            pool_release(server, sockfd);
+            return 0;
+        }
+
+        close(sockfd);
+        if (!reused || got_reply)
+        {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// Function to read one response from a pooled connection
+// Copies the message, or the payload when there is one, into response as a C string.
+// At most BUFFER_SIZE - 1 bytes are kept; the rest is discarded so the connection stays usable.
+int read_reply(int sockfd, struct dfs_header *reply, char *response, int *got_reply)
+{
+    if (dfs_read_header(sockfd, reply) < 0)
+    {
+        return -1;
+    }
+    *got_reply = 1;
+
+    if (dfs_read_message(sockfd, reply, response, BUFFER_SIZE) < 0)
+    {
+        return -1;
+    }
+    if (reply->length == 0)
+    {
+        return 0;
+    }
+
+    size_t keep = (reply->length < BUFFER_SIZE - 1) ? reply->length : BUFFER_SIZE - 1;
+    if (dfs_read_full(sockfd, response, keep) < 0)
+    {
+        return -1;
+    }
+    response[keep] = '\0';
+    return dfs_discard(sockfd, reply->length - keep);
+}
+
+// Function to move len bytes from one socket to another
+// Uses splice() through a pipe so the data never enters user space, and falls back to
+// a read/write loop when splice is unavailable or disabled with DFS_NO_SPLICE. Small
+// transfers (batches of small uploads) skip the pipe setup and are copied directly.
+int relay_stream(int from_sock, int to_sock, off_t len) 
+{
+    char *no_splice = getenv("DFS_NO_SPLICE");
+    if (len >= SPLICE_MIN_SIZE && (no_splice == NULL || no_splice[0] == '\0' || strcmp(no_splice, "0") == 0)) 
+    {
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC) == 0) 
+        {
+            // A larger pipe means fewer splice() calls per transfer
+            fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+
+            off_t taken = 0;
+            int result = splice_stream(from_sock, to_sock, pipefd, len, &taken);
+            close(pipefd[0]);
+            close(pipefd[1]);
+            if (result == 0) 
+            {
+                return 0;
+            }
+            // Only fall back if splice refused before taking any data from the source; bytes
+            // already in the pipe would otherwise be lost
+            if (taken > 0 || (errno != EINVAL && errno != ENOSYS)) 
+            {
+                return -1;
+            }
+        }
+    }
+    return copy_stream(from_sock, to_sock, len);
+}
+
+// Function to splice len bytes between two sockets through a pipe
+// Reports how many bytes were taken from from_sock in taken, whether or not they were delivered.
+int splice_stream(int from_sock, int to_sock, int pipefd[2], off_t len, off_t *taken) 
+{
+    off_t remaining = len;
+    while (remaining > 0) 
+    {
+        size_t chunk = (remaining < SPLICE_PIPE_SIZE) ? remaining : SPLICE_PIPE_SIZE;
+        ssize_t in = splice(from_sock, NULL, pipefd[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) continue;
+        if (in <= 0) 
+        {
+            if (in == 0) errno = EPIPE; // Peer closed before sending everything
+            return -1;
+        }
+        *taken += in;
+
+        // Drain the pipe completely before reading more
+        while (in > 0) 
+        {
+            ssize_t out = splice(pipefd[0], NULL, to_sock, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) continue;
+            if (out <= 0) 
+            {
+                return -1;
+            }
+            in -= out;
+            remaining -= out;
+        }
+    }
+    return 0;
+}
+
+// Function to copy len bytes between two sockets through a user-space buffer
+// Fallback for kernels or socket types that do not support splice().
+int copy_stream(int from_sock, int to_sock, off_t len) 
+{
+    char *buffer = malloc(RELAY_BUFFER_SIZE);
+    if (buffer == NULL) 
+    {
+        return -1;
+    }
+
+    off_t remaining = len;
+    while (remaining > 0) 
+    {
+        ssize_t n = read(from_sock, buffer, (remaining < RELAY_BUFFER_SIZE) ? remaining : RELAY_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || dfs_write_full(to_sock, buffer, n) < 0) 
+        {
+            free(buffer);
+            return -1;
+        }
+        remaining -= n;
+    }
+    free(buffer);
+    return 0;
+}
+
+// Function to resolve the backend hosts of the routing table once
+// Every later connection reuses the cached address instead of doing a DNS lookup.
+int resolve_backends() 
+{
+    for (int i = 2; i < routes.nservers; i++) 
+    {
+        struct hostent *server = gethostbyname(routes.servers[i].host);
+        if (server == NULL) 
+        {
+            fprintf(stderr, "ERROR: Cannot resolve %s for %s\n", routes.servers[i].host, routes.servers[i].name);
+            return -1;
+        }
+
+        bzero((char *)&backend_addrs[i], sizeof(backend_addrs[i]));
+        backend_addrs[i].sin_family = AF_INET;
+        backend_addrs[i].sin_port = htons(routes.servers[i].port);
+        bcopy((char *)server->h_addr, (char *)&backend_addrs[i].sin_addr.s_addr, server->h_length);
+    }
+    return 0;
+}
+
+// Function to open a new connection to a backend server
+// Uses the cached backend address and disables Nagle for request/response traffic.
+int connect_backend(int server) 
+{
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) 
+    {
+        return -1;
+    }
+
+    // connect() gives up after the send timeout, so an inline request does not wait out TCP's own timeout
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &io_timeout, sizeof(io_timeout));
+    struct sockaddr_in serv_addr = backend_addrs[server];
+    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) 
+    {
+        close(sockfd);
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    return sockfd;
+}
+
+// Function to take a connection to a backend from the pool
+// Idle connections are health-checked before reuse; a new authenticated connection is opened if none is usable.
+// The connection gets the running request's io_timeout.
+int pool_acquire(int server, int *reused) 
+{
+    int sockfd = pool_take(server);
+    *reused = (sockfd >= 0);
+    if (sockfd >= 0) 
+    {
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &io_timeout, sizeof(io_timeout));
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &io_timeout, sizeof(io_timeout));
+        return sockfd;
+    }
+
+    sockfd = connect_backend(server);
+    if (sockfd < 0) 
+    {
+        return -1;
+    }
+
+    // Authenticate so the backend keeps the connection open for further requests; a backend that
+    // accepts connections but never answers (stopped or stalled) is given up on
+    char *argv[] = { (char *)pool_secret() };
+    struct dfs_header reply;
+    char response[BUFFER_SIZE];
+    int got_reply = 0;
+    struct timeval wait = { POOL_AUTH_TIMEOUT, 0 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+    if (dfs_send_request(sockfd, DFS_OP_AUTH, 0, 0, 1, argv) < 0 ||
+        read_reply(sockfd, &reply, response, &got_reply) < 0 || reply.status != DFS_OK) 
+    {
+        close(sockfd);
+        return -1;
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &io_timeout, sizeof(io_timeout));
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &io_timeout, sizeof(io_timeout));
+    return sockfd;
+}
+
+// Function to take an idle connection to a backend, if a usable one is pooled
+// Idle connections are health-checked before reuse. Returns -1 if none is left.
+int pool_take(int server) 
+{
+    struct backend_pool *pool = &pools[server];
+
+    pool_reap(time(NULL));
+    while (pool->nidle > 0) 
+    {
+        // Most recently used first, since it is the least likely to have gone stale
+        struct pooled_conn pc = pool->idle[--pool->nidle];
+        if (pool_healthy(pc.fd)) 
+        {
+            return pc.fd;
+        }
+        close(pc.fd);
+    }
+    return -1;
+}
+
+// Function to return a connection to the pool after a successful exchange
+// The connection is closed instead when the pool for that backend is full.
+void pool_release(int server, int sockfd) 
+{
+    struct backend_pool *pool = &pools[server];
+    if (pool->nidle == POOL_MAX_IDLE) 
+    {
+        close(sockfd);
+        return;
+    }
+
+    pool->idle[pool->nidle].fd = sockfd;
+    pool->idle[pool->nidle].last_used = time(NULL);
+    pool->nidle++;
+}
+
+// Function to check that an idle pooled connection is still usable
+// An idle connection must have nothing to read; EOF or stray data means it cannot be reused.
+int pool_healthy(int sockfd) 
+{
+    char byte;
+    ssize_t n = recv(sockfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// Function to close pooled connections that have been idle for too long
+// Idle connections are ordered oldest first, so expired ones are at the front.
+void pool_reap(time_t now) 
+{
+    for (int i = 2; i < routes.nservers; i++) 
+    {
+        struct backend_pool *pool = &pools[i];
+        int expired = 0;
+        while (expired < pool->nidle && now - pool->idle[expired].last_used >= POOL_IDLE_TIMEOUT) 
+        {
+            close(pool->idle[expired].fd);
+            expired++;
+        }
+        if (expired > 0) 
+        {
+            memmove(pool->idle, pool->idle + expired, (pool->nidle - expired) * sizeof(struct pooled_conn));
+            pool->nidle -= expired;
+        }
+    }
+}
+
+// Function to drop the pool in a forked child
+// The parent keeps using those connections, so the child must not touch them.
+void pool_forget() 
+{
+    for (int i = 2; i < routes.nservers; i++) 
+    {
+        for (int j = 0; j < pools[i].nidle; j++) 
+        {
+            close(pools[i].idle[j].fd);
+        }
+        pools[i].nidle = 0;
+    }
+}
+
+// Function to get the shared secret used to authenticate pooled connections
+// Taken from DFS_SECRET so deployments can set their own.
+const char *pool_secret() 
+{
+    char *env = getenv("DFS_SECRET");
+    return (env != NULL && env[0] != '\0') ? env : DEFAULT_SECRET;
+}
+
+// Function to create a directory tree for a given path
+// Ensures that all intermediate directories in the path exist.
+int create_directory_tree(char *path) 
+{
+    char *p;
+    char tmp[MAX_PATH_LEN];
+    
+    snprintf(tmp, MAX_PATH_LEN, "%s", path);
+    
+    // Skip leading slash if present
+    if (tmp[0] == '/') 
+    {
+        p = tmp + 1;
+    } else {
+        p = tmp;
+    }
+    
+    // Create each directory in the path
+    while ((p = strchr(p, '/'))) 
+    {
+        *p = '\0';
+        if (mkdir(tmp, 0755) && errno != EEXIST) 
+        {
+            return -1;
+        }
+        *p = '/';
+        p++;
+    }
+    
+    // Create the final directory
+    if (mkdir(tmp, 0755) && errno != EEXIST) 
+    {
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Function to handle errors
+// Prints the error message and exits the program.
+void error(const char *msg) 
+{
+    perror(msg);
+    exit(1);
 }
\ No newline at end of file
@@ -1,7 +1,10 @@
 // Distributed File System - S2 Server Implementation
 // This file implements the server (S2) which handles PDF files.
+// Started with DFS_EXT it keeps another type instead, one S1's routing table (DFS_ROUTES) adds.
 // S2 receives commands from S1 and processes them accordingly.
 
+#define _GNU_SOURCE // for accept4(), sched_setaffinity() and renameat2()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,261 +22,991 @@
 #include <sys/sendfile.h>
 #include <time.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include "dfs_protocol.h"
+#include "dfs_listing.h"
+#include "dfs_index.h"
+#include "dfs_watch.h"
+#include "dfs_tar.h"
+#include "dfs_gzip.h"
+#include "dfs_token.h"
+#include "dfs_checksum.h"
+#include "dfs_routes.h"
 
-#define PORT 4308
-#define MAX_CLIENTS 5
+#define PORT 4308 // Default port; DFS_PORT overrides it
+#define MAX_CLIENTS 4096
 #define BUFFER_SIZE 1024
 #define MAX_PATH_LEN 1024
+#define RECV_BUFFER_SIZE 65536 // Chunk size when receiving uploads
+#define MAX_EVENTS 256
+#define MAX_WORKERS 256
+#define DEFAULT_IDLE_TIMEOUT 60 // Seconds a session may stay idle (DFS_IDLE_TIMEOUT)
+#define DEFAULT_SECRET "dfs-shared-secret" // Used when DFS_SECRET is not set
+
+// Connection states for the event loop
+enum conn_state
+{
+    CONN_READ_HEADER, // Waiting for the next request header from S1
+    CONN_READ_ARGS, // Waiting for the request's argument block
+    CONN_DISPATCH, // Request is complete and ready to run
+    CONN_DONE // Connection can be closed
+};
+
+// Per-connection state tracked by the event loop
+struct conn
+{
+    int fd; // Socket connected to S1, or to a client S1 redirected here
+    enum conn_state state; // Current state
+    size_t len; // Bytes of the current header or argument block received so far
+    unsigned char header[DFS_HEADER_SIZE]; // Raw request header
+    char *args; // Argument block of the current request
+    struct dfs_request req; // Decoded request
+    int session; // Authenticated S1 connection that stays open between requests
+    time_t last_active; // When S1 last sent data
+    struct conn *prev, *next; // Neighbours in the list of open connections
+};
+
+// Open connections, least recently active first
+struct conn *conn_head = NULL;
+struct conn *conn_tail = NULL;
+int loop_listener = -1; // This worker's listening socket
+int loop_epfd = -1; // This worker's epoll instance
+int loop_sigfd = -1; // This worker's SIGCHLD descriptor
+int idle_timeout = DEFAULT_IDLE_TIMEOUT; // Seconds before an idle session is closed
+int require_auth = 1; // Refuse requests that come neither from S1 nor with a token (DFS_REQUIRE_AUTH)
+const char *server_name = "S2"; // Instance name (DFS_NAME), as S1's routing table calls it
+int listen_port = PORT; // Port this instance listens on (DFS_PORT)
+const char *file_ext = ".pdf"; // Type of file this instance keeps (DFS_EXT)
+char file_type[DFS_ROUTES_EXT_MAX] = "PDF"; // The type as messages name it, file_ext in capitals
+char store_dir[MAX_PATH_LEN]; // Where this instance keeps its files, ~/<instance name>
+struct dfs_tar_cache tar_cache; // Cached archive of the instance's files
+struct dfs_index path_index; // Index of the instance's files, shared by all processes
 
 // Function prototypes
-void handle_client(int client_sock);
-int upload_file(int client_sock, char *filename, char *dest_path);
-int download_file(int client_sock, char *filename);
-int remove_file(int client_sock, char *filename);
-int download_tar(int client_sock);
-int display_filenames(int client_sock, char *pathname);
+int configured_workers();
+int configured_idle_timeout();
+int configured_require_auth();
+int open_listener(int port);
+pid_t start_worker(int index, int *listeners, int nworkers);
+void pin_to_cpu(int index);
+void event_loop(int listen_sock);
+void accept_clients(int epfd, int listen_sock);
+void conn_touch(struct conn *c, time_t now);
+void conn_close(int epfd, struct conn *c);
+void conn_sweep(int epfd, time_t now);
+int next_timeout_ms(time_t now);
+void conn_on_readable(struct conn *c);
+int conn_parse_header(struct conn *c);
+void dispatch_request(struct conn *c);
+void run_request(struct conn *c);
+void serve_session(struct conn *c);
+void leave_event_loop(struct conn *keep);
+void authenticate_session(struct conn *c);
+int check_token(struct dfs_request *req);
+const char *shared_secret();
+int is_bulk_request(const struct dfs_request *req);
+void handle_client(int client_sock, struct dfs_request *req);
+int upload_file(int client_sock, struct dfs_request *req, char *filename, char *dest_path);
+int download_file(int client_sock, struct dfs_request *req, char *filename);
+int remove_file(int client_sock, struct dfs_request *req, char *filename, const char *expected);
+int checksum_file(int client_sock, struct dfs_request *req, char *filename);
+int download_tar(int client_sock, struct dfs_request *req);
+int display_filenames(int client_sock, struct dfs_request *req, char *pathname);
+int sync_index(int client_sock, struct dfs_request *req);
+int send_filter(int client_sock, struct dfs_request *req);
 int create_directory_tree(char *path);
+int send_typed_status(int client_sock, const struct dfs_request *req, uint16_t status, const char *format);
 void error(const char *msg);
 
-// Main function initializes the server and listens for connections from S1.
-// It creates a child process for each connection to handle requests concurrently.
-int main() 
+// Main function initializes the server and supervises its worker processes.
+// Every worker owns a SO_REUSEPORT listener pinned to a CPU and runs its own event loop.
+int main()
+{
+    // Raise the descriptor limit so one process can hold many connections
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // A peer that hangs up mid-transfer should fail the write, not kill the worker
+    signal(SIGPIPE, SIG_IGN);
+
+    // Open one listener per worker up front so binding errors surface immediately
+    // and a respawned worker inherits the connections queued on its listener.
+    int nworkers = configured_workers();
+    idle_timeout = configured_idle_timeout();
+    require_auth = configured_require_auth();
+
+    // Several instances of this server can run on one host, each under its own name and port
+    if (getenv("DFS_NAME") != NULL && getenv("DFS_NAME")[0] != '\0' && strchr(getenv("DFS_NAME"), '/') == NULL &&
+        strlen(getenv("DFS_NAME")) < DFS_ROUTES_NAME_MAX)
+    {
+        server_name = getenv("DFS_NAME");
+    }
+    if (getenv("DFS_PORT") != NULL && atoi(getenv("DFS_PORT")) > 0)
+    {
+        listen_port = atoi(getenv("DFS_PORT"));
+    }
+    if (getenv("DFS_EXT") != NULL && getenv("DFS_EXT")[0] != '\0')
+    {
+        if (!dfs_routes_valid_ext(getenv("DFS_EXT")) || strcmp(getenv("DFS_EXT"), ".c") == 0)
+        {
+            fprintf(stderr, "ERROR: Invalid DFS_EXT %s\n", getenv("DFS_EXT"));
+            exit(1);
+        }
+        file_ext = getenv("DFS_EXT");
+        dfs_routes_type_name(file_ext, file_type, sizeof(file_type));
+    }
+    snprintf(store_dir, MAX_PATH_LEN, "%s/%s", getenv("HOME"), server_name);
+    dfs_index_init(&path_index, store_dir, file_ext); // Before the workers, who share it
+    char cache_name[DFS_TAR_CACHE_NAME_MAX];
+    snprintf(cache_name, sizeof(cache_name), "%sfiles-%s", file_ext + 1, server_name); // Apart from other instances' archives
+    if (dfs_tar_cache_init(&tar_cache, cache_name, file_ext, &path_index) < 0)
+    {
+        fprintf(stderr, "WARNING: Archive cache unavailable; every downltar plans its archive afresh\n");
+    }
+    dfs_watch_start(&path_index, &tar_cache); // Follows changes made to store_dir by other programs
+    int *listeners = malloc(nworkers * sizeof(int));
+    pid_t *workers = malloc(nworkers * sizeof(pid_t));
+    if (listeners == NULL || workers == NULL)
+    {
+        error("ERROR allocating worker table");
+    }
+    for (int i = 0; i < nworkers; i++)
+    {
+        listeners[i] = open_listener(listen_port);
+    }
+
+    // Print server start message
+    printf("%s server (%s files) started on port %d with %d workers\n", server_name, file_type, listen_port, nworkers);
+    fflush(stdout);
+
+    for (int i = 0; i < nworkers; i++)
+    {
+        workers[i] = start_worker(i, listeners, nworkers);
+    }
+
+    // Respawn workers that die; the listeners stay open in the supervisor
+    while (1)
+    {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+        {
+            if (errno == EINTR) continue;
+            error("ERROR waiting for workers");
+        }
+        for (int i = 0; i < nworkers; i++)
+        {
+            if (workers[i] == pid)
+            {
+                fprintf(stderr, "%s worker %d (pid %d) exited, restarting\n", server_name, i, (int)pid);
+                sleep(1); // Avoid a tight crash loop
+                workers[i] = start_worker(i, listeners, nworkers);
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Function to read the configured worker pool size
+// Uses DFS_WORKERS when set, otherwise one worker per online CPU.
+int configured_workers()
+{
+    char *env = getenv("DFS_WORKERS");
+    int n = (env != NULL) ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > MAX_WORKERS) n = MAX_WORKERS;
+    return n;
+}
+
+// Function to read how long a session may stay idle
+// Uses DFS_IDLE_TIMEOUT (seconds) when set, otherwise DEFAULT_IDLE_TIMEOUT.
+int configured_idle_timeout()
+{
+    char *env = getenv("DFS_IDLE_TIMEOUT");
+    int secs = (env != NULL) ? atoi(env) : DEFAULT_IDLE_TIMEOUT;
+    return (secs > 0) ? secs : DEFAULT_IDLE_TIMEOUT;
+}
+
+// Function to read whether requests must come from S1 or carry a token
+// Uses DFS_REQUIRE_AUTH when set (0 lets anyone in). Otherwise it is on unless redirects are off
+// (DFS_REDIRECT_TTL=0), since redirected clients learn the backends' addresses.
+int configured_require_auth()
+{
+    char *env = getenv("DFS_REQUIRE_AUTH");
+    if (env != NULL && env[0] != '\0')
+    {
+        return atoi(env) > 0;
+    }
+    env = getenv("DFS_REDIRECT_TTL");
+    return (env == NULL || atoi(env) > 0);
+}
+
+// Function to open a non-blocking listening socket on the given port
+// SO_REUSEPORT lets every worker bind its own socket so the kernel spreads accepts across them.
+int open_listener(int port)
 {
-    int sockfd, newsockfd;
-    socklen_t clilen;
-    struct sockaddr_in serv_addr, cli_addr;
-    pid_t pid;
+    int sockfd;
+    struct sockaddr_in serv_addr;
 
     // Create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) 
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sockfd < 0)
     {
         error("ERROR opening socket");
     }
 
+    // Allow quick restarts and several listeners on the same port
+    int opt = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+    {
+        error("ERROR setting SO_REUSEPORT");
+    }
+
     // Initialize socket structure
     bzero((char *) &serv_addr, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(PORT);
+    serv_addr.sin_port = htons(port);
 
     // Bind the host address
-    if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) 
+    if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
     {
         error("ERROR on binding");
     }
 
     // Start listening for the clients
-    listen(sockfd, MAX_CLIENTS);
-    clilen = sizeof(cli_addr);
+    if (listen(sockfd, MAX_CLIENTS) < 0)
+    {
+        error("ERROR on listen");
+    }
+    return sockfd;
+}
 
-    printf("S2 server (PDF files) started on port %d\n", PORT);
+// Function to fork a worker process for the given slot
+// The worker keeps only its own listener, pins itself to a CPU and runs the event loop.
+pid_t start_worker(int index, int *listeners, int nworkers)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        error("ERROR on fork");
+    }
+    if (pid > 0)
+    {
+        return pid;
+    }
 
-    // Main loop to accept connections from S1
-    while (1) 
+    // Worker process: exit together with the supervisor
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1)
     {
-        // Accept connection from S1
-        newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
-        if (newsockfd < 0) 
+        exit(0);
+    }
+
+    for (int i = 0; i < nworkers; i++)
+    {
+        if (i != index) close(listeners[i]);
+    }
+    pin_to_cpu(index);
+    event_loop(listeners[index]);
+    exit(0);
+}
+
+// Function to pin the calling process to one of the CPUs it may run on
+// Workers are spread round-robin over the allowed CPU set.
+void pin_to_cpu(int index)
+{
+    cpu_set_t allowed, target;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    {
+        return;
+    }
+
+    int ncpus = CPU_COUNT(&allowed);
+    if (ncpus <= 0) return;
+    int wanted = index % ncpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        if (wanted-- == 0)
         {
-            error("ERROR on accept");
+            CPU_ZERO(&target);
+            CPU_SET(cpu, &target);
+            sched_setaffinity(0, sizeof(target), &target);
+            return;
         }
+    }
+}
 
-        // Create child process to handle the connection
-        pid = fork();
-        if (pid < 0) 
+// Function to run the epoll event loop
+// Accepts connections from S1, collects their commands without blocking and dispatches complete ones.
+// Short commands run inline; bulk transfers are handed to a child process.
+void event_loop(int listen_sock)
+{
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        error("ERROR creating epoll instance");
+    }
+    loop_listener = listen_sock;
+    loop_epfd = epfd;
+
+    // Deliver SIGCHLD through a descriptor so children are reaped from the loop
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd < 0)
+    {
+        error("ERROR creating signalfd");
+    }
+    loop_sigfd = sigfd;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_sock;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_sock, &ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &sigfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1)
+    {
+        // Wake up in time to close idle sessions
+        int nready = epoll_wait(epfd, events, MAX_EVENTS, next_timeout_ms(time(NULL)));
+        if (nready < 0)
         {
-            error("ERROR on fork");
+            if (errno == EINTR) continue;
+            error("ERROR on epoll_wait");
         }
+        time_t now = time(NULL);
 
-        if (pid == 0) 
+        for (int i = 0; i < nready; i++)
+        {
+            if (events[i].data.ptr == &listen_sock)
+            {
+                // Accept every pending connection
+                accept_clients(epfd, listen_sock);
+            }
+            else if (events[i].data.ptr == &sigfd)
+            {
+                // Drain pending signals and clean up zombie processes
+                struct signalfd_siginfo si;
+                while (read(sigfd, &si, sizeof(si)) == sizeof(si));
+                while (waitpid(-1, NULL, WNOHANG) > 0);
+            }
+            else
+            {
+                struct conn *c = events[i].data.ptr;
+                conn_on_readable(c);
+                if (c->state == CONN_DONE)
+                {
+                    conn_close(epfd, c);
+                }
+                else
+                {
+                    conn_touch(c, time(NULL));
+                }
+            }
+        }
+
+        // Only expire connections once this batch of events no longer refers to them
+        conn_sweep(epfd, now);
+    }
+}
+
+// Function to accept all pending connections on the non-blocking listener
+// Each new client gets its own connection state and is registered edge-triggered.
+void accept_clients(int epfd, int listen_sock)
+{
+    while (1)
+    {
+        int newsockfd = accept4(listen_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newsockfd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("ERROR on accept");
+            }
+            return;
+        }
+
+        // Responses are small frames written back to back on a session; do not let
+        // Nagle hold one back until the previous one is acknowledged
+        int opt = 1;
+        setsockopt(newsockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+        struct conn *c = calloc(1, sizeof(struct conn));
+        if (c == NULL)
         {
-            // Child process
-            close(sockfd);
-            handle_client(newsockfd);
             close(newsockfd);
-            exit(0);
-        } 
-        else 
+            continue;
+        }
+        c->fd = newsockfd;
+        c->state = CONN_READ_HEADER;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, newsockfd, &ev) < 0)
         {
-            // Parent process
             close(newsockfd);
-            // Clean up zombie processes
-            while (waitpid(-1, NULL, WNOHANG) > 0);
+            free(c);
+            continue;
         }
+        conn_touch(c, time(NULL));
+    }
+}
+
+// Function to record activity on a connection
+// Moves it to the tail of the connection list, which therefore stays ordered by last activity.
+void conn_touch(struct conn *c, time_t now)
+{
+    c->last_active = now;
+    if (conn_tail == c) return;
+
+    // Unlink (a new connection is not linked yet)
+    if (c->prev != NULL) c->prev->next = c->next;
+    if (c->next != NULL) c->next->prev = c->prev;
+    if (conn_head == c) conn_head = c->next;
+
+    c->prev = conn_tail;
+    c->next = NULL;
+    if (conn_tail != NULL) conn_tail->next = c;
+    conn_tail = c;
+    if (conn_head == NULL) conn_head = c;
+}
+
+// Function to close a connection and release its state
+// A forked child may still hold the socket, so it is deregistered from epoll explicitly.
+void conn_close(int epfd, struct conn *c)
+{
+    if (c->prev != NULL) c->prev->next = c->next;
+    if (c->next != NULL) c->next->prev = c->prev;
+    if (conn_head == c) conn_head = c->next;
+    if (conn_tail == c) conn_tail = c->prev;
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->args);
+    free(c);
+}
+
+// Function to close sessions that have been idle for too long
+// The list is ordered by last activity, so expired connections are at the front.
+void conn_sweep(int epfd, time_t now)
+{
+    while (conn_head != NULL && now - conn_head->last_active >= idle_timeout)
+    {
+        conn_close(epfd, conn_head);
+    }
+}
+
+// Function to compute how long epoll_wait() may sleep
+// Returns -1 (no timeout) when there is no connection to expire.
+int next_timeout_ms(time_t now)
+{
+    if (conn_head == NULL)
+    {
+        return -1;
+    }
+    time_t left = conn_head->last_active + idle_timeout - now;
+    return (left > 0) ? (int)left * 1000 : 0;
+}
+
+// Function to advance a connection's state machine when its socket becomes readable
+// Reads until the socket is drained (edge-triggered) and dispatches each request once its
+// header and arguments have arrived.
+void conn_on_readable(struct conn *c)
+{
+    while (c->state == CONN_READ_HEADER || c->state == CONN_READ_ARGS)
+    {
+        // Read exactly the header and then exactly the argument block, so an
+        // upload's payload is left in the socket for the handler
+        int in_header = (c->state == CONN_READ_HEADER);
+        size_t total = in_header ? DFS_HEADER_SIZE : c->req.hdr.arg_len;
+        char *dst = in_header ? (char *)c->header : c->args;
+
+        ssize_t n = read(c->fd, dst + c->len, total - c->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0)
+        {
+            // S1 hung up (possibly between requests) or the socket failed
+            c->state = CONN_DONE;
+            return;
+        }
+        c->len += n;
+        if (c->len < total) continue;
+
+        c->len = 0;
+        if (in_header)
+        {
+            conn_parse_header(c);
+        }
+        else
+        {
+            c->state = CONN_DISPATCH;
+        }
+
+        // Sessions come back here to pick up requests that are already queued
+        if (c->state == CONN_DISPATCH)
+        {
+            dispatch_request(c);
+        }
+    }
+}
+
+// Function to decode a complete request header and prepare for its arguments
+// A frame that is not DFS or announces an oversized argument block ends the connection.
+int conn_parse_header(struct conn *c)
+{
+    if (dfs_decode_header(c->header, &c->req.hdr) < 0)
+    {
+        dfs_send_status(c->fd, &c->req, DFS_EPROTO, "ERROR: Malformed request");
+        c->state = CONN_DONE;
+        return -1;
     }
 
-    // Close the socket
-    close(sockfd);
+    c->args = malloc(c->req.hdr.arg_len + 1);
+    if (c->args == NULL)
+    {
+        c->state = CONN_DONE;
+        return -1;
+    }
+    c->state = (c->req.hdr.arg_len > 0) ? CONN_READ_ARGS : CONN_DISPATCH;
     return 0;
 }
 
-// Function to handle requests from S1
-// Parses the command received from S1 and calls the appropriate function.
-void handle_client(int client_sock) 
+// Function to run a complete request for a connection
+// Short requests run inline and authenticated S1 sessions go back to reading the next one.
+// A bulk transfer is handed to a child process, which then owns the session for good.
+void dispatch_request(struct conn *c)
 {
-    char buffer[BUFFER_SIZE];
-    int n;
-    
-    // Read command from client (S1)
-    bzero(buffer, BUFFER_SIZE);
-    n = read(client_sock, buffer, BUFFER_SIZE - 1);
-    if (n < 0) 
+    // The request handlers use blocking I/O on the socket
+    int flags = fcntl(c->fd, F_GETFL, 0);
+    fcntl(c->fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    // Whether a removal is bulk depends on its arguments, so they are split first
+    c->req.argc = dfs_split_args(c->args, c->req.hdr.arg_len, c->req.argv, DFS_MAX_ARGS);
+    if (is_bulk_request(&c->req))
     {
-        error("ERROR reading from socket");
+        // Bulk transfers can take a long time, so they run in a child process
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("ERROR on fork");
+            dfs_reject(c->fd, &c->req, DFS_EIO, "ERROR: Server busy");
+        }
+        else if (pid == 0)
+        {
+            // Child process
+            sigset_t mask;
+            sigemptyset(&mask);
+            sigprocmask(SIG_SETMASK, &mask, NULL);
+            leave_event_loop(c);
+            run_request(c);
+            if (c->session)
+            {
+                serve_session(c);
+            }
+            close(c->fd);
+            exit(0);
+        }
+        free(c->args);
+        c->args = NULL;
+        c->state = CONN_DONE;
+        return;
     }
-    
-    printf("Received command: %s\n", buffer);
-    
-    // Parse command
-    char *cmd = strtok(buffer, " ");
-    if (cmd == NULL)
+
+    run_request(c);
+    free(c->args);
+    c->args = NULL;
+    if (c->session)
+    {
+        fcntl(c->fd, F_SETFL, flags | O_NONBLOCK);
+        c->state = CONN_READ_HEADER;
+    }
+    else
+    {
+        c->state = CONN_DONE;
+    }
+}
+
+// Function to check a request's arguments and run it
+// The caller has already split the arguments into the request.
+// Authentication and tokens are handled here; everything else goes to handle_client().
+void run_request(struct conn *c)
+{
+    if (c->req.argc < 0)
+    {
+        dfs_reject(c->fd, &c->req, DFS_EINVAL, "ERROR: Malformed request arguments");
+    }
+    else if (c->req.hdr.opcode == DFS_OP_AUTH)
+    {
+        authenticate_session(c);
+    }
+    else if ((c->req.hdr.flags & DFS_FLAG_TOKEN) && check_token(&c->req) < 0)
+    {
+        dfs_reject(c->fd, &c->req, DFS_EAUTH, "ERROR: Invalid or expired token");
+    }
+    else if (require_auth && !c->session && !(c->req.hdr.flags & DFS_FLAG_TOKEN))
+    {
+        dfs_reject(c->fd, &c->req, DFS_EAUTH, "ERROR: Authentication required");
+    }
+    else
+    {
+        handle_client(c->fd, &c->req);
+    }
+}
+
+// Function to let go of what a bulk child inherits from its worker, except the connection it serves
+// Left open, the listener would stay in the SO_REUSEPORT group after the worker dies and be handed
+// connections nobody accepts, and connections the worker closes would stay open for their peers.
+void leave_event_loop(struct conn *keep)
+{
+    close(loop_listener);
+    close(loop_epfd);
+    close(loop_sigfd);
+    for (struct conn *c = conn_head; c != NULL; c = c->next)
+    {
+        if (c != keep)
+        {
+            close(c->fd);
+        }
+    }
+}
+
+// Function to keep serving a session in a bulk child
+// The child owns the connection after its transfer, so it serves S1's later requests
+// itself with blocking I/O until S1 hangs up or leaves the session idle too long.
+void serve_session(struct conn *c)
+{
+    while (1)
+    {
+        struct pollfd pfd = { c->fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, idle_timeout * 1000);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) return;
+
+        if (dfs_read_full(c->fd, c->header, DFS_HEADER_SIZE) < 0)
+        {
+            return;
+        }
+        if (dfs_decode_header(c->header, &c->req.hdr) < 0)
+        {
+            dfs_send_status(c->fd, &c->req, DFS_EPROTO, "ERROR: Malformed request");
+            return;
+        }
+
+        c->args = malloc(c->req.hdr.arg_len + 1);
+        if (c->args == NULL || dfs_read_full(c->fd, c->args, c->req.hdr.arg_len) < 0)
+        {
+            return;
+        }
+        c->req.argc = dfs_split_args(c->args, c->req.hdr.arg_len, c->req.argv, DFS_MAX_ARGS);
+        run_request(c);
+        free(c->args);
+        c->args = NULL;
+    }
+}
+
+// Function to authenticate a pooled connection from S1
+// A connection presenting the shared secret becomes a session that carries any number of requests.
+void authenticate_session(struct conn *c)
+{
+    const char *secret = (c->req.argc == 1) ? c->req.argv[0] : "";
+    const char *expected = shared_secret();
+
+    // Compare without an early exit so timing does not leak the secret
+    size_t len = strlen(expected);
+    unsigned char diff = (strlen(secret) != len);
+    for (size_t i = 0; i < len && secret[i] != '\0'; i++)
+    {
+        diff |= (unsigned char)(secret[i] ^ expected[i]);
+    }
+
+    if (diff != 0)
     {
-        write(client_sock, "ERROR: Invalid command", 22);
+        c->session = 0;
+        dfs_send_status(c->fd, &c->req, DFS_EAUTH, "ERROR: Authentication failed");
         return;
     }
-    
-    if (strcmp(cmd, "uploadf") == 0) 
+
+    c->session = 1;
+    dfs_send_status(c->fd, &c->req, DFS_OK, "OK");
+}
+
+// Function to check the token a client presents for a transfer S1 redirected here
+// The token is the request's last argument and is removed from it; it must have been issued for
+// this opcode, these arguments and, for an upload, this size.
+int check_token(struct dfs_request *req)
+{
+    if ((req->hdr.opcode != DFS_OP_DOWNLOAD && req->hdr.opcode != DFS_OP_UPLOAD) || req->argc < 1)
+    {
+        return -1;
+    }
+    const char *token = req->argv[--req->argc];
+    uint64_t size = (req->hdr.opcode == DFS_OP_UPLOAD) ? req->hdr.length : 0;
+    return dfs_token_check(shared_secret(), req->hdr.opcode, size, req->argc, req->argv, token);
+}
+
+// Function to give the secret shared with S1
+const char *shared_secret()
+{
+    const char *secret = getenv("DFS_SECRET");
+    return (secret != NULL && secret[0] != '\0') ? secret : DEFAULT_SECRET;
+}
+
+// Function to decide whether a request should leave the event loop
+// File transfers and anything that reads a whole file are bulk; listings and plain removals are
+// served inline.
+int is_bulk_request(const struct dfs_request *req)
+{
+    return req->hdr.opcode == DFS_OP_UPLOAD || req->hdr.opcode == DFS_OP_DOWNLOAD ||
+           req->hdr.opcode == DFS_OP_TAR || req->hdr.opcode == DFS_OP_CHECKSUM ||
+           (req->hdr.opcode == DFS_OP_REMOVE && req->argc == 2);
+}
+
+// Function to handle requests from S1
+// Checks the request's arguments and calls the appropriate function.
+void handle_client(int client_sock, struct dfs_request *req)
+{
+    // S1's directory polls every few seconds, so its syncs are not logged
+    if (req->hdr.opcode != DFS_OP_SYNC && req->hdr.opcode != DFS_OP_FILTER)
+    {
+        printf("Received request %u: opcode %d", req->hdr.request_id, req->hdr.opcode);
+        for (int i = 0; i < req->argc; i++)
+        {
+            printf(" %s", req->argv[i]);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    if (req->hdr.opcode == DFS_OP_UPLOAD)
     {
         // Handle file upload
-        char *filename = strtok(NULL, " ");
-        char *dest_path = strtok(NULL, " ");
-        if (filename == NULL || dest_path == NULL) 
+        if (req->argc != 2)
         {
-            write(client_sock, "ERROR: Invalid uploadf command format", 36);
+            dfs_reject(client_sock, req, DFS_EINVAL, "ERROR: Invalid uploadf command format");
             return;
         }
-        upload_file(client_sock, filename, dest_path);
-    } 
-    else if (strcmp(cmd, "downlf") == 0) 
+        upload_file(client_sock, req, req->argv[0], req->argv[1]);
+    }
+    else if (req->hdr.opcode == DFS_OP_DOWNLOAD)
     {
         // Handle file download
-        char *filename = strtok(NULL, " ");
-        if (filename == NULL) 
+        if (req->argc != 1)
         {
-            write(client_sock, "ERROR: Invalid downlf command format", 34);
+            dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Invalid downlf command format");
             return;
         }
-        download_file(client_sock, filename);
-    } 
-    else if (strcmp(cmd, "removef") == 0) 
+        download_file(client_sock, req, req->argv[0]);
+    }
+    else if (req->hdr.opcode == DFS_OP_REMOVE)
     {
-        // Handle file removal
-        char *filename = strtok(NULL, " ");
-        if (filename == NULL) {
-            write(client_sock, "ERROR: Invalid removef command format", 35);
+        // Handle file removal (path, and from S1 moving the file, the checksum it must have)
+        if (req->argc != 1 && req->argc != 2)
+        {
+            dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Invalid removef command format");
             return;
         }
-        remove_file(client_sock, filename);
-    } 
-    else if (strcmp(cmd, "downltar") == 0) 
+        remove_file(client_sock, req, req->argv[0], (req->argc == 2) ? req->argv[1] : NULL);
+    }
+    else if (req->hdr.opcode == DFS_OP_TAR)
     {
         // Handle tar file download
-        download_tar(client_sock);
-    } 
-    else if (strcmp(cmd, "dispfnames") == 0)
+        download_tar(client_sock, req);
+    }
+    else if (req->hdr.opcode == DFS_OP_LIST)
     {
-        // Handle display filenames request
-        char *pathname = strtok(NULL, " ");
-        if (pathname == NULL) {
-            write(client_sock, "ERROR: Invalid dispfnames command format", 38);
+        // Handle display filenames request (path, optional page size and cursor)
+        if (req->argc < 1 || req->argc > 3)
+        {
+            dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Invalid dispfnames command format");
             return;
         }
-        display_filenames(client_sock, pathname);
-    } 
-    else 
+        display_filenames(client_sock, req, req->argv[0]);
+    }
+    else if (req->hdr.opcode == DFS_OP_SYNC)
     {
-        // Handle unknown command
-        write(client_sock, "ERROR: Unknown command", 21);
+        // Handle S1's directory catching up with this server's files (epoch, last change seen)
+        if (req->argc != 2)
+        {
+            dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Invalid sync request");
+            return;
+        }
+        sync_index(client_sock, req);
+    }
+    else if (req->hdr.opcode == DFS_OP_FILTER)
+    {
+        // Handle S1's directory asking for a Bloom filter of this server's files
+        if (req->argc != 0)
+        {
+            dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Invalid filter request");
+            return;
+        }
+        send_filter(client_sock, req);
+    }
+    else if (req->hdr.opcode == DFS_OP_CHECKSUM)
+    {
+        // Handle S1 verifying a file it moved here or away from here
+        if (req->argc != 1)
+        {
+            dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Invalid checksum request");
+            return;
+        }
+        checksum_file(client_sock, req, req->argv[0]);
+    }
+    else
+    {
+        // Handle unknown request
+        dfs_reject(client_sock, req, DFS_EINVAL, "ERROR: Unknown command");
     }
 }
 
 // Function to upload a PDF file to S2
-// Receives the file from S1 and stores it in the appropriate directory.
-int upload_file(int client_sock, char *filename, char *dest_path) 
+// Receives the file streamed by S1 and stores it in the appropriate directory.
+int upload_file(int client_sock, struct dfs_request *req, char *filename, char *dest_path)
 {
-    // First, check if the file is a PDF
+    // First, check if the file is a PDF file
     char *ext = strrchr(filename, '.');
-    if (ext == NULL || strcmp(ext, ".pdf") != 0) 
+    if (ext == NULL || strcmp(ext, file_ext) != 0)
     {
-        write(client_sock, "ERROR: S2 only handles PDF files", 31);
+        char message[64];
+        snprintf(message, sizeof(message), "ERROR: S2 only handles %s files", file_type);
+        dfs_reject(client_sock, req, DFS_EINVAL, message);
         return -1;
     }
-    
+
     // Create destination path in S2
-    char s2_path[MAX_PATH_LEN];
-    snprintf(s2_path, MAX_PATH_LEN, "%s/S2%s", getenv("HOME"), dest_path + 3); // +3 to skip "~S1"
-    
+    // Construct the directory, file and temporary paths; one cut short would name another file
+    char *base_name = basename(filename);
+    char s2_path[MAX_PATH_LEN], full_path[MAX_PATH_LEN], tmp_path[MAX_PATH_LEN];
+    if (snprintf(s2_path, MAX_PATH_LEN, "%s%s", store_dir, dest_path + 3) >= MAX_PATH_LEN || // +3 to skip "~S1"
+        snprintf(full_path, MAX_PATH_LEN, "%s/%s", s2_path, base_name) >= MAX_PATH_LEN ||
+        snprintf(tmp_path, MAX_PATH_LEN, "%s/.%s.XXXXXX", s2_path, base_name) >= MAX_PATH_LEN)
+    {
+        dfs_reject(client_sock, req, DFS_EINVAL, "ERROR: Destination path too long");
+        return -1;
+    }
+
     // Create directory tree if needed
-    if (create_directory_tree(s2_path) < 0) 
+    if (create_directory_tree(s2_path) < 0)
     {
-        write(client_sock, "ERROR: Failed to create directory", 32);
+        dfs_reject(client_sock, req, DFS_EIO, "ERROR: Failed to create directory");
         return -1;
     }
-    
-    // Construct full file path
-    char *base_name = basename(filename);
-    char full_path[MAX_PATH_LEN];
-    snprintf(full_path, MAX_PATH_LEN, "%s/%s", s2_path, base_name);
-    
-    // Rename/move the file from temporary location (sent by S1) to final destination
-    if (rename(filename, full_path) < 0) 
+
+    // Receive into a hidden temporary file next to the destination so the final rename is atomic
+    int fd = mkstemp(tmp_path);
+    if (fd < 0)
     {
-        write(client_sock, "ERROR: Failed to move file to destination", 38);
+        dfs_reject(client_sock, req, DFS_EIO, "ERROR: Failed to create file");
         return -1;
     }
-    
-    write(client_sock, "SUCCESS: PDF file stored in S2", 30);
+    fchmod(fd, 0644);
+
+    // Receive file data; the payload follows the request header directly
+    char buffer[RECV_BUFFER_SIZE];
+    off_t remaining = req->hdr.length;
+    while (remaining > 0)
+    {
+        ssize_t n = read(client_sock, buffer, (remaining < RECV_BUFFER_SIZE) ? remaining : RECV_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            // S1 gave up: discard the partial file
+            close(fd);
+            unlink(tmp_path);
+            return -1;
+        }
+        if (dfs_write_full(fd, buffer, n) < 0)
+        {
+            // The disk is full: discard the partial file but keep the connection in sync
+            close(fd);
+            unlink(tmp_path);
+            dfs_discard(client_sock, remaining - n);
+            dfs_send_status(client_sock, req, DFS_EIO, "ERROR: File transfer failed");
+            return -1;
+        }
+        remaining -= n;
+    }
+    close(fd);
+
+    // Move the completed file into place
+    if (rename(tmp_path, full_path) < 0)
+    {
+        unlink(tmp_path);
+        dfs_send_status(client_sock, req, DFS_EIO, "ERROR: Failed to move file to destination");
+        return -1;
+    }
+
+    dfs_index_update(&path_index, full_path);
+    dfs_tar_cache_invalidate(&tar_cache);
+    send_typed_status(client_sock, req, DFS_OK, "SUCCESS: %s file stored in S2");
     return 0;
 }
 
 // Function to download a PDF file from S2
 // Sends the requested file to S1 if it exists.
-int download_file(int client_sock, char *filename) 
+int download_file(int client_sock, struct dfs_request *req, char *filename)
 {
     // Check if file exists in S2
     char s2_path[MAX_PATH_LEN];
-    snprintf(s2_path, MAX_PATH_LEN, "%s/S2%s", getenv("HOME"), filename + 3); // +3 to skip "~S1"
-    
+    snprintf(s2_path, MAX_PATH_LEN, "%s%s", store_dir, filename + 3); // +3 to skip "~S1"
+
     struct stat st;
-    if (stat(s2_path, &st) != 0) 
+    if (stat(s2_path, &st) != 0)
     {
-        write(client_sock, "ERROR: PDF file not found in S2", 30);
+        send_typed_status(client_sock, req, DFS_ENOENT, "ERROR: %s file not found in S2");
         return -1;
     }
-    
+
     // Open file
     int fd = open(s2_path, O_RDONLY);
-    if (fd < 0) 
+    if (fd < 0)
     {
-        write(client_sock, "ERROR: Failed to open PDF file", 29);
+        send_typed_status(client_sock, req, DFS_EIO, "ERROR: Failed to open %s file");
         return -1;
     }
-    
-    // Send file size
-    if (write(client_sock, &st.st_size, sizeof(off_t)) != sizeof(off_t)) 
+
+    // Send the response header announcing the file size
+    if (dfs_send_data_header(client_sock, req, st.st_size) < 0)
     {
         close(fd);
-        write(client_sock, "ERROR: Failed to send file size", 31);
         return -1;
     }
-    
+
     // Send file data
     off_t remaining = st.st_size;
     char buffer[BUFFER_SIZE];
-    while (remaining > 0) 
+    while (remaining > 0)
     {
         ssize_t n = read(fd, buffer, (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE);
-        if (n <= 0)
-        {
-            close(fd);
-            write(client_sock, "ERROR: File transfer failed", 27);
-            return -1;
-        }
-        if (write(client_sock, buffer, n) != n) 
+        if (n <= 0 || dfs_write_full(client_sock, buffer, n) < 0)
         {
+            // The client expects the rest of the file, so the session cannot continue
             close(fd);
-            write(client_sock, "ERROR: File transfer failed", 27);
+            shutdown(client_sock, SHUT_RDWR);
             return -1;
         }
         remaining -= n;
@@ -283,159 +1016,231 @@ int download_file(int client_sock, char *filename)
 }
 
 // Function to remove a PDF file from S2
-// Deletes the specified file if it exists.
-int remove_file(int client_sock, char *filename)
+// Deletes the specified file if it exists. With expected set, the file is deleted only if it
+// still has that checksum: it is moved aside first, so a new upload cannot replace it between the
+// check and the removal, and put back (unless a newer one has arrived meanwhile) if it differs.
+int remove_file(int client_sock, struct dfs_request *req, char *filename, const char *expected)
 {
     // Check if file exists in S2
     char s2_path[MAX_PATH_LEN];
-    snprintf(s2_path, MAX_PATH_LEN, "%s/S2%s", getenv("HOME"), filename + 3); // +3 to skip "~S1"
-    
-    if (unlink(s2_path) == 0) 
+    if (snprintf(s2_path, MAX_PATH_LEN, "%s%s", store_dir, filename + 3) >= MAX_PATH_LEN) // +3 to skip "~S1"
+    {
+        dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Path too long");
+        return -1;
+    }
+
+    if (expected != NULL)
     {
-        write(client_sock, "SUCCESS: PDF file deleted from S2", 32);
+        // The file is moved aside under a longer name, which must not be cut short onto another file
+        char aside[MAX_PATH_LEN], checksum[DFS_CHECKSUM_MAX];
+        if (snprintf(aside, MAX_PATH_LEN, "%s.removing-%d", s2_path, (int)getpid()) >= MAX_PATH_LEN)
+        {
+            dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Path too long");
+            return -1;
+        }
+        if (rename(s2_path, aside) < 0)
+        {
+            send_typed_status(client_sock, req, DFS_ENOENT, "ERROR: %s file not found in S2");
+            return -1;
+        }
+        int fd = open(aside, O_RDONLY);
+        int same = (fd >= 0 && dfs_checksum_fd(fd, checksum) == 0 && strcmp(checksum, expected) == 0);
+        if (fd >= 0) close(fd);
+        if (!same && renameat2(AT_FDCWD, aside, AT_FDCWD, s2_path, RENAME_NOREPLACE) == 0)
+        {
+            send_typed_status(client_sock, req, DFS_ECHANGED, "ERROR: %s file changed, not deleted");
+            return -1;
+        }
+        unlink(aside);
+        dfs_index_update(&path_index, s2_path);
+        dfs_tar_cache_invalidate(&tar_cache);
+        if (!same)
+        {
+            send_typed_status(client_sock, req, DFS_ECHANGED, "ERROR: %s file changed, not deleted");
+            return -1;
+        }
+        send_typed_status(client_sock, req, DFS_OK, "SUCCESS: %s file deleted from S2");
         return 0;
     }
-    
-    write(client_sock, "ERROR: PDF file not found in S2", 30);
+
+    if (unlink(s2_path) == 0)
+    {
+        dfs_index_update(&path_index, s2_path);
+        dfs_tar_cache_invalidate(&tar_cache);
+        send_typed_status(client_sock, req, DFS_OK, "SUCCESS: %s file deleted from S2");
+        return 0;
+    }
+
+    send_typed_status(client_sock, req, DFS_ENOENT, "ERROR: %s file not found in S2");
     return -1;
 }
 
-// Function to create a tar file containing all PDF files in S2
-// Finds all .pdf files and creates a tar archive to send to S1.
-int download_tar(int client_sock) 
+// Function to send the checksum of a PDF file in S2
+// S1 compares it with the checksum of what it copied when moving the file between instances.
+int checksum_file(int client_sock, struct dfs_request *req, char *filename)
 {
-    char s2_dir[MAX_PATH_LEN];
-    snprintf(s2_dir, MAX_PATH_LEN, "%s/S2", getenv("HOME"));
-    
-    // Create tar file for .pdf files
-    char tar_cmd[MAX_PATH_LEN + 50];
-    snprintf(tar_cmd, sizeof(tar_cmd),
-             "find %s -type f -name \"*.pdf\" | tar -cf /tmp/pdffiles.tar -T -", s2_dir);
+    char s2_path[MAX_PATH_LEN];
+    snprintf(s2_path, MAX_PATH_LEN, "%s%s", store_dir, filename + 3); // +3 to skip "~S1"
 
-    // Execute the tar command
-    if (system(tar_cmd) != 0)
+    int fd = open(s2_path, O_RDONLY);
+    if (fd < 0)
     {
-        write(client_sock, "ERROR: Failed to create tar file", 32);
+        send_typed_status(client_sock, req, DFS_ENOENT, "ERROR: %s file not found in S2");
         return -1;
     }
-    
-    // Check if the tar file was created successfully
-    struct stat st;
-    if (stat("/tmp/pdffiles.tar", &st) != 0) 
+    char checksum[DFS_CHECKSUM_MAX];
+    int result = dfs_checksum_fd(fd, checksum);
+    close(fd);
+    if (result < 0)
     {
-        write(client_sock, "ERROR: Tar file not found", 25);
+        dfs_send_status(client_sock, req, DFS_EIO, "ERROR: Failed to read file");
         return -1;
     }
-    
-    // Open the tar file for reading
-    int fd = open("/tmp/pdffiles.tar", O_RDONLY);
-    if (fd < 0) 
+    dfs_send_status(client_sock, req, DFS_OK, checksum);
+    return 0;
+}
+
+// Function to send a tar archive of the PDF files in S2
+// Archives every file, or those the request's filters select, and streams the archive to S1
+// as it is written, with no temporary file.
+int download_tar(int client_sock, struct dfs_request *req)
+{
+    // Narrow the archive to what the request's filters select
+    struct dfs_tar_filter filter;
+    if (dfs_tar_filter_parse(&filter, req) < 0)
     {
-        write(client_sock, "ERROR: Failed to open tar file", 30);
+        dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Invalid downltar filter");
         return -1;
     }
-    
-    // Send the tar file size to the client
-    write(client_sock, &st.st_size, sizeof(off_t));
-    
-    // Send the tar file data to the client
-    off_t remaining = st.st_size;
-    while (remaining > 0) 
+
+    // Compress the archive on the fly when the client accepts gzip
+    if (dfs_gzip_accepted(req))
     {
-        ssize_t sent = sendfile(client_sock, fd, NULL, remaining);
-        if (sent <= 0) 
+        return dfs_tar_send_gzip(client_sock, req, &tar_cache, store_dir, &filter);
+    }
+
+    // Serve the cached archive, rebuilt first if anything changed since it was made;
+    // a filtered archive is always planned fresh
+    int cached = filter.active ? -1 : dfs_tar_cache_open(&tar_cache, store_dir);
+    if (cached >= 0)
+    {
+        int result = dfs_tar_send_file(client_sock, req, cached);
+        close(cached);
+        if (result < 0)
         {
-            close(fd);
-            write(client_sock, "ERROR: File transfer failed", 27);
-            return -1;
+            // The archive is incomplete, so the session cannot continue
+            shutdown(client_sock, SHUT_RDWR);
         }
-        remaining -= sent;
+        return result;
     }
-    close(fd);
-    
-    // Clean up the tar file
-    unlink("/tmp/pdffiles.tar");
-    
+
+    // Without a usable cache, plan a fresh archive so its exact size can be announced
+    struct dfs_tar tar;
+    if (dfs_tar_collect(&tar, &path_index, store_dir, file_ext, &filter) < 0)
+    {
+        dfs_send_status(client_sock, req, DFS_EIO, "ERROR: Failed to create tar file");
+        return -1;
+    }
+
+    // Send the response header announcing the archive size
+    if (dfs_send_data_header(client_sock, req, tar.size) < 0)
+    {
+        dfs_tar_free(&tar);
+        return -1;
+    }
+
+    // Stream the archive, member by member
+    if (dfs_tar_send(client_sock, &tar) < 0)
+    {
+        // The archive is incomplete, so the session cannot continue
+        dfs_tar_free(&tar);
+        shutdown(client_sock, SHUT_RDWR);
+        return -1;
+    }
+    dfs_tar_free(&tar);
     return 0;
 }
 
 // Function to display filenames of PDF files in S2
-// Recursively lists all .pdf files in the S2 directory.
-int display_filenames(int client_sock, char *pathname) 
+// Lists one page of the .pdf files under the directory, resuming where the cursor says.
+int display_filenames(int client_sock, struct dfs_request *req, char *pathname) 
 {
+    // The page size and the cursor are optional
+    int page = (req->argc > 1) ? atoi(req->argv[1]) : DFS_DEFAULT_PAGE;
+    char cursor[DFS_MAX_CURSOR];
+    snprintf(cursor, sizeof(cursor), "%s", (req->argc > 2) ? req->argv[2] : "");
+    if (page < 1 || page > DFS_MAX_PAGE) 
+    {
+        dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Invalid page size");
+        return -1;
+    }
+
     // Get the corresponding path in S2
     char s2_path[MAX_PATH_LEN];
-    snprintf(s2_path, MAX_PATH_LEN, "%s/S2%s", getenv("HOME"), 
+    snprintf(s2_path, MAX_PATH_LEN, "%s%s", store_dir, 
              (strcmp(pathname, "~S1") == 0) ? "" : (pathname + 3)); // Handle root case
     
     // Check if path exists and is a directory
     struct stat st;
     if (stat(s2_path, &st) != 0 || !S_ISDIR(st.st_mode)) 
     {
-        write(client_sock, "", 0); // Send empty response if directory doesn't exist
+        dfs_send_data(client_sock, req, "", 0); // Send an empty list if directory doesn't exist
         return 0;
     }
     
-    // Get PDF files from S2 recursively
-    char file_list[BUFFER_SIZE] = {0};
+    // Get one page of PDF files from S2, from the index when there is one
+    struct dfs_buf files = { 0 };
+    int found = dfs_index_usable(&path_index) ? dfs_index_page(&path_index, pathname, page, cursor, sizeof(cursor), &files)
+                                              : dfs_walk_page(s2_path, file_ext, pathname, page, cursor, sizeof(cursor), &files);
+    if (found < 0) 
+    {
+        free(files.data);
+        dfs_send_status(client_sock, req, DFS_EINVAL, "ERROR: Invalid listing cursor");
+        return -1;
+    }
     
-    // Recursive directory traversal function
-    void list_pdf_files(const char *base_path, const char *relative_path) 
+    // Send the page to S1, with the cursor for the next one if there is more
+    dfs_send_page(client_sock, req, "", cursor, files.data, files.len);
+    free(files.data);
+    return 0;
+}
+
+// Function to send S1 what its directory needs to catch up with this server's files
+// Answers from the path index: the changes logged since the last one S1 saw, or every file.
+int sync_index(int client_sock, struct dfs_request *req)
+{
+    struct dfs_buf entries = { 0 };
+    char message[128];
+    if (dfs_index_sync(&path_index, strtoull(req->argv[0], NULL, 10), strtoull(req->argv[1], NULL, 10), &entries, message, sizeof(message)) < 0)
     {
-        DIR *dir = opendir(base_path);
-        if (!dir) return;
-        
-        struct dirent *ent;
-        while ((ent = readdir(dir)) != NULL) 
-        {
-            // Skip . and .. directories
-            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) 
-            {
-                continue;
-            }
-            
-            char full_path[MAX_PATH_LEN];
-            snprintf(full_path, sizeof(full_path), "%s/%s", base_path, ent->d_name);
-            
-            char new_relative_path[MAX_PATH_LEN];
-            if (strcmp(relative_path, "") == 0) 
-            {
-                snprintf(new_relative_path, sizeof(new_relative_path), "%s", ent->d_name);
-            } 
-            else 
-            {
-                snprintf(new_relative_path, sizeof(new_relative_path), "%s/%s", relative_path, ent->d_name);
-            }
-            
-            if (ent->d_type == DT_REG) 
-            {
-                // Check if it's a PDF file
-                char *ext = strrchr(ent->d_name, '.');
-                if (ext && strcmp(ext, ".pdf") == 0) 
-                {
-                    // Convert to ~S1-style path
-                    char output_path[MAX_PATH_LEN];
-                    snprintf(output_path, sizeof(output_path), "~S1/%s", new_relative_path);
+        free(entries.data);
+        dfs_send_status(client_sock, req, DFS_EUNAVAIL, "ERROR: No file index to sync from");
+        return -1;
+    }
 
-                    
-                    strncat(file_list, output_path, BUFFER_SIZE - strlen(file_list) - 1);
-                    strncat(file_list, "\n", BUFFER_SIZE - strlen(file_list) - 1);
-                }
-            } 
-            else if (ent->d_type == DT_DIR) 
-            {
-                // Recursively process subdirectory
-                list_pdf_files(full_path, new_relative_path);
-            }
-        }
-        closedir(dir);
+    dfs_send_page(client_sock, req, message, "", entries.data, entries.len);
+    free(entries.data);
+    return 0;
+}
+
+// Function to send S1 a Bloom filter of this server's files
+// Built from the path index; the message gives its epoch, last change and size in bits.
+int send_filter(int client_sock, struct dfs_request *req)
+{
+    uint64_t *words, nbits;
+    char message[128];
+    if (dfs_index_filter(&path_index, &words, &nbits, message, sizeof(message)) < 0)
+    {
+        dfs_send_status(client_sock, req, DFS_EUNAVAIL, "ERROR: No file index to build a filter from");
+        return -1;
     }
-    
-    // Start recursive traversal from the base path
-    list_pdf_files(s2_path, "");
-    
-    // Send the list to S1
-    write(client_sock, file_list, strlen(file_list));
+
+    for (uint64_t i = 0; i < nbits / 64; i++)
+    {
+        words[i] = htole64(words[i]);
+    }
+    dfs_send_page(client_sock, req, message, "", words, nbits / 8);
+    free(words);
     return 0;
 }
 
@@ -479,6 +1284,15 @@ int create_directory_tree(char *path)
     return 0;
 }
 
+// Function to send a status whose message names the instance's file type
+// format holds one %s for it ("ERROR: %s file not found in S2").
+int send_typed_status(int client_sock, const struct dfs_request *req, uint16_t status, const char *format)
+{
+    char message[128];
+    snprintf(message, sizeof(message), format, file_type);
+    return dfs_send_status(client_sock, req, status, message);
+}
+
 // Function to handle errors
 // Prints the error message and exits the program.
 void error(const char *msg) 
@@ -0,0 +1,299 @@
+#!/bin/bash
+
+# Test for the path index's crash recovery and its walks.
+# Drives the index directly through a small client, one run per server lifetime: replays the log
+# across a snapshot, ignores a log record torn by a crash, keeps a log that a failed snapshot
+# moved aside, walks the tree again when the storage root changed while the index was down, and
+# walks the crit-bit tree from keys that are and are not indexed. Then kills S3 while it stores
+# uploads, restarts it and compares its listings with the files on disk. Runs against a
+# throwaway HOME so real data is untouched.
+#
+# Usage: ./test_index.sh
+
+PORT=4398
+
+# Get the absolute path of the script's directory
+SCRIPT_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+WORK_DIR=$(mktemp -d)
+BIN_DIR="$WORK_DIR/bin"
+ROOT="$WORK_DIR/home/T"
+STATE="$WORK_DIR/state"
+FAILED=0
+
+# Function to stop the server and remove the work directory
+cleanup() {
+    pkill -9 -f "^$BIN_DIR/s3$" 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+# Function to report one check
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "PASS: $1"
+    else
+        echo "FAIL: $1 (expected '$3', got '$2')"
+        FAILED=1
+    fi
+}
+
+# Function to run the index client on one storage root as one server lifetime
+# Extra environment comes first, e.g. "DFS_INDEX_SNAPSHOT_RECORDS=1 index_run T settle".
+index_run() {
+    local vars=()
+    while [[ "$1" == *=* ]]; do vars+=("$1"); shift; done
+    local root="$WORK_DIR/home/$1"
+    shift
+    env HOME="$WORK_DIR/home" DFS_INDEX_DIR="$STATE" DFS_INDEX_WATCH=0 "${vars[@]}" \
+        "$BIN_DIR/index_client" "$root" "$@" | tr '\n' ' ' | sed 's/ $//'
+}
+
+# Function to list a storage root's .txt files the way the index names them
+on_disk() {
+    (cd "$1" && find . -name '*.txt' ! -name '.*' | sed 's|^\.||' | sort | tr '\n' ' ' | sed 's/ $//')
+}
+
+# Build S3 and two clients: one for the index itself, one that speaks the S1 protocol -------------
+mkdir -p "$BIN_DIR" "$STATE" "$WORK_DIR/server/S3"
+gcc -O2 -o "$BIN_DIR/s3" "$SCRIPT_DIR/s3.c" -lz -pthread || exit 1
+cat > "$WORK_DIR/index_client.c" << 'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "dfs_index.h"
+
+// Function to print a visited key on a line of its own
+int print_key(void *arg, const struct dfs_index_leaf *leaf)
+{
+    printf("%.*s\n", (int)leaf->key_len, leaf->key);
+    *(int *)arg = 1;
+    return 0;
+}
+
+// Function to remember the last key of a batch
+int keep_key(void *arg, const struct dfs_index_leaf *leaf)
+{
+    memcpy(arg, leaf->key, leaf->key_len);
+    ((char *)arg)[leaf->key_len] = '\0';
+    return print_key(&(int){ 0 }, leaf);
+}
+
+// Function to wait until the snapshot on disk holds every change
+void settle(struct dfs_index_head *h)
+{
+    for (int attempt = 0; attempt < 1000; attempt++)
+    {
+        dfs_index_lock(h);
+        int done = !h->snapshot_missing && h->snapshot_seq == h->seq;
+        dfs_index_unlock(h);
+        if (done) return;
+        usleep(10000);
+    }
+    printf("unsettled\n");
+}
+
+// Function to open the index of root like a server does, then run the operations given after it
+int main(int argc, char *argv[])
+{
+    struct dfs_index idx;
+    if (dfs_index_init(&idx, argv[1], ".txt") < 0) return 1;
+    char path[DFS_WALK_PATH_LEN * 2], last[DFS_INDEX_KEY_MAX];
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "update") == 0)
+        {
+            // update KEY: bring one file's entry in line with the disk
+            snprintf(path, sizeof(path), "%s%s", argv[1], argv[++i]);
+            dfs_index_update(&idx, path);
+        }
+        else if (strcmp(argv[i], "tree") == 0)
+        {
+            // tree KEY: drop everything under a directory
+            dfs_index_remove_tree(&idx, argv[++i]);
+        }
+        else if (strcmp(argv[i], "settle") == 0)
+        {
+            settle(idx.head);
+        }
+        else if (strcmp(argv[i], "count") == 0)
+        {
+            printf("%llu\n", (unsigned long long)idx.head->count);
+        }
+        else if (strcmp(argv[i], "list") == 0)
+        {
+            // list PREFIX BATCH: every key under PREFIX, read BATCH at a time as listings page
+            const char *prefix = argv[++i];
+            int batch = atoi(argv[++i]), visited;
+            strcpy(last, prefix);
+            do
+            {
+                dfs_index_lock(idx.head);
+                visited = dfs_index_walk(idx.head, prefix, last, batch, keep_key, last);
+                dfs_index_unlock(idx.head);
+            } while (visited == batch);
+        }
+        else if (strcmp(argv[i], "walk") == 0)
+        {
+            // walk PREFIX START STRICT MAX: one call of the walk, "none" if it visits nothing
+            int any = 0;
+            dfs_index_lock(idx.head);
+            dfs_index_walk_from(idx.head, argv[i + 1], argv[i + 2], atoi(argv[i + 3]), atoi(argv[i + 4]), print_key, &any);
+            dfs_index_unlock(idx.head);
+            if (!any) printf("none\n");
+            i += 4;
+        }
+    }
+    return 0;
+}
+EOF
+gcc -O2 -I"$SCRIPT_DIR" -o "$BIN_DIR/index_client" "$WORK_DIR/index_client.c" -pthread || exit 1
+cat > "$WORK_DIR/store_client.c" << 'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "dfs_protocol.h"
+
+// Function to send one request and read the status of its reply; the payload is left unread
+int request(int fd, uint8_t opcode, uint64_t length, int argc, char **argv, const void *data, struct dfs_header *hdr, char *message)
+{
+    if (dfs_send_request(fd, opcode, 0, length, argc, argv) < 0 || (length > 0 && dfs_write_full(fd, data, length) < 0) ||
+        dfs_read_header(fd, hdr) < 0 || dfs_read_message(fd, hdr, message, DFS_MAX_ARG_LEN + 1) < 0)
+    {
+        return -1;
+    }
+    return hdr->status;
+}
+
+// Function to open an authenticated session, then either store files or list a folder
+// "store DIR": uploads DIR/f1.txt, DIR/f2.txt, ... until the server goes away.
+// "list DIR": prints the folder's listing, page by page.
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(atoi(argv[1])) };
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) return 1;
+
+    struct dfs_header hdr;
+    char message[DFS_MAX_ARG_LEN + 1];
+    char *secret[] = { "dfs-shared-secret" };
+    if (request(fd, DFS_OP_AUTH, 0, 1, secret, NULL, &hdr, message) != DFS_OK) return 1;
+
+    char dest[256], name[64], cursor[DFS_MAX_CURSOR] = "", data[4096];
+    snprintf(dest, sizeof(dest), "~S1/%s", argv[3]);
+    memset(data, 'x', sizeof(data));
+    if (strcmp(argv[2], "store") == 0)
+    {
+        for (int i = 1;; i++)
+        {
+            snprintf(name, sizeof(name), "f%d.txt", i);
+            char *args[] = { name, dest };
+            if (request(fd, DFS_OP_UPLOAD, sizeof(data), 2, args, data, &hdr, message) != DFS_OK) return 0;
+        }
+    }
+    do
+    {
+        char page[] = "100";
+        char *args[] = { dest, page, cursor };
+        if (request(fd, DFS_OP_LIST, 0, 3, args, NULL, &hdr, message) != DFS_OK) return 1;
+        char *listing = malloc(hdr.length + 1);
+        if (listing == NULL || dfs_read_full(fd, listing, hdr.length) < 0) return 1;
+        fwrite(listing, 1, hdr.length, stdout);
+        free(listing);
+        const char *next = dfs_page_cursor(&hdr, message);
+        snprintf(cursor, sizeof(cursor), "%s", (next != NULL) ? next : "");
+    } while (cursor[0] != '\0');
+    return 0;
+}
+EOF
+gcc -O2 -I"$SCRIPT_DIR" -o "$BIN_DIR/store_client" "$WORK_DIR/store_client.c" || exit 1
+
+# Replay across a snapshot -------------------------------------------------------------------------
+mkdir -p "$ROOT/keep" "$ROOT/sub"
+echo a > "$ROOT/a.txt"; echo b > "$ROOT/b.txt"; echo k > "$ROOT/keep/k.txt"
+check "the first start walks the tree" "$(index_run T settle list / 2)" "/a.txt /b.txt /keep/k.txt"
+
+# Changes up to a snapshot, then more that only reach the log
+echo c > "$ROOT/sub/c.txt"; rm "$ROOT/a.txt"
+index_run DFS_INDEX_SNAPSHOT_RECORDS=1 T update /sub/c.txt update /a.txt settle > /dev/null
+echo d > "$ROOT/sub/d.txt"
+index_run T update /sub/d.txt > /dev/null
+echo h > "$ROOT/keep/hidden.txt" # Never reported, so only a walk of the tree would find it
+check "a restart replays the log on top of the snapshot" "$(index_run T list / 2)" "/b.txt /keep/k.txt /sub/c.txt /sub/d.txt"
+
+# A log record torn by a crash -----------------------------------------------------------------------
+echo e > "$ROOT/sub/e.txt"; echo f > "$ROOT/sub/f.txt"
+index_run T update /sub/e.txt update /sub/f.txt > /dev/null
+truncate -s -3 "$STATE/T.log"
+check "a torn final record is ignored" "$(index_run T list /sub/ 2)" "/sub/c.txt /sub/d.txt /sub/e.txt"
+echo g > "$ROOT/sub/g.txt"
+index_run T update /sub/g.txt > /dev/null
+check "changes logged after a torn record survive the next restart" "$(index_run T list /sub/ 2)" \
+    "/sub/c.txt /sub/d.txt /sub/e.txt /sub/g.txt"
+
+# A log moved aside by a snapshot that then failed ---------------------------------------------------
+echo i > "$ROOT/sub/i.txt"
+index_run T update /sub/i.txt > /dev/null
+mv "$STATE/T.log" "$STATE/T.log.old"
+echo j > "$ROOT/sub/j.txt"
+check "changes in a log left aside are replayed" "$(index_run T update /sub/j.txt list /sub/ 2)" \
+    "/sub/c.txt /sub/d.txt /sub/e.txt /sub/g.txt /sub/i.txt /sub/j.txt"
+index_run DFS_INDEX_SNAPSHOT_RECORDS=1 T settle > /dev/null
+check "the next snapshot takes over the log left aside" "$(ls "$STATE" | grep -c 'T.log.old')" "0"
+check "and keeps its changes" "$(index_run T list /sub/ 2)" "/sub/c.txt /sub/d.txt /sub/e.txt /sub/g.txt /sub/i.txt /sub/j.txt"
+
+# A storage root changed while the index was down ----------------------------------------------------
+check "the index does not see files it was never told of" "$(index_run T list / 2 | grep -c hidden)" "0"
+echo n > "$ROOT/new.txt"
+check "a change at the top level makes the next start walk the tree" "$(index_run T settle list / 2)" "$(on_disk "$ROOT")"
+mv "$ROOT" "$ROOT.old"
+mkdir -p "$ROOT/x"; echo y > "$ROOT/x/y.txt"
+touch -d '2000-01-01' "$ROOT" # Older than the index, so only its identity tells it apart
+check "a replaced storage root is walked again" "$(index_run T settle list / 2)" "/x/y.txt"
+
+# Walks of the crit-bit tree -------------------------------------------------------------------------
+mkdir -p "$WORK_DIR/home/W/a" "$WORK_DIR/home/W/ab" "$WORK_DIR/home/W/c" "$WORK_DIR/home/W/big"
+for f in a/1 a/2 a/3 ab/1 c/1; do echo "$f" > "$WORK_DIR/home/W/$f.txt"; done
+(cd "$WORK_DIR/home/W/big" && seq -f 'f%05g.txt' 1 5000 | xargs touch)
+index_run W settle > /dev/null
+check "a walk starts at an indexed key" "$(index_run W walk /a/ /a/2.txt 0 10)" "/a/2.txt /a/3.txt"
+check "a strict walk starts after it" "$(index_run W walk /a/ /a/2.txt 1 10)" "/a/3.txt"
+check "a walk from a key not indexed starts at the next one" "$(index_run W walk /a/ /a/25.txt 1 10)" "/a/3.txt"
+check "a walk stays within its prefix" "$(index_run W walk /a/ /a/ 0 10)" "/a/1.txt /a/2.txt /a/3.txt"
+check "a strict walk from the last key visits nothing" "$(index_run W walk /a/ /a/3.txt 1 10)" "none"
+check "a prefix between indexed keys visits nothing" "$(index_run W walk /b/ /b/ 0 10)" "none"
+check "a prefix after every key visits nothing" "$(index_run W walk /d/ /d/ 0 10)" "none"
+check "a walk stops after its maximum" "$(index_run W walk / /ab/1.txt 0 2)" "/ab/1.txt /big/f00001.txt"
+check "batches resume where the last one stopped" "$(index_run W list /big/ 7 | wc -w)" "5000"
+check "and never repeat a key" "$(index_run W list /big/ 7 | tr ' ' '\n' | sort -u | wc -l)" "5000"
+rm "$WORK_DIR/home/W/a/2.txt"
+check "a batch resumes after a key removed meanwhile" "$(index_run W update /a/2.txt walk /a/ /a/2.txt 1 10)" "/a/3.txt"
+rm -r "$WORK_DIR/home/W/big"
+check "removing a folder larger than one batch empties it" "$(index_run W tree /big count)" "4"
+
+# Killing S3 while it stores uploads -----------------------------------------------------------------
+for round in 1 2 3; do
+    HOME="$WORK_DIR/server" DFS_PORT=$PORT DFS_WORKERS=2 DFS_INDEX_SNAPSHOT_RECORDS=100 "$BIN_DIR/s3" > /dev/null 2>&1 &
+    disown # Killed below; that is not worth a message
+    for attempt in 1 2 3 4 5 6 7 8 9 10; do
+        "$BIN_DIR/store_client" $PORT list . > /dev/null 2>&1 && break
+        sleep 1
+    done
+    for r in $(seq 1 $((round - 1))); do
+        check "round $((round - 1)): listing of run$r matches the disk after the restart" \
+            "$("$BIN_DIR/store_client" $PORT list run$r | sed 's|^~S1||' | sort | tr '\n' ' ' | sed 's/ $//')" \
+            "$(on_disk "$WORK_DIR/server/S3" | tr ' ' '\n' | grep "^/run$r/" | tr '\n' ' ' | sed 's/ $//')"
+    done
+    "$BIN_DIR/store_client" $PORT store run$round > /dev/null 2>&1 &
+    sleep 1
+    pkill -9 -f "^$BIN_DIR/s3$"
+    wait $! 2>/dev/null
+done
+check "every round stored some files before the kill" "$(ls "$WORK_DIR/server/S3" | wc -l)" "3"
+
+if [ $FAILED -ne 0 ]; then
+    echo "Some index tests failed"
+    exit 1
+fi
+echo "All index tests passed"
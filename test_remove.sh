@@ -0,0 +1,140 @@
+#!/bin/bash
+
+# Test for removals on a pooled S1 connection.
+# Opens one authenticated session to S3, the way S1's pool does, and sends a plain removal
+# followed by a guarded one (a removal that names the file's checksum). The plain removal must
+# be served inline and the guarded one handed to a child process, which then keeps serving the
+# session. Runs against a throwaway HOME so real data is untouched.
+#
+# Usage: ./test_remove.sh
+
+PORT=4399
+
+# Get the absolute path of the script's directory
+SCRIPT_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+WORK_DIR=$(mktemp -d)
+BIN_DIR="$WORK_DIR/bin"
+FAILED=0
+
+# Function to stop the server and remove the work directory
+cleanup() {
+    lsof -ti:$PORT | xargs kill -9 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+# Function to report one check
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "PASS: $1"
+    else
+        echo "FAIL: $1 (expected '$3', got '$2')"
+        FAILED=1
+    fi
+}
+
+# Function to count the S3 processes started by this script
+s3_processes() {
+    pgrep -f "^$BIN_DIR/s3$" | wc -l
+}
+
+# Function to wait for the client's next reply and count the server's processes after it
+next_reply() {
+    for attempt in 1 2 3 4 5 6 7 8 9 10; do
+        [ $(wc -l < "$WORK_DIR/replies") -ge $1 ] && break
+        sleep 1
+    done
+    s3_processes
+    echo >&3
+}
+
+# Build S3 and a client that speaks the S1 protocol directly -------------------------------------
+mkdir -p "$BIN_DIR" "$WORK_DIR/home/S3"
+gcc -O2 -o "$BIN_DIR/s3" "$SCRIPT_DIR/s3.c" -lz -pthread || exit 1
+cat > "$WORK_DIR/remove_client.c" << 'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "dfs_protocol.h"
+
+// Function to send one request, print the status of its reply and wait for the script
+void request(int fd, uint8_t opcode, int argc, char **argv)
+{
+    struct dfs_header hdr;
+    char message[256] = "";
+    if (dfs_send_request(fd, opcode, 0, 0, argc, argv) < 0 || dfs_read_header(fd, &hdr) < 0 ||
+        dfs_read_message(fd, &hdr, message, sizeof(message)) < 0)
+    {
+        printf("none\n");
+        exit(1);
+    }
+    printf("%d\n", hdr.status);
+    fflush(stdout);
+
+    // The script looks at the server's processes before the next request
+    getchar();
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(atoi(argv[1])) };
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) return 1;
+
+    char *secret[] = { "dfs-shared-secret" };
+    char *plain[] = { "~S1/plain.txt" };
+    char *guarded[] = { "~S1/guarded.txt", argv[2] };
+    char *after[] = { "~S1/after.txt" };
+    request(fd, DFS_OP_AUTH, 1, secret);
+    request(fd, DFS_OP_REMOVE, 1, plain);
+    request(fd, DFS_OP_REMOVE, 2, guarded);
+    request(fd, DFS_OP_REMOVE, 1, after);
+    return 0;
+}
+EOF
+gcc -O2 -I"$SCRIPT_DIR" -o "$BIN_DIR/remove_client" "$WORK_DIR/remove_client.c" -lz || exit 1
+
+# Start S3 with one worker -------------------------------------------------------------------------
+echo "This file is removed plainly" > "$WORK_DIR/home/S3/plain.txt"
+echo "This file is removed with its checksum" > "$WORK_DIR/home/S3/guarded.txt"
+echo "This file is removed after the guarded removal" > "$WORK_DIR/home/S3/after.txt"
+CHECKSUM=$(python3 -c 'import sys, zlib; d = open(sys.argv[1], "rb").read(); print("%08x:%d" % (zlib.crc32(d), len(d)))' \
+    "$WORK_DIR/home/S3/guarded.txt")
+
+HOME="$WORK_DIR/home" DFS_PORT=$PORT DFS_WORKERS=1 "$BIN_DIR/s3" > /dev/null 2>&1 &
+disown # cleanup() kills it; that is not worth a message
+for attempt in 1 2 3 4 5 6 7 8 9 10; do
+    lsof -ti:$PORT > /dev/null && break
+    sleep 1
+done
+sleep 1
+BEFORE=$(s3_processes)
+
+# Run the session ----------------------------------------------------------------------------------
+mkfifo "$WORK_DIR/hold"
+"$BIN_DIR/remove_client" $PORT "$CHECKSUM" < "$WORK_DIR/hold" > "$WORK_DIR/replies" &
+CLIENT_PID=$!
+exec 3> "$WORK_DIR/hold"
+next_reply 1 > /dev/null
+AFTER_PLAIN=$(next_reply 2)
+AFTER_GUARDED=$(next_reply 3)
+AFTER_NEXT=$(next_reply 4)
+exec 3>&-
+wait $CLIENT_PID
+
+REPLIES=$(tr '\n' ' ' < "$WORK_DIR/replies")
+check "every request on the session succeeds" "$REPLIES" "0 0 0 0 "
+check "plain removal deletes its file" "$(ls "$WORK_DIR/home/S3" | grep -c '^plain.txt$')" "0"
+check "guarded removal deletes its file" "$(ls "$WORK_DIR/home/S3" | grep -c '^guarded.txt$')" "0"
+check "removal after the guarded one deletes its file" "$(ls "$WORK_DIR/home/S3" | grep -c '^after.txt$')" "0"
+check "plain removal is served inline" "$AFTER_PLAIN" "$BEFORE"
+check "guarded removal is handed to a child" "$AFTER_GUARDED" "$((BEFORE + 1))"
+check "the child keeps serving the session" "$AFTER_NEXT" "$((BEFORE + 1))"
+
+if [ $FAILED -ne 0 ]; then
+    echo "Some removal tests failed"
+    exit 1
+fi
+echo "All removal tests passed"
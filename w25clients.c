@@ -7,46 +7,154 @@
 #include <sys/types.h>
 #include <sys/socket.h> // for socket()
 #include <netinet/in.h>
+#include <netinet/tcp.h> // for TCP_NODELAY
 #include <netdb.h> // for gethostbyname()
 #include <arpa/inet.h> // for inet_ntoa()
 #include <sys/stat.h>
 #include <fcntl.h> // for open()
 #include <libgen.h> // for basename()
 #include <errno.h> // for errno
+#include <signal.h> // for signal()
+#include <poll.h> // for poll()
+#include <time.h> // for clock_gettime()
+#include <sys/sendfile.h> // for sendfile()
+#include "dfs_protocol.h" // for the wire protocol
+#include "dfs_token.h" // for the size of redirect tokens
+#include "dfs_routes.h" // for the rule file types follow
 
 #define PORT 4307 // S1 server port
 #define BUFFER_SIZE 1024 // Buffer size for file transfer
 #define MAX_PATH_LEN 1024 // Maximum path length
+#define DEFAULT_BATCH_WINDOW 32 // Requests kept in flight in batch mode
+#define BATCH_BUFFER_SIZE 65536 // Receive buffer for batch mode
+
+// Request sent in batch mode and still waiting for its response
+struct batch_entry
+{
+    uint32_t request_id;
+    uint8_t opcode;
+    char label[MAX_PATH_LEN]; // Path or file type named in the command
+    char output[MAX_PATH_LEN]; // Local file for downloads, empty otherwise
+    char page[16]; // Page size of a listing
+    int pages; // Pages of a listing received so far
+};
+
+// Request being written to the socket in batch mode
+struct batch_send
+{
+    unsigned char *frame; // Header and arguments, NULL when nothing is pending
+    size_t frame_len;
+    size_t frame_off;
+    int payload_fd; // File being uploaded, -1 if none
+    off_t payload_left;
+};
+
+// Response being assembled from the socket in batch mode
+struct batch_recv
+{
+    unsigned char raw[DFS_HEADER_SIZE];
+    size_t got; // Header bytes received
+    struct dfs_header hdr;
+    char message[DFS_MAX_ARG_LEN + 1]; // Message, and a listing's cursor after it
+    uint32_t msg_len; // Message bytes received
+    uint64_t payload_left; // Payload bytes still to come, or of the current chunk if chunked
+    unsigned char chunk_raw[4]; // Size of the next chunk, as received so far
+    size_t chunk_got;
+    int chunks_done; // The empty chunk ending a chunked payload has arrived
+    int out_fd; // File receiving a download, -1 if none
+    char tmp_path[MAX_PATH_LEN]; // Staging file the download is written to
+};
 
 // Function prototypes
 void error(const char *msg); // Error handling function
 int connect_to_server(); // Function to connect to the server
-void handle_uploadf(int sockfd, char *filename, char *dest_path); // Function to handle file upload
-void handle_downlf(int sockfd, char *filename);
-void handle_removef(int sockfd, char *filename);
-void handle_downltar(int sockfd, char *filetype);
-void handle_dispfnames(int sockfd, char *pathname);
-int send_file(int sockfd, char *filename);
-int receive_file(int sockfd, char *filename);
-
-int main() {
-    int sockfd;
+int connect_to(const char *host, int port); // Function to connect to a server by host and port
+int session_alive(int sockfd); // Function to check that the session to S1 is still open
+int handle_uploadf(int sockfd, char *filename, char *dest_path); // Function to handle file upload
+int handle_downlf(int sockfd, char *filename);
+int handle_removef(int sockfd, char *filename);
+int handle_downltar(int sockfd, char *filetype, char **options);
+int handle_dispfnames(int sockfd, char *pathname, char *page_size);
+int send_request(int sockfd, uint8_t opcode, uint64_t length, int argc, char **argv, uint32_t *request_id);
+int send_flagged_request(int sockfd, uint8_t opcode, uint16_t flags, uint64_t length, int argc, char **argv, uint32_t *request_id);
+int request_redirect(int sockfd, uint8_t opcode, int argc, char **argv, char *token); // Function to ask S1 to let a transfer go direct
+int read_response(int sockfd, uint32_t request_id, struct dfs_header *h, char *message);
+int send_file(int sockfd, char *filename, off_t size);
+int receive_file(int sockfd, uint32_t request_id, char *filename);
+int open_download(const char *filename, char *tmp_path);
+int finish_download(int fd, const char *tmp_path, const char *filename, int complete);
+int check_remote_path(const char *path, const char *what); // Function to check that a path is under ~S1/
+int check_file_type(const char *filename); // Function to check that a file type is supported
+int check_page_size(const char *page_size); // Function to check a listing page size
+int check_encoding(const char *encoding); // Function to check a requested archive encoding
+long long parse_since(const char *value); // Function to read a since= time
+int tar_arguments(char *filetype, char **options, char **argv, char *since_arg, size_t since_size);
+const char *tar_output_name(const char *filetype); // Function to name the local tar file
+int run_batch(FILE *in, int window); // Function to run commands with requests pipelined
+int batch_prepare(char *line, struct batch_entry *e, struct batch_send *out);
+int batch_send_some(int sockfd, struct batch_send *out);
+int batch_continue_listing(struct batch_entry *e, struct batch_recv *rx, struct batch_send *out);
+int batch_receive(struct batch_entry *e, struct batch_recv *rx, char *data, size_t len, size_t *used);
+void batch_report(struct batch_entry *e, struct batch_recv *rx);
+
+uint32_t next_request_id = 1; // Identifies each request sent to S1
+int redirect_mode = 0; // Move file contents to and from the backends directly (DFS_REDIRECT=1)
+
+int main(int argc, char *argv[]) {
+    int sockfd = -1; // Session to S1, kept open across commands
     char buffer[BUFFER_SIZE]; // Buffer for user input
     
+    // Report a server that hangs up mid-upload instead of dying on SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+    redirect_mode = (getenv("DFS_REDIRECT") != NULL && atoi(getenv("DFS_REDIRECT")) > 0);
+
+    // Batch mode: w25clients -b [-n window] [command_file]
+    int batch = 0, window = DEFAULT_BATCH_WINDOW, opt;
+    while ((opt = getopt(argc, argv, "bn:")) != -1) 
+    {
+        if (opt == 'b') 
+        {
+            batch = 1;
+        } 
+        else if (opt == 'n' && atoi(optarg) > 0) 
+        {
+            window = atoi(optarg);
+        } 
+        else 
+        {
+            fprintf(stderr, "Usage: %s [-b [-n window] [command_file]]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (batch) 
+    {
+        FILE *in = (optind < argc) ? fopen(argv[optind], "r") : stdin;
+        if (in == NULL) 
+        {
+            error("ERROR opening command file");
+            return 1;
+        }
+        return (run_batch(in, window) == 0) ? 0 : 1;
+    }
+
     printf("Distributed File System Client\n");
     printf("Available commands:\n");
     printf("  uploadf <filename> <destination_path> (example: uploadf test1.txt ~S1/folder1/)\n");
     printf("  downlf <filename> (example: downlf ~S1/folder1/test1.txt)\n");
     printf("  removef <filename> (example: removef ~S1/folder1/test1.txt)\n");
-    printf("  downltar <filetype> (example: downltar .txt)\n");
-    printf("  dispfnames <pathname> (example: dispfnames ~S1/)\n");
+    printf("  downltar <filetype|all> [gzip] [prefix=~S1/dir] [since=time] [min=bytes] [max=bytes]\n");
+    printf("           (example: downltar .txt gzip prefix=~S1/docs since=2026-10-01)\n");
+    printf("  dispfnames <pathname> [page_size] (example: dispfnames ~S1/)\n");
     printf("  exit\n\n");
     
     while (1) 
     {
         printf("w25clients$ ");
         bzero(buffer, BUFFER_SIZE); 
-        fgets(buffer, BUFFER_SIZE - 1, stdin);
+        if (fgets(buffer, BUFFER_SIZE - 1, stdin) == NULL) 
+        {
+            break; // End of input
+        }
         
         // Remove newline
         buffer[strcspn(buffer, "\n")] = 0;
@@ -63,13 +171,22 @@ int main() {
             break;
         }
         
-        // Connect to server
-        sockfd = connect_to_server();
+        // Reuse the session to S1, reconnecting if the server has closed it (idle timeout)
+        if (sockfd >= 0 && !session_alive(sockfd)) 
+        {
+            close(sockfd);
+            sockfd = -1;
+        }
         if (sockfd < 0) 
         {
-            printf("Failed to connect to server\n");
-            continue;
+            sockfd = connect_to_server();
+            if (sockfd < 0) 
+            {
+                printf("Failed to connect to server\n");
+                continue;
+            }
         }
+        int status = 0;
         
         // Parse command
         char *cmd = strtok(buffer, " ");
@@ -82,10 +199,9 @@ int main() {
             if (filename == NULL || dest_path == NULL) 
             {
                 printf("Invalid command format. Usage: uploadf <filename> <destination_path>\n"); // Example: uploadf test1.txt ~S1/folder1/
-                close(sockfd);
                 continue;
             }
-            handle_uploadf(sockfd, filename, dest_path); // Upload file
+            status = handle_uploadf(sockfd, filename, dest_path); // Upload file
         } 
 
         // task 2 downlf
@@ -95,10 +211,9 @@ int main() {
             if (filename == NULL) 
             {
                 printf("Invalid command format. Usage: downlf <filename>\n");
-                close(sockfd);
                 continue;
             }
-            handle_downlf(sockfd, filename);
+            status = handle_downlf(sockfd, filename);
         }
 		// task 3 removef
         else if (strcmp(cmd, "removef") == 0) 
@@ -107,48 +222,69 @@ int main() {
             if (filename == NULL) 
             {
                 printf("Invalid command format. Usage: removef <filename>\n");
-                close(sockfd);
                 continue;
             }
-            handle_removef(sockfd, filename);
+            status = handle_removef(sockfd, filename);
         } 
 		// task 4 downltar
         else if (strcmp(cmd, "downltar") == 0) 
         {
             char *filetype = strtok(NULL, " ");
+            char *options[DFS_MAX_ARGS + 1]; // Encoding and filters; one too many is reported
+            int noptions = 0;
+            while (noptions < DFS_MAX_ARGS && (options[noptions] = strtok(NULL, " ")) != NULL) 
+            {
+                noptions++;
+            }
+            options[noptions] = NULL;
             if (filetype == NULL) 
             {
-                printf("Invalid command format. Usage: downltar <filetype>\n");
-                close(sockfd);
+                printf("Invalid command format. Usage: downltar <filetype> [gzip] [prefix=~S1/dir] [since=time] [min=bytes] [max=bytes]\n");
                 continue;
             }
-            handle_downltar(sockfd, filetype);
+            status = handle_downltar(sockfd, filetype, options);
         }
 
 		// task 5 dispfnames
         else if (strcmp(cmd, "dispfnames") == 0)
         {
             char *pathname = strtok(NULL, " ");
+            char *page_size = strtok(NULL, " ");
             if (pathname == NULL) 
             {
-                printf("Invalid command format. Usage: dispfnames <pathname>\n");
-                close(sockfd);
+                printf("Invalid command format. Usage: dispfnames <pathname> [page_size]\n");
                 continue;
             }
-            handle_dispfnames(sockfd, pathname);
+            status = handle_dispfnames(sockfd, pathname, page_size);
         } 
         else 
         {
             printf("Unknown command: %s\n", cmd);
         }
         
-        close(sockfd); // Close the socket after each command
+        // A transfer that failed part-way leaves the session out of sync, so start a new one
+        if (status < 0) 
+        {
+            close(sockfd);
+            sockfd = -1;
+        }
     }
     
+    if (sockfd >= 0) 
+    {
+        close(sockfd); // Close the session on exit
+    }
     return 0;
 }
 
 int connect_to_server() // Function to connect to the server
+{
+    return connect_to("localhost", PORT);
+}
+
+// Function to connect to a server by host and port
+// Used for S1 and for the backends S1 redirects transfers to.
+int connect_to(const char *host, int port)
 {
     int sockfd; // Socket file descriptor
     struct sockaddr_in serv_addr; // Server address structure
@@ -162,10 +298,11 @@ int connect_to_server() // Function to connect to the server
     }
     
     // Get server address
-    server = gethostbyname("localhost");
+    server = gethostbyname(host);
     if (server == NULL) 
     {
         fprintf(stderr, "ERROR, no such host\n"); // Host resolution failed
+        close(sockfd);
         return -1;
     }
     
@@ -173,254 +310,1004 @@ int connect_to_server() // Function to connect to the server
     bzero((char *) &serv_addr, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET; // Address family
     bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length); // Copy host address
-    serv_addr.sin_port = htons(PORT); // Port number
+    serv_addr.sin_port = htons(port); // Port number
     
     // Connect to server
     if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) 
     {
         error("ERROR connecting");
+        close(sockfd);
         return -1;
     }
     
+    // Requests are small frames, so send them without waiting on Nagle; keep-alive
+    // probes notice a server that vanished while the session sat idle
+    int opt = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+    
     return sockfd; // Return the socket file descriptor
 }
 
+// Function to check that the session to S1 is still open
+// The server closes sessions that stay idle too long; EOF or stray data means reconnect.
+int session_alive(int sockfd) 
+{
+    char byte;
+    ssize_t n = recv(sockfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
 // Error handling function
-void handle_uploadf(int sockfd, char *filename, char *dest_path) 
+int handle_uploadf(int sockfd, char *filename, char *dest_path) 
 {
     // Verify file exists
     struct stat st;
     if (stat(filename, &st) != 0) 
     {
         printf("ERROR: File '%s' not found\n", filename);
-        return;
+        return 0;
     }
     
-    // Check if destination path starts with ~S1/
-    if (strncmp(dest_path, "~S1/", 4) != 0) 
+    // Check the destination path and the file type
+    if (check_remote_path(dest_path, "Destination path") < 0 || check_file_type(filename) < 0) 
     {
-        printf("ERROR: Destination path must start with ~S1/\n");
-        return;
+        return 0;
     }
     
-    // Check file extension
-    char *ext = strrchr(filename, '.');
-    if (ext == NULL) 
+    // In redirect mode, S1 may send the file to the backend directly (.c files stay in S1)
+    int target = sockfd;
+    uint16_t flags = 0;
+    char token[DFS_TOKEN_MAX];
+    if (redirect_mode && strcmp(strrchr(filename, '.'), ".c") != 0) 
     {
-        printf("ERROR: File has no extension\n");
-        return;
-    }
-    
-    // Check if file type is supported
-    if (strcmp(ext, ".c") != 0 && strcmp(ext, ".pdf") != 0 && strcmp(ext, ".txt") != 0 && strcmp(ext, ".zip") != 0) 
-    {
-        printf("ERROR: Unsupported file type. Only .c, .pdf, .txt, .zip allowed\n");
-        return;
+        char size[24];
+        snprintf(size, sizeof(size), "%lld", (long long)st.st_size);
+        char *ask[] = { filename, dest_path, size };
+        target = request_redirect(sockfd, DFS_OP_UPLOAD, 3, ask, token);
+        if (target < 0) 
+        {
+            return (target == -1) ? -1 : 0;
+        }
+        flags = (target != sockfd) ? DFS_FLAG_TOKEN : 0;
     }
-    
-    // Send command to server
-    char command[BUFFER_SIZE];
-    snprintf(command, BUFFER_SIZE, "uploadf %s %s", filename, dest_path);
-    if (write(sockfd, command, strlen(command)) < 0) 
+
+    // Send the request; the file follows right behind it
+    uint32_t request_id;
+    char *argv[] = { filename, dest_path, token };
+    if (send_flagged_request(target, DFS_OP_UPLOAD, flags, st.st_size, flags ? 3 : 2, argv, &request_id) < 0)
     {
         error("ERROR writing to socket");
-        return;
+        if (target != sockfd) close(target);
+        return (target != sockfd) ? 0 : -1;
     }
-    
-    // Wait for server response
+    int result = send_file(target, filename, st.st_size);
+
+    // Wait for the final response
+    struct dfs_header h;
     char response[BUFFER_SIZE];
-    bzero(response, BUFFER_SIZE);
-    if (read(sockfd, response, BUFFER_SIZE - 1) < 0) 
+    if (result == 0) 
     {
-        error("ERROR reading from socket");
-        return;
+        result = read_response(target, request_id, &h, response);
     }
-    
-    // Check server response
-    if (strcmp(response, "READY") == 0) 
-    {
-        // Server is ready to receive file
-        if (send_file(sockfd, filename) == 0) 
-        {
-            // Wait for final response
-            bzero(response, BUFFER_SIZE);
-            if (read(sockfd, response, BUFFER_SIZE - 1) < 0) 
-            {
-                error("ERROR reading from socket");
-                return;
-            }
-            printf("%s\n", response);
-        }
-    } 
-    else 
+    if (result == 0) 
     {
         printf("%s\n", response);
     }
+    if (target != sockfd) 
+    {
+        close(target);
+        return 0; // The session to S1 is unaffected
+    }
+    return result;
 }
 
 // Error handling function
-void handle_downlf(int sockfd, char *filename) 
+int handle_downlf(int sockfd, char *filename) 
 {
-    // Check if filename starts with ~S1/
-    if (strncmp(filename, "~S1/", 4) != 0) 
+    // Check the filename and the file type
+    if (check_remote_path(filename, "Filename") < 0 || check_file_type(filename) < 0) 
     {
-        printf("ERROR: Filename must start with ~S1/\n");
-        return;
+        return 0;
     }
     
-    // Check file extension
-    char *ext = strrchr(filename, '.');
-    if (ext == NULL) 
+    // In redirect mode, S1 may send the file from the backend directly (.c files stay in S1)
+    int target = sockfd;
+    uint16_t flags = 0;
+    char token[DFS_TOKEN_MAX];
+    if (redirect_mode && strcmp(strrchr(filename, '.'), ".c") != 0) 
     {
-        printf("ERROR: File has no extension\n");
-        return;
-    }
-    
-    // Check if file type is supported
-    if (strcmp(ext, ".c") != 0 && strcmp(ext, ".pdf") != 0 && 
-        strcmp(ext, ".txt") != 0 && strcmp(ext, ".zip") != 0) 
+        target = request_redirect(sockfd, DFS_OP_DOWNLOAD, 1, &filename, token);
+        if (target < 0) 
         {
-        printf("ERROR: Unsupported file type. Only .c, .pdf, .txt, .zip allowed\n");
-        return;
+            return (target == -1) ? -1 : 0;
+        }
+        flags = (target != sockfd) ? DFS_FLAG_TOKEN : 0;
     }
-    
-    // Send command to server
-    char command[BUFFER_SIZE];
-    snprintf(command, BUFFER_SIZE, "downlf %s", filename);
-    if (write(sockfd, command, strlen(command)) < 0) 
+
+    // Send request to server
+    uint32_t request_id;
+    char *argv[] = { filename, token };
+    if (send_flagged_request(target, DFS_OP_DOWNLOAD, flags, 0, flags ? 2 : 1, argv, &request_id) < 0) 
     {
         error("ERROR writing to socket");
-        return;
+        if (target != sockfd) close(target);
+        return (target != sockfd) ? 0 : -1;
     }
     
     // Get the base name for saving locally
-    char *base_name = basename(filename);
+    char base_name[MAX_PATH_LEN];
+    snprintf(base_name, sizeof(base_name), "%s", basename(filename));
     
     // Receive file from server
-    if (receive_file(sockfd, base_name) == 0) 
+    int result = receive_file(target, request_id, base_name);
+    if (result == 0) 
     {
         printf("File '%s' downloaded successfully\n", base_name);
     }
+    if (target != sockfd) 
+    {
+        close(target);
+        return 0; // The session to S1 is unaffected
+    }
+    return (result < 0) ? -1 : 0;
 }
 
 // Error handling function
-void handle_removef(int sockfd, char *filename) 
+int handle_removef(int sockfd, char *filename) 
 {
-    // Check if filename starts with ~S1/
-    if (strncmp(filename, "~S1/", 4) != 0) 
+    // Check the filename and the file type
+    if (check_remote_path(filename, "Filename") < 0 || check_file_type(filename) < 0) 
     {
-        printf("ERROR: Filename must start with ~S1/\n");
-        return;
+        return 0;
     }
     
-    // Check file extension
-    char *ext = strrchr(filename, '.');
-    if (ext == NULL) {
-        printf("ERROR: File has no extension\n");
-        return;
-    }
-    
-    // Check if file type is supported
-    if (strcmp(ext, ".c") != 0 && strcmp(ext, ".pdf") != 0 && strcmp(ext, ".txt") != 0 && strcmp(ext, ".zip") != 0)
-    {
-        printf("ERROR: Unsupported file type. Only .c, .pdf, .txt, .zip allowed\n");
-        return;
-    }
-    
-    // Send command to server
-    char command[BUFFER_SIZE];
-    snprintf(command, BUFFER_SIZE, "removef %s", filename);
-    if (write(sockfd, command, strlen(command)) < 0) 
+    // Send request to server
+    uint32_t request_id;
+    if (send_request(sockfd, DFS_OP_REMOVE, 0, 1, &filename, &request_id) < 0) 
     {
         error("ERROR writing to socket");
-        return;
+        return -1;
     }
     
     // Get server response
+    struct dfs_header h;
     char response[BUFFER_SIZE];
-    bzero(response, BUFFER_SIZE);
-    if (read(sockfd, response, BUFFER_SIZE - 1) < 0) 
+    if (read_response(sockfd, request_id, &h, response) < 0) 
     {
-        error("ERROR reading from socket");
-        return;
+        return -1;
     }
     
     printf("%s\n", response);
+    return 0;
 }
 
 // Error handling function
-void handle_downltar(int sockfd, char *filetype) 
+int handle_downltar(int sockfd, char *filetype, char **options) 
 {
-    // Check file type
-    if (strcmp(filetype, ".c") != 0 && strcmp(filetype, ".pdf") != 0 && strcmp(filetype, ".txt") != 0) 
+    // Check file type and options and determine output filename
+    char *argv[DFS_MAX_ARGS];
+    char since_arg[32];
+    const char *output_name = tar_output_name(filetype);
+    int argc = (output_name != NULL) ? tar_arguments(filetype, options, argv, since_arg, sizeof(since_arg)) : -1;
+    if (argc < 0) 
     {
-        printf("ERROR: Unsupported file type for tar. Only .c, .pdf, .txt allowed\n");
-        return;
+        return 0;
     }
+    char output_file[MAX_PATH_LEN];
+    snprintf(output_file, sizeof(output_file), "%s", output_name);
     
-    // Determine output filename
-    char output_file[50];
-    if (strcmp(filetype, ".c") == 0) 
+    // Send request to server, with the encoding wanted and the files to include
+    uint32_t request_id;
+    if (send_request(sockfd, DFS_OP_TAR, 0, argc, argv, &request_id) < 0) 
     {
-        strcpy(output_file, "cfiles.tar");
-    } 
-    else if (strcmp(filetype, ".pdf") == 0) 
+        error("ERROR writing to socket");
+        return -1;
+    }
+    
+    // Receive tar file from server; a compressed one is saved with .gz added
+    int result = receive_file(sockfd, request_id, output_file);
+    if (result == 0) 
     {
-        strcpy(output_file, "pdfiles.tar");
-    } else 
+        printf("Tar file '%s' downloaded successfully\n", output_file);
+    }
+    return (result < 0) ? -1 : 0;
+}
+
+// Function to list the files under a directory
+// Fetches the listing one page at a time, page_size files per page (DFS_DEFAULT_PAGE if NULL),
+// and prints each page as it arrives, so memory use does not grow with the listing.
+int handle_dispfnames(int sockfd, char *pathname, char *page_size) 
+{
+    // Check the pathname and the page size
+    if (check_remote_path(pathname, "Pathname") < 0 || check_page_size(page_size) < 0) 
     {
-        strcpy(output_file, "txtfiles.tar");
+        return 0;
     }
     
-    // Send command to server
-    char command[BUFFER_SIZE];
-    snprintf(command, BUFFER_SIZE, "downltar %s", filetype);
-    if (write(sockfd, command, strlen(command)) < 0) 
+    char page[16];
+    snprintf(page, sizeof(page), "%d", (page_size != NULL) ? atoi(page_size) : DFS_DEFAULT_PAGE);
+    char cursor[DFS_MAX_CURSOR] = "";
+    int first = 1;
+    do 
     {
-        error("ERROR writing to socket");
-        return;
+        // Send request to server, continuing from the previous page
+        uint32_t request_id;
+        char *argv[] = { pathname, page, cursor };
+        if (send_request(sockfd, DFS_OP_LIST, 0, 3, argv, &request_id) < 0) 
+        {
+            error("ERROR writing to socket");
+            return -1;
+        }
+        
+        // Get server response; its message may carry the cursor for the next page
+        struct dfs_header h;
+        char message[DFS_MAX_ARG_LEN + 1];
+        if (dfs_read_header(sockfd, &h) < 0 || dfs_read_message(sockfd, &h, message, sizeof(message)) < 0) 
+        {
+            printf("ERROR: Failed to read from socket\n");
+            return -1;
+        }
+        if (h.request_id != request_id) 
+        {
+            printf("ERROR: Response does not match request %u\n", request_id);
+            return -1;
+        }
+        if (h.status != DFS_OK) 
+        {
+            printf("%s\n", message);
+            return 0;
+        }
+        
+        // The page is the response payload; print it as it arrives
+        if (first) 
+        {
+            printf("Files in %s:\n", pathname);
+            first = 0;
+        }
+        char response[BUFFER_SIZE];
+        uint64_t remaining = h.length;
+        while (remaining > 0) 
+        {
+            size_t chunk = (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE;
+            if (dfs_read_full(sockfd, response, chunk) < 0) 
+            {
+                printf("ERROR: Failed to read from socket\n");
+                return -1;
+            }
+            fwrite(response, 1, chunk, stdout);
+            remaining -= chunk;
+        }
+        
+        // S1 names any server that did not answer in time in the response's message
+        if (message[0] != '\0') 
+        {
+            printf("%s\n", message);
+        }
+        fflush(stdout);
+        
+        const char *next = dfs_page_cursor(&h, message);
+        snprintf(cursor, sizeof(cursor), "%s", (next != NULL) ? next : "");
+    } while (cursor[0] != '\0');
+    return 0;
+}
+
+// Function to check that a path is under ~S1/
+// Prints an error naming what the path is for and returns -1 otherwise.
+int check_remote_path(const char *path, const char *what) 
+{
+    if (strncmp(path, "~S1/", 4) != 0) 
+    {
+        printf("ERROR: %s must start with ~S1/\n", what);
+        return -1;
     }
-    
-    // Receive tar file from server
-    if (receive_file(sockfd, output_file) == 0) 
+    return 0;
+}
+
+// Function to check that a file has an extension S1 could route
+// Which types are supported is up to S1's routing table, which answers for the rest.
+// Prints an error and returns -1 if the file has none.
+int check_file_type(const char *filename) 
+{
+    const char *ext = strrchr(filename, '.');
+    if (ext == NULL || strchr(ext, '/') != NULL) 
     {
-        printf("Tar file '%s' downloaded successfully\n", output_file);
+        printf("ERROR: File has no extension\n");
+        return -1;
+    }
+    if (!dfs_routes_valid_ext(ext)) 
+    {
+        printf("ERROR: Unsupported file type %s\n", ext);
+        return -1;
     }
+    return 0;
 }
 
-// Error handling function
-void handle_dispfnames(int sockfd, char *pathname) 
+// Function to check a listing page size
+// A missing page size is fine (the default is used); otherwise it must be 1 to DFS_MAX_PAGE.
+int check_page_size(const char *page_size) 
 {
-    // Check if pathname starts with ~S1/
-    if (strncmp(pathname, "~S1/", 4) != 0) 
+    if (page_size != NULL && (atoi(page_size) < 1 || atoi(page_size) > DFS_MAX_PAGE)) 
     {
-        printf("ERROR: Pathname must start with ~S1/\n");
-        return;
+        printf("ERROR: Page size must be between 1 and %d\n", DFS_MAX_PAGE);
+        return -1;
     }
-    
-    // Send command to server
-    char command[BUFFER_SIZE];
-    snprintf(command, BUFFER_SIZE, "dispfnames %s", pathname);
-    if (write(sockfd, command, strlen(command)) < 0) 
+    return 0;
+}
+
+// Function to check a requested archive encoding
+// No encoding means a plain tar archive; the only other choice is gzip.
+int check_encoding(const char *encoding) 
+{
+    if (encoding != NULL && strcmp(encoding, "gzip") != 0) 
+    {
+        printf("ERROR: Unsupported archive encoding '%s'. Only gzip allowed\n", encoding);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to read a since= time as seconds since the epoch
+// Accepts a plain number of seconds or a local time written YYYY-MM-DD[THH:MM[:SS]].
+// Returns -1 if the time is malformed.
+long long parse_since(const char *value) 
+{
+    if (value[0] != '\0' && strspn(value, "0123456789") == strlen(value)) 
+    {
+        return atoll(value);
+    }
+
+    struct tm tm;
+    int len = 0, more = 0;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(value, "%4d-%2d-%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &len) != 3) 
+    {
+        return -1;
+    }
+    if (value[len] == 'T') 
+    {
+        if (sscanf(value + len, "T%2d:%2d%n", &tm.tm_hour, &tm.tm_min, &more) != 2) return -1;
+        len += more;
+        if (value[len] == ':') 
+        {
+            if (sscanf(value + len, ":%2d%n", &tm.tm_sec, &more) != 1) return -1;
+            len += more;
+        }
+    }
+    if (value[len] != '\0') 
+    {
+        return -1;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1; // Let mktime() work out daylight saving time
+    time_t t = mktime(&tm);
+    return (t < 0) ? -1 : (long long)t;
+}
+
+// Function to build the arguments of a downltar request
+// options holds the words after the file type, up to a NULL: "gzip" asks for a compressed archive,
+// and prefix=~S1/dir, since=time, min=bytes and max=bytes select the files archived. The since
+// time is sent as seconds, written to since_arg. Fills argv, which has room for DFS_MAX_ARGS
+// arguments, and returns their number, or -1 after printing what is wrong.
+int tar_arguments(char *filetype, char **options, char **argv, char *since_arg, size_t since_size) 
+{
+    int argc = 1, filters = 0;
+    argv[0] = filetype;
+    argv[1] = ""; // No encoding, when only filters are given
+    for (int i = 0; options[i] != NULL; i++) 
+    {
+        char *option = options[i];
+        char *value = strchr(option, '=');
+        if (value == NULL) 
+        {
+            if (check_encoding(option) < 0) return -1;
+            argv[1] = option;
+            argc = 2;
+            continue;
+        }
+        value++;
+
+        if (DFS_TAR_FILTER_ARG + filters == DFS_MAX_ARGS) 
+        {
+            printf("ERROR: Too many downltar filters\n");
+            return -1;
+        }
+        if (strncmp(option, "prefix=", 7) == 0) 
+        {
+            if (strcmp(value, "~S1") != 0 && check_remote_path(value, "Prefix") < 0) return -1;
+        }
+        else if (strncmp(option, "since=", 6) == 0) 
+        {
+            long long seconds = parse_since(value);
+            if (seconds < 0) 
+            {
+                printf("ERROR: since must be seconds since the epoch or YYYY-MM-DD[THH:MM[:SS]]\n");
+                return -1;
+            }
+            snprintf(since_arg, since_size, "since=%lld", seconds);
+            option = since_arg;
+        }
+        else if (strncmp(option, "min=", 4) == 0 || strncmp(option, "max=", 4) == 0) 
+        {
+            if (value[0] == '\0' || strspn(value, "0123456789") != strlen(value)) 
+            {
+                printf("ERROR: %.3s must be a size in bytes\n", option);
+                return -1;
+            }
+        }
+        else 
+        {
+            printf("ERROR: Unknown downltar option '%s'\n", option);
+            return -1;
+        }
+        argv[DFS_TAR_FILTER_ARG + filters++] = option;
+    }
+    return (filters > 0) ? DFS_TAR_FILTER_ARG + filters : argc;
+}
+
+// Function to name the local file a tar download is saved to
+// A type's archive is named after it ("txtfiles.tar"). Returns NULL (after printing an error) if
+// filetype is neither a file type nor "all".
+const char *tar_output_name(const char *filetype) 
+{
+    static char name[DFS_ROUTES_EXT_MAX + 16];
+    if (strcmp(filetype, ".pdf") == 0) 
+    {
+        return "pdfiles.tar"; // The name it always had
+    }
+    if (strcmp(filetype, "all") == 0) 
+    {
+        return "allfiles.tar"; // Every type, from every server
+    }
+    if (!dfs_routes_valid_ext(filetype)) 
+    {
+        printf("ERROR: Unsupported file type for tar. Give a file type such as .txt, or all\n");
+        return NULL;
+    }
+    snprintf(name, sizeof(name), "%sfiles.tar", filetype + 1);
+    return name;
+}
+
+// Function to run batch mode
+// Reads commands from in and keeps up to window requests in flight on one session. S1 answers
+// in order, so responses are matched to the oldest outstanding request. Returns the number of
+// commands that failed.
+int run_batch(FILE *in, int window)
+{
+    int sockfd = connect_to_server();
+    if (sockfd < 0)
+    {
+        printf("Failed to connect to server\n");
+        return 1;
+    }
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+    struct batch_entry *inflight = calloc(window, sizeof(struct batch_entry));
+    char *buffer = malloc(BATCH_BUFFER_SIZE);
+    if (inflight == NULL || buffer == NULL)
+    {
+        printf("ERROR: Out of memory\n");
+        close(sockfd);
+        return 1;
+    }
+
+    struct batch_send out = { 0 };
+    struct batch_recv rx = { 0 };
+    out.payload_fd = -1;
+    rx.out_fd = -1;
+    int head = 0, count = 0, commands = 0, failed = 0, input_done = 0, broken = 0;
+    char line[BUFFER_SIZE];
+    int line_no = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (!broken && (!input_done || out.frame != NULL || count > 0))
+    {
+        // Queue the next command once the previous one has been fully sent. Nothing is queued
+        // behind a listing, whose next page can only be asked for once this one has arrived.
+        while (out.frame == NULL && !input_done && count < window &&
+               (count == 0 || inflight[(head + count - 1) % window].opcode != DFS_OP_LIST))
+        {
+            if (fgets(line, sizeof(line), in) == NULL)
+            {
+                input_done = 1;
+                break;
+            }
+            line_no++;
+            line[strcspn(line, "\n")] = 0;
+            if (line[0] == '\0' || line[0] == '#') continue;
+            if (strcmp(line, "exit") == 0)
+            {
+                input_done = 1;
+                break;
+            }
+
+            commands++;
+            struct batch_entry *e = &inflight[(head + count) % window];
+            if (batch_prepare(line, e, &out) < 0)
+            {
+                printf("  (line %d)\n", line_no);
+                failed++;
+                continue;
+            }
+            count++;
+        }
+
+        // The input ran out with nothing left to send or wait for
+        if (out.frame == NULL && count == 0)
+        {
+            break;
+        }
+
+        struct pollfd pfd = { sockfd, POLLIN, 0 };
+        if (out.frame != NULL) pfd.events |= POLLOUT;
+        if (poll(&pfd, 1, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            error("ERROR on poll");
+            break;
+        }
+
+        if ((pfd.revents & POLLOUT) && batch_send_some(sockfd, &out) < 0)
+        {
+            error("ERROR writing to socket");
+            broken = 1;
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t n = read(sockfd, buffer, BATCH_BUFFER_SIZE);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            if (n <= 0)
+            {
+                printf("ERROR: Connection to server lost\n");
+                broken = 1;
+                break;
+            }
+
+            // One read may complete several responses
+            size_t used = 0;
+            while (used < (size_t)n && !broken)
+            {
+                if (count == 0)
+                {
+                    printf("ERROR: Unexpected response from server\n");
+                    broken = 1;
+                    break;
+                }
+                int done = batch_receive(&inflight[head], &rx, buffer, n, &used);
+                if (done < 0)
+                {
+                    broken = 1;
+                }
+                else if (done > 0 && rx.hdr.status == DFS_OK && (rx.hdr.flags & DFS_FLAG_MORE))
+                {
+                    // The listing continues: the same entry waits for its next page
+                    if (batch_continue_listing(&inflight[head], &rx, &out) < 0)
+                    {
+                        broken = 1;
+                    }
+                }
+                else if (done > 0)
+                {
+                    if (rx.hdr.status != DFS_OK) failed++;
+                    head = (head + 1) % window;
+                    count--;
+                }
+            }
+        }
+    }
+
+    // Everything still queued or in flight is lost with the session
+    if (broken)
+    {
+        failed += count;
+        if (rx.out_fd >= 0)
+        {
+            finish_download(rx.out_fd, rx.tmp_path, inflight[head].output, 0);
+        }
+    }
+    if (out.payload_fd >= 0) close(out.payload_fd);
+    free(out.frame);
+    free(inflight);
+    free(buffer);
+    close(sockfd);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fflush(stdout);
+    fprintf(stderr, "Batch: %d commands, %d failed, %.3f s (window %d)\n", commands, failed, secs, window);
+    return failed;
+}
+
+// Function to validate one batch command and build its request
+// Performs the same checks as interactive mode. The frame (and the file to upload, if any)
+// is stored in out for batch_send_some().
+int batch_prepare(char *line, struct batch_entry *e, struct batch_send *out)
+{
+    char *cmd = strtok(line, " ");
+    char *arg1 = strtok(NULL, " ");
+    char *arg2 = strtok(NULL, " ");
+    char *argv[DFS_MAX_ARGS] = { arg1, arg2, "" };
+    char since_arg[32];
+    int argc = 1;
+    uint64_t length = 0;
+
+    memset(e, 0, sizeof(*e));
+    if (cmd == NULL || arg1 == NULL)
+    {
+        printf("Invalid command format: %s\n", (cmd != NULL) ? cmd : "");
+        return -1;
+    }
+    snprintf(e->label, sizeof(e->label), "%s", arg1);
+
+    if (strcmp(cmd, "uploadf") == 0)
+    {
+        struct stat st;
+        if (arg2 == NULL)
+        {
+            printf("Invalid command format. Usage: uploadf <filename> <destination_path>\n");
+            return -1;
+        }
+        if (stat(arg1, &st) != 0)
+        {
+            printf("ERROR: File '%s' not found\n", arg1);
+            return -1;
+        }
+        if (check_remote_path(arg2, "Destination path") < 0 || check_file_type(arg1) < 0)
+        {
+            return -1;
+        }
+        out->payload_fd = open(arg1, O_RDONLY);
+        if (out->payload_fd < 0)
+        {
+            printf("ERROR: Failed to open file '%s'\n", arg1);
+            return -1;
+        }
+        e->opcode = DFS_OP_UPLOAD;
+        argc = 2;
+        length = st.st_size;
+        out->payload_left = st.st_size;
+    }
+    else if (strcmp(cmd, "downlf") == 0)
+    {
+        if (check_remote_path(arg1, "Filename") < 0 || check_file_type(arg1) < 0)
+        {
+            return -1;
+        }
+        e->opcode = DFS_OP_DOWNLOAD;
+        snprintf(e->output, sizeof(e->output), "%s", basename(arg1));
+    }
+    else if (strcmp(cmd, "removef") == 0)
+    {
+        if (check_remote_path(arg1, "Filename") < 0 || check_file_type(arg1) < 0)
+        {
+            return -1;
+        }
+        e->opcode = DFS_OP_REMOVE;
+    }
+    else if (strcmp(cmd, "downltar") == 0)
+    {
+        // Everything after the file type is an encoding or a filter
+        char *options[DFS_MAX_ARGS + 1] = { arg2 };
+        int noptions = (arg2 != NULL) ? 1 : 0;
+        while (arg2 != NULL && noptions < DFS_MAX_ARGS && (options[noptions] = strtok(NULL, " ")) != NULL)
+        {
+            noptions++;
+        }
+        options[noptions] = NULL;
+
+        const char *output_file = tar_output_name(arg1);
+        argc = (output_file != NULL) ? tar_arguments(arg1, options, argv, since_arg, sizeof(since_arg)) : -1;
+        if (argc < 0)
+        {
+            return -1;
+        }
+        e->opcode = DFS_OP_TAR;
+        snprintf(e->output, sizeof(e->output), "%s", output_file);
+    }
+    else if (strcmp(cmd, "dispfnames") == 0)
+    {
+        if (check_remote_path(arg1, "Pathname") < 0 || check_page_size(arg2) < 0)
+        {
+            return -1;
+        }
+        e->opcode = DFS_OP_LIST;
+        snprintf(e->page, sizeof(e->page), "%d", (arg2 != NULL) ? atoi(arg2) : DFS_DEFAULT_PAGE);
+        argv[1] = e->page;
+        argc = 3;
+    }
+    else
+    {
+        printf("Unknown command: %s\n", cmd);
+        return -1;
+    }
+
+    e->request_id = next_request_id++;
+    out->frame = dfs_build_request(e->opcode, e->request_id, length, argc, argv, &out->frame_len);
+    out->frame_off = 0;
+    if (out->frame == NULL)
+    {
+        printf("ERROR: Command too long\n");
+        if (out->payload_fd >= 0) close(out->payload_fd);
+        out->payload_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to push as much of the pending request as the socket accepts
+// Sends the frame, then the upload payload straight from the file with sendfile().
+int batch_send_some(int sockfd, struct batch_send *out)
+{
+    while (out->frame_off < out->frame_len)
+    {
+        ssize_t n = write(sockfd, out->frame + out->frame_off, out->frame_len - out->frame_off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return 0;
+        if (n <= 0) return -1;
+        out->frame_off += n;
+    }
+
+    while (out->payload_left > 0)
+    {
+        ssize_t n = sendfile(sockfd, out->payload_fd, NULL, out->payload_left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return 0;
+        if (n <= 0) return -1;
+        out->payload_left -= n;
+    }
+
+    // The request is complete
+    if (out->payload_fd >= 0) close(out->payload_fd);
+    out->payload_fd = -1;
+    free(out->frame);
+    out->frame = NULL;
+    return 0;
+}
+
+// Function to ask for the next page of a listing in batch mode
+// Reuses the listing's entry with a new request ID; the request goes out like any other.
+int batch_continue_listing(struct batch_entry *e, struct batch_recv *rx, struct batch_send *out)
+{
+    char *argv[3] = { e->label, e->page, (char *)dfs_page_cursor(&rx->hdr, rx->message) };
+    if (argv[2] == NULL)
+    {
+        return -1;
+    }
+
+    e->request_id = next_request_id++;
+    out->frame = dfs_build_request(DFS_OP_LIST, e->request_id, 0, 3, argv, &out->frame_len);
+    out->frame_off = 0;
+    return (out->frame != NULL) ? 0 : -1;
+}
+
+// Function to feed received bytes into the response being assembled
+// Consumes bytes from data starting at *used (advancing it) until the response for e is complete.
+// Returns 1 when it is complete, 0 if more bytes are needed and -1 on a protocol error.
+int batch_receive(struct batch_entry *e, struct batch_recv *rx, char *data, size_t len, size_t *used)
+{
+    while (*used < len)
+    {
+        char *p = data + *used;
+        size_t avail = len - *used;
+
+        if (rx->got < DFS_HEADER_SIZE)
+        {
+            // Response header
+            size_t take = (avail < DFS_HEADER_SIZE - rx->got) ? avail : DFS_HEADER_SIZE - rx->got;
+            memcpy(rx->raw + rx->got, p, take);
+            rx->got += take;
+            *used += take;
+            if (rx->got < DFS_HEADER_SIZE) return 0;
+
+            if (dfs_decode_header(rx->raw, &rx->hdr) < 0 || rx->hdr.request_id != e->request_id)
+            {
+                printf("ERROR: Response does not match request %u\n", e->request_id);
+                return -1;
+            }
+            rx->msg_len = 0;
+            rx->payload_left = rx->hdr.length;
+            rx->chunk_got = 0;
+            rx->chunks_done = 0;
+            if (rx->hdr.status == DFS_OK && (rx->payload_left > 0 || (rx->hdr.flags & DFS_FLAG_CHUNKED)) && e->output[0] != '\0')
+            {
+                rx->out_fd = open_download(e->output, rx->tmp_path);
+                if (rx->out_fd < 0)
+                {
+                    printf("ERROR: Failed to create file '%s'\n", e->output);
+                }
+            }
+            if (rx->hdr.status == DFS_OK && e->opcode == DFS_OP_LIST && e->pages++ == 0)
+            {
+                printf("Files in %s:\n", e->label);
+            }
+        }
+        else if (rx->msg_len < rx->hdr.arg_len)
+        {
+            // Status message; anything beyond the buffer is dropped
+            size_t take = (avail < rx->hdr.arg_len - rx->msg_len) ? avail : rx->hdr.arg_len - rx->msg_len;
+            size_t room = (rx->msg_len < sizeof(rx->message) - 1) ? sizeof(rx->message) - 1 - rx->msg_len : 0;
+            memcpy(rx->message + rx->msg_len, p, (take < room) ? take : room);
+            rx->msg_len += take;
+            *used += take;
+        }
+        else if (rx->payload_left > 0)
+        {
+            // Payload: a downloaded file or a listing
+            size_t take = (avail < rx->payload_left) ? avail : rx->payload_left;
+            if (e->opcode == DFS_OP_LIST)
+            {
+                fwrite(p, 1, take, stdout);
+            }
+            else if (rx->out_fd >= 0 && dfs_write_full(rx->out_fd, p, take) < 0)
+            {
+                printf("ERROR: Failed to write to file\n");
+                finish_download(rx->out_fd, rx->tmp_path, e->output, 0);
+                rx->out_fd = -1;
+            }
+            rx->payload_left -= take;
+            *used += take;
+        }
+        else if ((rx->hdr.flags & DFS_FLAG_CHUNKED) && !rx->chunks_done)
+        {
+            // Size of the next chunk; an empty chunk ends the payload
+            size_t take = (avail < sizeof(rx->chunk_raw) - rx->chunk_got) ? avail : sizeof(rx->chunk_raw) - rx->chunk_got;
+            memcpy(rx->chunk_raw + rx->chunk_got, p, take);
+            rx->chunk_got += take;
+            *used += take;
+            if (rx->chunk_got == sizeof(rx->chunk_raw))
+            {
+                uint32_t be;
+                memcpy(&be, rx->chunk_raw, sizeof(be));
+                rx->payload_left = be32toh(be);
+                rx->chunk_got = 0;
+                rx->chunks_done = (rx->payload_left == 0);
+                if (rx->payload_left > DFS_MAX_CHUNK)
+                {
+                    printf("ERROR: Response to request %u has an oversized chunk\n", e->request_id);
+                    return -1;
+                }
+            }
+        }
+
+        if (rx->got == DFS_HEADER_SIZE && rx->msg_len >= rx->hdr.arg_len && rx->payload_left == 0 &&
+            (!(rx->hdr.flags & DFS_FLAG_CHUNKED) || rx->chunks_done))
+        {
+            batch_report(e, rx);
+            rx->got = 0;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Function to print the outcome of a completed batch request
+// Uses the same messages as interactive mode.
+void batch_report(struct batch_entry *e, struct batch_recv *rx)
+{
+    rx->message[(rx->msg_len < sizeof(rx->message) - 1) ? rx->msg_len : sizeof(rx->message) - 1] = '\0';
+
+    if (rx->hdr.status != DFS_OK)
+    {
+        printf("%s\n", rx->message);
+    }
+    else if (e->opcode == DFS_OP_DOWNLOAD || e->opcode == DFS_OP_TAR)
+    {
+        // An empty file has no payload, so it is only created now
+        if (rx->out_fd < 0 && rx->hdr.length == 0 && !(rx->hdr.flags & DFS_FLAG_CHUNKED))
+        {
+            rx->out_fd = open_download(e->output, rx->tmp_path);
+        }
+        if (rx->out_fd >= 0)
+        {
+            // A compressed archive is saved with the encoding's suffix
+            if (strcmp(rx->message, "gzip") == 0)
+            {
+                strncat(e->output, ".gz", sizeof(e->output) - strlen(e->output) - 1);
+            }
+            int saved = finish_download(rx->out_fd, rx->tmp_path, e->output, 1);
+            rx->out_fd = -1;
+            if (saved == 0)
+            {
+                printf((e->opcode == DFS_OP_TAR) ? "Tar file '%s' downloaded successfully\n" : "File '%s' downloaded successfully\n", e->output);
+            }
+            else
+            {
+                printf("ERROR: Failed to save file '%s'\n", e->output);
+            }
+        }
+    }
+    else if (e->opcode != DFS_OP_LIST || rx->message[0] != '\0')
+    {
+        // Status text, or the warning that ends an incomplete listing
+        printf("%s\n", rx->message);
+    }
+
+    if (rx->out_fd >= 0)
+    {
+        finish_download(rx->out_fd, rx->tmp_path, e->output, 0);
+        rx->out_fd = -1;
+    }
+}
+
+// Function to send a request to S1
+// Assigns the next request ID, which the response must echo.
+int send_request(int sockfd, uint8_t opcode, uint64_t length, int argc, char **argv, uint32_t *request_id)
+{
+    return send_flagged_request(sockfd, opcode, 0, length, argc, argv, request_id);
+}
+
+// Function to send a request with flags to S1 or a backend
+int send_flagged_request(int sockfd, uint8_t opcode, uint16_t flags, uint64_t length, int argc, char **argv, uint32_t *request_id)
+{
+    *request_id = next_request_id++;
+    return dfs_send_flagged_request(sockfd, opcode, flags, *request_id, length, argc, argv);
+}
+
+// Function to ask S1 to let a download or upload go straight to the backend
+// Returns a new connection to the backend, with the token to present there in token (room for
+// DFS_TOKEN_MAX bytes), or sockfd if S1 will carry the transfer itself, as it does when
+// redirects are off or the backend cannot be reached from here. Returns -2 if S1 refused the
+// request (the reason is printed) and -1 if the session to S1 broke.
+int request_redirect(int sockfd, uint8_t opcode, int argc, char **argv, char *token)
+{
+    uint32_t request_id;
+    if (send_flagged_request(sockfd, opcode, DFS_FLAG_REDIRECT, 0, argc, argv, &request_id) < 0)
     {
         error("ERROR writing to socket");
-        return;
+        return -1;
     }
-    
-    // Get server response
-    char response[BUFFER_SIZE];
-    bzero(response, BUFFER_SIZE);
-    if (read(sockfd, response, BUFFER_SIZE - 1) < 0) 
+    struct dfs_header h;
+    char message[BUFFER_SIZE];
+    if (read_response(sockfd, request_id, &h, message) < 0)
     {
-        error("ERROR reading from socket");
-        return;
+        return -1;
     }
-    
-    printf("Files in %s:\n%s", pathname, response);
+    if (h.status == DFS_EUNAVAIL)
+    {
+        return sockfd;
+    }
+    if (h.status != DFS_OK || !(h.flags & DFS_FLAG_REDIRECT))
+    {
+        printf("%s\n", message);
+        return -2;
+    }
+
+    // The message reads "<host> <port> <token>"
+    char host[256];
+    int port;
+    if (sscanf(message, "%255s %d %47s", host, &port, token) != 3)
+    {
+        printf("ERROR: Malformed redirect from server\n");
+        return -2;
+    }
+    int backend = connect_to(host, port);
+    return (backend >= 0) ? backend : sockfd;
+}
+
+// Function to read the response to a request
+// Copies the response's message into message; the payload, if any, is left for the caller.
+int read_response(int sockfd, uint32_t request_id, struct dfs_header *h, char *message)
+{
+    if (dfs_read_header(sockfd, h) < 0 || dfs_read_message(sockfd, h, message, BUFFER_SIZE) < 0)
+    {
+        printf("ERROR: Failed to read from socket\n");
+        return -1;
+    }
+    if (h->request_id != request_id)
+    {
+        printf("ERROR: Response does not match request %u\n", request_id);
+        return -1;
+    }
+    return 0;
 }
 
 // Function to send a file to the server
-int send_file(int sockfd, char *filename) 
+// Streams exactly size bytes, the payload length announced in the request header.
+int send_file(int sockfd, char *filename, off_t size) 
 {
     int fd;
     char buffer[BUFFER_SIZE];
@@ -434,28 +1321,11 @@ int send_file(int sockfd, char *filename)
         return -1;
     }
     
-    // Get file size
-    struct stat st;
-    if (fstat(fd, &st) < 0) 
-    {
-        printf("ERROR: Failed to get file size\n");
-        close(fd);
-        return -1;
-    }
-    
-    // Send file size
-    if (write(sockfd, &st.st_size, sizeof(off_t)) < 0) 
-    {
-        error("ERROR writing file size to socket");
-        close(fd);
-        return -1;
-    }
-    
     // Send file data
-    off_t remaining = st.st_size;
+    off_t remaining = size;
     while (remaining > 0) 
     {
-        n = read(fd, buffer, BUFFER_SIZE);
+        n = read(fd, buffer, (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE);
         if (n <= 0) // Error or end of file
         {
             printf("ERROR: Failed to read from file\n");
@@ -463,7 +1333,7 @@ int send_file(int sockfd, char *filename)
             return -1;
         }
         // Send data to server
-        if (write(sockfd, buffer, n) < 0) 
+        if (dfs_write_full(sockfd, buffer, n) < 0) 
         {
             error("ERROR writing to socket");
             close(fd);
@@ -477,57 +1347,72 @@ int send_file(int sockfd, char *filename)
     return 0;
 }
 // Function to receive a file from the server
-int receive_file(int sockfd, char *filename) 
+// A payload the server compressed with gzip is saved with ".gz" appended to filename, which must
+// have room for MAX_PATH_LEN bytes. Returns 0 on success, 1 if the server reported an error and
+// -1 if the session broke.
+int receive_file(int sockfd, uint32_t request_id, char *filename) 
 {
     int fd;
     char buffer[BUFFER_SIZE];
+    char tmp_path[MAX_PATH_LEN];
     ssize_t n;
 
-    // Peek into the socket to check if response starts with "ERROR"
-    char peek_buf[6] = {0}; // 5 + null terminator
-    n = recv(sockfd, peek_buf, 5, MSG_PEEK);  // Look at first 5 bytes without removing them from buffer
-
-    // Check for error in peeking
-    if (n <= 0) 
-    {
-        printf("ERROR: Failed to read from socket\n");
-        return -1;
-    }
-
-    // Check if the response starts with "ERROR"
-    if (strncmp(peek_buf, "ERROR", 5) == 0) 
+    // The response header says whether a file follows and how large it is
+    struct dfs_header h;
+    char message[BUFFER_SIZE];
+    if (read_response(sockfd, request_id, &h, message) < 0) 
     {
-        // Read full error message now
-        char error_msg[BUFFER_SIZE] = {0};
-        read(sockfd, error_msg, BUFFER_SIZE - 1);
-        printf("%s\n", error_msg);
         return -1;
     }
-
-    // Read file size
-    off_t file_size;
-    if (read(sockfd, &file_size, sizeof(off_t)) != sizeof(off_t)) 
+    if (h.status != DFS_OK) 
     {
-        printf("ERROR: Failed to read file size\n");
-        return -1;
+        printf("%s\n", message);
+        return 1;
     }
 
-    // Check if file size is valid
-    if (file_size <= 0) 
+    // Create the staging file; it replaces filename only once complete
+    if (strcmp(message, "gzip") == 0) 
     {
-        printf("ERROR: Invalid file size received: %ld\n", (long)file_size);
-        return -1;
+        strncat(filename, ".gz", MAX_PATH_LEN - strlen(filename) - 1);
     }
-
-    // Create file
-    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    fd = open_download(filename, tmp_path);
     if (fd < 0) {
         printf("ERROR: Failed to create file '%s'\n", filename);
+        return (dfs_discard(sockfd, h.length) < 0) ? -1 : 1; // Keep the session in sync
+    }
+
+    // A chunked payload arrives as chunks up to an empty one
+    if (h.flags & DFS_FLAG_CHUNKED) 
+    {
+        uint32_t chunk;
+        while (dfs_read_chunk_size(sockfd, &chunk) == 0) 
+        {
+            if (chunk == 0) 
+            {
+                return (finish_download(fd, tmp_path, filename, 1) == 0) ? 0 : 1;
+            }
+            while (chunk > 0) 
+            {
+                n = read(sockfd, buffer, (chunk < BUFFER_SIZE) ? chunk : BUFFER_SIZE);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0 || dfs_write_full(fd, buffer, n) < 0) 
+                {
+                    break;
+                }
+                chunk -= n;
+            }
+            if (chunk > 0) 
+            {
+                break;
+            }
+        }
+        printf("ERROR: File transfer failed\n");
+        finish_download(fd, tmp_path, filename, 0);
         return -1;
     }
 
     // Receive file data
-    off_t remaining = file_size;
+    uint64_t remaining = h.length;
     while (remaining > 0) 
     {
         // Read data from socket
@@ -535,8 +1420,7 @@ int receive_file(int sockfd, char *filename)
         if (n <= 0) 
         {
             printf("ERROR: File transfer failed\n");
-            close(fd);
-            unlink(filename);  // Delete partially written file
+            finish_download(fd, tmp_path, filename, 0); // Delete partially written file
             return -1;
         }
 
@@ -544,18 +1428,59 @@ int receive_file(int sockfd, char *filename)
         if (write(fd, buffer, n) < 0) 
         {
             printf("ERROR: Failed to write to file\n");
-            close(fd);
-            unlink(filename);
-            return -1;
+            finish_download(fd, tmp_path, filename, 0);
+            return (dfs_discard(sockfd, remaining - n) < 0) ? -1 : 1; // Keep the session in sync
         }
 
         remaining -= n; // Update remaining bytes
     }
 
-    close(fd); // Close the file
+    // Move the complete file into place
+    if (finish_download(fd, tmp_path, filename, 1) < 0)
+    {
+        printf("ERROR: Failed to save file '%s'\n", filename);
+        return 1;
+    }
     return 0; // Success
 }
 
+// Function to create the staging file a download is written to
+// Each download gets its own hidden file with a unique name next to filename, so concurrent
+// downloads of the same file (two downltar .c runs, say) never write into each other's copy.
+int open_download(const char *filename, char *tmp_path)
+{
+    char dir[MAX_PATH_LEN], base[MAX_PATH_LEN];
+    strncpy(dir, filename, MAX_PATH_LEN - 1);
+    dir[MAX_PATH_LEN - 1] = '\0';
+    strncpy(base, filename, MAX_PATH_LEN - 1);
+    base[MAX_PATH_LEN - 1] = '\0';
+    snprintf(tmp_path, MAX_PATH_LEN, "%s/.%s.XXXXXX", dirname(dir), basename(base));
+
+    int fd = mkstemp(tmp_path);
+    if (fd >= 0)
+    {
+        // mkstemp() creates the file private; give it the mode a plain open() would have
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0644 & ~mask);
+    }
+    return fd;
+}
+
+// Function to finish a download's staging file
+// Renames it over filename if the download is complete, which replaces any older copy in one
+// step, and removes it otherwise. Returns -1 if the file was not put in place.
+int finish_download(int fd, const char *tmp_path, const char *filename, int complete)
+{
+    int failed = (close(fd) < 0);
+    if (complete && !failed && rename(tmp_path, filename) == 0)
+    {
+        return 0;
+    }
+    unlink(tmp_path);
+    return -1;
+}
+
 // Error handling function
 void error(const char *msg) 
 {